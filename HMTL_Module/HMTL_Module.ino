@@ -39,6 +39,7 @@
 #include "MessageHandler.h"
 
 #include "PixelUtil.h"
+#include "PalettePixels.h"
 
 #include "Socket.h"
 
@@ -110,6 +111,22 @@ byte wifi_data_buffer[TCP_BUFFER_TOTAL(WIFI_SEND_BUFFER_SIZE)];
 #define STATUS_UPDATE_PERIOD 15000
 unsigned long statusUpdateTime = 0;
 
+/*
+ * Frame scheduling.  Outputs are refreshed at most once per frame period, with
+ * messages handled in the time between frames.  The period is taken from the
+ * config flags unless set by FRAME_PERIOD_MS, and a period of 0 refreshes
+ * outputs as soon as they change.
+ */
+uint16_t frame_period = 0;
+unsigned long next_frame_ms = 0;
+uint16_t pending_outputs = 0;
+
+/* Frame statistics since the last status update */
+uint16_t frame_count = 0;
+unsigned long last_frame_us = 0;
+unsigned long frame_jitter_total_us = 0;
+unsigned long frame_jitter_max_us = 0;
+
 
 /*
  * Set the BAUD if not over-riden by build flags
@@ -125,8 +142,10 @@ config_hdr_t config;
 output_hdr_t *outputs[HMTL_MAX_OUTPUTS];
 config_max_t readoutputs[HMTL_MAX_OUTPUTS];
 void *objects[HMTL_MAX_OUTPUTS];
+hmtl_segment_t segments[HMTL_MAX_SEGMENTS];
 
 PixelUtil pixels;
+PalettePixels palette_pixels;
 
 /*
  * A timesync object must be defined and initialized here as some libraries
@@ -149,8 +168,8 @@ boolean sound_updated = false;
  * Program management
  */
 
-/* List of available programs */
-hmtl_program_t program_functions[] = {
+/* List of available programs, kept in flash */
+HMTL_PROGRAM_REGISTRY(program_functions,
   { HMTL_PROGRAM_NONE, NULL, NULL},
   { HMTL_PROGRAM_BLINK, program_blink, program_blink_init },
   { HMTL_PROGRAM_TIMED_CHANGE, program_timed_change, program_timed_change_init },
@@ -159,14 +178,14 @@ hmtl_program_t program_functions[] = {
   { HMTL_PROGRAM_CIRCULAR, program_circular, program_circular_init},
   { PROGRAM_BRIGHTNESS, NULL,  program_brightness },
   { PROGRAM_COLOR, NULL, program_color},
+  { PROGRAM_PALETTE, NULL, program_palette},
 
   { HMTL_PROGRAM_LEVEL_VALUE, program_level_value, program_level_value_init },
   { HMTL_PROGRAM_SOUND_VALUE, program_sound_value, program_sound_value_init },
   { HMTL_PROGRAM_SOUND_PIXELS, program_sound_pixels, program_sound_pixels_init },
 
   { PROGRAM_SENSOR_DATA, process_sensor_data, program_sensor_data_init },
-};
-#define NUM_PROGRAMS (sizeof (program_functions) / sizeof (hmtl_program_t))
+);
 
 program_tracker_t *active_programs[HMTL_MAX_OUTPUTS];
 ProgramManager manager;
@@ -181,6 +200,7 @@ void additional_setup();
 void additional_loop();
 
 void setup() {
+  int config_end = 0;
 
   Serial.begin(BAUD);
 
@@ -200,7 +220,10 @@ void setup() {
                                      NULL, // MPR121
                                      NULL, // RGB
                                      NULL, // Value
-                                     NULL);
+                                     &config_end);
+
+  /* A palette output keeps indices in place of the PixelUtil's RGB pixels */
+  hmtl_setup_palette(&config, readoutputs, objects, &palette_pixels);
 
   byte num_sockets = 0;
 
@@ -248,12 +271,30 @@ void setup() {
     DEBUG_ERR_STATE(2);
   }
 
+#ifdef FRAME_PERIOD_MS
+  frame_period = FRAME_PERIOD_MS;
+#else
+  frame_period = HMTL_FRAME_PERIOD(config.flags);
+#endif
+  DEBUG3_VALUELN("Frame period:", frame_period);
+
   /* Setup the program manager */
   manager = ProgramManager(outputs, active_programs, objects, HMTL_MAX_OUTPUTS,
-                           program_functions, NUM_PROGRAMS);
+                           &program_functions);
+
+  /* Any segments of the pixel outputs are addressed as additional outputs */
+  int num_segments = hmtl_setup_segments(&config, readoutputs, segments,
+                                         HMTL_MAX_SEGMENTS);
+  manager.set_segments(segments, num_segments);
 
   handler = MessageHandler(config.address, &manager, sockets, num_sockets);
 
+  /* Start the boot scene from the scene store following the config */
+  if (config_end > 0) {
+    handler.set_scene_store(config_end);
+    handler.recall_scene(handler.boot_scene());
+  }
+
   /* Perform any additional setup that's required */
   additional_setup();
 
@@ -270,7 +311,10 @@ void additional_setup() {
 #endif
 
 #ifdef STARTUP_COMMANDS
-  startup_commands(&manager, &handler, sockets, &config);
+  /* A stored boot scene takes the place of the startup commands */
+  if (handler.boot_scene() == HMTL_SCENE_NONE) {
+    startup_commands(&manager, &handler, sockets, &config);
+  }
 #endif
 }
 
@@ -283,10 +327,48 @@ byte get_button_value() {
 void status_update() {
   DEBUG3_PRINTLN("Status:");
   DEBUG3_VALUELN(" * uptime:", millis())
+  DEBUG3_COMMAND(
+    unsigned long elapsed = millis() - statusUpdateTime;
+    DEBUG3_VALUE(" * fps:",
+                 elapsed ? (uint32_t)frame_count * 1000 / elapsed : 0);
+  );
+  DEBUG3_VALUE(" jitter us avg:",
+               frame_count ? frame_jitter_total_us / frame_count : 0);
+  DEBUG3_VALUELN(" max:", frame_jitter_max_us);
+  DEBUG3_VALUE(" * trackers:", manager.pool_stats.trackers_used);
+  DEBUG3_VALUE(" max:", manager.pool_stats.trackers_max);
+  DEBUG3_VALUE(" states:", manager.pool_stats.states_used);
+  DEBUG3_VALUE(" max:", manager.pool_stats.states_max);
+  DEBUG3_VALUELN(" failed:", manager.pool_stats.states_failed);
 
 #if defined(ESP32)
 api_status();
 #endif
+
+  frame_count = 0;
+  frame_jitter_total_us = 0;
+  frame_jitter_max_us = 0;
+}
+
+/*
+ * Record the timing of a frame.  Jitter is the difference between the time
+ * since the previous frame and the frame period.  With no frame period only
+ * the frames that refreshed outputs are counted.
+ */
+void record_frame() {
+  unsigned long now_us = micros();
+
+  if ((frame_period > 0) && (frame_count > 0)) {
+    long jitter = (long)(now_us - last_frame_us) - (long)frame_period * 1000;
+    if (jitter < 0) jitter = -jitter;
+    frame_jitter_total_us += jitter;
+    if ((unsigned long)jitter > frame_jitter_max_us) {
+      frame_jitter_max_us = jitter;
+    }
+  }
+
+  last_frame_us = now_us;
+  frame_count++;
 }
 
 #define MSG_MAX_SZ (sizeof(msg_hdr_t) + sizeof(msg_max_t))
@@ -298,8 +380,8 @@ boolean first_run = true;
  * The main event loop
  *
  * - Checks for and handles messages over all interfaces
- * - Runs any enabled programs
- * - Updates any outputs
+ * - At the start of each frame runs any enabled programs
+ * - Updates any outputs that have changed
  */
 void loop() {
   // Check and send a serial-ready message if needed
@@ -307,27 +389,42 @@ void loop() {
 
   /*
    * Check the serial device and all sockets for messages, forwarding them and
-   * processing them if they are for this module.
+   * processing them if they are for this module.  This runs on every loop so
+   * that messages are handled in the slack time between frames.
    */
-  boolean update = handler.check(&config);
+  pending_outputs |= handler.check(&config);
 
   additional_loop();
 
-  /* Execute any active programs */
-  if (manager.run()) {
-    update = true;
-  }
+  if ((frame_period == 0) || ((long)(millis() - next_frame_ms) >= 0)) {
+    /* Execute any active programs */
+    pending_outputs |= manager.run();
 
-  /* If this is the first execution then update to set initial values */
-  if (first_run) {
-    update = true;
-    first_run = false;
-  }
+    /* If this is the first execution then update to set initial values */
+    if (first_run) {
+      pending_outputs = (uint16_t)-1;
+      first_run = false;
+    }
 
-  if (update) {
-    /* Update the outputs */
-    for (byte i = 0; i < config.num_outputs; i++) {
-      hmtl_update_output(outputs[i], objects[i]);
+    /* Update only the outputs that have changed, once per frame */
+    if (pending_outputs) {
+      for (byte i = 0; i < config.num_outputs; i++) {
+        if (pending_outputs & (1 << i)) {
+          hmtl_update_output(outputs[i], objects[i]);
+        }
+      }
+      pending_outputs = 0;
+      if (frame_period == 0) record_frame();
+    }
+
+    if (frame_period > 0) {
+      record_frame();
+
+      next_frame_ms += frame_period;
+      if ((long)(millis() - next_frame_ms) >= 0) {
+        /* Frames were missed, restart the schedule from now */
+        next_frame_ms = millis() + frame_period;
+      }
     }
   }
 
@@ -428,6 +525,7 @@ boolean process_sensor_data(output_hdr_t *output,
 typedef struct {
   uint16_t value;
 } state_level_value_t;
+PROGRAM_STATE_CHECK(state_level_value_t);
 
 boolean program_level_value_init(msg_program_t *msg,
                                  program_tracker_t *tracker,
@@ -442,6 +540,9 @@ boolean program_level_value_init(msg_program_t *msg,
   state_level_value_t *state =
           (state_level_value_t *)manager->get_program_state(tracker,
                                                             sizeof (state_level_value_t));
+  if (state == NULL) {
+    return false;
+  }
   state->value = 0;
 
   return true;
@@ -474,6 +575,7 @@ typedef struct {
   uint16_t value;
   uint32_t max;
 } state_sound_value_t;
+PROGRAM_STATE_CHECK(state_sound_value_t);
 
 boolean program_sound_value_init(msg_program_t *msg,
                                  program_tracker_t *tracker,
@@ -488,6 +590,9 @@ boolean program_sound_value_init(msg_program_t *msg,
   state_sound_value_t *state =
           (state_sound_value_t *)manager->get_program_state(tracker,
                                                             sizeof (state_sound_value_t));
+  if (state == NULL) {
+    return false;
+  }
   state->value = 0;
   state->max = 0;
 
@@ -541,12 +646,13 @@ typedef struct {
   program_sound_pixels_t msg;
   uint16_t max[SOUND_CHANNELS];
 } state_sound_pixels_t;
+PROGRAM_STATE_CHECK(state_sound_pixels_t);
 
 boolean program_sound_pixels_init(msg_program_t *msg,
                                   program_tracker_t *tracker,
                                   output_hdr_t *output, void *object,
                                   ProgramManager *manager) {
-  if ((output == NULL) || !IS_HMTL_PIXEL_OUTPUT(output->type)) {
+  if ((output == NULL) || (output->type != HMTL_OUTPUT_PIXELS)) {
     return false;
   }
 
@@ -554,6 +660,9 @@ boolean program_sound_pixels_init(msg_program_t *msg,
   state_sound_pixels_t *state =
           (state_sound_pixels_t *)manager->get_program_state(tracker,
                                                              sizeof (state_sound_pixels_t));
+  if (state == NULL) {
+    return false;
+  }
   memcpy(&state->msg, msg->values, sizeof (state->msg));
   memset(state->max, 0, sizeof(uint16_t) * SOUND_CHANNELS);
 
@@ -10,7 +10,7 @@
 
 #include "HMTLPrograms.h"
 #include "MessageHandler.h"
-#include "Programmanager.h"
+#include "ProgramManager.h"
 #include "Socket.h"
 
 #include "HMTL_Module.h"
@@ -28,9 +28,8 @@ void startup_commands(ProgramManager *manager, MessageHandler *handler,
                       Socket **sockets, config_hdr_t *config) {
 
   /*
-   * TODO: This mechanism is overly hard-coded.  A method of adding commands in
-   * the EEPROM configuration would be much better, allowing for proper
-   * configuration.
+   * These are only used when no boot scene is stored in the EEPROM scene
+   * store, which is the configurable replacement for them.
    */
   msg_hdr_t *msg = NULL;
 
@@ -8,6 +8,7 @@
 
 #include <Arduino.h>
 #include <HMTLTypes.h>
+#include <HMTLProtocol.h>
 
 #ifndef DEBUG_LEVEL
   #define DEBUG_LEVEL DEBUG_ERROR
@@ -23,6 +24,51 @@
 #include "PixelUtil.h"
 #include "RS485Utils.h"
 
+/* CRC-8 lookup table for polynomial 0x07 */
+const uint8_t hmtl_crc_table[256] PROGMEM = {
+  0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31,
+  0x24, 0x23, 0x2A, 0x2D, 0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+  0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D, 0xE0, 0xE7, 0xEE, 0xE9,
+  0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+  0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1,
+  0xB4, 0xB3, 0xBA, 0xBD, 0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+  0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA, 0xB7, 0xB0, 0xB9, 0xBE,
+  0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+  0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16,
+  0x03, 0x04, 0x0D, 0x0A, 0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+  0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A, 0x89, 0x8E, 0x87, 0x80,
+  0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+  0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8,
+  0xDD, 0xDA, 0xD3, 0xD4, 0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+  0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44, 0x19, 0x1E, 0x17, 0x10,
+  0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+  0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F,
+  0x6A, 0x6D, 0x64, 0x63, 0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+  0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13, 0xAE, 0xA9, 0xA0, 0xA7,
+  0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+  0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF,
+  0xFA, 0xFD, 0xF4, 0xF3
+};
+
+/* Compute the CRC of a complete message, treating the crc field as 0 */
+uint8_t hmtl_msg_crc(const msg_hdr_t *msg_hdr) {
+  const byte *data = (const byte *)msg_hdr;
+  uint8_t crc = 0;
+
+  crc = HMTL_CRC_UPDATE(crc, data[0]);
+  crc = HMTL_CRC_UPDATE(crc, 0);
+  for (uint8_t i = 2; i < msg_hdr->length; i++) {
+    crc = HMTL_CRC_UPDATE(crc, data[i]);
+  }
+
+  return crc;
+}
+
+/* Fill in the crc field of a message after its contents are complete */
+void hmtl_msg_set_crc(msg_hdr_t *msg_hdr) {
+  msg_hdr->crc = hmtl_msg_crc(msg_hdr);
+}
+
 uint16_t hmtl_msg_size(output_hdr_t *output) 
 {
   switch (output->type) {
@@ -45,9 +91,10 @@ uint16_t hmtl_msg_size(output_hdr_t *output)
 }
 
 /*
- * Process a command message for a particular output
+ * Process a command message for a particular output, returning a bitmask of
+ * the outputs that were changed.
  */
-int
+int32_t
 hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
                        byte num_outputs, output_hdr_t *outputs[],
                        void *objects[])
@@ -76,6 +123,7 @@ hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
     stop_output = starting_output + 1;
   }
 
+  int32_t updated = 0;
   for (byte output = starting_output; output < stop_output; output++) {
 
     output_hdr_t *out = outputs[output];
@@ -96,6 +144,7 @@ hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
           values[i] = msg2->value;
         }
         hmtl_set_output_rgb(out, data, values);
+        updated |= (1 << output);
         break;
       }
 
@@ -107,6 +156,7 @@ hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
 
         msg_rgb_t *msg2 = (msg_rgb_t *) msg;
         hmtl_set_output_rgb(out, data, msg2->values);
+        updated |= (1 << output);
         break;
       }
 
@@ -118,7 +168,7 @@ hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
     }
   }
 
-  return 0;
+  return updated;
 }
 
 /* Check for HMTL formatted msg over a socket interface */
@@ -149,7 +199,14 @@ hmtl_socket_getmsg(Socket *socket, unsigned int *msglen, uint16_t address) {
       goto ERROR_OUT;
     }
 
-    // TODO: Check the CRC!  Check the version!
+#ifdef HMTL_USE_CRC
+    if (hmtl_msg_crc(msg_hdr) != msg_hdr->crc) {
+      DEBUG1_HEXVALLN("hmtl_socket_getmsg: bad crc ", msg_hdr->crc);
+      goto ERROR_OUT;
+    }
+#endif
+
+    // TODO: Check the version!
 
     return msg_hdr;
   }
@@ -163,11 +220,14 @@ hmtl_socket_getmsg(Socket *socket, unsigned int *msglen, uint16_t address) {
  * Read in a message structure from the serial interface
  */
 boolean
-hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr) 
+hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr, byte *crc_ptr)
 {
   msg_hdr_t *msg_hdr = (msg_hdr_t *)&msg[0];
   byte offset = *offset_ptr;
   boolean complete = false;
+#ifdef HMTL_USE_CRC
+  byte crc = (crc_ptr != NULL) ? *crc_ptr : 0;
+#endif
 
   while (Serial.available()) {
     if (offset > msg_len) {
@@ -176,6 +236,12 @@ hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr)
       DEBUG_ERR("hmtl_serial_update: exceed max msg len");
     }
 
+    if ((offset == 0) && ((Serial.peek() == HMTL_SERIAL_SEQ) ||
+                          (Serial.peek() == HMTL_SERIAL_SEQ_SYNC))) {
+      /* The sequence prefix of the next message is handled by the caller */
+      break;
+    }
+
     byte val = Serial.read();
     //    DEBUG4_VALUE(" ", offset);
     //    DEBUG4_HEXVAL("-", val);
@@ -189,9 +255,16 @@ hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr)
       }
 
       /* This is probably the beginning of the message */ 
+#ifdef HMTL_USE_CRC
+      crc = 0;
+#endif
     }
 
     msg[offset] = val;
+#ifdef HMTL_USE_CRC
+    /* The CRC is computed with the crc field as 0 */
+    crc = HMTL_CRC_UPDATE(crc, (offset == offsetof(msg_hdr_t, crc)) ? 0 : val);
+#endif
     offset++;
 
     if (offset >= sizeof (msg_hdr_t)) {
@@ -205,10 +278,21 @@ hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr)
 
       if (offset == msg_hdr->length) {
         /* This is a complete message */
+#ifdef HMTL_USE_CRC
+        if (crc_ptr == NULL) {
+          /* Without saved state the running CRC may be partial */
+          crc = hmtl_msg_crc(msg_hdr);
+        }
+        if (crc != msg_hdr->crc) {
+          DEBUG1_HEXVALLN("hmtl_serial_getmsg: bad crc ", msg_hdr->crc);
+          offset = 0;
+          continue;
+        }
+#endif
         DEBUG4_PRINTLN("hmtl_serial_getmsg: Received complete command");
         complete = true;
 
-        // XXX: Check the CRC and the version
+        // XXX: Check the version
         break;
       }
     }
@@ -223,6 +307,9 @@ hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr)
   );
 
   *offset_ptr = offset;
+#ifdef HMTL_USE_CRC
+  if (crc_ptr != NULL) *crc_ptr = crc;
+#endif
   return complete;
 }
 
@@ -230,6 +317,14 @@ hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr)
  * Individual message formatting
  */
 
+/* Source stamped on formatted messages, and the next sequence number */
+static socket_addr_t msg_source = SOCKET_ADDR_INVALID;
+static uint8_t msg_seq = 0;
+
+void hmtl_msg_set_source(socket_addr_t source) {
+  msg_source = (source == SOCKET_ADDR_ANY) ? SOCKET_ADDR_INVALID : source;
+}
+
 /* Initialize the message header */
 void hmtl_msg_fmt(msg_hdr_t *msg_hdr, uint16_t address, uint8_t length, 
                   uint8_t type, uint8_t flags) {
@@ -240,10 +335,12 @@ void hmtl_msg_fmt(msg_hdr_t *msg_hdr, uint16_t address, uint8_t length,
   msg_hdr->type = type;
   msg_hdr->flags = flags;
   msg_hdr->address = address;
+  msg_hdr->source = msg_source;
+  msg_hdr->seq = (msg_source != SOCKET_ADDR_INVALID) ? msg_seq++ : 0;
+  msg_hdr->ttl = HMTL_MSG_TTL;
 
 #ifdef HMTL_USE_CRC
-  /* Compute the CRC with the crc value with the crc value == 0 */
-  msg_hdr->crc = EEPROM_crc(msg_hdr, length);
+  hmtl_msg_set_crc(msg_hdr);
 #endif
 }
 
@@ -310,8 +407,7 @@ uint16_t hmtl_poll_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
   
   // TODO: Add outputs XXX
 
-  hmtl_msg_fmt(msg_hdr, address, len, MSG_TYPE_POLL);
-  msg_hdr->flags |= flags | MSG_FLAG_ACK;
+  hmtl_msg_fmt(msg_hdr, address, len, MSG_TYPE_POLL, flags | MSG_FLAG_ACK);
   return len;
 }
 
@@ -334,9 +430,104 @@ uint16_t hmtl_dumpconfig_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
   return len;
 }
 
+/* Format an acknowledgement of sequenced serial messages */
+uint16_t hmtl_serial_ack_fmt(byte *buffer, uint16_t buffsize,
+                             socket_addr_t address, uint8_t sequence) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_serial_ack_t *msg_ack = (msg_serial_ack_t *)(msg_hdr + 1);
+
+  if (buffsize < HMTL_MSG_SERIAL_ACK_LEN) {
+    DEBUG_ERR("hmtl_serial_ack_fmt: buff too small");
+    DEBUG_ERR_STATE(1);
+  }
+
+  msg_ack->sequence = sequence;
+
+  hmtl_msg_fmt(msg_hdr, address, HMTL_MSG_SERIAL_ACK_LEN, MSG_TYPE_SERIAL_ACK,
+               MSG_FLAG_ACK);
+  return HMTL_MSG_SERIAL_ACK_LEN;
+}
+
+/* Initialize an empty batch message */
+uint16_t hmtl_batch_fmt(byte *buffer, uint16_t buffsize, socket_addr_t address,
+                        uint8_t flags) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+
+  if (buffsize < HMTL_MSG_BATCH_MIN_LEN) {
+    DEBUG_ERR("hmtl_batch_fmt: buff too small");
+    DEBUG_ERR_STATE(1);
+  }
+
+  hmtl_msg_fmt(msg_hdr, address, HMTL_MSG_BATCH_MIN_LEN, MSG_TYPE_BATCH, flags);
+  return HMTL_MSG_BATCH_MIN_LEN;
+}
+
+/*
+ * Append a formatted message to a batch.  If the message doesn't fit then 0 is
+ * returned and the batch is unchanged, so that the caller can send the batch
+ * and start a new one.
+ */
+uint16_t hmtl_batch_add(byte *buffer, uint16_t buffsize, const msg_hdr_t *msg) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+
+  if ((msg->type == MSG_TYPE_BATCH) || (msg->type == MSG_TYPE_FRAGMENT) ||
+      (msg->type >= MSG_TYPE_DONT_FORWARD)) {
+    DEBUG1_VALUELN("hmtl_batch_add: can't batch type:", msg->type);
+    return 0;
+  }
+
+  uint8_t datalen = msg->length - sizeof (msg_hdr_t);
+  uint16_t len = msg_hdr->length + sizeof (msg_batch_entry_t) + datalen;
+  if ((len > buffsize) || (len > HMTL_MAX_MSG_LEN)) {
+    return 0;
+  }
+
+  msg_batch_entry_t *entry = (msg_batch_entry_t *)(buffer + msg_hdr->length);
+  entry->length = datalen;
+  entry->type = msg->type;
+  entry->address = msg->address;
+  memcpy(entry + 1, msg + 1, datalen);
+
+  /* The batch keeps the sequence number it was stamped with */
+  msg_hdr->length = len;
+#ifdef HMTL_USE_CRC
+  hmtl_msg_set_crc(msg_hdr);
+#endif
+  return len;
+}
+
+/* Wrap a formatted message in a timed message */
+uint16_t hmtl_timed_fmt(byte *buffer, uint16_t buffsize, uint32_t execute_ms,
+                        const msg_hdr_t *msg) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_timed_t *msg_timed = (msg_timed_t *)(msg_hdr + 1);
+
+  if ((msg->type != MSG_TYPE_OUTPUT) && (msg->type != MSG_TYPE_BATCH) &&
+      (msg->type != MSG_TYPE_SCENE)) {
+    DEBUG1_VALUELN("hmtl_timed_fmt: can't time type:", msg->type);
+    return 0;
+  }
+
+  socket_addr_t address = msg->address;
+  uint8_t msglen = msg->length;
+  uint16_t len = HMTL_MSG_TIMED_LEN(msglen);
+  if ((len > buffsize) || (len > HMTL_MAX_MSG_LEN)) {
+    DEBUG1_VALUELN("hmtl_timed_fmt: too long:", len);
+    return 0;
+  }
+
+  // The message may already be in the buffer, so move it before writing
+  memmove(msg_timed + 1, msg, msglen);
+  msg_timed->execute_ms = execute_ms;
+
+  hmtl_msg_fmt(msg_hdr, address, len, MSG_TYPE_TIMED);
+  return len;
+}
+
 /*
  * Format a sensor response message.  The caller will fill in the actual sensor
- * data after the header.
+ * data after the header, and then call hmtl_msg_set_crc() if HMTL_USE_CRC is
+ * enabled.
  */
 uint16_t hmtl_sensor_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
                          uint8_t datalen, uint8_t **data_ptr) {
@@ -346,8 +537,7 @@ uint16_t hmtl_sensor_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
   uint16_t len = HMTL_MSG_SENSOR_MIN_LEN + datalen;
 
   /* Format the message header */
-  hmtl_msg_fmt(msg_hdr, address, len, MSG_TYPE_SENSOR);
-  msg_hdr->flags |= MSG_FLAG_ACK;
+  hmtl_msg_fmt(msg_hdr, address, len, MSG_TYPE_SENSOR, MSG_FLAG_ACK);
 
   /* Set the data ptr to be returned */
   *data_ptr = (uint8_t *)&msg_sense->data;
@@ -355,6 +545,196 @@ uint16_t hmtl_sensor_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
   return len;
 }
 
+/* Pixel i of a frame as it is encoded, XORed with the previous frame if any */
+static inline uint32_t frame_pixel(const byte *pixels, const byte *previous,
+                                   uint16_t i) {
+  const byte *p = pixels + 3 * i;
+  uint32_t value = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  if (previous != NULL) {
+    const byte *q = previous + 3 * i;
+    value ^= ((uint32_t)q[0] << 16) | ((uint32_t)q[1] << 8) | q[2];
+  }
+  return value;
+}
+
+static inline void frame_pixel_write(byte *buffer, uint32_t value) {
+  buffer[0] = value >> 16;
+  buffer[1] = value >> 8;
+  buffer[2] = value;
+}
+
+/*
+ * Format the next chunk of a pixel frame.  Repeated pixels are encoded as
+ * runs and everything else as literals, with as many pixels as fit in the
+ * buffer.
+ */
+uint16_t hmtl_pixel_frame_fmt(byte *buffer, uint16_t buffsize,
+                              socket_addr_t address, uint8_t output,
+                              uint8_t frame, const byte *pixels,
+                              const byte *previous, uint16_t num_pixels,
+                              uint16_t *offset) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_pixel_frame_t *msg_frame = (msg_pixel_frame_t *)(msg_hdr + 1);
+
+  uint16_t limit = (buffsize < HMTL_MAX_MSG_LEN) ? buffsize : HMTL_MAX_MSG_LEN;
+  uint16_t len = HMTL_MSG_PIXEL_FRAME_MIN_LEN;
+  uint16_t led = *offset;
+
+  while ((led < num_pixels) && (len + 4 <= limit)) {
+    uint32_t value = frame_pixel(pixels, previous, led);
+
+    byte run = 1;
+    while ((led + run < num_pixels) && (run < HMTL_FRAME_MAX_PACKET) &&
+           (frame_pixel(pixels, previous, led + run) == value)) {
+      run++;
+    }
+
+    if (run > 1) {
+      buffer[len] = HMTL_FRAME_RUN | (run - 1);
+      frame_pixel_write(&buffer[len + 1], value);
+      len += 4;
+      led += run;
+      continue;
+    }
+
+    /* A literal continues until the next run or the buffer is full */
+    uint16_t control = len++;
+    byte count = 0;
+    do {
+      frame_pixel_write(&buffer[len], value);
+      len += 3;
+      led++;
+      count++;
+      if (led >= num_pixels) break;
+      value = frame_pixel(pixels, previous, led);
+    } while ((count < HMTL_FRAME_MAX_PACKET) && (len + 3 <= limit) &&
+             ((led + 1 >= num_pixels) ||
+              (frame_pixel(pixels, previous, led + 1) != value)));
+    buffer[control] = count - 1;
+  }
+
+  if (led == *offset) {
+    DEBUG1_VALUELN("hmtl_pixel_frame_fmt: no pixels fit at ", led);
+    return 0;
+  }
+
+  msg_frame->output = output;
+  msg_frame->frame = frame;
+  msg_frame->offset = *offset;
+  msg_frame->flags = (previous != NULL ? HMTL_FRAME_DELTA : 0) |
+                     (led >= num_pixels ? HMTL_FRAME_FINAL : 0);
+  *offset = led;
+
+  hmtl_msg_fmt(msg_hdr, address, len, MSG_TYPE_PIXEL_FRAME);
+  return len;
+}
+
+/* Decode the packets of a pixel frame chunk */
+int hmtl_pixel_frame_decode(const byte *data, uint8_t datalen, boolean delta,
+                            byte *pixels, uint16_t num_pixels) {
+  const byte *end = data + datalen;
+  uint16_t written = 0;
+
+  while (data < end) {
+    byte control = *data++;
+    byte count = (control & ~HMTL_FRAME_RUN) + 1;
+    if (count > num_pixels - written) {
+      return -1;
+    }
+
+    if (control & HMTL_FRAME_RUN) {
+      if (end - data < 3) return -1;
+      byte r = data[0], g = data[1], b = data[2];
+      data += 3;
+
+      if (!delta) {
+        for (byte i = 0; i < count; i++, pixels += 3) {
+          pixels[0] = r;
+          pixels[1] = g;
+          pixels[2] = b;
+        }
+      } else if (r | g | b) {
+        for (byte i = 0; i < count; i++, pixels += 3) {
+          pixels[0] ^= r;
+          pixels[1] ^= g;
+          pixels[2] ^= b;
+        }
+      } else {
+        /* Unchanged pixels */
+        pixels += 3 * count;
+      }
+    } else {
+      uint16_t bytes = 3 * count;
+      if (end - data < bytes) return -1;
+
+      if (delta) {
+        for (uint16_t i = 0; i < bytes; i++) {
+          pixels[i] ^= data[i];
+        }
+      } else {
+        memcpy(pixels, data, bytes);
+      }
+      data += bytes;
+      pixels += bytes;
+    }
+
+    written += count;
+  }
+
+  return written;
+}
+
+/* Bytes of the carried message in each fragment of at most fragsize bytes */
+static uint8_t fragment_payload(uint16_t fragsize) {
+  if (fragsize > HMTL_FRAGMENT_MAX_MSG_LEN) {
+    fragsize = HMTL_FRAGMENT_MAX_MSG_LEN;
+  }
+  if (fragsize <= HMTL_MSG_FRAGMENT_MIN_LEN) {
+    return 0;
+  }
+  return fragsize - HMTL_MSG_FRAGMENT_MIN_LEN;
+}
+
+uint8_t hmtl_fragment_count(uint8_t msglen, uint16_t fragsize) {
+  uint8_t payload = fragment_payload(fragsize);
+  if (payload == 0) {
+    return 0;
+  }
+  return ((uint16_t)msglen + payload - 1) / payload;
+}
+
+/*
+ * Format a single fragment of a message.  Fragments carry no flags, so that a
+ * carried acknowledgement is only treated as one once it is reassembled.
+ */
+uint16_t hmtl_fragment_fmt(byte *buffer, uint16_t buffsize,
+                           const msg_hdr_t *msg, uint8_t id, uint8_t index) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_fragment_t *msg_fragment = (msg_fragment_t *)(msg_hdr + 1);
+
+  uint8_t total = hmtl_fragment_count(msg->length, buffsize);
+  if (index >= total) {
+    DEBUG1_VALUELN("hmtl_fragment_fmt: no fragment ", index);
+    return 0;
+  }
+
+  uint8_t payload = fragment_payload(buffsize);
+  uint16_t start = (uint16_t)index * payload;
+  uint8_t datalen = msg->length - start;
+  if (datalen > payload) {
+    datalen = payload;
+  }
+
+  msg_fragment->id = id;
+  msg_fragment->index = index;
+  msg_fragment->total = total;
+  memcpy(msg_fragment->data, (const byte *)msg + start, datalen);
+
+  uint16_t len = HMTL_MSG_FRAGMENT_MIN_LEN + datalen;
+  hmtl_msg_fmt(msg_hdr, msg->address, len, MSG_TYPE_FRAGMENT);
+  return len;
+}
+
 /* Format an address setting message */
 uint16_t hmtl_set_addr_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
                            uint16_t device_id, uint16_t new_address) {
@@ -373,6 +753,25 @@ uint16_t hmtl_set_addr_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
   return HMTL_MSG_SET_ADDR_LEN;
 }
 
+/* Format a scene recall message */
+uint16_t hmtl_scene_fmt(byte *buffer, uint16_t buffsize, socket_addr_t address,
+                        uint8_t scene, uint8_t flags) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_scene_t *msg_scene = (msg_scene_t *)(msg_hdr + 1);
+
+  if (buffsize < HMTL_MSG_SCENE_LEN) {
+    DEBUG1_VALUELN("hmtl_scene_fmt: too small:", buffsize);
+    return 0;
+  }
+
+  msg_scene->scene = scene;
+  msg_scene->flags = flags;
+  msg_scene->reserved = 0;
+
+  hmtl_msg_fmt(msg_hdr, address, HMTL_MSG_SCENE_LEN, MSG_TYPE_SCENE);
+  return HMTL_MSG_SCENE_LEN;
+}
+
 /***** Wrapper functions for sending HMTL Messages ****************************/
 
 
@@ -401,6 +800,25 @@ void hmtl_send_rgb(Socket *socket, byte *buff, byte buff_len,
   socket->sendMsgTo(address, buff, len);
 }
 
+void hmtl_send_fragmented(Socket *socket, socket_addr_t address,
+                          const msg_hdr_t *msg, uint8_t id) {
+  if (msg->length <= socket->send_data_size) {
+    memcpy(socket->send_buffer, msg, msg->length);
+    socket->sendMsgTo(address, socket->send_buffer, msg->length);
+    return;
+  }
+
+  uint8_t total = hmtl_fragment_count(msg->length, socket->send_data_size);
+  DEBUG5_VALUE("hmtl_send_fragmented: len:", msg->length);
+  DEBUG5_VALUELN(" fragments:", total);
+
+  for (uint8_t index = 0; index < total; index++) {
+    uint16_t len = hmtl_fragment_fmt(socket->send_buffer,
+                                     socket->send_data_size, msg, id, index);
+    socket->sendMsgTo(address, socket->send_buffer, len);
+  }
+}
+
 
 /*******************************************************************************
  * Data processing helper functions
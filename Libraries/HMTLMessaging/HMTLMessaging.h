@@ -13,7 +13,11 @@
 #include "RS485Utils.h"
 #include "HMTLTypes.h"
 
-// Uncomment this line to enable CRC checking of messages
+/*
+ * Uncomment this line to enable CRC checking of messages.  When enabled the
+ * CRC is filled in for sent messages and verified for received ones, so all
+ * modules on a network must be built with the same setting.
+ */
 //#define HMTL_USE_CRC
 
 /******************************************************************************
@@ -25,8 +29,9 @@
  * depending on the header's type and flag fields.
  *
  * Message header:
- * 8B:  |startcode |   crc    | version  | length   |
+ * 12B: |startcode |   crc    | version  | length   |
  *      |  type    |  flags   |       address       |
+ *      |       source        |   seq    |   ttl    |
  *
  * Output message adds output_hdr_t + output-type specific data
  * 2B:  |   type   |  output  | ...
@@ -36,7 +41,7 @@
 
 #define HMTL_MSG_START 0xFC
 
-#define HMTL_MSG_VERSION 2
+#define HMTL_MSG_VERSION 3
 typedef struct {
   uint8_t startcode;
   uint8_t crc;
@@ -51,17 +56,40 @@ typedef struct {
   // serial).
   socket_addr_t address;
 
+  /*
+   * The module or controller that created the message and its sequence number
+   * from that sender, which identify copies of a message that arrive over
+   * more than one path.  They're stamped by hmtl_msg_fmt(), see
+   * hmtl_msg_set_source().  Messages from senders without an address have
+   * source SOCKET_ADDR_INVALID and can't be recognized as copies, so only
+   * their ttl limits forwarding.  The ttl is the number of further times the
+   * message may be forwarded.
+   */
+  socket_addr_t source;
+  uint8_t seq;
+  uint8_t ttl;
 } msg_hdr_t;
 
+#ifndef HMTL_MSG_TTL
+  #define HMTL_MSG_TTL 8 // Default hop limit for new messages
+#endif
+
 /* Message type codes */
+#define MSG_TYPE_BASE        0x01 // Lowest message type
 #define MSG_TYPE_OUTPUT      0x01
 #define MSG_TYPE_POLL        0x02
 #define MSG_TYPE_SET_ADDR    0x03
 #define MSG_TYPE_SENSOR      0x04
 #define MSG_TYPE_TIMESYNC    0x05
+#define MSG_TYPE_BATCH       0x06
+#define MSG_TYPE_TIMED       0x07
+#define MSG_TYPE_PIXEL_FRAME 0x08
+#define MSG_TYPE_FRAGMENT    0x09
+#define MSG_TYPE_SCENE       0x0A
 
 #define MSG_TYPE_DONT_FORWARD 0xE0 // Msg types past this should not be forwarded
 #define MSG_TYPE_DUMP_CONFIG  0xE0
+#define MSG_TYPE_SERIAL_ACK   0xE1
 
 /* Message flags */
 #define MSG_FLAG_ACK        (1 << 0) // This message is an acknowledgement
@@ -132,7 +160,7 @@ typedef struct {
  * Message format for MSG_TYPE_SENSOR
  */
 typedef struct {
-  uint8_t data[];
+  uint8_t data[0];
 } msg_sensor_response_t;
 #define HMTL_MSG_SENSOR_MIN_LEN (sizeof (msg_hdr_t) + sizeof (msg_sensor_response_t))
 
@@ -147,6 +175,171 @@ typedef struct {
 #define HMTL_SENSOR_LIGHT 0x2
 #define HMTL_SENSOR_POT   0x3
 
+/*******************************************************************************
+ * Message format for MSG_TYPE_SERIAL_ACK
+ *
+ * Cumulative acknowledgement of sequenced serial messages, see
+ * HMTL_SERIAL_SEQ in HMTLProtocol.h
+ */
+typedef struct {
+  uint8_t sequence; // Last sequence number received in order
+} msg_serial_ack_t;
+#define HMTL_MSG_SERIAL_ACK_LEN (sizeof (msg_hdr_t) + sizeof (msg_serial_ack_t))
+
+/*******************************************************************************
+ * Message format for MSG_TYPE_BATCH
+ *
+ * A batch carries several messages in a single frame.  Each message is packed
+ * as a msg_batch_entry_t followed by the message body (everything after the
+ * msg_hdr_t), and the batch header's flags apply to every entry.
+ *
+ * Batch message:
+ * 12B: | msg_hdr_t |
+ * 4B:  |  length  |   type   |       address       | length bytes of body
+ * 4B:  |  length  |   type   |       address       | length bytes of body
+ * ...
+ */
+typedef struct {
+  uint8_t length; // Length of the message body following this entry
+  uint8_t type;
+  socket_addr_t address;
+} msg_batch_entry_t;
+#define HMTL_MSG_BATCH_MIN_LEN (sizeof (msg_hdr_t))
+
+// Size of an entry holding a message of the given total length
+#define HMTL_MSG_BATCH_ENTRY_LEN(msglen) \
+  (sizeof (msg_batch_entry_t) + (msglen) - sizeof (msg_hdr_t))
+
+// Batches are limited to the standard 64B socket buffers by default
+#ifndef HMTL_MSG_BATCH_MAX_LEN
+  #define HMTL_MSG_BATCH_MAX_LEN 64
+#endif
+
+/*******************************************************************************
+ * Message format for MSG_TYPE_TIMED
+ *
+ * A timed message carries a complete output, batch or scene message
+ * (including its header) that is to be processed at execute_ms, in
+ * timesync.ms() time.
+ * Sending cues ahead of time lets every module act on the same millisecond
+ * regardless of how long forwarding took to reach it.  The timed message is
+ * addressed to the same address as the message it carries.  A module holds
+ * only MSG_PENDING_QUEUE cues at once, a single one on AVR, and drops any
+ * that arrive while it is full.
+ *
+ * Timed message:
+ * 12B: | msg_hdr_t |
+ * 4B:  |                 execute_ms                |
+ * 12B: | msg_hdr_t of the carried message | followed by its body
+ */
+typedef struct {
+  uint32_t execute_ms;
+} msg_timed_t;
+#define HMTL_MSG_TIMED_LEN(msglen) \
+  (sizeof (msg_hdr_t) + sizeof (msg_timed_t) + (msglen))
+
+/*******************************************************************************
+ * Message format for MSG_TYPE_PIXEL_FRAME
+ *
+ * Pixel frames stream RGB data to a pixel output, segment or palette output.
+ * A frame is sent as one or more chunks in order of increasing offset, each
+ * holding encoded pixels beginning at offset.  Chunks are decoded directly
+ * into the output's pixels, and the output, including programs on its other
+ * segments, is only updated once the chunk flagged HMTL_FRAME_FINAL has been
+ * applied.  Palette outputs map each pixel
+ * to the nearest palette entry and only take key frames.
+ *
+ * Chunk data is a series of packets, each a control byte followed by pixels:
+ *   0x00-0x7F: literal, (control + 1) pixels of 3 bytes follow
+ *   0x80-0xFF: run, one pixel follows that is repeated (control - 0x7F) times
+ *
+ * Delta frames (HMTL_FRAME_DELTA) hold each pixel XORed with the previous
+ * frame, so unchanged pixels are runs of zero.  A delta frame is only applied
+ * if it directly follows a complete frame, so after a lost chunk delta frames
+ * are dropped until the next key frame.
+ *
+ * Pixel frame message:
+ * 12B: | msg_hdr_t |
+ * 5B:  |  output  |  frame   |       offset        |  flags   | data
+ */
+typedef struct __attribute__((__packed__)) {
+  uint8_t output;
+  uint8_t frame;   // Frame id, incremented for each frame
+  uint16_t offset; // First pixel of this chunk
+  uint8_t flags;
+  uint8_t data[0];
+} msg_pixel_frame_t;
+#define HMTL_MSG_PIXEL_FRAME_MIN_LEN \
+  (sizeof (msg_hdr_t) + sizeof (msg_pixel_frame_t))
+
+#define HMTL_FRAME_DELTA 0x1 // Pixels are XORed with the previous frame
+#define HMTL_FRAME_FINAL 0x2 // Last chunk of the frame
+
+#define HMTL_FRAME_RUN        0x80 // Control byte flag for a run of pixels
+#define HMTL_FRAME_MAX_PACKET 128  // Most pixels in a single packet
+
+/*******************************************************************************
+ * Message format for MSG_TYPE_FRAGMENT
+ *
+ * A message too long for a socket's frames is sent as a series of fragments,
+ * each carrying the next part of the complete message including its header.
+ * Fragments are addressed as the message they carry so that they're forwarded
+ * the same way, and the receiver reassembles them before processing the
+ * message.  Fragments of a message must arrive in order, a partial message is
+ * dropped if a fragment is missing or it isn't completed within
+ * HMTL_FRAGMENT_TIMEOUT_MS.  Fragments can't be batched.
+ *
+ * Every fragment but the last carries the same number of bytes, so a message
+ * of length L in fragments of at most F bytes has
+ * ceil(L / (F - HMTL_MSG_FRAGMENT_MIN_LEN)) fragments.
+ *
+ * Fragment message:
+ * 12B: | msg_hdr_t |
+ * 3B:  |    id    |  index   |  total   | part of the carried message
+ */
+typedef struct {
+  uint8_t id;    // Identifies the message among the sender's messages
+  uint8_t index; // Index of this fragment, from 0
+  uint8_t total; // Number of fragments in the message
+  uint8_t data[0];
+} msg_fragment_t;
+#define HMTL_MSG_FRAGMENT_MIN_LEN \
+  (sizeof (msg_hdr_t) + sizeof (msg_fragment_t))
+
+// Longest message that can be fragmented, limited by msg_hdr_t.length
+#define HMTL_FRAGMENT_MAX_MSG_LEN 255
+
+/*******************************************************************************
+ * Message format for MSG_TYPE_SCENE
+ *
+ * A scene message starts the programs of a scene from the module's scene
+ * store (see HMTLTypes.h), so a broadcast scene message changes the programs
+ * of an entire installation.  Modules without programs in the scene are
+ * unchanged.  If HMTL_SCENE_FLAG_BOOT is set the scene also becomes the boot
+ * scene, started when the module is powered on.
+ *
+ * Scene message:
+ * 12B: | msg_hdr_t |
+ * 3B:  |  scene   |  flags   | reserved |
+ */
+typedef struct {
+  uint8_t scene;
+  uint8_t flags;
+  uint8_t reserved;
+} msg_scene_t;
+#define HMTL_MSG_SCENE_LEN (sizeof (msg_hdr_t) + sizeof (msg_scene_t))
+
+#define HMTL_SCENE_FLAG_BOOT 0x1 // Store this as the boot scene
+
+/* Program record of the scene store */
+typedef struct {
+  uint8_t scene;
+  msg_program_t program;
+} scene_program_t;
+
+static_assert(sizeof (scene_program_t) == HMTL_SCENE_RECORD_MAX,
+              "Scene records must hold a program message");
+
 /* This should be the largest individual message object ***********************/
 typedef msg_program_t msg_max_t;
 
@@ -155,19 +348,46 @@ typedef msg_program_t msg_max_t;
  */
 
 
+/*******************************************************************************
+ * Message CRC
+ *
+ * The crc field is a CRC-8 (polynomial 0x07, initial value 0) of the entire
+ * message, computed with the crc field itself set to 0.
+ */
+extern const uint8_t hmtl_crc_table[256] PROGMEM;
+
+/* Add a single byte to a running CRC */
+#define HMTL_CRC_UPDATE(crc, val) \
+  pgm_read_byte(&hmtl_crc_table[(uint8_t)((crc) ^ (val))])
+
+/* Compute the CRC of a complete message */
+uint8_t hmtl_msg_crc(const msg_hdr_t *msg_hdr);
+
+/* Fill in the crc field of a message after its contents are complete */
+void hmtl_msg_set_crc(msg_hdr_t *msg_hdr);
+
 /*******************************************************************************
  * Utility functions
  */
 uint16_t hmtl_msg_size(output_hdr_t *output);
 
-/* Process a HMTL formatted message */
-int hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
+/*
+ * Process a HMTL formatted message, returning a bitmask of the outputs that
+ * were changed or a negative value on error.
+ */
+int32_t hmtl_handle_output_msg(msg_hdr_t *msg_hdr,
                            byte num_objects,
                            output_hdr_t *outputs[],
                            void *objects[] = NULL);
 
-/* Receive a message over the serial interface */
-boolean hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr);
+/*
+ * Receive a message over the serial interface.  If crc_ptr is provided then the
+ * CRC is computed as bytes are received and is kept there between calls.
+ * Sequence prefixes (HMTL_SERIAL_SEQ) before a message are left unread for the
+ * caller.
+ */
+boolean hmtl_serial_getmsg(byte *msg, byte msg_len, byte *offset_ptr,
+                           byte *crc_ptr = NULL);
 
 /* Receive a message over the socket interface */
 msg_hdr_t *hmtl_socket_getmsg(Socket *socket, unsigned int *msglen,
@@ -180,6 +400,16 @@ msg_hdr_t *hmtl_socket_getmsg(Socket *socket, unsigned int *msglen,
 void hmtl_msg_fmt(msg_hdr_t *msg_hdr, socket_addr_t address, uint8_t length,
                   uint8_t type, uint8_t flags = 0);
 
+/*
+ * Set the source that hmtl_msg_fmt() stamps messages with, each with the next
+ * sequence number.  MessageHandler sets this to the module's address, and
+ * controllers should set their own.  Every sender needs a unique address, as
+ * a module drops messages with its own address as their source and copies
+ * are recognized by source and sequence number.  Unconfigured modules, with
+ * address SOCKET_ADDR_ANY, don't stamp their messages.
+ */
+void hmtl_msg_set_source(socket_addr_t source);
+
 uint16_t hmtl_value_fmt(byte *buffer, uint16_t buffsize,
 			socket_addr_t address, uint8_t output, int value);
 uint16_t hmtl_rgb_fmt(byte *buffer, uint16_t buffsize,
@@ -195,9 +425,66 @@ uint16_t hmtl_set_addr_fmt(byte *buffer, uint16_t buffsize,
 uint16_t hmtl_dumpconfig_fmt(byte *buffer, uint16_t buffsize, uint16_t address,
                              byte flags,
                              byte datalen);
+
+uint16_t hmtl_serial_ack_fmt(byte *buffer, uint16_t buffsize,
+                             socket_addr_t address, uint8_t sequence);
+
+/* Initialize an empty batch message */
+uint16_t hmtl_batch_fmt(byte *buffer, uint16_t buffsize, socket_addr_t address,
+                        uint8_t flags = 0);
+
+/*
+ * Append a formatted message to a batch, returning the new length of the
+ * batch or 0 if the message could not be added.
+ */
+uint16_t hmtl_batch_add(byte *buffer, uint16_t buffsize, const msg_hdr_t *msg);
+
+/*
+ * Format a timed message carrying a copy of msg, returning its length or 0 if
+ * it doesn't fit or isn't an output, batch or scene message
+ */
+uint16_t hmtl_timed_fmt(byte *buffer, uint16_t buffsize, uint32_t execute_ms,
+                        const msg_hdr_t *msg);
+
 uint16_t hmtl_sensor_fmt(byte *buffer, uint16_t buffsize, socket_addr_t address,
                          uint8_t datalen, uint8_t **data_ptr);
 
+/*
+ * Format the next chunk of a frame of num_pixels 3 byte pixels, beginning at
+ * pixel *offset.  If previous is provided the chunk is delta encoded against
+ * that frame.  Returns the message length and advances *offset past the
+ * encoded pixels, or returns 0 if no pixels fit.
+ */
+uint16_t hmtl_pixel_frame_fmt(byte *buffer, uint16_t buffsize,
+                              socket_addr_t address, uint8_t output,
+                              uint8_t frame, const byte *pixels,
+                              const byte *previous, uint16_t num_pixels,
+                              uint16_t *offset);
+
+/*
+ * Decode the data of a pixel frame chunk into num_pixels 3 byte pixels,
+ * returning the number of pixels written or -1 if the data is malformed or
+ * holds more than num_pixels.
+ */
+int hmtl_pixel_frame_decode(const byte *data, uint8_t datalen, boolean delta,
+                            byte *pixels, uint16_t num_pixels);
+
+/*
+ * Number of fragments needed to send a message of msglen bytes in fragments of
+ * at most fragsize bytes, or 0 if the fragments can't carry any data.
+ */
+uint8_t hmtl_fragment_count(uint8_t msglen, uint16_t fragsize);
+
+/*
+ * Format fragment index of msg, using fragments of at most buffsize bytes.
+ * Returns the fragment's length, or 0 if there is no such fragment.
+ */
+uint16_t hmtl_fragment_fmt(byte *buffer, uint16_t buffsize,
+                           const msg_hdr_t *msg, uint8_t id, uint8_t index);
+
+uint16_t hmtl_scene_fmt(byte *buffer, uint16_t buffsize, socket_addr_t address,
+                        uint8_t scene, uint8_t flags = 0);
+
 /*******************************************************************************
  * Wrapper functions for sending HMTL Messages 
  */
@@ -214,6 +501,13 @@ void hmtl_send_poll_request(Socket *socket, byte *buff, byte buff_len,
 void hmtl_send_sensor_request(Socket *socket, byte *buff, byte buff_len,
                               socket_addr_t address);
 
+/*
+ * Send a message over a socket, as fragments filling the socket's send buffer
+ * if it doesn't fit in one.  The message must not be in the send buffer.
+ */
+void hmtl_send_fragmented(Socket *socket, socket_addr_t address,
+                          const msg_hdr_t *msg, uint8_t id);
+
 /*******************************************************************************
  * Data processing helper functions
  */
@@ -48,6 +48,81 @@ void hmtl_program_fmt(msg_program_t *msg_program, uint8_t output,
   msg_program->type = program;
 }
 
+/*******************************************************************************
+ * Fixed-point interpolation
+ */
+
+/* Easing curves sampled at 16ths of the period, from HMTL_EASE_IN onwards */
+static const uint8_t hmtl_ease_table[HMTL_EASE_CURVES - 1][17] PROGMEM = {
+  { 0, 1, 4, 9, 16, 25, 36, 49, 64, 81, 100, 121, 143, 168, 195, 224, 255 },
+  { 0, 31, 60, 87, 112, 134, 155, 174, 191, 206, 219, 230, 239, 246, 251, 254,
+    255 },
+  { 0, 3, 11, 24, 40, 59, 81, 104, 128, 151, 174, 196, 215, 231, 244, 252, 255 },
+};
+
+void hmtl_tween_start(hmtl_tween_t *tween, unsigned long now, uint32_t period) {
+  tween->start_ms = now;
+  tween->rate = (period > 0) ? (0xFFFFFFFFUL / period) : 0;
+}
+
+boolean hmtl_tween_done(const hmtl_tween_t *tween, unsigned long now,
+                        uint32_t period) {
+  return (uint32_t)(now - tween->start_ms) >= period;
+}
+
+/* Return the fraction of the period elapsed, 0 to 0xFFFF */
+uint16_t hmtl_tween_fract16(const hmtl_tween_t *tween, unsigned long now,
+                            uint32_t period) {
+  uint32_t elapsed = now - tween->start_ms;
+  if (elapsed >= period) {
+    return 0xFFFF;
+  }
+  return (uint16_t)((elapsed * tween->rate) >> 16);
+}
+
+/* Return the eased fraction of the period elapsed, 0 to 255 */
+fract8 hmtl_tween_fract8(const hmtl_tween_t *tween, unsigned long now,
+                         uint32_t period, uint8_t curve) {
+  return hmtl_ease(hmtl_tween_fract16(tween, now, period), curve);
+}
+
+fract8 hmtl_ease(uint16_t fraction, uint8_t curve) {
+  if ((curve == HMTL_EASE_LINEAR) || (curve >= HMTL_EASE_CURVES)) {
+    return fraction >> 8;
+  }
+
+  const uint8_t *table = hmtl_ease_table[curve - 1];
+  uint8_t index = fraction >> 12;
+  uint8_t low = pgm_read_byte(&table[index]);
+  uint8_t high = pgm_read_byte(&table[index + 1]);
+  uint8_t within = (fraction >> 4) & 0xFF;
+  return low + (((uint16_t)(high - low) * within) >> 8);
+}
+
+/*******************************************************************************
+ * Fast pseudo-random numbers
+ */
+
+static uint32_t hmtl_random_state = 0;
+
+void hmtl_random_seed(uint32_t seed) {
+  /* Zero is the one state xorshift can't leave */
+  hmtl_random_state = seed ? seed : 0x2545F491UL;
+}
+
+uint32_t hmtl_random32() {
+  if (hmtl_random_state == 0) {
+    hmtl_random_seed(((uint32_t)random(0x10000) << 16) | random(0x10000));
+  }
+
+  uint32_t x = hmtl_random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  hmtl_random_state = x;
+  return x;
+}
+
 /* Format a cancel message */
 uint16_t hmtl_program_cancel_fmt(byte *buffer, uint16_t buffsize,
                                  uint16_t address, uint8_t output) {
@@ -176,6 +251,60 @@ uint16_t program_circular_fmt(byte *buffer, uint16_t buffsize,
   return HMTL_MSG_PROGRAM_LEN;
 }
 
+/* Format a message setting entries of a palette output's palette */
+uint16_t program_palette_fmt(byte *buffer, uint16_t buffsize,
+                             uint16_t address, uint8_t output,
+                             uint8_t first, uint8_t count, const CRGB *colors) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_program_t *msg_program = (msg_program_t *)(msg_hdr + 1);
+
+  hmtl_program_fmt(msg_program, output, PROGRAM_PALETTE, buffsize);
+
+  hmtl_program_palette_t *program =
+          (hmtl_program_palette_t *)msg_program->values;
+
+  if (count > HMTL_PALETTE_PROGRAM_COLORS) {
+    count = HMTL_PALETTE_PROGRAM_COLORS;
+  }
+
+  *program = hmtl_program_palette_t();
+  program->first = first;
+  program->count = count;
+  for (byte i = 0; i < count; i++) {
+    program->colors[i] = colors[i];
+  }
+
+  hmtl_msg_fmt(msg_hdr, address, HMTL_MSG_PROGRAM_LEN, MSG_TYPE_OUTPUT);
+  return HMTL_MSG_PROGRAM_LEN;
+}
+
+/*
+ * Convert a formatted program message into one that runs the program on a
+ * layer.  The program's values are moved after the layer header, so only the
+ * first HMTL_LAYER_PROGRAM_VAL of them are kept.
+ */
+uint16_t hmtl_program_layer_fmt(byte *buffer, uint16_t buffsize,
+                                uint8_t layer, uint8_t blend, uint8_t alpha,
+                                uint16_t start, uint16_t length) {
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_program_t *msg_program = (msg_program_t *)(msg_hdr + 1);
+
+  hmtl_program_layer_t *program = (hmtl_program_layer_t *)msg_program->values;
+  memmove(program->values, msg_program->values, HMTL_LAYER_PROGRAM_VAL);
+  program->program = msg_program->type;
+  program->layer = layer;
+  program->blend = blend;
+  program->alpha = alpha;
+  program->start = start;
+  program->length = length;
+
+  hmtl_program_fmt(msg_program, msg_program->hdr.output, HMTL_PROGRAM_LAYER,
+                   buffsize);
+  hmtl_msg_fmt(msg_hdr, msg_hdr->address, HMTL_MSG_PROGRAM_LEN,
+               MSG_TYPE_OUTPUT, msg_hdr->flags);
+  return HMTL_MSG_PROGRAM_LEN;
+}
+
 uint16_t hmtl_program_fade_fmt(byte *buffer, uint16_t buffsize,
                                uint16_t address, uint8_t output,
                                uint32_t period,
@@ -293,6 +422,9 @@ boolean program_blink_init(msg_program_t *msg, program_tracker_t *tracker,
   state_blink_t *state =
           (state_blink_t *)manager->get_program_state(tracker,
                                                       sizeof(state_blink_t));
+  if (state == NULL) {
+    return false;
+  }
   memcpy(&state->msg, msg->values, sizeof (state->msg)); // ??? Correct size?
   state->on = false;
   state->next_change = timesync.ms();
@@ -353,10 +485,13 @@ boolean program_timed_change_init(msg_program_t *msg,
   state_timed_change_t *state =
           (state_timed_change_t *)manager->get_program_state(tracker,
                                                   sizeof(state_timed_change_t));
+  if (state == NULL) {
+    return false;
+  }
   DEBUG3_VALUE(" msgsz=", sizeof (state->msg));
 
   memcpy(&state->msg, msg->values, sizeof (state->msg)); // ??? Correct size?
-  state->change_time = 0;
+  state->tween.start_ms = 0;
 
   DEBUG3_VALUELN(" change_period:", state->msg.change_period);
 
@@ -369,14 +504,14 @@ boolean program_timed_change(output_hdr_t *output, void *object,
   unsigned long now = timesync.ms();
   state_timed_change_t *state = (state_timed_change_t *)tracker->state;
 
-  if (state->change_time == 0) {
+  if (state->tween.start_ms == 0) {
     // Set the initial color
     hmtl_set_output_rgb(output, object, state->msg.start_value);
-    state->change_time = now + state->msg.change_period;
+    hmtl_tween_start(&state->tween, now, state->msg.change_period);
     changed = true;
   }
 
-  if (now > state->change_time) {
+  if (hmtl_tween_done(&state->tween, now, state->msg.change_period)) {
     // Set the final color
     hmtl_set_output_rgb(output, object, state->msg.stop_value);
 
@@ -406,6 +541,9 @@ boolean program_fade_init(msg_program_t *msg,
   state_fade_t *state =
           (state_fade_t *)manager->get_program_state(tracker,
                                                      sizeof(state_fade_t));
+  if (state == NULL) {
+    return false;
+  }
   memcpy(&state->msg, msg->values, sizeof (state->msg));
 
   DEBUG3_VALUE(" ", state->msg.period);
@@ -417,7 +555,7 @@ boolean program_fade_init(msg_program_t *msg,
   DEBUG3_VALUE(",", state->msg.stop_value[2]);
   DEBUG3_HEXVALLN(" 0x", state->msg.flags);
 
-  state->start_time = 0;
+  hmtl_tween_start(&state->tween, 0, state->msg.period);
 
   return true;
 }
@@ -428,36 +566,31 @@ boolean program_fade(output_hdr_t *output, void *object,
   unsigned long now = timesync.ms();
   state_fade_t *state = (state_fade_t *)tracker->state;
 
-  if (state->start_time == 0) {
+  if (state->tween.start_ms == 0) {
     // Set the initial color
     hmtl_set_output_rgb(output, object, state->msg.start_value.raw);
     changed = true;
-    state->start_time = now;
+    state->tween.start_ms = now;
     DEBUG5_VALUELN("Fade ms:", now);
   } else {
     // Calculate the color at this time
-
-    unsigned long elapsed = now - state->start_time;
-    if (elapsed >= state->msg.period) {
-      elapsed = state->msg.period;
-    }
-
-    // TODO: There is probably a more efficient way to do this calculation
-    fract8 fraction = (fract8)map(elapsed, 0, state->msg.period, 0, 255);
+    uint8_t curve = (state->msg.flags & HMTL_FADE_EASE_MASK) >>
+                    HMTL_FADE_EASE_SHIFT;
+    fract8 fraction = hmtl_tween_fract8(&state->tween, now, state->msg.period,
+                                        curve);
     CRGB current = blend(state->msg.start_value, state->msg.stop_value,
                          fraction);
     hmtl_set_output_rgb(output, object, current.raw);
     changed = true;
 
     DEBUG5_VALUE("Fade ms:", now);
-    DEBUG5_VALUE(" elapsed:", elapsed);
     DEBUG5_VALUELN(" fract:", fraction);
 
-    if (elapsed >= state->msg.period) {
+    if (hmtl_tween_done(&state->tween, now, state->msg.period)) {
       // The fade has completed
       if (state->msg.flags & HMTL_FADE_FLAG_CYCLE) {
         // Reset the start time and reverse the direction of fade
-        state->start_time = now;
+        state->tween.start_ms = now;
 
         CRGB temp = state->msg.start_value;
         state->msg.start_value = state->msg.stop_value;
@@ -474,6 +607,23 @@ boolean program_fade(output_hdr_t *output, void *object,
   return changed;
 }
 
+/*
+ * Return the pixels that a program on an output draws on, which is either the
+ * entire strip or a segment's range of it.
+ */
+static CRGB *program_pixels(output_hdr_t *output, void *object,
+                            uint16_t *num_pixels) {
+  PixelUtil *pixels = (PixelUtil *)object;
+  if (output->type == HMTL_OUTPUT_SEGMENT) {
+    hmtl_segment_t *segment = (hmtl_segment_t *)output;
+    *num_pixels = segment->length;
+    return pixels->leds + segment->start;
+  }
+
+  *num_pixels = pixels->numPixels();
+  return pixels->leds;
+}
+
 /*******************************************************************************
  * Program to produce a colorful "sparkle" pattern
  */
@@ -482,7 +632,8 @@ boolean program_sparkle_init(msg_program_t *msg,
                              program_tracker_t *tracker,
                              output_hdr_t *output, void *object,
                              ProgramManager *manager) {
-  if ((output == NULL) || (output->type != HMTL_OUTPUT_PIXELS)) {
+  if ((output == NULL) || (!IS_HMTL_PIXEL_OUTPUT(output->type) &&
+                           (output->type != HMTL_OUTPUT_PALETTE))) {
     return false;
   }
 
@@ -491,6 +642,9 @@ boolean program_sparkle_init(msg_program_t *msg,
   state_sparkle_t *state =
           (state_sparkle_t *)manager->get_program_state(tracker,
                                                         sizeof (state_sparkle_t));
+  if (state == NULL) {
+    return false;
+  }
   memcpy(&state->msg, msg->values, sizeof (state->msg));
 
   if (state->msg.period == 0) state->msg.period = 50;
@@ -516,34 +670,85 @@ boolean program_sparkle_init(msg_program_t *msg,
   // Combine the bg and sparkle threshold to get the true bgthreshold
   state->msg.bg_threshold += state->msg.sparkle_threshold;
 
+  // Replace the maximums with the span of each range
+  state->msg.hue_max -= state->msg.hue_min;
+  state->msg.sat_max -= state->msg.sat_min;
+  state->msg.val_max -= state->msg.val_min;
+
   state->last_change_ms = millis();
 
   return true;
 }
 
+/* Sparkle frame on a palette output, which draws palette indices */
+static void sparkle_palette(state_sparkle_t *state, PalettePixels *palette) {
+  byte bg = palette->nearestIndex(state->msg.bgColor);
+  uint16_t num_pixels = palette->numPixels();
+  uint32_t bits = 0;
+  byte remaining = 0;
+  for (uint16_t led = 0; led < num_pixels; led++) {
+    if (remaining == 0) {
+      bits = hmtl_random32();
+      remaining = 4;
+    }
+    byte rand = scale8((uint8_t)bits, 100);
+    bits >>= 8;
+    remaining--;
+
+    if (rand <= state->msg.sparkle_threshold) {
+      byte hue = state->msg.hue_min +
+                 scale8((uint8_t)hmtl_random32(), state->msg.hue_max);
+      palette->setIndex(led, palette->hueIndex(hue));
+    } else if (rand <= state->msg.bg_threshold) {
+      palette->setIndex(led, bg);
+    }
+  }
+}
+
 boolean program_sparkle(output_hdr_t *output, void *object,
                         program_tracker_t *tracker) {
   unsigned long now = timesync.ms();
   state_sparkle_t *state = (state_sparkle_t *)tracker->state;
 
   if (now - state->last_change_ms >= state->msg.period) {
-    PixelUtil *pixels = (PixelUtil*)object;
-
     state->last_change_ms = now;
 
-    PIXEL_ADDR_TYPE led;
-    for ( led = 0; led < pixels->numPixels(); led++) {
-      byte rand = (byte)random(100);
+    if (output->type == HMTL_OUTPUT_PALETTE) {
+      sparkle_palette(state, (PalettePixels *)object);
+      return true;
+    }
+
+    /*
+     * Each random word decides four pixels, and each sparkle takes its hue,
+     * saturation, and value from the bytes of one more.  The framebuffer is
+     * written directly rather than through setPixelRGB().
+     */
+    uint16_t num_pixels;
+    CRGB *leds = program_pixels(output, object, &num_pixels);
+    uint32_t bits = 0;
+    byte remaining = 0;
+    for (uint16_t led = 0; led < num_pixels; led++) {
+      if (remaining == 0) {
+        bits = hmtl_random32();
+        remaining = 4;
+      }
+      byte rand = scale8((uint8_t)bits, 100); // 0-99, as random(100)
+      bits >>= 8;
+      remaining--;
+
       if (rand <= state->msg.sparkle_threshold) {
-        CRGB color = CHSV(state->msg.hue_min +
-                                  (uint8_t)random(state->msg.hue_max - state->msg.hue_min),
-                          state->msg.sat_min +
-                                  (uint8_t)random(state->msg.sat_max - state->msg.sat_min),
-                          state->msg.val_min +
-                                  (uint8_t)random(state->msg.val_max - state->msg.val_min));
-        pixels->setPixelRGB(led, color);
+        uint32_t hsv = hmtl_random32();
+        hsv2rgb_rainbow(CHSV(state->msg.hue_min +
+                                     scale8((uint8_t)hsv, state->msg.hue_max),
+                             state->msg.sat_min +
+                                     scale8((uint8_t)(hsv >> 8),
+                                            state->msg.sat_max),
+                             state->msg.val_min +
+                                     scale8((uint8_t)(hsv >> 16),
+                                            state->msg.val_max)),
+                        leds[led]);
       } else if (rand <= state->msg.bg_threshold) {
-        pixels->setPixelRGB(led, state->msg.bgColor);
+        leds[led] = state->msg.bgColor;
       } // Otherwise leave as previous color
     }
 
@@ -560,7 +765,8 @@ boolean program_sparkle(output_hdr_t *output, void *object,
 boolean program_brightness(msg_program_t *msg, program_tracker_t *tracker,
                            output_hdr_t *output, void *object,
                            ProgramManager *manager) {
-  if ((output == NULL) || (output->type != HMTL_OUTPUT_PIXELS)) {
+  if ((output == NULL) || ((output->type != HMTL_OUTPUT_PIXELS) &&
+                           (output->type != HMTL_OUTPUT_PALETTE))) {
     return false;
   }
 
@@ -573,12 +779,14 @@ boolean program_brightness(msg_program_t *msg, program_tracker_t *tracker,
 }
 
 /*
- * Set a range of LEDs to an indicated color
+ * Set a range of LEDs to an indicated color.  On a segment the range is
+ * relative to the start of the segment and limited to it.
  */
 boolean program_color(msg_program_t *msg, program_tracker_t *tracker,
                       output_hdr_t *output, void *object,
                       ProgramManager *manager) {
-  if ((output == NULL) || (output->type != HMTL_OUTPUT_PIXELS)) {
+  if ((output == NULL) || (!IS_HMTL_PIXEL_OUTPUT(output->type) &&
+                           (output->type != HMTL_OUTPUT_PALETTE))) {
     return false;
   }
 
@@ -588,8 +796,52 @@ boolean program_color(msg_program_t *msg, program_tracker_t *tracker,
   DEBUG3_VALUE("Ran:", color->range.start);
   DEBUG3_VALUELN("-", color->range.start + color->range.length - 1);
 
+  pixel_range_t range = color->range;
+  if (output->type == HMTL_OUTPUT_SEGMENT) {
+    hmtl_segment_t *segment = (hmtl_segment_t *)output;
+    if (range.start >= segment->length) {
+      return false;
+    }
+    if (range.length > segment->length - range.start) {
+      range.length = segment->length - range.start;
+    }
+    range.start += segment->start;
+  }
+
+  if (output->type == HMTL_OUTPUT_PALETTE) {
+    PalettePixels *palette = (PalettePixels *)object;
+    palette->setRange(range.start, range.length,
+                      palette->nearestIndex(color->color));
+    return false;
+  }
+
   PixelUtil *pixels = (PixelUtil*)object;
-  pixels->setRangeRGB(color->range, color->color);
+  pixels->setRangeRGB(range, color->color);
+
+  return false;
+}
+
+/*
+ * Set entries of a palette output's palette, which changes the color of every
+ * pixel using them.  This is a one-time command.
+ */
+boolean program_palette(msg_program_t *msg, program_tracker_t *tracker,
+                        output_hdr_t *output, void *object,
+                        ProgramManager *manager) {
+  if ((output == NULL) || (output->type != HMTL_OUTPUT_PALETTE)) {
+    return false;
+  }
+
+  hmtl_program_palette_t *program = (hmtl_program_palette_t *)msg->values;
+  PalettePixels *palette = (PalettePixels *)object;
+
+  DEBUG3_VALUE("Palette:", program->first);
+  DEBUG3_VALUELN(" count:", program->count);
+
+  for (byte i = 0; (i < program->count) && (i < HMTL_PALETTE_PROGRAM_COLORS) &&
+                   (program->first + i < PALETTE_SIZE); i++) {
+    palette->palette[program->first + i] = program->colors[i];
+  }
 
   return false;
 }
@@ -598,13 +850,14 @@ boolean program_color(msg_program_t *msg, program_tracker_t *tracker,
  * Program to cycle a pattern around a pixel strip
  *
  * This program runs colors on a length of pixels that circles around the entire
- * LED array.
+ * LED array, or around a segment of it.
  */
 
 boolean program_circular_init(msg_program_t *msg, program_tracker_t *tracker,
                               output_hdr_t *output, void *object,
                               ProgramManager *manager) {
-  if ((output == NULL) || (output->type != HMTL_OUTPUT_PIXELS)) {
+  if ((output == NULL) || (!IS_HMTL_PIXEL_OUTPUT(output->type) &&
+                           (output->type != HMTL_OUTPUT_PALETTE))) {
     return false;
   }
 
@@ -614,6 +867,9 @@ boolean program_circular_init(msg_program_t *msg, program_tracker_t *tracker,
   state_circular_t *state =
           (state_circular_t *)manager->get_program_state(tracker,
                                                          sizeof (state_circular_t));
+  if (state == NULL) {
+    return false;
+  }
 
   /* Copy the incoming message into the state */
   memcpy(&state->msg, msg->values, sizeof (state->msg));
@@ -630,57 +886,126 @@ boolean program_circular_init(msg_program_t *msg, program_tracker_t *tracker,
   DEBUG3_VALUE(" ", state->msg.pattern);
   DEBUG3_HEXVALLN(" ", state->msg.flags);
 
+  /* Precompute the per-pixel step so that drawing needs no division */
+  uint16_t half = state->msg.length / 2;
+  if (state->msg.pattern == CIRCULAR_PATTERN_RAINBOW) {
+    state->step = ((uint32_t)255 << 8) / state->msg.length / 2;
+  } else {
+    state->step = half ? 255 / half : 0;
+  }
+
   state->current = 0;
   state->color_position = 0;
+  state->redraw = true;
   state->last_change_ms = millis();
 
   return true;
 }
 
+/* Hue of the pixel at led in the rainbow pattern */
+static byte circular_hue(state_circular_t *state, uint16_t led) {
+  return state->color_position + (byte)(((uint32_t)led * state->step) >> 8);
+}
+
+/* Color of the pixel at led, which is offset pixels from the segment start */
+static CRGB circular_color(state_circular_t *state, uint16_t led,
+                           uint16_t offset, CRGB base) {
+  switch (state->msg.pattern) {
+    case CIRCULAR_PATTERN_RAINBOW: {
+      return CRGB(CHSV(circular_hue(state, led), 255, 255));
+    }
+    case CIRCULAR_PATTERN_BLACK: {
+      return CRGB(0, 0, 0);
+    }
+    default: {
+      /* Scale the color so that the center LED is brightest */
+      uint16_t half = state->msg.length / 2;
+      uint16_t distance = (offset > half) ? offset - half : half - offset;
+      uint16_t dim = distance * state->step;
+      return base.nscale8(dim >= 255 ? 0 : 255 - dim);
+    }
+  }
+}
+
+/* Draw the pixel at led, as a palette index if there is a palette */
+static void circular_draw(state_circular_t *state, CRGB *leds,
+                          PalettePixels *palette, uint16_t led,
+                          uint16_t offset, CRGB base) {
+  if (palette == NULL) {
+    leds[led] = circular_color(state, led, offset, base);
+  } else if (state->msg.pattern == CIRCULAR_PATTERN_RAINBOW) {
+    palette->setIndex(led, palette->hueIndex(circular_hue(state, led)));
+  } else {
+    palette->setIndex(led, palette->nearestIndex(circular_color(state, led,
+                                                                offset,
+                                                                base)));
+  }
+}
+
 boolean program_circular(output_hdr_t *output, void *object,
                          program_tracker_t *tracker) {
   unsigned long now = timesync.ms();
   state_circular_t *state = (state_circular_t *)tracker->state;
 
   if (now - state->last_change_ms >= state->msg.period) {
-    PixelUtil *pixels = (PixelUtil *)object;
+    uint16_t num_pixels;
+    CRGB *leds = NULL;
+    PalettePixels *palette = NULL;
+    if (output->type == HMTL_OUTPUT_PALETTE) {
+      palette = (PalettePixels *)object;
+      num_pixels = palette->numPixels();
+    } else {
+      leds = program_pixels(output, object, &num_pixels);
+    }
+    uint16_t length = state->msg.length;
+    if (length > num_pixels) length = num_pixels;
+    if (length == 0) return false;
 
     state->last_change_ms = now;
 
-    /* Clear the previous current LED */
-    pixels->setPixelRGB(state->current, CRGB(0,0,0));
-
-    /* Increment the current start of the colored LEDs */
-    state->current = (state->current + 1) % pixels->numPixels();
-    state->color_position++;
-
-    /* Set the colors of the LEDs */
-    for (byte i = 0; i < state->msg.length; i++) {
-      uint16_t led = (state->current + i) % pixels->numPixels();
-      // This needs to cycle to beginning?  Might be the LED limit I have
-
-      CRGB color;
-      switch (state->msg.pattern) {
-        case 1: {
-          byte position = state->color_position + (i * 255/state->msg.length/2);
-          color = CRGB(CHSV(position, 255, 255));
-          break;
-        }
-        case 2: {
-
-          break;
-        }
-        default: {
-          /* Scale the color based so that the center LED is brightest */
-          byte scale = 255 -
-                       abs(state->msg.length / 2 - i) *
-                       (255 / (state->msg.length / 2));
-          color = CRGB(CHSV(state->color_position, 255, 255)).nscale8(scale);
-          break;
-        }
+    /* Clear the previous current LED and advance the start of the segment */
+    boolean wrapped = false;
+    if (!state->redraw) {
+      if (palette != NULL) {
+        palette->setIndex(state->current,
+                          palette->nearestIndex(CRGB(0, 0, 0)));
+      } else {
+        leds[state->current] = CRGB(0, 0, 0);
+      }
+      state->current++;
+      if (state->current >= num_pixels) {
+        state->current = 0;
+        wrapped = true;
       }
+    }
 
-      pixels->setPixelRGB(led, color);
+    if (state->msg.pattern == CIRCULAR_PATTERN_RAINBOW) {
+      /*
+       * Each time the segment returns to the start of the strip the hues
+       * advance by the number of steps taken to get there.
+       */
+      if (wrapped) {
+        state->color_position += (byte)num_pixels;
+        state->redraw = true;
+      }
+    } else {
+      state->color_position++;
+      state->redraw = true;
+    }
+
+    CRGB base = CHSV(state->color_position, 255, 255);
+    if (state->redraw) {
+      uint16_t led = state->current;
+      for (uint16_t i = 0; i < length; i++) {
+        circular_draw(state, leds, palette, led, i, base);
+        if (++led >= num_pixels) led = 0;
+      }
+      state->redraw = false;
+    } else {
+      /* Only the new head of the segment changes */
+      uint16_t head = state->current + length - 1;
+      if (head >= num_pixels) head -= num_pixels;
+      circular_draw(state, leds, palette, head, length - 1, base);
     }
 
     return true;
@@ -11,6 +11,7 @@
 
 #include "FastLED.h"
 #include "PixelUtil.h"
+#include "PalettePixels.h"
 #include "ProgramManager.h"
 
 /*******************************************************************************
@@ -27,17 +28,57 @@
 #define HMTL_PROGRAM_SPARKLE      0x06
 #define HMTL_PROGRAM_SOUND_PIXELS 0x07
 #define HMTL_PROGRAM_CIRCULAR     0x08
+#define HMTL_PROGRAM_LAYER        0x09
 
 #define PROGRAM_SENSOR_DATA       0x10 // Special handler for sensor data messages
 
 #define PROGRAM_BRIGHTNESS        0x30 // One-time only
 #define PROGRAM_COLOR             0x31
+#define PROGRAM_PALETTE           0x32
 
 /* Intialize the program header */
 void hmtl_program_fmt(msg_program_t *msg_program, uint8_t output,
                       uint8_t program, uint16_t buffsize);
 
 
+/*******************************************************************************
+ * Fixed-point interpolation for programs that change over a period.
+ *
+ * hmtl_tween_start() divides once to compute the rate, 2^32 / period, so that
+ * the fraction of the period elapsed at any time is a multiply and a shift.
+ * The fraction can be shaped by an easing curve, which is interpolated from a
+ * 17 entry PROGMEM table.
+ */
+#define HMTL_EASE_LINEAR 0
+#define HMTL_EASE_IN     1 // Quadratic, starts slowly
+#define HMTL_EASE_OUT    2 // Quadratic, ends slowly
+#define HMTL_EASE_IN_OUT 3 // Smoothstep, starts and ends slowly
+#define HMTL_EASE_CURVES 4
+
+typedef struct {
+  unsigned long start_ms;
+  uint32_t rate;
+} hmtl_tween_t;
+
+void hmtl_tween_start(hmtl_tween_t *tween, unsigned long now, uint32_t period);
+boolean hmtl_tween_done(const hmtl_tween_t *tween, unsigned long now,
+                        uint32_t period);
+uint16_t hmtl_tween_fract16(const hmtl_tween_t *tween, unsigned long now,
+                            uint32_t period);
+fract8 hmtl_tween_fract8(const hmtl_tween_t *tween, unsigned long now,
+                         uint32_t period, uint8_t curve);
+fract8 hmtl_ease(uint16_t fraction, uint8_t curve);
+
+/*
+ * Fast pseudo-random numbers for per-pixel programs.  This is a 32 bit
+ * xorshift generator, each call is a few shifts rather than the 32 bit
+ * multiply and divide of random(), and every byte of the result is usable.
+ * It is seeded from random() the first time it is called.
+ */
+void hmtl_random_seed(uint32_t seed);
+uint32_t hmtl_random32();
+
+
 /*
  * Program to blink between two colors
  */
@@ -69,6 +110,7 @@ typedef struct {
   boolean on;
   unsigned long next_change;
 } state_blink_t;
+PROGRAM_STATE_CHECK(state_blink_t);
 
 
 /*
@@ -92,8 +134,9 @@ void hmtl_send_timed_change(Socket *socket, byte *buff, byte buff_len,
 
 typedef struct {
   hmtl_program_timed_change_t msg;
-  unsigned long change_time;
+  hmtl_tween_t tween;
 } state_timed_change_t;
+PROGRAM_STATE_CHECK(state_timed_change_t);
 
 boolean program_timed_change_init(msg_program_t *msg,
                                   program_tracker_t *tracker,
@@ -112,6 +155,9 @@ typedef struct {
   uint8_t flags;           //  1B
 } hmtl_program_fade_t;     // 11B
 #define HMTL_FADE_FLAG_CYCLE 0x1 // Fade reverses when completed
+#define HMTL_FADE_EASE_SHIFT 1   // Bits 1-2 are the HMTL_EASE_* curve
+#define HMTL_FADE_EASE_MASK  (0x3 << HMTL_FADE_EASE_SHIFT)
+#define HMTL_FADE_EASE(curve) ((curve) << HMTL_FADE_EASE_SHIFT)
 uint16_t hmtl_program_fade_fmt(byte *buffer, uint16_t buffsize,
                                uint16_t address, uint8_t output,
                                uint32_t period,
@@ -126,12 +172,15 @@ boolean program_fade(output_hdr_t *output, void *object,
 
 typedef struct {
   hmtl_program_fade_t msg;
-  unsigned long start_time;
+  hmtl_tween_t tween;
 } state_fade_t;
+PROGRAM_STATE_CHECK(state_fade_t);
 
 
 /*
- * Program which generates a randomized sparkle pattern
+ * Program which generates a randomized sparkle pattern.  On palette outputs a
+ * sparkle is the palette index of its hue, the saturation and value ranges
+ * are unused, and the background is the nearest palette entry.
  */
 typedef struct {
   uint16_t period;        //  2B
@@ -148,10 +197,16 @@ typedef struct {
                           // 13B Total
 } hmtl_program_sparkle_t;
 
+/*
+ * program_sparkle_init() replaces the hue, sat and val maximums in the state
+ * with the span of each range so that each pixel scales a random byte into
+ * them with scale8().
+ */
 typedef struct {
   hmtl_program_sparkle_t msg;
   unsigned long last_change_ms;
 } state_sparkle_t;
+PROGRAM_STATE_CHECK(state_sparkle_t);
 
 uint16_t program_sparkle_fmt(byte *buffer, uint16_t buffsize,
                              uint16_t address, uint8_t output,
@@ -196,9 +251,37 @@ boolean program_color(msg_program_t *msg, program_tracker_t *tracker,
                       output_hdr_t *output, void *object,
                       ProgramManager *manager);
 
+/*
+ * Program that sets count entries of a palette output's palette, beginning
+ * with entry first
+ */
+#define HMTL_PALETTE_PROGRAM_COLORS ((MAX_PROGRAM_VAL - 2) / sizeof (CRGB))
+typedef struct {
+  uint8_t first;
+  uint8_t count;
+  CRGB colors[HMTL_PALETTE_PROGRAM_COLORS];
+} hmtl_program_palette_t;
+uint16_t program_palette_fmt(byte *buffer, uint16_t buffsize,
+                             uint16_t address, uint8_t output,
+                             uint8_t first, uint8_t count, const CRGB *colors);
+boolean program_palette(msg_program_t *msg, program_tracker_t *tracker,
+                        output_hdr_t *output, void *object,
+                        ProgramManager *manager);
+
 /*
  * Program that sends a pattern on a circular loop of the available LEDs
+ *
+ * The rainbow pattern's hues are fixed to each pixel's position, so each step
+ * only sets the new head pixel and clears the tail.  The hues shift once per
+ * trip around the strip, which redraws the segment.  The scaled pattern's
+ * color changes every step and so is redrawn in full.  On palette outputs the
+ * rainbow uses the palette index of each hue and other colors the nearest
+ * palette entry.
  */
+#define CIRCULAR_PATTERN_SCALED  0 // One color, brightest in the center
+#define CIRCULAR_PATTERN_RAINBOW 1 // Hues across half the color wheel
+#define CIRCULAR_PATTERN_BLACK   2
+
 typedef struct {
   uint16_t period;        // 2B
   uint16_t length;        // 2B
@@ -210,8 +293,11 @@ typedef struct {
   hmtl_program_circular_t msg;
   unsigned long last_change_ms;
   uint16_t current;
+  uint16_t step;          // Hue per pixel in 8.8 or brightness per pixel
   byte color_position;
+  boolean redraw;
 } state_circular_t;
+PROGRAM_STATE_CHECK(state_circular_t);
 
 uint16_t program_circular_fmt(byte *buffer, uint16_t buffsize,
                              uint16_t address, uint8_t output,
@@ -224,6 +310,33 @@ boolean program_circular(output_hdr_t *output, void *object,
                         program_tracker_t *tracker);
 
 
+/*
+ * Run a program on a layer of a pixel output, see ProgramManager.h.  The
+ * program's values follow the layer header, and a program of
+ * HMTL_PROGRAM_NONE removes the layer.
+ */
+#define HMTL_BLEND_REPLACE 0
+#define HMTL_BLEND_ADD     1 // Saturating add
+#define HMTL_BLEND_MAX     2 // Brightest of each channel
+#define HMTL_BLEND_ALPHA   3 // alpha/255 of the layer over the pixels below
+
+#define HMTL_LAYER_HDR_LEN 8
+#define HMTL_LAYER_PROGRAM_VAL (MAX_PROGRAM_VAL - HMTL_LAYER_HDR_LEN)
+
+typedef struct {
+  uint8_t layer;          // 1B Layer number, starting from 1
+  uint8_t program;        // 1B
+  uint8_t blend;          // 1B
+  uint8_t alpha;          // 1B
+  uint16_t start;         // 2B First pixel the layer covers
+  uint16_t length;        // 2B Pixels covered, 0 for the rest of the strip
+  uint8_t values[HMTL_LAYER_PROGRAM_VAL];
+} hmtl_program_layer_t;
+
+uint16_t hmtl_program_layer_fmt(byte *buffer, uint16_t buffsize,
+                                uint8_t layer, uint8_t blend, uint8_t alpha,
+                                uint16_t start, uint16_t length);
+
 /*******************************************************************************
  * Additional helper messages
  */
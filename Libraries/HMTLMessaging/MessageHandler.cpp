@@ -29,20 +29,91 @@
   #define OBJECT_TYPE 0
 #endif
 
+/* Handlers for all standard message types */
+const msg_handler_t default_handlers[] PROGMEM = {
+  MSG_HANDLERS_DEFAULT
+};
+
 MessageHandler::MessageHandler() {
   address = SOCKET_ADDR_INVALID;
+  handlers = NULL;
+  num_handlers = 0;
+  num_indexed = 0;
+  dump_location = 0;
+  scene_location = 0;
+  num_pending = 0;
+  frame_state = FRAME_IDLE;
+#if HMTL_FRAGMENT_BUFFERS > 0
+  for (byte i = 0; i < HMTL_FRAGMENT_BUFFERS; i++) {
+    fragments[i].next = 0;
+  }
+#endif
+
+  clear_seen();
+}
+
+MessageHandler::MessageHandler(socket_addr_t _address, ProgramManager *_manager,
+                               Socket *_sockets[], uint8_t _num_sockets) :
+        MessageHandler(_address, _manager, _sockets, _num_sockets,
+                       default_handlers, MSG_HANDLER_COUNT(default_handlers)) {
 }
 
 MessageHandler::MessageHandler(socket_addr_t _address, ProgramManager *_manager,
-                               Socket *_sockets[], uint8_t _num_sockets) {
+                               Socket *_sockets[], uint8_t _num_sockets,
+                               const msg_handler_t *_handlers,
+                               uint8_t _num_handlers) {
   address = _address;
   manager = _manager;
   sockets = _sockets;
   num_sockets = _num_sockets;
 
+  /* Messages formatted by this module are stamped with its address */
+  hmtl_msg_set_source(address);
+
+  handlers = _handlers;
+  num_handlers = _num_handlers;
+  num_indexed = 0;
+  while ((num_indexed < num_handlers) &&
+         (pgm_read_byte(&handlers[num_indexed].type) ==
+          MSG_TYPE_BASE + num_indexed)) {
+    num_indexed++;
+  }
+
   serial_msg_offset = 0;
+  serial_msg_crc = 0;
+  serial_seq_state = 0;
+  serial_seq = 0;
+  serial_seq_last = 0;
+  serial_seq_unacked = 0;
+  serial_seq_nacked = false;
   last_serial_ms = 0;
   last_ready_ms = 0;
+
+  for (byte i = 0; i < MSG_DEFERRED_QUEUE; i++) {
+    deferred[i].length = 0;
+  }
+
+  for (byte i = 0; i < MSG_PENDING_QUEUE; i++) {
+    pending_order[i] = i;
+  }
+  num_pending = 0;
+
+  dump_location = 0;
+  scene_location = 0;
+
+  frame_state = FRAME_IDLE;
+  frame_output = HMTL_NO_OUTPUT;
+  frame_id = 0;
+  frame_offset = 0;
+  frame_ms = 0;
+
+#if HMTL_FRAGMENT_BUFFERS > 0
+  for (byte i = 0; i < HMTL_FRAGMENT_BUFFERS; i++) {
+    fragments[i].next = 0;
+  }
+#endif
+
+  clear_seen();
 }
 
 /*
@@ -65,13 +136,31 @@ void MessageHandler::serial_ready() {
   }
 }
 
+/*
+ * Lookup the handler for a message type in the PROGMEM handler table, which
+ * for the standard types is a direct index.
+ */
+msg_handler_func MessageHandler::lookup_handler(uint8_t type) {
+  uint8_t index = type - MSG_TYPE_BASE;
+  if (index < num_indexed) {
+    return (msg_handler_func)pgm_read_ptr(&handlers[index].function);
+  }
+
+  for (uint8_t i = num_indexed; i < num_handlers; i++) {
+    if (pgm_read_byte(&handlers[i].type) == type) {
+      return (msg_handler_func)pgm_read_ptr(&handlers[i].function);
+    }
+  }
+  return NULL;
+}
+
 /* Process a message if it is for this module */
-boolean MessageHandler::process_msg(msg_hdr_t *msg_hdr, Socket *src,
-                                    Socket *serial_socket,
-                                    config_hdr_t *config) {
+uint16_t MessageHandler::process_msg(msg_hdr_t *msg_hdr, Socket *src,
+                                     Socket *serial_socket,
+                                     config_hdr_t *config) {
   if (msg_hdr->version != HMTL_MSG_VERSION) {
     DEBUG_ERR("Invalid message version");
-    return false;
+    return 0;
   }
 
   /* Test if the message is for this device */
@@ -90,181 +179,808 @@ boolean MessageHandler::process_msg(msg_hdr_t *msg_hdr, Socket *src,
       Serial.write((byte *)msg_hdr, msg_hdr->length);
 
       if (msg_hdr->type != MSG_TYPE_SENSOR) { // Sensor broadcasts are for everyone
-        return false;
+        return 0;
       }
     }
 
-    switch (msg_hdr->type) {
+    msg_handler_func function = lookup_handler(msg_hdr->type);
+    if (function != NULL) {
+      return function(this, msg_hdr, src, serial_socket, config);
+    }
 
-      case MSG_TYPE_OUTPUT: {
-        output_hdr_t *out_hdr = (output_hdr_t *)(msg_hdr + 1);
-        if (out_hdr->type == HMTL_OUTPUT_PROGRAM) {
-          manager->handle_msg((msg_program_t *)out_hdr);
-        } else {
-          hmtl_handle_output_msg(msg_hdr, manager->num_outputs,
-                                 manager->outputs, manager->objects);
-        }
+    DEBUG4_VALUELN("No handler for type:", msg_hdr->type);
+  }
 
-        return true;
-      }
+  return 0;
+}
 
-      case MSG_TYPE_POLL: {
-        // Generate a response to a poll message
-        uint16_t source_address = 0;
-        Socket *sock;
-
-        if (src != NULL) {
-          // The response will be going over a socket, get the source address
-          source_address = src->sourceFromData(msg_hdr);
-          sock = src;
-        } else {
-          // The data will be sent back to the indicated Serial device.  A
-          // socket still needs to be specified in order to have a buffer to
-          // fill.
-          sock = serial_socket;
-        }
-
-        DEBUG3_VALUELN("Poll req src:", source_address);
-
-        // Format the poll response
-        uint16_t len = hmtl_poll_fmt(sock->send_buffer,
-                                     sock->send_data_size,
-                                     source_address,
-                                     msg_hdr->flags, OBJECT_TYPE,
-                                     config,
-                                     manager->outputs,
-                                     sock->recvLimit);
-
-        // Respond to the appropriate source
-        if (src != NULL) {
-          if (msg_hdr->address == SOCKET_ADDR_ANY) {
-            // If this was a broadcast address then do not respond immediately,
-            // delay for time based on our address.
-            int delayMs = address * 2;
-            DEBUG3_VALUELN("Delay resp: ", delayMs)
-            delay(delayMs); // TODO: This blocks any running program?  Use a timer
-          }
-
-          src->sendMsgTo(source_address, sock->send_buffer, len);
-        } else {
-          // Send the response on the serial device
-          Serial.write(sock->send_buffer, len);
-        }
-
-        break;
-      }
+/*
+ * Handle an output message, either setting an output's value directly or
+ * passing program messages to the ProgramManager.
+ */
+uint16_t MessageHandler::handle_output(MessageHandler *handler,
+                                       msg_hdr_t *msg_hdr, Socket *src,
+                                       Socket *serial_socket,
+                                       config_hdr_t *config) {
+  ProgramManager *manager = handler->manager;
 
-      case MSG_TYPE_SET_ADDR: {
-        /* Handle an address change message */
-        msg_set_addr_t *set_addr = (msg_set_addr_t *)(msg_hdr + 1);
-        if ((set_addr->device_id == 0) ||
-            (set_addr->device_id == config->device_id)) {
-          address = set_addr->address;
-          src->sourceAddress = address;
-          DEBUG2_VALUELN("Address changed to ", address);
-        }
-        break;
-      }
+  output_hdr_t *out_hdr = (output_hdr_t *)(msg_hdr + 1);
+  if (out_hdr->type == HMTL_OUTPUT_PROGRAM) {
+    return handler->start_program((msg_program_t *)out_hdr);
+  }
 
-      case MSG_TYPE_SENSOR: {
-        if (msg_hdr->flags & MSG_FLAG_ACK) {
-          /*
-           * This is a sensor response, record relevant values for usage
-           * elsewhere.
-           */
-          msg_sensor_data_t *sensor = NULL;
-          while ((sensor = hmtl_next_sensor(msg_hdr, sensor))) {
-            // Call the ProgramManager's handler for the sensor function
-            manager->run_program(PROGRAM_SENSOR_DATA, sensor);
-          }
-          DEBUG_PRINT_END();
-        }
-        break;
-      }
+  hmtl_segment_t *segment = manager->lookup_segment(out_hdr->output);
+  if (segment != NULL) {
+    /* Values and colors sent to a segment set its range of the strip */
+    uint8_t values[3];
+    if (out_hdr->type == HMTL_OUTPUT_VALUE) {
+      values[0] = values[1] = values[2] = ((msg_value_t *)out_hdr)->value;
+    } else if (out_hdr->type == HMTL_OUTPUT_RGB) {
+      memcpy(values, ((msg_rgb_t *)out_hdr)->values, sizeof (values));
+    } else {
+      DEBUG1_VALUELN("handle_output: invalid type for segment:", out_hdr->type);
+      return 0;
+    }
+    hmtl_set_output_rgb(&segment->hdr,
+                        manager->objects[segment->pixels_output], values);
+    return manager->output_bit(out_hdr->output);
+  }
 
-      case MSG_TYPE_TIMESYNC: {
-        /*
-         * This is a time synchronization message, send to the ProgramManager's
-         * TimeSync object.
-         */
-        timesync.synchronize(src, SOCKET_ADDR_INVALID, msg_hdr);
-        break;
-      }
+  int32_t updated = hmtl_handle_output_msg(msg_hdr, manager->num_outputs,
+                                           manager->outputs, manager->objects);
+  if (updated < 0) {
+    return 0;
+  }
+  return (uint16_t)updated;
+}
+
+/*
+ * Program setup may change the targeted outputs immediately, such as with
+ * one-time programs, so they are all considered updated.
+ */
+uint16_t MessageHandler::start_program(msg_program_t *program) {
+  if (!manager->handle_msg(program)) {
+    return 0;
+  }
+  if (program->hdr.output == HMTL_ALL_OUTPUTS) {
+    return (uint16_t)((1UL << manager->num_outputs) - 1);
+  }
+  return manager->output_bit(program->hdr.output);
+}
+
+/*
+ * Generate a response to a poll message
+ */
+uint16_t MessageHandler::handle_poll(MessageHandler *handler,
+                                     msg_hdr_t *msg_hdr, Socket *src,
+                                     Socket *serial_socket,
+                                     config_hdr_t *config) {
+  uint16_t source_address = 0;
+  Socket *sock;
+
+  if (src != NULL) {
+    // The response will be going over a socket, get the source address
+    source_address = src->sourceFromData(msg_hdr);
+    sock = src;
+  } else {
+    // The data will be sent back to the indicated Serial device.  A
+    // socket still needs to be specified in order to have a buffer to
+    // fill.
+    sock = serial_socket;
+  }
+
+  DEBUG3_VALUELN("Poll req src:", source_address);
+
+  // Format the poll response
+  uint16_t len = hmtl_poll_fmt(sock->send_buffer,
+                               sock->send_data_size,
+                               source_address,
+                               msg_hdr->flags, OBJECT_TYPE,
+                               config,
+                               handler->manager->outputs,
+                               sock->recvLimit);
+
+  // Respond to the appropriate source
+  if (src != NULL) {
+    if (msg_hdr->address == SOCKET_ADDR_ANY) {
+      // If this was a broadcast address then do not respond immediately,
+      // queue the response to be sent after a delay based on our address.
+      unsigned long delayMs = handler->address * 2;
+      DEBUG3_VALUELN("Delay resp: ", delayMs)
+      handler->defer_msg(src, source_address, sock->send_buffer, len, delayMs);
+    } else {
+      src->sendMsgTo(source_address, sock->send_buffer, len);
+    }
+  } else {
+    // Send the response on the serial device
+    Serial.write(sock->send_buffer, len);
+  }
+
+  return 0;
+}
+
+/*
+ * Handle an address change message
+ */
+uint16_t MessageHandler::handle_set_addr(MessageHandler *handler,
+                                         msg_hdr_t *msg_hdr, Socket *src,
+                                         Socket *serial_socket,
+                                         config_hdr_t *config) {
+  msg_set_addr_t *set_addr = (msg_set_addr_t *)(msg_hdr + 1);
+  if ((set_addr->device_id == 0) ||
+      (set_addr->device_id == config->device_id)) {
+    handler->address = set_addr->address;
+    src->sourceAddress = handler->address;
+    hmtl_msg_set_source(handler->address);
+    DEBUG2_VALUELN("Address changed to ", handler->address);
+  }
+
+  return 0;
+}
+
+/*
+ * Handle a sensor message
+ */
+uint16_t MessageHandler::handle_sensor(MessageHandler *handler,
+                                       msg_hdr_t *msg_hdr, Socket *src,
+                                       Socket *serial_socket,
+                                       config_hdr_t *config) {
+  if (msg_hdr->flags & MSG_FLAG_ACK) {
+    /*
+     * This is a sensor response, record relevant values for usage
+     * elsewhere.
+     */
+    msg_sensor_data_t *sensor = NULL;
+    while ((sensor = hmtl_next_sensor(msg_hdr, sensor))) {
+      // Call the ProgramManager's handler for the sensor function
+      handler->manager->run_program(PROGRAM_SENSOR_DATA, sensor);
+    }
+    DEBUG_PRINT_END();
+  }
+
+  return 0;
+}
+
+/*
+ * This is a time synchronization message, send to the ProgramManager's
+ * TimeSync object.
+ */
+uint16_t MessageHandler::handle_timesync(MessageHandler *handler,
+                                         msg_hdr_t *msg_hdr, Socket *src,
+                                         Socket *serial_socket,
+                                         config_hdr_t *config) {
+  timesync.synchronize(src, SOCKET_ADDR_INVALID, msg_hdr);
+  return 0;
+}
+
+/*
+ * This is a request to dump the EEPROM objects.  The dump is sent one record
+ * per call to check() by send_dump_chunk(), to the serial device or to the
+ * requesting socket.
+ */
+uint16_t MessageHandler::handle_dump_config(MessageHandler *handler,
+                                            msg_hdr_t *msg_hdr, Socket *src,
+                                            Socket *serial_socket,
+                                            config_hdr_t *config) {
+  if (src != NULL) {
+    if (msg_hdr->address == SOCKET_ADDR_ANY) {
+      // Broadcast dump requests over a socket would have every module respond
+      return 0;
+    }
+    handler->dump_address = src->sourceFromData(msg_hdr);
+    handler->dump_buffer_socket = src;
+  } else {
+    handler->dump_address = 0;
+    handler->dump_buffer_socket = serial_socket;
+  }
+
+  DEBUG3_VALUELN("Dump req src:", handler->dump_address);
+
+  /* Any dump already in progress is restarted for this request */
+  handler->dump_socket = src;
+  handler->dump_flags = msg_hdr->flags;
+  handler->dump_location = HMTL_CONFIG_ADDR; // Starting location in EEPROM
 
-      case MSG_TYPE_DUMP_CONFIG: {
-        /*
-         * This is a request to dump the EEPROM objects to the serial device.
-         *
-         * TODO: This could be made to work remotely rather than only to requests
-         * from the serial device.
-         */
-        uint16_t source_address = 0;
-
-        DEBUG3_VALUELN("Dump req src:", source_address);
-
-        /*
-         * The response will be a typical message header followed by the raw data
-         * from EEPROM.
-         */
-        msg_dumpconfig_response_t *resp = (msg_dumpconfig_response_t *)(serial_socket->send_buffer + sizeof (msg_hdr_t));
-
-        int location = HMTL_CONFIG_ADDR; // Starting location in EEPROM
-        int next_addr = 0;
-        uint8_t flags;
-
-        do {
-          uint16_t len;
-          flags = msg_hdr->flags;
-
-          next_addr = EEPROM_safe_read(location, resp->data,
-                                       serial_socket->send_data_size -
-                                           HMTL_MSG_DUMPCONFIG_MIN_LEN);
-          if (next_addr > 0) {
-            uint16_t datalen = (uint16_t)EEPROM_DATA_SIZE(next_addr - location);
-
-            DEBUG4_VALUELN("Dump config:", location);
-
-            /*
-             * Check if the next address is a valid structure and if so indicate
-             * that there will be additional messages.
-             */
-            if (EEPROM_check_address(next_addr)) {
-              flags |= MSG_FLAG_MORE_DATA;
-            } else {
-              DEBUG4_PRINTLN("Dump final message")
-            }
-
-            // Now that the length of the data is known construct the message
-            len = hmtl_dumpconfig_fmt(serial_socket->send_buffer,
-                                      serial_socket->send_data_size,
-                                      source_address,
-                                      flags,
-                                      datalen);
-
-            location = next_addr;
-          } else {
-            /*
-             * There was an error, respond with an error flag
-             */
-            flags |= MSG_FLAG_ERROR;
-
-            len = hmtl_dumpconfig_fmt(serial_socket->send_buffer,
-                                      serial_socket->send_data_size,
-                                      source_address,
-                                      flags,
-                                      0);
-          }
-
-          Serial.write(serial_socket->send_buffer, len);
-
-        } while (flags & MSG_FLAG_MORE_DATA);
-
-        break;
+  return 0;
+}
+
+/*
+ * Unpack a batch message, rebuilding a full message for each entry and
+ * processing it as if it had been received on its own.
+ */
+uint16_t MessageHandler::handle_batch(MessageHandler *handler,
+                                      msg_hdr_t *msg_hdr, Socket *src,
+                                      Socket *serial_socket,
+                                      config_hdr_t *config) {
+  byte msg[MSG_MAX_SZ];
+  msg_hdr_t *entry_hdr = (msg_hdr_t *)msg;
+  uint16_t updated = 0;
+
+  uint16_t offset = sizeof (msg_hdr_t);
+  while (offset + sizeof (msg_batch_entry_t) <= msg_hdr->length) {
+    msg_batch_entry_t *entry = (msg_batch_entry_t *)((byte *)msg_hdr + offset);
+    offset += sizeof (msg_batch_entry_t) + entry->length;
+
+    if ((offset > msg_hdr->length) ||
+        (sizeof (msg_hdr_t) + entry->length > MSG_MAX_SZ)) {
+      DEBUG_ERR("handle_batch: invalid entry length");
+      break;
+    }
+
+    if ((entry->type == MSG_TYPE_BATCH) || (entry->type == MSG_TYPE_FRAGMENT)) {
+      DEBUG1_VALUELN("handle_batch: can't batch type:", entry->type);
+      continue;
+    }
+
+    /* Entries keep the batch's origin rather than being stamped here */
+    memcpy(entry_hdr, msg_hdr, sizeof (msg_hdr_t));
+    memcpy(entry_hdr + 1, entry + 1, entry->length);
+    entry_hdr->length = sizeof (msg_hdr_t) + entry->length;
+    entry_hdr->type = entry->type;
+    entry_hdr->address = entry->address;
+#ifdef HMTL_USE_CRC
+    hmtl_msg_set_crc(entry_hdr);
+#endif
+
+    updated |= handler->process_msg(entry_hdr, src, serial_socket, config);
+  }
+
+  return updated;
+}
+
+/*
+ * Queue the message carried by a timed message, or process it immediately if
+ * it is already due.  A message that can't be queued is dropped rather than
+ * being processed early.
+ */
+uint16_t MessageHandler::handle_timed(MessageHandler *handler,
+                                      msg_hdr_t *msg_hdr, Socket *src,
+                                      Socket *serial_socket,
+                                      config_hdr_t *config) {
+  msg_timed_t *msg_timed = (msg_timed_t *)(msg_hdr + 1);
+  msg_hdr_t *timed_hdr = (msg_hdr_t *)(msg_timed + 1);
+
+  if ((msg_hdr->length < HMTL_MSG_TIMED_LEN(sizeof (msg_hdr_t))) ||
+      (timed_hdr->length < sizeof (msg_hdr_t)) ||
+      (HMTL_MSG_TIMED_LEN(timed_hdr->length) > msg_hdr->length)) {
+    DEBUG_ERR("handle_timed: invalid length");
+    return 0;
+  }
+
+  if ((timed_hdr->type != MSG_TYPE_OUTPUT) &&
+      (timed_hdr->type != MSG_TYPE_BATCH) &&
+      (timed_hdr->type != MSG_TYPE_SCENE)) {
+    DEBUG1_VALUELN("handle_timed: can't time type:", timed_hdr->type);
+    return 0;
+  }
+
+  int32_t delay = (int32_t)(msg_timed->execute_ms - (uint32_t)timesync.ms());
+  if ((delay > 0) && (delay <= MSG_PENDING_MAX_MS)) {
+    if (!handler->schedule_msg(timed_hdr, msg_timed->execute_ms, src,
+                               serial_socket)) {
+      DEBUG1_VALUELN("handle_timed: dropped msg due in:", delay);
+    }
+    return 0;
+  } else if (delay > 0) {
+    DEBUG1_VALUELN("handle_timed: too far ahead:", delay);
+  }
+
+  return handler->process_msg(timed_hdr, src, serial_socket, config);
+}
+
+/*
+ * Decode the data of a key frame chunk onto num_pixels pixels of a palette
+ * output beginning at led, mapping each pixel to its nearest palette entry.
+ * Returns the number of pixels written or -1 if the data is malformed or holds
+ * more than num_pixels.
+ */
+static int decode_palette_frame(const byte *data, uint8_t datalen,
+                                PalettePixels *palette, uint16_t led,
+                                uint16_t num_pixels) {
+  const byte *end = data + datalen;
+  uint16_t written = 0;
+
+  while (data < end) {
+    byte control = *data++;
+    byte count = (control & ~HMTL_FRAME_RUN) + 1;
+    uint16_t bytes = (control & HMTL_FRAME_RUN) ? 3 : 3 * count;
+    if ((count > num_pixels - written) || (end - data < bytes)) {
+      return -1;
+    }
+
+    if (control & HMTL_FRAME_RUN) {
+      palette->setRange(led, count,
+                        palette->nearestIndex(CRGB(data[0], data[1],
+                                                   data[2])));
+      led += count;
+    } else {
+      for (const byte *pixel = data; pixel < data + bytes; pixel += 3) {
+        palette->setIndex(led++,
+                          palette->nearestIndex(CRGB(pixel[0], pixel[1],
+                                                     pixel[2])));
       }
     }
+
+    data += bytes;
+    written += count;
   }
 
-  return false;
+  return written;
+}
+
+/*
+ * Decode a chunk of a pixel frame into its output's pixels, updating the
+ * output once the final chunk of the frame has been applied.
+ *
+ * Palette outputs only accept key frames, each pixel being set to its nearest
+ * palette entry.  They keep palette indices rather than the RGB pixels a delta
+ * frame is encoded against, so delta frames to them are dropped.
+ */
+uint16_t MessageHandler::handle_pixel_frame(MessageHandler *handler,
+                                            msg_hdr_t *msg_hdr, Socket *src,
+                                            Socket *serial_socket,
+                                            config_hdr_t *config) {
+  ProgramManager *manager = handler->manager;
+  msg_pixel_frame_t *chunk = (msg_pixel_frame_t *)(msg_hdr + 1);
+
+  if (msg_hdr->length < HMTL_MSG_PIXEL_FRAME_MIN_LEN) {
+    DEBUG_ERR("handle_pixel_frame: invalid length");
+    return 0;
+  }
+
+  /* Frames may be sent to a pixel output or to one of its segments */
+  hmtl_segment_t *segment = manager->lookup_segment(chunk->output);
+  byte strip_output = (segment ? segment->pixels_output : chunk->output);
+  if ((strip_output >= manager->num_outputs) ||
+      (manager->outputs[strip_output] == NULL) ||
+      ((manager->outputs[strip_output]->type != HMTL_OUTPUT_PIXELS) &&
+       (manager->outputs[strip_output]->type != HMTL_OUTPUT_PALETTE)) ||
+      (manager->objects[strip_output] == NULL)) {
+    DEBUG1_VALUELN("handle_pixel_frame: invalid output:", chunk->output);
+    return 0;
+  }
+
+  PixelUtil *pixels = NULL;
+  PalettePixels *palette = NULL;
+  uint16_t num_pixels;
+  if (manager->outputs[strip_output]->type == HMTL_OUTPUT_PALETTE) {
+    palette = (PalettePixels *)manager->objects[strip_output];
+    num_pixels = palette->numPixels();
+  } else {
+    pixels = (PixelUtil *)manager->objects[strip_output];
+    num_pixels = pixels->numPixels();
+  }
+
+  uint16_t first = 0;
+  if (segment != NULL) {
+    first = segment->start;
+    num_pixels = segment->length;
+  }
+
+  boolean delta = chunk->flags & HMTL_FRAME_DELTA;
+  if (chunk->offset == 0) {
+    /* A frame that was still being received is abandoned */
+    uint16_t released = 0;
+    if (handler->frame_state == FRAME_RECEIVING) {
+      released = handler->abort_frame();
+    }
+
+    /* A delta frame must follow the frame it was encoded against */
+    if (delta &&
+        ((palette != NULL) ||
+         (handler->frame_state != FRAME_COMPLETE) ||
+         (handler->frame_output != chunk->output) ||
+         (chunk->frame != (byte)(handler->frame_id + 1)))) {
+      DEBUG1_VALUELN("handle_pixel_frame: no base for ", chunk->frame);
+      handler->frame_state = FRAME_IDLE;
+      return released;
+    }
+
+    /* The stream replaces any program on the output */
+    msg_program_t cancel;
+    cancel.hdr.type = HMTL_OUTPUT_PROGRAM;
+    cancel.hdr.output = chunk->output;
+    cancel.type = HMTL_PROGRAM_NONE;
+    manager->handle_msg(&cancel);
+    if (segment != NULL) {
+      /* Layers would be composited over the segment's pixels */
+      manager->free_layers(strip_output);
+    }
+
+    /*
+     * Programs on the strip's other segments keep running, so its updates
+     * are held until the whole frame has been applied.
+     */
+    manager->hold_output(chunk->output);
+
+    handler->frame_state = FRAME_RECEIVING;
+    handler->frame_output = chunk->output;
+    handler->frame_id = chunk->frame;
+    handler->frame_offset = 0;
+  } else if ((handler->frame_state != FRAME_RECEIVING) ||
+             (handler->frame_output != chunk->output) ||
+             (handler->frame_id != chunk->frame) ||
+             (handler->frame_offset != chunk->offset)) {
+    DEBUG1_VALUELN("handle_pixel_frame: out of order ", chunk->offset);
+    return handler->abort_frame();
+  }
+
+  int decoded = -1;
+  uint8_t datalen = msg_hdr->length - HMTL_MSG_PIXEL_FRAME_MIN_LEN;
+  if ((chunk->offset < num_pixels) && (palette != NULL)) {
+    decoded = decode_palette_frame(chunk->data, datalen, palette,
+                                   first + chunk->offset,
+                                   num_pixels - chunk->offset);
+  } else if (chunk->offset < num_pixels) {
+    decoded = hmtl_pixel_frame_decode(chunk->data, datalen, delta,
+                                      (byte *)(pixels->leds + first +
+                                               chunk->offset),
+                                      num_pixels - chunk->offset);
+  }
+  if (decoded < 0) {
+    DEBUG_ERR("handle_pixel_frame: invalid data");
+    return handler->abort_frame();
+  }
+  handler->frame_offset += decoded;
+  handler->frame_ms = millis();
+
+  if (!(chunk->flags & HMTL_FRAME_FINAL)) {
+    return 0;
+  }
+
+  handler->frame_state = FRAME_COMPLETE;
+  manager->release_output(chunk->output);
+  return manager->output_bit(chunk->output);
+}
+
+/*
+ * Abandon a frame that is being received, releasing its output's updates.  Any
+ * chunks that were applied remain on the output.
+ */
+uint16_t MessageHandler::abort_frame() {
+  uint16_t released = 0;
+  if (frame_state == FRAME_RECEIVING) {
+    released = manager->release_output(frame_output);
+  }
+  frame_state = FRAME_IDLE;
+  return released;
+}
+
+/*
+ * Add a fragment to the message being reassembled from its sender, processing
+ * the message once its last fragment has arrived.
+ */
+uint16_t MessageHandler::handle_fragment(MessageHandler *handler,
+                                         msg_hdr_t *msg_hdr, Socket *src,
+                                         Socket *serial_socket,
+                                         config_hdr_t *config) {
+#if HMTL_FRAGMENT_BUFFERS == 0
+  DEBUG1_PRINTLN("handle_fragment: no fragment buffers");
+  return 0;
+#else
+  msg_fragment_t *fragment = (msg_fragment_t *)(msg_hdr + 1);
+
+  if ((msg_hdr->length < HMTL_MSG_FRAGMENT_MIN_LEN) ||
+      (fragment->index >= fragment->total)) {
+    DEBUG_ERR("handle_fragment: invalid fragment");
+    return 0;
+  }
+
+  socket_addr_t source = (src != NULL) ? src->sourceFromData(msg_hdr) :
+                                         SOCKET_ADDR_INVALID;
+  msg_fragments_t *entry = handler->find_fragments(src, source,
+                                                   fragment->index == 0);
+  if (fragment->index == 0) {
+    entry->src = src;
+    entry->source = source;
+    entry->id = fragment->id;
+    entry->total = fragment->total;
+    entry->length = 0;
+    entry->start_ms = timesync.ms();
+  } else if ((entry == NULL) ||
+             (entry->id != fragment->id) ||
+             (entry->total != fragment->total) ||
+             (entry->next != fragment->index)) {
+    /* A fragment was lost, the rest of the message can't be used */
+    DEBUG1_VALUELN("handle_fragment: out of order ", fragment->index);
+    if (entry != NULL) {
+      entry->next = 0;
+    }
+    return 0;
+  }
+
+  uint8_t datalen = msg_hdr->length - HMTL_MSG_FRAGMENT_MIN_LEN;
+  if ((uint16_t)entry->length + datalen > HMTL_FRAGMENT_MAX_LEN) {
+    DEBUG1_VALUELN("handle_fragment: too long for id ", fragment->id);
+    entry->next = 0;
+    return 0;
+  }
+
+  memcpy(entry->data + entry->length, fragment->data, datalen);
+  entry->length += datalen;
+  entry->next = fragment->index + 1;
+  if (entry->next < entry->total) {
+    return 0;
+  }
+
+  /*
+   * The message is complete.  Fragments can't be batched, so processing it
+   * can't need this buffer for another message.
+   */
+  entry->next = 0;
+
+  msg_hdr_t *msg = (msg_hdr_t *)entry->data;
+  if ((entry->length < sizeof (msg_hdr_t)) ||
+      (msg->length != entry->length) ||
+      (msg->type == MSG_TYPE_FRAGMENT)) {
+    DEBUG_ERR("handle_fragment: invalid message");
+    return 0;
+  }
+
+#ifdef HMTL_USE_CRC
+  if (hmtl_msg_crc(msg) != msg->crc) {
+    DEBUG1_HEXVALLN("handle_fragment: bad crc ", msg->crc);
+    return 0;
+  }
+#endif
+
+  return handler->process_msg(msg, src, serial_socket, config);
+#endif
+}
+
+#if HMTL_FRAGMENT_BUFFERS > 0
+/*
+ * Partial messages that have timed out are released as they are found
+ */
+msg_fragments_t *MessageHandler::find_fragments(Socket *src,
+                                                socket_addr_t source,
+                                                boolean start) {
+  unsigned long now = timesync.ms();
+  msg_fragments_t *unused = NULL;
+  msg_fragments_t *oldest = NULL;
+
+  for (byte i = 0; i < HMTL_FRAGMENT_BUFFERS; i++) {
+    msg_fragments_t *entry = &fragments[i];
+    if ((entry->next != 0) &&
+        (now - entry->start_ms > HMTL_FRAGMENT_TIMEOUT_MS)) {
+      DEBUG3_VALUELN("Fragments timed out from ", entry->source);
+      entry->next = 0;
+    }
+
+    if (entry->next == 0) {
+      if (unused == NULL) unused = entry;
+      continue;
+    }
+
+    if ((entry->src == src) && (entry->source == source)) {
+      return entry;
+    }
+
+    if ((oldest == NULL) || ((long)(entry->start_ms - oldest->start_ms) < 0)) {
+      oldest = entry;
+    }
+  }
+
+  if (!start) {
+    return NULL;
+  }
+  if (unused != NULL) {
+    return unused;
+  }
+
+  DEBUG1_VALUELN("Dropping fragments from ", oldest->source);
+  return oldest;
+}
+#endif
+
+/*
+ * Recall a scene from the scene store, first storing it as the boot scene if
+ * that was requested.
+ */
+uint16_t MessageHandler::handle_scene(MessageHandler *handler,
+                                      msg_hdr_t *msg_hdr, Socket *src,
+                                      Socket *serial_socket,
+                                      config_hdr_t *config) {
+  msg_scene_t *msg_scene = (msg_scene_t *)(msg_hdr + 1);
+
+  if (msg_hdr->length < HMTL_MSG_SCENE_LEN) {
+    DEBUG_ERR("handle_scene: invalid length");
+    return 0;
+  }
+
+  if (msg_scene->flags & HMTL_SCENE_FLAG_BOOT) {
+    config_scenes_t scenes;
+    if ((hmtl_read_scenes(handler->scene_location, &scenes) > 0) &&
+        (scenes.boot_scene != msg_scene->scene)) {
+      /* Only rewritten when changed, to spare the EEPROM */
+      scenes.boot_scene = msg_scene->scene;
+      hmtl_write_scenes(handler->scene_location, &scenes);
+    }
+  }
+
+  return handler->recall_scene(msg_scene->scene);
+}
+
+uint8_t MessageHandler::boot_scene() {
+  config_scenes_t scenes;
+  if (hmtl_read_scenes(scene_location, &scenes) < 0) {
+    return HMTL_SCENE_NONE;
+  }
+  return scenes.boot_scene;
+}
+
+/*
+ * Program records are read one at a time into a zeroed record, which fills in
+ * any values that weren't stored.  The records of a scene are consecutive, so
+ * reading stops at the end of the scene.
+ */
+uint16_t MessageHandler::recall_scene(uint8_t scene) {
+  config_scenes_t scenes;
+  int addr = hmtl_read_scenes(scene_location, &scenes);
+  if ((addr < 0) || (scene == HMTL_SCENE_NONE)) {
+    return 0;
+  }
+
+  DEBUG3_VALUELN("Recall scene:", scene);
+
+  uint16_t updated = 0;
+  boolean found = false;
+  scene_program_t record;
+  for (byte i = 0; i < scenes.num_programs; i++) {
+    memset(&record, 0, sizeof (record));
+    addr = EEPROM_safe_read(addr, (uint8_t *)&record, sizeof (record));
+    if (addr < 0) {
+      DEBUG1_VALUELN("recall_scene: invalid record ", i);
+      break;
+    }
+
+    if (record.scene != scene) {
+      if (found) break;
+      continue;
+    }
+    found = true;
+    if (record.program.hdr.type != HMTL_OUTPUT_PROGRAM) {
+      continue;
+    }
+
+    updated |= start_program(&record.program);
+  }
+
+  return updated;
+}
+
+/*
+ * Insert a message into the pending queue, keeping it sorted by execution
+ * time with messages due at the same time kept in the order received.
+ */
+boolean MessageHandler::schedule_msg(msg_hdr_t *msg_hdr, uint32_t execute_ms,
+                                     Socket *src, Socket *serial_socket) {
+  if ((num_pending >= MSG_PENDING_QUEUE) ||
+      (msg_hdr->length > MSG_PENDING_MAX_LEN)) {
+    DEBUG1_VALUELN("schedule_msg: unable to queue len:", msg_hdr->length);
+    return false;
+  }
+
+  byte pos = num_pending;
+  while ((pos > 0) &&
+         ((int32_t)(pending[pending_order[pos - 1]].execute_ms -
+                    execute_ms) > 0)) {
+    pos--;
+  }
+
+  // The first unused entry is always after the pending ones
+  byte index = pending_order[num_pending];
+  for (byte i = num_pending; i > pos; i--) {
+    pending_order[i] = pending_order[i - 1];
+  }
+  pending_order[pos] = index;
+  num_pending++;
+
+  msg_pending_t *entry = &pending[index];
+  entry->src = src;
+  entry->serial_socket = serial_socket;
+  entry->execute_ms = execute_ms;
+  memcpy(entry->data, msg_hdr, msg_hdr->length);
+
+  DEBUG4_VALUELN("Scheduled msg for ", execute_ms);
+  return true;
+}
+
+/*
+ * Process all pending messages that are due
+ */
+uint16_t MessageHandler::run_pending(config_hdr_t *config) {
+  uint16_t updated = 0;
+  uint32_t now = (uint32_t)timesync.ms();
+
+  while ((num_pending > 0) &&
+         ((int32_t)(now - pending[pending_order[0]].execute_ms) >= 0)) {
+    /*
+     * The entry is removed after it is processed so that its slot can't be
+     * reused by a timed message that it carries in a batch.  Those are due
+     * later and so can't be inserted ahead of it.
+     */
+    byte index = pending_order[0];
+    msg_pending_t *entry = &pending[index];
+    updated |= process_msg((msg_hdr_t *)entry->data, entry->src,
+                           entry->serial_socket, config);
+
+    num_pending--;
+    for (byte i = 0; i < num_pending; i++) {
+      pending_order[i] = pending_order[i + 1];
+    }
+    pending_order[num_pending] = index;
+  }
+
+  return updated;
+}
+
+/*
+ * Send the next EEPROM record of an in-progress configuration dump
+ */
+boolean MessageHandler::send_dump_chunk() {
+  if (dump_location == 0) {
+    return false;
+  }
+
+  /*
+   * The response will be a typical message header followed by the raw data
+   * from EEPROM.
+   */
+  Socket *sock = dump_buffer_socket;
+  msg_dumpconfig_response_t *resp = (msg_dumpconfig_response_t *)(sock->send_buffer + sizeof (msg_hdr_t));
+
+  uint16_t len;
+  uint8_t flags = dump_flags;
+
+  int next_addr = EEPROM_safe_read(dump_location, resp->data,
+                                   sock->send_data_size -
+                                       HMTL_MSG_DUMPCONFIG_MIN_LEN);
+  if (next_addr > 0) {
+    uint16_t datalen = (uint16_t)EEPROM_DATA_SIZE(next_addr - dump_location);
+
+    DEBUG4_VALUELN("Dump config:", dump_location);
+
+    /*
+     * Check if the next address is a valid structure and if so indicate
+     * that there will be additional messages.  The dump ends with the
+     * configuration records, before any scene store.
+     */
+    if ((next_addr != scene_location) && EEPROM_check_address(next_addr)) {
+      flags |= MSG_FLAG_MORE_DATA;
+      dump_location = next_addr;
+    } else {
+      DEBUG4_PRINTLN("Dump final message")
+      dump_location = 0;
+    }
+
+    // Now that the length of the data is known construct the message
+    len = hmtl_dumpconfig_fmt(sock->send_buffer,
+                              sock->send_data_size,
+                              dump_address,
+                              flags,
+                              datalen);
+  } else {
+    /*
+     * There was an error, respond with an error flag
+     */
+    flags |= MSG_FLAG_ERROR;
+    dump_location = 0;
+
+    len = hmtl_dumpconfig_fmt(sock->send_buffer,
+                              sock->send_data_size,
+                              dump_address,
+                              flags,
+                              0);
+  }
+
+  if (dump_socket != NULL) {
+    dump_socket->sendMsgTo(dump_address, sock->send_buffer, len);
+  } else {
+    Serial.write(sock->send_buffer, len);
+  }
+
+  return true;
 }
 
 /*
@@ -272,15 +988,21 @@ boolean MessageHandler::process_msg(msg_hdr_t *msg_hdr, Socket *src,
  * forward it over other sockets if it isn't for this device or is a broacast
  * message, and then process the message if it is for this device.
  *
- * Returns true if processing the message resulted in some change that may
- * require the device's outputs to be updated.
+ * Returns a bitmask of the outputs changed by processing the message, which
+ * should be updated.
  */
-boolean MessageHandler::check_serial(config_hdr_t *config) {
-  boolean update = false;
+uint16_t MessageHandler::check_serial(config_hdr_t *config) {
+  uint16_t updated = 0;
 
   /* Check for messages on the serial interface */
   msg_hdr_t *msg_hdr = (msg_hdr_t *)serial_msg;
-  if (hmtl_serial_getmsg(serial_msg, MSG_MAX_SZ, &serial_msg_offset)) {
+  for (byte count = 0; count < HMTL_SERIAL_BURST; count++) {
+    read_serial_prefix();
+    if (!hmtl_serial_getmsg(serial_msg, MSG_MAX_SZ, &serial_msg_offset,
+                            &serial_msg_crc)) {
+      break;
+    }
+
     /* Received a complete message */
     DEBUG5_VALUE("Received msg len=", serial_msg_offset);
     DEBUG5_PRINT(" ");
@@ -288,37 +1010,102 @@ boolean MessageHandler::check_serial(config_hdr_t *config) {
             print_hex_string((byte *)msg_hdr, serial_msg_offset)
     );
     DEBUG_PRINT_END();
-    Serial.println(F(HMTL_ACK));
 
-    /* Check if the message should be forwarded to any sockets */
-    for (uint8_t i = 0; i < num_sockets; i++) {
-      if (sockets[i] != NULL) {
-        check_and_forward(msg_hdr, sockets[i]);
-      }
+    boolean sequenced = (serial_seq_state & SERIAL_SEQ_VALID);
+    if (!sequenced) {
+      Serial.println(F(HMTL_ACK));
+    } else if (!check_serial_sequence()) {
+      serial_msg_offset = 0;
+      serial_seq_state = 0;
+      continue;
     }
+    serial_seq_state = 0;
+
+    if (accept_msg(msg_hdr)) {
+      /* Check if the message should be forwarded to any sockets */
+      forward_msg(msg_hdr, NULL);
 
-    // Todo: Should this really use the first socket's buffer?  What if there
-    // are no sockets configured?
-    if (process_msg(msg_hdr, NULL, sockets[0], config)) {
-      update = true;
+      // Todo: Should this really use the first socket's buffer?  What if there
+      // are no sockets configured?
+      updated |= process_msg(msg_hdr, NULL, sockets[0], config);
     }
 
     serial_msg_offset = 0;
     last_serial_ms = timesync.ms();
+
+    if (sequenced &&
+        ((serial_seq_unacked >= HMTL_SERIAL_ACK_INTERVAL) ||
+         !Serial.available())) {
+      /* Coalesce acks until several are due or the host has stopped sending */
+      send_serial_ack();
+    }
+  }
+
+  return updated;
+}
+
+/*
+ * Consume a sequence prefix and number at the start of a serial message
+ */
+void MessageHandler::read_serial_prefix() {
+  while ((serial_msg_offset == 0) && Serial.available()) {
+    if (serial_seq_state & SERIAL_SEQ_PREFIX) {
+      serial_seq = Serial.read();
+      serial_seq_state &= ~SERIAL_SEQ_PREFIX;
+    } else if (Serial.peek() == HMTL_SERIAL_SEQ) {
+      Serial.read();
+      serial_seq_state = SERIAL_SEQ_PREFIX | SERIAL_SEQ_VALID;
+    } else if (Serial.peek() == HMTL_SERIAL_SEQ_SYNC) {
+      Serial.read();
+      serial_seq_state = SERIAL_SEQ_PREFIX | SERIAL_SEQ_VALID | SERIAL_SEQ_SYNC;
+    } else {
+      break;
+    }
+  }
+}
+
+/*
+ * Accept a sequenced message only if it is the next one expected.  Messages
+ * after a gap are dropped and a single duplicate ack is sent so that the host
+ * resends everything from the gap onwards.
+ */
+boolean MessageHandler::check_serial_sequence() {
+  if ((serial_seq_state & SERIAL_SEQ_SYNC) ||
+      (serial_seq == (byte)(serial_seq_last + 1))) {
+    serial_seq_last = serial_seq;
+    serial_seq_unacked++;
+    serial_seq_nacked = false;
+    return true;
   }
 
-  return update;
+  DEBUG3_VALUELN("Out of sequence:", serial_seq);
+  if (!serial_seq_nacked) {
+    send_serial_ack();
+    serial_seq_nacked = true;
+  }
+  return false;
+}
+
+/*
+ * Send a cumulative acknowledgement of the sequenced serial messages
+ */
+void MessageHandler::send_serial_ack() {
+  byte buffer[HMTL_MSG_SERIAL_ACK_LEN];
+  uint16_t len = hmtl_serial_ack_fmt(buffer, sizeof (buffer), address,
+                                     serial_seq_last);
+  Serial.write(buffer, len);
+  serial_seq_unacked = 0;
 }
 
 /*
  * Check for messages over the indicated socket and handle any messages
  * received.
  *
- * Returns true if processing the message resulted in some change that may
- * require the device's outputs to be updated.
+ * Returns a bitmask of the outputs changed by processing the message, which
+ * should be updated.
  */
-boolean MessageHandler::check_socket(Socket *socket, Socket *serial_socket,
-                                     config_hdr_t *config) {
+uint16_t MessageHandler::check_socket(Socket *socket, Socket *serial_socket,
+                                      config_hdr_t *config) {
   unsigned int msglen;
   msg_hdr_t *msg_hdr = hmtl_socket_getmsg(socket, &msglen);
   if (msg_hdr != NULL) {
@@ -329,44 +1116,127 @@ boolean MessageHandler::check_socket(Socket *socket, Socket *serial_socket,
     );
     DEBUG_PRINT_END();
 
-    /* Check if the message should be forwarded to any sockets */
-    for (uint8_t i = 0; i < num_sockets; i++) {
-      if ((sockets[i] != NULL) && (sockets[i] != socket)) {
-        check_and_forward(msg_hdr, sockets[i]);
+    return handle_socket_msg(msg_hdr, socket, serial_socket, config);
+  }
+
+  return 0;
+}
+
+uint16_t MessageHandler::handle_socket_msg(msg_hdr_t *msg_hdr, Socket *socket,
+                                           Socket *serial_socket,
+                                           config_hdr_t *config) {
+  if (!accept_msg(msg_hdr)) {
+    return 0;
+  }
+
+  /* Check if the message should be forwarded to any sockets */
+  forward_msg(msg_hdr, socket);
+
+  return process_msg(msg_hdr, socket, serial_socket, config);
+}
+
+/*
+ * Messages that arrive while waiting are handled as if received by
+ * check_socket(), as they have been consumed from the socket.
+ */
+uint16_t MessageHandler::timesync_wait(config_hdr_t *config) {
+  uint16_t updated = 0;
+  unsigned int msglen;
+  msg_hdr_t *msg_hdr;
+
+  uint32_t start_us = micros();
+  while ((msg_hdr = timesync.hotWait(address, &msglen)) != NULL) {
+    Socket *socket = timesync.getSocket();
+    updated |= handle_socket_msg(msg_hdr, socket, socket, config);
+
+    /* Return to the loop, the wait continues on the next check() */
+    if ((uint32_t)(micros() - start_us) >= TIMESYNC_HOT_WAIT_US) break;
+  }
+
+  return updated;
+}
+
+/*
+ * Queue a message to be sent after a delay.  The delay is local, so it's
+ * measured with millis() rather than the synchronized time, which can step
+ * when it is adjusted.
+ */
+void MessageHandler::defer_msg(Socket *socket, socket_addr_t dest,
+                               const byte *data, byte length,
+                               unsigned long delay_ms) {
+  if (length <= MSG_DEFERRED_MAX_LEN) {
+    for (byte i = 0; i < MSG_DEFERRED_QUEUE; i++) {
+      msg_deferred_t *entry = &deferred[i];
+      if (entry->length == 0) {
+        entry->socket = socket;
+        entry->address = dest;
+        entry->send_ms = millis() + delay_ms;
+        entry->length = length;
+        memcpy(entry->data, data, length);
+        return;
       }
     }
+  }
 
-    if (process_msg(msg_hdr, socket, serial_socket, config)) {
-      return true;
-    }
+  DEBUG1_VALUELN("defer_msg: unable to queue len:", length);
+  if (data != socket->send_buffer) {
+    memcpy(socket->send_buffer, data, length);
   }
+  socket->sendMsgTo(dest, socket->send_buffer, length);
+}
 
-  return false;
+/*
+ * Send any deferred messages whose time has come
+ */
+void MessageHandler::send_deferred() {
+  unsigned long now = millis();
+  for (byte i = 0; i < MSG_DEFERRED_QUEUE; i++) {
+    msg_deferred_t *entry = &deferred[i];
+    if ((entry->length > 0) && ((long)(now - entry->send_ms) >= 0)) {
+      DEBUG4_VALUELN("Sending deferred to ", entry->address);
+      memcpy(entry->socket->send_buffer, entry->data, entry->length);
+      entry->socket->sendMsgTo(entry->address, entry->socket->send_buffer,
+                               entry->length);
+      entry->length = 0;
+    }
+  }
 }
 
 /*
- * Check the serial device and all sockets for messsages
+ * Check the serial device and all sockets for messsages, returning a bitmask
+ * of the outputs that were changed.
  */
-boolean MessageHandler::check(config_hdr_t *config) {
-  boolean update = false;
+uint16_t MessageHandler::check(config_hdr_t *config) {
+  send_deferred();
+  send_dump_chunk();
 
-  if (check_serial(config)) {
-    update = true;
+  uint16_t updated = 0;
+  if ((frame_state == FRAME_RECEIVING) &&
+      (millis() - frame_ms >= HMTL_FRAME_TIMEOUT_MS)) {
+    DEBUG1_VALUELN("Pixel frame timed out at ", frame_offset);
+    updated |= abort_frame();
   }
 
+  updated |= run_pending(config);
+  updated |= check_serial(config);
+
   for (uint8_t socket = 0; socket < num_sockets; socket++) {
-    if ((sockets[socket] != NULL) &&
-        (check_socket(sockets[socket], sockets[socket], config))) {
-      update = true;
+    if (sockets[socket] != NULL) {
+      updated |= check_socket(sockets[socket], sockets[socket], config);
     }
   }
 
-  return update;
+  if (timesync.update()) {
+    updated |= timesync_wait(config);
+  }
+
+  return manager->hold_updates(updated);
 }
 
 /*
  * Check if a message should be forwarded and transmit it over
- * the indicated socket if so.
+ * the indicated socket if so.  Sockets send from their own send_buffer, so
+ * the message is staged there unless it was formatted in place.
  */
 boolean MessageHandler::check_and_forward(msg_hdr_t *msg_hdr, Socket *socket) {
   if (((msg_hdr->address != address) || (msg_hdr->address == SOCKET_ADDR_ANY)) &&
@@ -379,7 +1249,9 @@ boolean MessageHandler::check_and_forward(msg_hdr_t *msg_hdr, Socket *socket) {
       DEBUG1_VALUELN("Message larger than send buffer:", msg_hdr->length);
     } else {
       DEBUG4_VALUELN("Forwarding msg to ", msg_hdr->address);
-      memcpy(socket->send_buffer, msg_hdr, msg_hdr->length);
+      if ((byte *)msg_hdr != socket->send_buffer) {
+        memcpy(socket->send_buffer, msg_hdr, msg_hdr->length);
+      }
       socket->sendMsgTo(msg_hdr->address, socket->send_buffer, msg_hdr->length);
       return true;
     }
@@ -389,4 +1261,104 @@ boolean MessageHandler::check_and_forward(msg_hdr_t *msg_hdr, Socket *socket) {
   return false;
 }
 
+boolean MessageHandler::accept_msg(msg_hdr_t *msg_hdr) {
+  if (msg_hdr->version != HMTL_MSG_VERSION) {
+    // Older headers have no origin, so they can't be safely forwarded
+    DEBUG_ERR("Invalid message version");
+    return false;
+  }
+
+  if (msg_hdr->source == SOCKET_ADDR_INVALID) {
+    /* The sender has no address, so copies can't be recognized */
+    return true;
+  }
+
+  if (msg_hdr->source == address) {
+    DEBUG4_VALUELN("Dropping own msg seq:", msg_hdr->seq);
+    return false;
+  }
+
+  /* Find the sender's entry, expiring any that have gone quiet */
+  unsigned long now = timesync.ms();
+  msg_seen_t *entry = NULL;
+  for (byte i = 0; i < HMTL_SEEN_CACHE; i++) {
+    if (now - seen[i].seen_ms >= HMTL_SEEN_TIMEOUT_MS) {
+      seen[i].source = SOCKET_ADDR_INVALID;
+    }
+    if (seen[i].source == msg_hdr->source) {
+      entry = &seen[i];
+    }
+  }
+
+  if (entry == NULL) {
+    /* Start a new entry, replacing the least recent if all are in use */
+    entry = &seen[0];
+    for (byte i = 1; i < HMTL_SEEN_CACHE; i++) {
+      if (entry->source == SOCKET_ADDR_INVALID) break;
+      if ((seen[i].source == SOCKET_ADDR_INVALID) ||
+          (now - seen[i].seen_ms > now - entry->seen_ms)) {
+        entry = &seen[i];
+      }
+    }
+    entry->source = msg_hdr->source;
+    entry->window = 0;
+  } else {
+    int8_t ahead = (int8_t)(msg_hdr->seq - entry->seq);
+    uint8_t behind = -ahead;
+    if (ahead > 0) {
+      /* Slide the window up to this message */
+      entry->window = (ahead > HMTL_SEEN_WINDOW) ? 0 :
+                      (uint16_t)((entry->window << 1) | 1) << (ahead - 1);
+    } else if (behind > HMTL_SEEN_WINDOW) {
+      /*
+       * The sender's sequence also advances for messages that don't reach
+       * this module, such as unicasts to others, so after a gap of more than
+       * 127 a new message appears to be behind.  Anything outside the window
+       * restarts it, and the ttl bounds how long stale copies circulate.
+       */
+      entry->window = 0;
+    } else {
+      /* An earlier message, which is dropped unless it's new to the window */
+      uint16_t bit = (behind > 0) ? (1 << (behind - 1)) : 0;
+      if ((bit == 0) || (entry->window & bit)) {
+        DEBUG4_VALUE("Dropping duplicate msg from:", msg_hdr->source);
+        DEBUG4_VALUELN(" seq:", msg_hdr->seq);
+        return false;
+      }
+      entry->window |= bit;
+      entry->seen_ms = now;
+      return true;
+    }
+  }
+
+  entry->seq = msg_hdr->seq;
+  entry->seen_ms = now;
+  return true;
+}
+
+void MessageHandler::forward_msg(msg_hdr_t *msg_hdr, Socket *src) {
+  if ((msg_hdr->ttl == 0) || (msg_hdr->type >= MSG_TYPE_DONT_FORWARD)) {
+    return;
+  }
+
+  /* Forwarded copies have one fewer hop remaining */
+  msg_hdr->ttl--;
+#ifdef HMTL_USE_CRC
+  hmtl_msg_set_crc(msg_hdr);
+#endif
+
+  for (uint8_t i = 0; i < num_sockets; i++) {
+    if ((sockets[i] != NULL) && (sockets[i] != src)) {
+      check_and_forward(msg_hdr, sockets[i]);
+    }
+  }
+}
+
+void MessageHandler::clear_seen() {
+  for (byte i = 0; i < HMTL_SEEN_CACHE; i++) {
+    seen[i].source = SOCKET_ADDR_INVALID;
+    seen[i].seen_ms = 0;
+  }
+}
+
 
@@ -13,14 +13,189 @@
 #include "HMTLMessaging.h"
 #include "ProgramManager.h"
 
-// TODO: Rather than a monolithic process_msg function, instead provide
-//       an array of handler functions for each message type
-typedef boolean (*msg_handler_func)(Socket *src, msg_hdr_t *msg);
+class MessageHandler;
+
+/*
+ * Handler for a single message type, with the same arguments as process_msg.
+ * Returns a bitmask of the outputs that may need to be updated.
+ */
+typedef uint16_t (*msg_handler_func)(MessageHandler *handler,
+                                     msg_hdr_t *msg_hdr, Socket *src,
+                                     Socket *serial_socket,
+                                     config_hdr_t *config);
+
+/*
+ * Entry in a message handler table.  Tables are stored in PROGMEM and only
+ * the handlers listed in the table are linked in, for instance:
+ *
+ *   const msg_handler_t module_handlers[] PROGMEM = {
+ *     MSG_HANDLERS_DEFAULT,
+ *     { MSG_TYPE_CUSTOM, handle_custom_msg },
+ *   };
+ *   handler = MessageHandler(address, &manager, sockets, num_sockets,
+ *                            module_handlers, MSG_HANDLER_COUNT(module_handlers));
+ *
+ * The leading entries whose types run consecutively from MSG_TYPE_BASE are
+ * indexed directly by type, and only the entries after them are searched, so
+ * the standard types are listed first and in order.
+ */
 typedef struct {
   uint8_t type;
   msg_handler_func function;
 } msg_handler_t;
 
+#define MSG_HANDLER_COUNT(table) (sizeof (table) / sizeof (msg_handler_t))
+
+#define MSG_HANDLERS_DEFAULT \
+  { MSG_TYPE_OUTPUT,      MessageHandler::handle_output }, \
+  { MSG_TYPE_POLL,        MessageHandler::handle_poll }, \
+  { MSG_TYPE_SET_ADDR,    MessageHandler::handle_set_addr }, \
+  { MSG_TYPE_SENSOR,      MessageHandler::handle_sensor }, \
+  { MSG_TYPE_TIMESYNC,    MessageHandler::handle_timesync }, \
+  { MSG_TYPE_BATCH,       MessageHandler::handle_batch }, \
+  { MSG_TYPE_TIMED,       MessageHandler::handle_timed }, \
+  { MSG_TYPE_PIXEL_FRAME, MessageHandler::handle_pixel_frame }, \
+  { MSG_TYPE_FRAGMENT,    MessageHandler::handle_fragment }, \
+  { MSG_TYPE_SCENE,       MessageHandler::handle_scene }, \
+  { MSG_TYPE_DUMP_CONFIG, MessageHandler::handle_dump_config }
+
+/*
+ * Responses that are to be sent at a later time, such as staggered responses
+ * to broadcast polls.
+ */
+#ifndef MSG_DEFERRED_QUEUE
+  #define MSG_DEFERRED_QUEUE 2
+#endif
+
+#ifndef MSG_DEFERRED_MAX_LEN
+  #define MSG_DEFERRED_MAX_LEN HMTL_MSG_POLL_MIN_LEN
+#endif
+
+/*
+ * Sequenced serial messages are acknowledged every HMTL_SERIAL_ACK_INTERVAL
+ * messages, or sooner if no more serial data is waiting.  Up to
+ * HMTL_SERIAL_BURST complete serial messages are processed per check().
+ */
+#ifndef HMTL_SERIAL_ACK_INTERVAL
+  #define HMTL_SERIAL_ACK_INTERVAL 4
+#endif
+
+#ifndef HMTL_SERIAL_BURST
+  #define HMTL_SERIAL_BURST 4
+#endif
+
+typedef struct {
+  Socket *socket;
+  socket_addr_t address;
+  unsigned long send_ms; // millis() when the message is to be sent
+  byte length; // 0 if this entry is unused
+  byte data[MSG_DEFERRED_MAX_LEN];
+} msg_deferred_t;
+
+/*
+ * Timed messages waiting for their execution time.  Messages due further than
+ * MSG_PENDING_MAX_MS in the future, such as from a controller whose time isn't
+ * synchronized with this module, are executed immediately.  Messages that
+ * arrive while the queue is full are dropped.  Each entry holds a maximum
+ * length message, so AVR builds queue only one by default.
+ */
+#ifndef MSG_PENDING_QUEUE
+  #if defined(__AVR__)
+    #define MSG_PENDING_QUEUE 1
+  #else
+    #define MSG_PENDING_QUEUE 4
+  #endif
+#endif
+
+#ifndef MSG_PENDING_MAX_LEN
+  #define MSG_PENDING_MAX_LEN (sizeof (msg_hdr_t) + sizeof (msg_max_t))
+#endif
+
+#ifndef MSG_PENDING_MAX_MS
+  #define MSG_PENDING_MAX_MS 10000
+#endif
+
+typedef struct {
+  Socket *src;
+  Socket *serial_socket;
+  uint32_t execute_ms;
+  byte data[MSG_PENDING_MAX_LEN];
+} msg_pending_t;
+
+/*
+ * A pixel frame's output isn't updated while the frame is being received, so
+ * a frame whose remaining chunks don't arrive within this time is abandoned.
+ */
+#ifndef HMTL_FRAME_TIMEOUT_MS
+  #define HMTL_FRAME_TIMEOUT_MS 250
+#endif
+
+/*
+ * Messages being reassembled from fragments, one per sender.  A partial
+ * message is dropped if it isn't completed within HMTL_FRAGMENT_TIMEOUT_MS or
+ * if its buffer is needed for a newer message.  Each buffer holds a message of
+ * up to HMTL_FRAGMENT_MAX_LEN, so AVR builds drop fragments rather than
+ * reassembling them unless HMTL_FRAGMENT_BUFFERS is set.
+ */
+#ifndef HMTL_FRAGMENT_BUFFERS
+  #if defined(__AVR__)
+    #define HMTL_FRAGMENT_BUFFERS 0
+  #else
+    #define HMTL_FRAGMENT_BUFFERS 1
+  #endif
+#endif
+
+#ifndef HMTL_FRAGMENT_MAX_LEN
+  #define HMTL_FRAGMENT_MAX_LEN HMTL_FRAGMENT_MAX_MSG_LEN
+#endif
+
+#ifndef HMTL_FRAGMENT_TIMEOUT_MS
+  #define HMTL_FRAGMENT_TIMEOUT_MS 250
+#endif
+
+typedef struct {
+  Socket *src;          // Socket the fragments came in on, NULL for serial
+  socket_addr_t source; // Sending module
+  uint8_t id;
+  uint8_t next;         // Index of the next fragment, 0 if this entry is unused
+  uint8_t total;
+  uint8_t length;       // Bytes of the message received so far
+  unsigned long start_ms;
+  byte data[HMTL_FRAGMENT_MAX_LEN];
+} msg_fragments_t;
+
+/*
+ * Recently received messages, tracked per sender as the newest sequence number
+ * from it and a window of the ones before it.  Copies of a message that arrive
+ * over other paths are dropped before they are forwarded or processed, which
+ * keeps broadcasts from circulating through looped topologies.  A message
+ * further from the newest than the window is taken as new, as a sender's
+ * sequence also counts messages this module never receives.
+ * A sender's entry is reset once nothing has been received from it for
+ * HMTL_SEEN_TIMEOUT_MS, so that it is recognized again after restarting, and
+ * if more are sending than HMTL_SEEN_CACHE the least recent entry is replaced.
+ */
+#ifndef HMTL_SEEN_CACHE
+  #if defined(__AVR__)
+    #define HMTL_SEEN_CACHE 4
+  #else
+    #define HMTL_SEEN_CACHE 8
+  #endif
+#endif
+
+#ifndef HMTL_SEEN_TIMEOUT_MS
+  #define HMTL_SEEN_TIMEOUT_MS 1000
+#endif
+
+#define HMTL_SEEN_WINDOW 16 // Bits in msg_seen_t.window
+
+typedef struct {
+  socket_addr_t source; // SOCKET_ADDR_INVALID if this entry is unused
+  uint8_t seq;          // Newest sequence number received
+  uint16_t window;      // Bit n is set if seq - 1 - n was received
+  unsigned long seen_ms;
+} msg_seen_t;
+
 /*
  * This class is for processing socket messages
  */
@@ -29,6 +204,9 @@ public:
   MessageHandler();
   MessageHandler(socket_addr_t _address, ProgramManager *_manager,
                  Socket *_sockets[], uint8_t _num_sockets);
+  MessageHandler(socket_addr_t _address, ProgramManager *_manager,
+                 Socket *_sockets[], uint8_t _num_sockets,
+                 const msg_handler_t *_handlers, uint8_t _num_handlers);
 
   /*
    * Check if a serial-ready messages should be sent over the serial port
@@ -38,10 +216,10 @@ public:
   /*
    * Check the serial device and all sockets for messages.
    *
-   * Returns true if processing the message resulted in some change that may
-   * require the device's outputs to be updated.
+   * Returns a bitmask of the outputs changed by processing the message, which
+   * should be updated.
    */
-  boolean check(config_hdr_t *config);
+  uint16_t check(config_hdr_t *config);
 
   /*
    * Process a single message
@@ -52,33 +230,45 @@ public:
    *                  socket's data buffer is used to construct the response.
    *   config: The device configuration
    *
-   * Returns true if processing the message resulted in some change that may
-   * require the device's outputs to be updated.
+   * Returns a bitmask of the outputs changed by processing the message, which
+   * should be updated.
    */
-  boolean process_msg(msg_hdr_t *msg_hdr, Socket *src,
-                      Socket *serial_socket,
-                      config_hdr_t *config);
+  uint16_t process_msg(msg_hdr_t *msg_hdr, Socket *src,
+                       Socket *serial_socket,
+                       config_hdr_t *config);
 
   /*
    * Check for messages over the Serial port.  If a message is received,
    * forward it over other sockets if it isn't for this device or is a broacast
    * message, and then process the message if it is for this device.
    *
-   * Returns true if processing the message resulted in some change that may
-   * require the device's outputs to be updated.
+   * Returns a bitmask of the outputs changed by processing the message, which
+   * should be updated.
    */
-  boolean check_serial(config_hdr_t *config);
+  uint16_t check_serial(config_hdr_t *config);
 
   /*
    * Check for messages over the indicated socket and handle any messages
    * received.
    *
-   * Returns true if processing the message resulted in some change that may
-   * require the device's outputs to be updated.
+   * Returns a bitmask of the outputs changed by processing the message, which
+   * should be updated.
    */
-  boolean check_socket(Socket *socket,
-                       Socket *serial_socket,
-                       config_hdr_t *config);
+  uint16_t check_socket(Socket *socket,
+                        Socket *serial_socket,
+                        config_hdr_t *config);
+
+  /*
+   * Forward and process a message received over a socket
+   */
+  uint16_t handle_socket_msg(msg_hdr_t *msg_hdr, Socket *socket,
+                             Socket *serial_socket, config_hdr_t *config);
+
+  /*
+   * Hot-wait for up to TIMESYNC_HOT_WAIT_US for the reply to an outstanding
+   * time sync exchange, handling any other messages that arrive meanwhile.
+   */
+  uint16_t timesync_wait(config_hdr_t *config);
 
   /*
    * Check if a message should be forwarded and transmit it over
@@ -86,6 +276,115 @@ public:
    */
   boolean check_and_forward(msg_hdr_t *msg_hdr, Socket *socket);
 
+  /*
+   * Return false if a received message is this module's own or a copy of a
+   * message that was already received, and should be dropped.
+   */
+  boolean accept_msg(msg_hdr_t *msg_hdr);
+
+  /*
+   * Forward a received message over every socket but the one it arrived on,
+   * if its ttl allows.
+   */
+  void forward_msg(msg_hdr_t *msg_hdr, Socket *src);
+
+  /*
+   * Queue a message to be sent over a socket after delay_ms.  If the queue is
+   * full then the message is sent immediately.
+   */
+  void defer_msg(Socket *socket, socket_addr_t dest, const byte *data,
+                 byte length, unsigned long delay_ms);
+
+  /*
+   * Send any deferred messages that are due
+   */
+  void send_deferred();
+
+  /*
+   * Send the next message of an in-progress configuration dump.  Returns
+   * false if no dump is in progress.
+   */
+  boolean send_dump_chunk();
+
+  /*
+   * Send a cumulative acknowledgement of the sequenced serial messages
+   * received so far.
+   */
+  void send_serial_ack();
+
+  /*
+   * Queue a message to be processed at execute_ms, returning false if it
+   * can't be queued.
+   */
+  boolean schedule_msg(msg_hdr_t *msg_hdr, uint32_t execute_ms,
+                       Socket *src, Socket *serial_socket);
+
+  /*
+   * Process any queued timed messages that are due, returning a bitmask of the
+   * outputs that were changed.
+   */
+  uint16_t run_pending(config_hdr_t *config);
+
+  /* Number of timed messages waiting to be processed */
+  byte pending_count() { return num_pending; }
+
+  /*
+   * Set the EEPROM location of the scene store, which follows the
+   * configuration records.  A location of 0 disables scenes.
+   */
+  void set_scene_store(int location) { scene_location = location; }
+
+  /* Return the stored boot scene, or HMTL_SCENE_NONE if there is none */
+  uint8_t boot_scene();
+
+  /*
+   * Start every stored program of a scene, returning a bitmask of the outputs
+   * that were changed.
+   */
+  uint16_t recall_scene(uint8_t scene);
+
+  /*
+   * Return the handler for a message type from the handler table, or NULL if
+   * the type has no handler.
+   */
+  msg_handler_func lookup_handler(uint8_t type);
+
+  /* Handlers for the standard message types */
+  static uint16_t handle_output(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                                Socket *src, Socket *serial_socket,
+                                config_hdr_t *config);
+  static uint16_t handle_poll(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                              Socket *src, Socket *serial_socket,
+                              config_hdr_t *config);
+  static uint16_t handle_set_addr(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                                  Socket *src, Socket *serial_socket,
+                                  config_hdr_t *config);
+  static uint16_t handle_sensor(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                                Socket *src, Socket *serial_socket,
+                                config_hdr_t *config);
+  static uint16_t handle_timesync(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                                  Socket *src, Socket *serial_socket,
+                                  config_hdr_t *config);
+  static uint16_t handle_dump_config(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                                     Socket *src, Socket *serial_socket,
+                                     config_hdr_t *config);
+  static uint16_t handle_batch(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                               Socket *src, Socket *serial_socket,
+                               config_hdr_t *config);
+  static uint16_t handle_timed(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                               Socket *src, Socket *serial_socket,
+                               config_hdr_t *config);
+  static uint16_t handle_pixel_frame(MessageHandler *handler,
+                                     msg_hdr_t *msg_hdr,
+                                     Socket *src, Socket *serial_socket,
+                                     config_hdr_t *config);
+  static uint16_t handle_fragment(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                                  Socket *src, Socket *serial_socket,
+                                  config_hdr_t *config);
+  static uint16_t handle_scene(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                               Socket *src, Socket *serial_socket,
+                               config_hdr_t *config);
+
   ProgramManager *manager;
 
 private:
@@ -93,13 +392,45 @@ private:
   Socket **sockets;
   uint8_t num_sockets;
 
+  /* Table of handlers for each message type, stored in PROGMEM */
+  const msg_handler_t *handlers;
+  uint8_t num_handlers;
+  uint8_t num_indexed; // Leading entries indexed by type - MSG_TYPE_BASE
+
   /*
    * Messages from a serial interface may come in across multiple calls to
-   * check serial and so must be buffered.
+   * check serial and so must be buffered.  The buffer holds either the largest
+   * single message wrapped in a timed message, or a full batch.
    */
-  static const uint8_t MSG_MAX_SZ = (sizeof(msg_hdr_t) + sizeof(msg_max_t));
+  static const uint8_t MSG_MAX_SZ =
+          (HMTL_MSG_TIMED_LEN(sizeof(msg_hdr_t) + sizeof(msg_max_t)) >
+           HMTL_MSG_BATCH_MAX_LEN) ?
+          HMTL_MSG_TIMED_LEN(sizeof(msg_hdr_t) + sizeof(msg_max_t)) :
+          HMTL_MSG_BATCH_MAX_LEN;
   byte serial_msg[MSG_MAX_SZ];
   byte serial_msg_offset;
+  byte serial_msg_crc; // Running CRC of the partial message
+
+  /*
+   * Sliding window state for sequenced serial messages
+   */
+  static const byte SERIAL_SEQ_VALID  = 0x1; // Message has a sequence number
+  static const byte SERIAL_SEQ_SYNC   = 0x2; // Message restarts the sequence
+  static const byte SERIAL_SEQ_PREFIX = 0x4; // Sequence number is next
+
+  byte serial_seq_state;
+  byte serial_seq;          // Sequence number of the message being received
+  byte serial_seq_last;     // Last sequence number received in order
+  byte serial_seq_unacked;  // Messages received since the last ack
+  boolean serial_seq_nacked; // A gap has already been reported
+
+  /*
+   * Read any sequence prefix before a serial message, then check the
+   * sequence number once the message is complete, returning false if the
+   * message is out of order and should be dropped.
+   */
+  void read_serial_prefix();
+  boolean check_serial_sequence();
 
   /*
    * Parameters for determining if a "ready" message should be sent to the
@@ -111,6 +442,68 @@ private:
   unsigned long last_serial_ms;
   unsigned long last_ready_ms;
 
+  msg_deferred_t deferred[MSG_DEFERRED_QUEUE];
+
+  /*
+   * Timed messages, with pending_order holding the indexes of the first
+   * num_pending entries sorted by execution time.
+   */
+  msg_pending_t pending[MSG_PENDING_QUEUE];
+  byte pending_order[MSG_PENDING_QUEUE];
+  byte num_pending;
+
+  /*
+   * State of an in-progress configuration dump, which sends one EEPROM record
+   * per call to check().
+   */
+  Socket *dump_socket;        // Socket to respond on, NULL for serial
+  Socket *dump_buffer_socket; // Socket whose buffer is used for responses
+  socket_addr_t dump_address;
+  int dump_location;          // Next EEPROM location, 0 if no dump is active
+  byte dump_flags;
+
+  /*
+   * State of the pixel frame stream, a single output may be streamed at a
+   * time.
+   */
+  static const byte FRAME_IDLE      = 0; // Delta frames can't be applied
+  static const byte FRAME_RECEIVING = 1; // Waiting for chunk frame_offset
+  static const byte FRAME_COMPLETE  = 2; // frame_id was completely applied
+
+  byte frame_state;
+  byte frame_output;
+  byte frame_id;
+  uint16_t frame_offset;
+  unsigned long frame_ms; // millis() when the last chunk was applied
+
+  uint16_t abort_frame();
+
+  /* EEPROM location of the scene store, 0 if there is none */
+  int scene_location;
+
+  /*
+   * Pass a program message to the ProgramManager, returning a bitmask of the
+   * outputs that it may have changed.
+   */
+  uint16_t start_program(msg_program_t *program);
+
+#if HMTL_FRAGMENT_BUFFERS > 0
+  /* Messages being reassembled from fragments */
+  msg_fragments_t fragments[HMTL_FRAGMENT_BUFFERS];
+
+  /*
+   * Return the partial message from a sender, or if start is set a buffer for
+   * a new one, reusing the oldest if none are free.
+   */
+  msg_fragments_t *find_fragments(Socket *src, socket_addr_t source,
+                                  boolean start);
+#endif
+
+  /* Duplicate suppression */
+  msg_seen_t seen[HMTL_SEEN_CACHE];
+
+  void clear_seen();
+
 
 };
 
@@ -27,29 +27,61 @@
  */
 
 ProgramManager::ProgramManager() {
+  registry = NULL;
+  states_allocated = 0;
+  memset(&pool_stats, 0, sizeof (pool_stats));
+
+  for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+    layer_pool[i].output = HMTL_NO_OUTPUT;
+  }
+  memset(layer_base, 0, sizeof (layer_base));
+  layers_changed = 0;
+  held_outputs = 0;
+  held_updates = 0;
+
+  segments = NULL;
+  num_segments = 0;
+  memset(segment_trackers, 0, sizeof (segment_trackers));
 };
 
 ProgramManager::ProgramManager(output_hdr_t **_outputs,
                                program_tracker_t **_trackers,
                                void **_objects,
                                byte _num_outputs,
-
-                               hmtl_program_t *_functions,
-                               byte _num_programs) {
+                               const hmtl_program_registry_t *_registry) {
   outputs = _outputs;
   trackers = _trackers;
   objects = _objects;
   num_outputs = _num_outputs;
 
-  functions = _functions;
-  num_programs = _num_programs;
+  if (num_outputs > PROGRAM_MANAGER_MAX_OUTPUTS) {
+    DEBUG_ERR("ProgramManager: too many outputs");
+    num_outputs = PROGRAM_MANAGER_MAX_OUTPUTS;
+  }
+
+  registry = _registry;
 
   for (byte i = 0; i < num_outputs; i++) {
     trackers[i] = NULL;
   }
 
+  states_allocated = 0;
+  memset(&pool_stats, 0, sizeof (pool_stats));
+
+  for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+    layer_pool[i].output = HMTL_NO_OUTPUT;
+  }
+  memset(layer_base, 0, sizeof (layer_base));
+  layers_changed = 0;
+  held_outputs = 0;
+  held_updates = 0;
+
+  segments = NULL;
+  num_segments = 0;
+  memset(segment_trackers, 0, sizeof (segment_trackers));
+
   DEBUG3_VALUE("ProgramManager: outputs:", num_outputs);
-  DEBUG3_VALUELN(" programs:", num_programs);
+  DEBUG3_VALUELN(" programs:", registry ? registry->num_programs : 0);
 }
 
 /**
@@ -75,20 +107,25 @@ byte ProgramManager::lookup_output_by_type(uint8_t type, uint8_t nth) {
  * Lookup a program in the manager based on its ID
  */
 byte ProgramManager::lookup_function(byte id) {
-  /* Find the program to be executed */
-  for (byte i = 0; i < num_programs; i++) {
-    if (functions[i].type == id) {
-      return i;
-    }
+  if ((registry == NULL) || (id >= registry->num_types)) {
+    return NO_PROGRAM;
   }
-  return NO_PROGRAM;
+  return pgm_read_byte(&registry->index[id]);
+}
+
+hmtl_program_func ProgramManager::program_function(byte program) {
+  return (hmtl_program_func)pgm_read_ptr(&registry->programs[program].program);
+}
+
+hmtl_program_setup ProgramManager::setup_function(byte program) {
+  return (hmtl_program_setup)pgm_read_ptr(&registry->programs[program].setup);
 }
 
 /*
  * Return the program ID from a tracker
  */
 byte ProgramManager::program_from_tracker(program_tracker_t *tracker) {
-  return functions[tracker->program_index].type;
+  return pgm_read_byte(&registry->programs[tracker->program_index].type);
 }
 
 /*
@@ -98,9 +135,9 @@ boolean ProgramManager::handle_msg(msg_program_t *msg) {
   DEBUG4_VALUE("handle_msg: program=", msg->type);
   DEBUG4_VALUELN(" output=", msg->hdr.output);
 
-  /* Find the program to be executed */
+  /* Find the program to be executed, a layer's is found when it starts */
   byte program = lookup_function(msg->type);
-  if (program == NO_PROGRAM) {
+  if ((program == NO_PROGRAM) && (msg->type != HMTL_PROGRAM_LAYER)) {
     DEBUG1_VALUELN("handle_msg: invalid type: ", msg->type);
     return false;
   }
@@ -112,7 +149,14 @@ boolean ProgramManager::handle_msg(msg_program_t *msg) {
     /* This should be applied to all outputs that can handle the message type */
     starting_output = 0;
     stop_output = num_outputs;
-  } else if (msg->hdr.output > num_outputs) {
+  } else if (IS_HMTL_SEGMENT_OUTPUT(msg->hdr.output)) {
+    if (lookup_segment(msg->hdr.output) == NULL) {
+      DEBUG1_VALUELN("handle_msg: invalid segment: ", msg->hdr.output);
+      return false;
+    }
+    starting_output = msg->hdr.output;
+    stop_output = starting_output + 1;
+  } else if (msg->hdr.output >= num_outputs) {
     DEBUG1_VALUELN("handle_msg: invalid output: ",
                    msg->hdr.output);
     return false;
@@ -127,18 +171,36 @@ boolean ProgramManager::handle_msg(msg_program_t *msg) {
 
   for (int output = starting_output; output < stop_output; output++) {
 
-    if (outputs[output] == NULL)
+    /* A segment's program runs on the pixel output it is part of */
+    hmtl_segment_t *segment = lookup_segment(output);
+    output_hdr_t *out_hdr = (segment ? &segment->hdr : outputs[output]);
+    byte strip_output = (segment ? segment->pixels_output : output);
+
+    if (out_hdr == NULL)
       continue;
 
     if (msg->type == HMTL_PROGRAM_NONE) {
-      /* This is a message to clear the existing program so free the tracker */
+      /*
+       * This is a message to clear the existing program so free the tracker
+       * and any layers on the output
+       */
       DEBUG3_VALUELN("handle_msg: clear ", output);
       free_tracker(output);
+      if (segment == NULL) {
+        free_layers(output);
+      }
+      continue;
+    }
+
+    if (msg->type == HMTL_PROGRAM_LAYER) {
+      if (segment == NULL) {
+        start_layer(output, msg);
+      }
       continue;
     }
 
     program_tracker_t *tracker;
-    if (functions[program].program == NULL) {
+    if (program_function(program) == NULL) {
       /*
        * This is an initialization-only command, set tracker to null
        */
@@ -156,15 +218,26 @@ boolean ProgramManager::handle_msg(msg_program_t *msg) {
 
     if (tracker) {
       // Record the output and object in the tracker
-      tracker->output = outputs[output];
-      tracker->object = objects[output];
+      tracker->output = out_hdr;
+      tracker->object = objects[strip_output];
     }
 
-    /* Attempt to setup the program */
+    /* Attempt to setup the program, drawing into the base if layered */
+    PixelUtil *pixels = NULL;
+    CRGB *strip = NULL;
+    if (layer_base[strip_output] != NULL) {
+      pixels = (PixelUtil *)objects[strip_output];
+      strip = pixels->leds;
+      pixels->leds = layer_base[strip_output];
+    }
 
+    boolean success = setup_function(program)(msg, tracker, out_hdr,
+                                              objects[strip_output], this);
 
-    boolean success = functions[program].setup(msg, tracker, outputs[output],
-                                               objects[output], this);
+    if (pixels != NULL) {
+      pixels->leds = strip;
+      layers_changed |= (1 << strip_output);
+    }
 
     if (!success) {
       if (tracker) {
@@ -176,33 +249,58 @@ boolean ProgramManager::handle_msg(msg_program_t *msg) {
     DEBUG4_VALUELN("handle_msg: setup on ", output);
   }
 
+  if ((msg->type == HMTL_PROGRAM_NONE) &&
+      (msg->hdr.output == HMTL_ALL_OUTPUTS)) {
+    /* Clearing all outputs clears their segments as well */
+    for (byte i = 0; i < num_segments; i++) {
+      free_tracker(HMTL_SEGMENT_OUTPUT(i));
+    }
+  }
+
   return true;
 }
 
+/* Return where the tracker of an output or segment is recorded */
+program_tracker_t **ProgramManager::tracker_slot(byte output) {
+  if (IS_HMTL_SEGMENT_OUTPUT(output)) {
+    return &segment_trackers[output - HMTL_SEGMENT_OUTPUT(0)];
+  }
+  return &trackers[output];
+}
+
 /*
- * Allocate a new program tracker
+ * Return the tracker for an output, which is taken from the tracker pool
  */
-program_tracker_t * ProgramManager::get_tracker(int index) {
-  if (trackers[index] == NULL) {
-    DEBUG3_VALUELN("get_tracker:", index);
-    // TODO: Should these be allocated or assigned when manager is initialized?
-    program_tracker_t *tracker = (program_tracker_t *) malloc(
-            sizeof(program_tracker_t));
-    trackers[index] = tracker;
+program_tracker_t * ProgramManager::get_tracker(byte output) {
+  program_tracker_t **slot = tracker_slot(output);
+  if (*slot == NULL) {
+    DEBUG3_VALUELN("get_tracker:", output);
+    if (IS_HMTL_SEGMENT_OUTPUT(output)) {
+      *slot = &tracker_pool[PROGRAM_MANAGER_MAX_OUTPUTS + output -
+                            HMTL_SEGMENT_OUTPUT(0)];
+    } else {
+      *slot = &tracker_pool[output];
+    }
   }
 
-  memset(trackers[index], 0, sizeof (program_tracker_t));
+  memset(*slot, 0, sizeof (program_tracker_t));
+
+  pool_stats.trackers_used++;
+  if (pool_stats.trackers_used > pool_stats.trackers_max) {
+    pool_stats.trackers_max = pool_stats.trackers_used;
+  }
 
-  return trackers[index];
+  return *slot;
 }
 
 /*
- * Free a single program tracker.  This
+ * Free a single program tracker.  This releases any state owned by the
+ * tracker and leaves it set to NO_PROGRAM.
  */
-void ProgramManager::free_tracker(int index) {
-  program_tracker_t *tracker = trackers[index];
+void ProgramManager::free_tracker(byte output) {
+  program_tracker_t *tracker = *tracker_slot(output);
   if (IS_RUNNING_PROGRAM(tracker)) {
-    DEBUG3_VALUELN("free_tracker:", index);
+    DEBUG3_VALUELN("free_tracker:", output);
     if (tracker->flags & PROGRAM_DEALLOC_STATE) {
       free_program_state(tracker);
     }
@@ -210,13 +308,16 @@ void ProgramManager::free_tracker(int index) {
     /* Clear the tracker and set its program to NO_PROGRAM */
     memset(tracker, 0, sizeof (program_tracker_t));
     tracker->program_index = NO_PROGRAM;
+
+    pool_stats.trackers_used--;
   }
 }
 
 
 /*
- * Allocate the state for a new program
- * TODO: Use a program state freelist
+ * Allocate the state for a new program from the state pool, returning NULL
+ * if the state is too large for a slot or all slots are in use.  The
+ * program's setup should then fail.
  */
 void *ProgramManager::get_program_state(program_tracker_t *tracker,
                                         byte size,
@@ -225,18 +326,43 @@ void *ProgramManager::get_program_state(program_tracker_t *tracker,
   if (preallocated != nullptr) {
     /* Use a pre-allocated program state */
     tracker->state = preallocated;
-  } else {
-    /* By default malloc every state object*/
-    void *state = malloc(size);
-    tracker->state = state;
-    tracker->flags |= PROGRAM_DEALLOC_STATE;
+    return tracker->state;
+  }
+
+  if (size > pool_stats.state_size_max) {
+    pool_stats.state_size_max = size;
+  }
+
+  tracker->state = nullptr;
+  if (size <= PROGRAM_STATE_SIZE) {
+    for (byte slot = 0; slot < PROGRAM_STATE_SLOTS; slot++) {
+      program_state_mask_t bit = (program_state_mask_t)1 << slot;
+      if (!(states_allocated & bit)) {
+        states_allocated |= bit;
+        tracker->state = &state_pool[slot];
+        break;
+      }
+    }
+  }
+
+  if (tracker->state == nullptr) {
+    DEBUG1_VALUELN("get_program_state: no slot for size ", size);
+    pool_stats.states_failed++;
+    return nullptr;
+  }
+
+  tracker->flags |= PROGRAM_DEALLOC_STATE;
+
+  pool_stats.states_used++;
+  if (pool_stats.states_used > pool_stats.states_max) {
+    pool_stats.states_max = pool_stats.states_used;
   }
+
   return tracker->state;
 }
 
 /*
- * Deallocate the state for a new program
- * TODO: Use a program state freelist
+ * Return the state for a program to the state pool
  */
 void ProgramManager::free_program_state(program_tracker_t *tracker) {
   if (tracker->state) {
@@ -245,10 +371,13 @@ void ProgramManager::free_program_state(program_tracker_t *tracker) {
        * If the tracker's flags indicate that the state should be deallocated
        * then do so now.
        */
-      free(tracker->state);
+      byte slot = (program_state_slot_t *)tracker->state - state_pool;
+      states_allocated &= ~((program_state_mask_t)1 << slot);
+      pool_stats.states_used--;
     }
 
     tracker->state = nullptr;
+    tracker->flags &= ~PROGRAM_DEALLOC_STATE;
   }
 }
 
@@ -257,29 +386,406 @@ void ProgramManager::free_program_state(program_tracker_t *tracker) {
  * Execute all configured program functions
  */
 uint16_t ProgramManager::run() {
-  uint16_t updated = 0;
+  uint16_t updated = layers_changed;
+  layers_changed = 0;
 
   for (byte i = 0; i < num_outputs; i++) {
-    program_tracker_t *tracker = trackers[i];
-    if (IS_RUNNING_PROGRAM(tracker)) {
+    /* With layers the output's program draws into the base layer */
+    PixelUtil *pixels = NULL;
+    CRGB *strip = NULL;
+    if (layer_base[i] != NULL) {
+      pixels = (PixelUtil *)objects[i];
+      strip = pixels->leds;
+      pixels->leds = layer_base[i];
+    }
 
-      if (tracker->flags & PROGRAM_TRACKER_DONE) {
-        /* If this program has been set as done then free its tracker */
-        free_tracker(i);
+    if (run_tracker(i, outputs[i], objects[i])) {
+      updated |= (1 << i);
+    }
+
+    /* Segments draw over the output's own program */
+    for (byte s = 0; s < num_segments; s++) {
+      if ((segments[s].pixels_output == i) &&
+          run_tracker(HMTL_SEGMENT_OUTPUT(s), &segments[s].hdr, objects[i])) {
+        updated |= (1 << i);
+      }
+    }
+
+    if (pixels == NULL) continue;
+
+    for (byte l = 0; l < PROGRAM_MANAGER_LAYERS; l++) {
+      program_layer_t *layer = &layer_pool[l];
+      if ((layer->output != i) || (layer->tracker.program_index == NO_PROGRAM)) {
         continue;
       }
 
-      if (functions[tracker->program_index].program(outputs[i],
-                                                    objects[i],
-                                                    tracker)) {
+      if (layer->tracker.flags & PROGRAM_TRACKER_DONE) {
+        /* A completed layer program leaves its pixels in place */
+        free_program_state(&layer->tracker);
+        layer->tracker.program_index = NO_PROGRAM;
+        continue;
+      }
+
+      pixels->leds = layer->pixels;
+      if (program_function(layer->tracker.program_index)(outputs[i],
+                                                         objects[i],
+                                                         &layer->tracker)) {
         updated |= (1 << i);
       }
     }
+
+    pixels->leds = strip;
+    if (updated & (1 << i)) {
+      composite(i);
+    }
   }
 
+  return hold_updates(updated);
+}
+
+/*
+ * Hold the updates of the pixel output that an output or segment is on
+ */
+void ProgramManager::hold_output(byte output) {
+  held_outputs |= output_bit(output);
+}
+
+/*
+ * Stop holding an output's updates, returning its bit if it was changed while
+ * held.
+ */
+uint16_t ProgramManager::release_output(byte output) {
+  uint16_t bit = output_bit(output);
+  uint16_t updated = held_updates & bit;
+  held_outputs &= ~bit;
+  held_updates &= ~bit;
   return updated;
 }
 
+/*
+ * Remove the held outputs from a set of updated outputs, recording them to be
+ * returned when released.
+ */
+uint16_t ProgramManager::hold_updates(uint16_t updated) {
+  held_updates |= updated & held_outputs;
+  return updated & ~held_outputs;
+}
+
+/*
+ * Run the program on an output or segment, returning true if it updated the
+ * output.  A program that has been set as done has its tracker freed.
+ */
+boolean ProgramManager::run_tracker(byte output, output_hdr_t *hdr,
+                                    void *object) {
+  program_tracker_t *tracker = *tracker_slot(output);
+  if (!IS_RUNNING_PROGRAM(tracker)) {
+    return false;
+  }
+
+  if (tracker->flags & PROGRAM_TRACKER_DONE) {
+    free_tracker(output);
+    return false;
+  }
+
+  return program_function(tracker->program_index)(hdr, object, tracker);
+}
+
+/*******************************************************************************
+ * Segments
+ */
+
+/*
+ * Set the segments built by hmtl_setup_segments(), which must remain valid
+ * for the life of the manager.
+ */
+void ProgramManager::set_segments(hmtl_segment_t *_segments,
+                                  byte _num_segments) {
+  for (byte i = 0; i < num_segments; i++) {
+    free_tracker(HMTL_SEGMENT_OUTPUT(i));
+  }
+
+  segments = _segments;
+  num_segments = _num_segments;
+  if (num_segments > PROGRAM_MANAGER_SEGMENTS) {
+    DEBUG_ERR("ProgramManager: too many segments");
+    num_segments = PROGRAM_MANAGER_SEGMENTS;
+  }
+
+  for (byte i = 0; i < num_segments; i++) {
+    if ((segments[i].pixels_output >= num_outputs) ||
+        (objects[segments[i].pixels_output] == NULL)) {
+      DEBUG1_VALUELN("ProgramManager: invalid segment ", i);
+      num_segments = i;
+      break;
+    }
+  }
+
+  DEBUG3_VALUELN("ProgramManager: segments:", num_segments);
+}
+
+/* Return the segment for an output number, or NULL if it isn't one */
+hmtl_segment_t *ProgramManager::lookup_segment(byte output) {
+  if (!IS_HMTL_SEGMENT_OUTPUT(output)) {
+    return NULL;
+  }
+
+  byte segment = output - HMTL_SEGMENT_OUTPUT(0);
+  if (segment >= num_segments) {
+    return NULL;
+  }
+  return &segments[segment];
+}
+
+/* Return the update bit of an output, which for a segment is its strip's */
+uint16_t ProgramManager::output_bit(byte output) {
+  hmtl_segment_t *segment = lookup_segment(output);
+  if (segment != NULL) {
+    return (uint16_t)1 << segment->pixels_output;
+  }
+  return (uint16_t)1 << output;
+}
+
+/*******************************************************************************
+ * Program layers
+ */
+
+/*
+ * Start the program in a HMTL_PROGRAM_LAYER message on a layer of an output,
+ * replacing any program already on that layer.
+ */
+boolean ProgramManager::start_layer(byte output, msg_program_t *msg) {
+  hmtl_program_layer_t *layer_msg = (hmtl_program_layer_t *)msg->values;
+
+  if (outputs[output]->type != HMTL_OUTPUT_PIXELS) {
+    return false;
+  }
+
+  if (layer_msg->layer == 0) {
+    DEBUG1_PRINTLN("start_layer: layer 0");
+    return false;
+  }
+
+  program_layer_t *layer = find_layer(output, layer_msg->layer);
+  if (layer != NULL) {
+    free_layer(layer);
+  }
+
+  if (layer_msg->program == HMTL_PROGRAM_NONE) {
+    return true;
+  }
+
+  byte program = lookup_function(layer_msg->program);
+  if (program == NO_PROGRAM) {
+    DEBUG1_VALUELN("start_layer: invalid type: ", layer_msg->program);
+    return false;
+  }
+
+  PixelUtil *pixels = (PixelUtil *)objects[output];
+  uint16_t num_pixels = pixels->numPixels();
+  if (num_pixels > PROGRAM_MANAGER_LAYER_PIXELS) {
+    DEBUG1_VALUELN("start_layer: too many pixels: ", num_pixels);
+    return false;
+  }
+
+  if (layer_msg->start >= num_pixels) {
+    DEBUG1_VALUELN("start_layer: invalid start: ", layer_msg->start);
+    return false;
+  }
+
+  layer = find_layer(HMTL_NO_OUTPUT, 0);
+  if (layer == NULL) {
+    DEBUG1_VALUELN("start_layer: no free layer for ", layer_msg->layer);
+    return false;
+  }
+
+  if (layer_base[output] == NULL) {
+    /* The output's program continues from what is on the strip */
+    layer_base[output] = (CRGB *)malloc(num_pixels * sizeof (CRGB));
+    if (layer_base[output] == NULL) {
+      DEBUG_ERR("start_layer: failed to allocate base");
+      return false;
+    }
+    memcpy(layer_base[output], pixels->leds, num_pixels * sizeof (CRGB));
+  }
+
+  layer->pixels = (CRGB *)calloc(num_pixels, sizeof (CRGB));
+  if (layer->pixels == NULL) {
+    DEBUG_ERR("start_layer: failed to allocate layer");
+
+    /* Only the new layer is rejected, the output's running layers continue */
+    for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+      if (layer_pool[i].output == output) {
+        return false;
+      }
+    }
+    free(layer_base[output]);
+    layer_base[output] = NULL;
+    return false;
+  }
+
+  layer->output = output;
+  layer->layer = layer_msg->layer;
+  layer->blend = layer_msg->blend;
+  layer->alpha = layer_msg->alpha;
+  layer->start = layer_msg->start;
+  layer->length = layer_msg->length;
+  if ((layer->length == 0) || (layer->length > num_pixels - layer->start)) {
+    layer->length = num_pixels - layer->start;
+  }
+
+  pool_stats.layers_used++;
+  if (pool_stats.layers_used > pool_stats.layers_max) {
+    pool_stats.layers_max = pool_stats.layers_used;
+  }
+
+  /* Setup the program from the values following the layer header */
+  msg_program_t program_msg;
+  program_msg.hdr = msg->hdr;
+  program_msg.type = layer_msg->program;
+  memcpy(program_msg.values, layer_msg->values, HMTL_LAYER_PROGRAM_VAL);
+  memset(program_msg.values + HMTL_LAYER_PROGRAM_VAL, 0,
+         MAX_PROGRAM_VAL - HMTL_LAYER_PROGRAM_VAL);
+
+  program_tracker_t *tracker = &layer->tracker;
+  memset(tracker, 0, sizeof (program_tracker_t));
+  tracker->program_index = NO_PROGRAM;
+  if (program_function(program) != NULL) {
+    tracker->program_index = program;
+    tracker->output = outputs[output];
+    tracker->object = objects[output];
+  } else {
+    /* Initialization-only programs just draw the layer */
+    tracker = NULL;
+  }
+
+  CRGB *strip = pixels->leds;
+  pixels->leds = layer->pixels;
+  boolean success = setup_function(program)(&program_msg, tracker,
+                                            outputs[output], objects[output],
+                                            this);
+  pixels->leds = strip;
+
+  if (!success && (tracker != NULL)) {
+    DEBUG4_VALUELN("start_layer: NA on ", output);
+    free_layer(layer);
+    return false;
+  }
+
+  DEBUG4_VALUE("start_layer: ", layer->layer);
+  DEBUG4_VALUELN(" on ", output);
+  layers_changed |= (1 << output);
+  return true;
+}
+
+/* Return the layer of an output, or a free layer for HMTL_NO_OUTPUT */
+program_layer_t *ProgramManager::find_layer(byte output, byte layer) {
+  for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+    if ((layer_pool[i].output == output) &&
+        ((output == HMTL_NO_OUTPUT) || (layer_pool[i].layer == layer))) {
+      return &layer_pool[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Stop a layer and release its pixels.  When an output's last layer is
+ * removed its base layer is returned to the strip.
+ */
+void ProgramManager::free_layer(program_layer_t *layer) {
+  byte output = layer->output;
+
+  if (layer->tracker.program_index != NO_PROGRAM) {
+    free_program_state(&layer->tracker);
+  }
+  free(layer->pixels);
+  layer->pixels = NULL;
+  layer->output = HMTL_NO_OUTPUT;
+  pool_stats.layers_used--;
+
+  for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+    if (layer_pool[i].output == output) {
+      layers_changed |= (1 << output);
+      return;
+    }
+  }
+
+  PixelUtil *pixels = (PixelUtil *)objects[output];
+  memcpy(pixels->leds, layer_base[output], pixels->numPixels() * sizeof (CRGB));
+  free(layer_base[output]);
+  layer_base[output] = NULL;
+  layers_changed |= (1 << output);
+}
+
+/* Stop all layers on an output */
+void ProgramManager::free_layers(byte output) {
+  for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+    if (layer_pool[i].output == output) {
+      free_layer(&layer_pool[i]);
+    }
+  }
+}
+
+/* Blend a layer's pixel onto the one below it */
+static inline CRGB blend_pixel(CRGB below, const CRGB &above, byte mode,
+                               byte alpha) {
+  switch (mode) {
+    case HMTL_BLEND_ADD: {
+      below += above;
+      return below;
+    }
+    case HMTL_BLEND_MAX: {
+      if (above.r > below.r) below.r = above.r;
+      if (above.g > below.g) below.g = above.g;
+      if (above.b > below.b) below.b = above.b;
+      return below;
+    }
+    case HMTL_BLEND_ALPHA: {
+      return blend(below, above, alpha);
+    }
+    default: {
+      return above;
+    }
+  }
+}
+
+/*
+ * Composite an output's base layer and its layers, ordered by layer number,
+ * onto the strip in a single pass.
+ */
+void ProgramManager::composite(byte output) {
+  program_layer_t *stack[PROGRAM_MANAGER_LAYERS];
+  byte depth = 0;
+  for (byte i = 0; i < PROGRAM_MANAGER_LAYERS; i++) {
+    program_layer_t *layer = &layer_pool[i];
+    if (layer->output != output) continue;
+
+    byte pos = depth++;
+    while ((pos > 0) && (stack[pos - 1]->layer > layer->layer)) {
+      stack[pos] = stack[pos - 1];
+      pos--;
+    }
+    stack[pos] = layer;
+  }
+
+  PixelUtil *pixels = (PixelUtil *)objects[output];
+  CRGB *strip = pixels->leds;
+  CRGB *base = layer_base[output];
+  uint16_t num_pixels = pixels->numPixels();
+
+  for (uint16_t led = 0; led < num_pixels; led++) {
+    CRGB color = base[led];
+    for (byte l = 0; l < depth; l++) {
+      program_layer_t *layer = stack[l];
+      if ((uint16_t)(led - layer->start) < layer->length) {
+        color = blend_pixel(color, layer->pixels[led], layer->blend,
+                            layer->alpha);
+      }
+    }
+    strip[led] = color;
+  }
+}
+
 /*
  * Run a single program without an object or tracker.  This is used for
  * providing custom sensor handlers (PROGRAM_SENSOR_DATA) and similar
@@ -288,7 +794,10 @@ uint16_t ProgramManager::run() {
 boolean ProgramManager::run_program(byte type, void *arg) {
   byte program = lookup_function(type);
   if (program != NO_PROGRAM) {
-    functions[program].program(NULL, arg, NULL);
+    hmtl_program_func function = program_function(program);
+    if (function != NULL) {
+      function(NULL, arg, NULL);
+    }
   }
 
   return false;
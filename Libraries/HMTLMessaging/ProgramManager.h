@@ -11,6 +11,7 @@
 #define PROGRAMMANAGER_H
 
 #include "HMTLMessaging.h"
+#include "PixelUtil.h"
 #include "TimeSync.h"
 
 /* Provide access to a time synchronization object */
@@ -37,6 +38,18 @@ typedef struct {
   hmtl_program_setup setup;
 } hmtl_program_t;
 
+/*
+ * A program registry is a table of programs in PROGMEM along with an index
+ * from each program type to its entry, both built at compile time by
+ * HMTL_PROGRAM_REGISTRY() so that looking up a program is a single read.
+ */
+typedef struct {
+  const hmtl_program_t *programs; // PROGMEM
+  const byte *index;              // PROGMEM, entry for each type < num_types
+  byte num_programs;
+  uint16_t num_types;
+} hmtl_program_registry_t;
+
 #define PROGRAM_TRACKER_DONE  0x1 // The running program has completed
 
 // The program state should be deallocated when done
@@ -54,6 +67,110 @@ struct program_tracker {
 #define IS_RUNNING_PROGRAM(tracker) \
   ((tracker != NULL) && (tracker->program_index != NO_PROGRAM))
 
+/*******************************************************************************
+ * Fixed pools for program trackers and state.  Each output has a dedicated
+ * tracker and program state is taken from a set of fixed-size slots, so
+ * starting and stopping programs never touches the heap.
+ */
+
+#ifndef PROGRAM_MANAGER_MAX_OUTPUTS
+  #define PROGRAM_MANAGER_MAX_OUTPUTS HMTL_MAX_OUTPUTS
+#endif
+
+/*
+ * Segments are virtual outputs covering a range of a pixel output, see
+ * hmtl_setup_segments().  Each segment has its own tracker and its program
+ * draws into its range of the shared strip after the output's own program.
+ */
+#ifndef PROGRAM_MANAGER_SEGMENTS
+  #define PROGRAM_MANAGER_SEGMENTS HMTL_MAX_SEGMENTS
+#endif
+
+/*
+ * Number of state slots.  Each output, segment and layer runs at most one
+ * program, so by default there is a slot for every one of them and a
+ * program's state is never refused.
+ */
+#ifndef PROGRAM_STATE_SLOTS
+  #define PROGRAM_STATE_SLOTS (PROGRAM_MANAGER_MAX_OUTPUTS + \
+                               PROGRAM_MANAGER_SEGMENTS + \
+                               PROGRAM_MANAGER_LAYERS)
+#endif
+
+/*
+ * Size of each state slot, this must be at least as large as the largest
+ * program state structure.  Use PROGRAM_STATE_CHECK() to verify this at
+ * compile time for each state type.
+ */
+#ifndef PROGRAM_STATE_SIZE
+  #if defined(__AVR__)
+    #define PROGRAM_STATE_SIZE 20
+  #else
+    #define PROGRAM_STATE_SIZE 32 // Allow for wider alignment
+  #endif
+#endif
+
+#define PROGRAM_STATE_CHECK(type) \
+  static_assert(sizeof (type) <= PROGRAM_STATE_SIZE, \
+                #type " is larger than PROGRAM_STATE_SIZE")
+
+typedef union {
+  byte data[PROGRAM_STATE_SIZE];
+  unsigned long align;
+} program_state_slot_t;
+
+/*
+ * Layers let several programs run on one pixel output.  The output's own
+ * program is its base, and each layer runs a program into its own copy of
+ * the strip.  When any of them update, the base and layers are composited
+ * onto the strip in a single pass, each layer blended onto the ones below it
+ * within its range of pixels.  Layer pixels are taken from the heap while an
+ * output has layers, and layers are only started on outputs of up to
+ * PROGRAM_MANAGER_LAYER_PIXELS pixels so that the heap used stays bounded.
+ */
+#ifndef PROGRAM_MANAGER_LAYERS
+  #if defined(__AVR__)
+    #define PROGRAM_MANAGER_LAYERS 1
+  #else
+    #define PROGRAM_MANAGER_LAYERS 4
+  #endif
+#endif
+
+#ifndef PROGRAM_MANAGER_LAYER_PIXELS
+  #if defined(__AVR__)
+    #define PROGRAM_MANAGER_LAYER_PIXELS 128
+  #else
+    #define PROGRAM_MANAGER_LAYER_PIXELS 0xFFFF
+  #endif
+#endif
+
+typedef struct {
+  byte output;          // HMTL_NO_OUTPUT when unused
+  byte layer;           // Layers are composited from the lowest number up
+  byte blend;
+  byte alpha;
+  uint16_t start;
+  uint16_t length;
+  CRGB *pixels;         // The layer's copy of the strip
+  program_tracker_t tracker;
+} program_layer_t;
+
+typedef uint32_t program_state_mask_t;
+static_assert(PROGRAM_STATE_SLOTS <= sizeof (program_state_mask_t) * 8,
+              "PROGRAM_STATE_SLOTS exceeds the allocation mask");
+
+/* Usage and high-water marks for the tracker and state pools */
+typedef struct {
+  byte trackers_used;
+  byte trackers_max;
+  byte states_used;
+  byte states_max;
+  byte state_size_max;  // Largest state size requested
+  byte states_failed;   // States refused as too large or with no free slot
+  byte layers_used;
+  byte layers_max;
+} program_pool_stats_t;
+
 /*******************************************************************************
  * Program tracking, configuration, etc
  */
@@ -67,7 +184,7 @@ class ProgramManager {
                  program_tracker_t **_trackers,
                  void **_objects,
                  byte _num_outputs,
-                 hmtl_program_t *_functions, byte _num_programs);
+                 const hmtl_program_registry_t *_registry);
 
   boolean handle_msg(msg_program_t *msg);
 
@@ -75,6 +192,10 @@ class ProgramManager {
 
   uint16_t run();
 
+  void set_segments(hmtl_segment_t *_segments, byte _num_segments);
+  hmtl_segment_t *lookup_segment(byte output);
+  uint16_t output_bit(byte output);
+
   output_hdr_t **outputs;
   void **objects;
   byte num_outputs;
@@ -87,16 +208,141 @@ class ProgramManager {
                           void *preallocated = nullptr);
   void free_program_state(program_tracker_t *tracker);
 
+  /* Stop all layers on a pixel output */
+  void free_layers(byte output);
+
+  /*
+   * Hold the updates of the pixel output that an output or segment is on,
+   * such as while a streamed frame is only partly received.  Its bit is left
+   * out of run() and hold_updates() until release_output(), which returns it
+   * if the output was changed meanwhile.
+   */
+  void hold_output(byte output);
+  uint16_t release_output(byte output);
+  uint16_t hold_updates(uint16_t updated);
+
+  program_pool_stats_t pool_stats;
+
  private:
-  program_tracker_t* get_tracker(int index);
-  void free_tracker(int index);
+  program_tracker_t **tracker_slot(byte output);
+  program_tracker_t* get_tracker(byte output);
+  void free_tracker(byte output);
+  boolean run_tracker(byte output, output_hdr_t *hdr, void *object);
 
   byte lookup_function(byte type);
+  hmtl_program_func program_function(byte program);
+  hmtl_program_setup setup_function(byte program);
 
-  hmtl_program_t *functions;
-  byte num_programs;
+  boolean start_layer(byte output, msg_program_t *msg);
+  program_layer_t *find_layer(byte output, byte layer);
+  void free_layer(program_layer_t *layer);
+  void composite(byte output);
+
+  const hmtl_program_registry_t *registry;
 
   program_tracker_t **trackers;
+
+  hmtl_segment_t *segments;
+  byte num_segments;
+  program_tracker_t *segment_trackers[PROGRAM_MANAGER_SEGMENTS];
+
+  program_tracker_t tracker_pool[PROGRAM_MANAGER_MAX_OUTPUTS +
+                                 PROGRAM_MANAGER_SEGMENTS];
+  program_state_slot_t state_pool[PROGRAM_STATE_SLOTS];
+  program_state_mask_t states_allocated;
+
+  program_layer_t layer_pool[PROGRAM_MANAGER_LAYERS];
+  CRGB *layer_base[PROGRAM_MANAGER_MAX_OUTPUTS]; // Base of outputs with layers
+  uint16_t layers_changed; // Outputs to composite after a layer change
+
+  uint16_t held_outputs;   // Outputs whose updates are held
+  uint16_t held_updates;   // Held outputs that have changed
+};
+
+/*******************************************************************************
+ * Compile-time program registry
+ *
+ *   HMTL_PROGRAM_REGISTRY(module_programs,
+ *     { HMTL_PROGRAM_NONE, NULL, NULL },
+ *     { HMTL_PROGRAM_BLINK, program_blink, program_blink_init },
+ *   );
+ *   manager = ProgramManager(outputs, trackers, objects, num_outputs,
+ *                            &module_programs);
+ *
+ * The index covers types up to the largest in the table, and a type that is
+ * listed more than once fails to compile.
+ */
+
+/* Entry of the program with a type among the first count, or NO_PROGRAM */
+constexpr byte hmtl_program_find(const hmtl_program_t *programs, byte count,
+                                 byte type, byte i = 0) {
+  return (i >= count) ? ProgramManager::NO_PROGRAM :
+         (programs[i].type == type) ? i :
+         hmtl_program_find(programs, count, type, i + 1);
+}
+
+constexpr boolean hmtl_programs_unique(const hmtl_program_t *programs,
+                                       byte count, byte i = 0) {
+  return (i >= count) ||
+         ((hmtl_program_find(programs, i, programs[i].type) ==
+           ProgramManager::NO_PROGRAM) &&
+          hmtl_programs_unique(programs, count, i + 1));
+}
+
+constexpr uint16_t hmtl_program_types(const hmtl_program_t *programs,
+                                      byte count, byte i = 0,
+                                      uint16_t types = 0) {
+  return (i >= count) ? types :
+         hmtl_program_types(programs, count, i + 1,
+                            (programs[i].type >= types) ?
+                            programs[i].type + 1 : types);
+}
+
+/* Sequence of the program types 0 to N - 1, for building the index */
+template <byte... types> struct hmtl_program_type_seq {};
+
+template <uint16_t N, byte... types>
+struct hmtl_program_make_types :
+        hmtl_program_make_types<N - 1, N - 1, types...> {};
+
+template <byte... types>
+struct hmtl_program_make_types<0, types...> {
+  typedef hmtl_program_type_seq<types...> seq;
+};
+
+template <uint16_t N>
+struct hmtl_program_index_t {
+  byte index[N];
 };
 
+template <byte... types>
+constexpr hmtl_program_index_t<sizeof...(types)>
+hmtl_program_make_index(const hmtl_program_t *programs, byte count,
+                        hmtl_program_type_seq<types...>) {
+  return {{ hmtl_program_find(programs, count, types)... }};
+}
+
+#define HMTL_PROGRAM_COUNT(programs) \
+  (sizeof (programs) / sizeof (hmtl_program_t))
+
+#define HMTL_PROGRAM_REGISTRY(name, ...)                                      \
+  constexpr hmtl_program_t name##_programs[] PROGMEM = { __VA_ARGS__ };       \
+  static_assert(HMTL_PROGRAM_COUNT(name##_programs) <                         \
+                ProgramManager::NO_PROGRAM,                                   \
+                #name " has too many programs");                              \
+  static_assert(hmtl_programs_unique(name##_programs,                         \
+                                     HMTL_PROGRAM_COUNT(name##_programs)),    \
+                #name " lists a program type more than once");                \
+  constexpr hmtl_program_index_t<                                             \
+    hmtl_program_types(name##_programs, HMTL_PROGRAM_COUNT(name##_programs))> \
+  name##_index PROGMEM = hmtl_program_make_index(                             \
+    name##_programs, HMTL_PROGRAM_COUNT(name##_programs),                     \
+    hmtl_program_make_types<                                                  \
+      hmtl_program_types(name##_programs,                                     \
+                         HMTL_PROGRAM_COUNT(name##_programs))>::seq());       \
+  const hmtl_program_registry_t name = {                                      \
+    name##_programs, name##_index.index,                                      \
+    HMTL_PROGRAM_COUNT(name##_programs), sizeof (name##_index.index)          \
+  }
+
 #endif
@@ -15,6 +15,7 @@
 
 #ifdef USE_PIXELUTIL
 #include "PixelUtil.h"
+#include "PalettePixels.h"
 #warning USE_PIXELUTIL is enabled
 #else
 #warning USE_PIXELUTIL is disabled
@@ -51,6 +52,10 @@ int hmtl_output_size(output_hdr_t *output)
 #ifdef USE_PIXELUTIL
     case HMTL_OUTPUT_PIXELS:
     return sizeof (config_pixels_t);
+    case HMTL_OUTPUT_SEGMENTS:
+    return sizeof (config_segments_t);
+    case HMTL_OUTPUT_PALETTE:
+    return sizeof (config_palette_t);
 #endif
 #ifdef USE_MPR121
     case HMTL_OUTPUT_MPR121:
@@ -174,6 +179,52 @@ int hmtl_write_config(config_hdr_t *hdr, output_hdr_t *outputs[])
   return addr;
 }
 
+/*
+ * Read the scene store header that follows the config, returning the EEProm
+ * address of the first program record.
+ */
+int hmtl_read_scenes(int addr, config_scenes_t *scenes)
+{
+  if (addr <= 0) {
+    return -1;
+  }
+
+  addr = EEPROM_safe_read(addr, (uint8_t *)scenes, sizeof (config_scenes_t));
+  if (addr < 0) {
+    DEBUG4_PRINTLN("hmtl_read_scenes: no scene store");
+    return -1;
+  }
+
+  if (scenes->magic != HMTL_SCENE_MAGIC) {
+    DEBUG4_PRINTLN("hmtl_read_scenes: invalid magic");
+    return -2;
+  }
+
+  return addr;
+}
+
+/*
+ * Write the scene store header, returning the EEProm address following it.
+ */
+int hmtl_write_scenes(int addr, config_scenes_t *scenes)
+{
+  EEPROM_init();
+
+  scenes->magic = HMTL_SCENE_MAGIC;
+  addr = EEPROM_safe_write(addr, (uint8_t *)scenes, sizeof (config_scenes_t));
+  if (addr < 0) {
+    DEBUG_ERR("hmtl_write_scenes: failed to write scenes to EEProm");
+    return -1;
+  }
+
+  EEPROM_end();
+
+  DEBUG2_VALUE("hmtl_write_scenes: programs=", scenes->num_programs);
+  DEBUG2_VALUELN(" boot=", scenes->boot_scene);
+
+  return addr;
+}
+
 /* Initialized the pins of an output */
 int hmtl_setup_output(config_hdr_t *config, output_hdr_t *hdr, void *data)
 {
@@ -220,6 +271,29 @@ int hmtl_setup_output(config_hdr_t *config, output_hdr_t *hdr, void *data)
         }
         break;
       }
+    case HMTL_OUTPUT_SEGMENTS:
+      {
+        // Segments are setup by hmtl_setup_segments()
+        DEBUG4_PRINT(" segments");
+        break;
+      }
+    case HMTL_OUTPUT_PALETTE:
+      {
+        DEBUG4_PRINT(" palette");
+        if (data != NULL) {
+          config_palette_t *out = (config_palette_t *)hdr;
+          DEBUG4_VALUE(" num:", out->numPixels);
+
+          PalettePixels *palette = (PalettePixels *)data;
+          if (!palette->init(out->numPixels, out->bits, out->type)) {
+            return -1;
+          }
+        } else {
+          DEBUG_ERR("Expected PalettePixels data struct for palette configs");
+          return -1;
+        }
+        break;
+      }
 #endif
 #ifdef USE_MPR121
     case HMTL_OUTPUT_MPR121:
@@ -345,6 +419,21 @@ int hmtl_update_output(output_hdr_t *hdr, void *data)
           PixelUtil *pixels = (PixelUtil *)data;
           pixels->update();
         }
+#endif
+        break;
+      }
+    case HMTL_OUTPUT_SEGMENTS:
+      {
+        // Segments are updated with their pixel output
+        break;
+      }
+    case HMTL_OUTPUT_PALETTE:
+      {
+#ifdef USE_PIXELUTIL
+        if (data) {
+          PalettePixels *palette = (PalettePixels *)data;
+          palette->update();
+        }
 #endif
         break;
       }
@@ -398,6 +487,25 @@ void hmtl_set_output_rgb(output_hdr_t *output, void *object, uint8_t value[3]) {
 #ifdef USE_PIXELUTIL
       PixelUtil *pixels = (PixelUtil *)object;
       pixels->setAllRGB(value[0], value[1], value[2]);
+#endif
+      break;
+    }
+    case HMTL_OUTPUT_SEGMENT: {
+#ifdef USE_PIXELUTIL
+      hmtl_segment_t *segment = (hmtl_segment_t *)output;
+      PixelUtil *pixels = (PixelUtil *)object;
+      pixel_range_t range;
+      range.start = segment->start;
+      range.length = segment->length;
+      pixels->setRangeRGB(range, CRGB(value[0], value[1], value[2]));
+#endif
+      break;
+    }
+    case HMTL_OUTPUT_PALETTE: {
+#ifdef USE_PIXELUTIL
+      PalettePixels *palette = (PalettePixels *)object;
+      palette->setAll(palette->nearestIndex(CRGB(value[0], value[1],
+                                                 value[2])));
 #endif
       break;
     }
@@ -464,6 +572,14 @@ boolean hmtl_validate_pixels(config_pixels_t *pixels) {
   return true;
 }
 
+boolean hmtl_validate_palette(config_palette_t *palette) {
+  if ((palette->clockPin > MAX_PIN_NUM) && (palette->clockPin != (uint8_t)-1)) return false;
+  if (palette->dataPin > MAX_PIN_NUM) return false;
+  if (palette->clockPin == palette->dataPin) return false;
+  if ((palette->bits != 4) && (palette->bits != 8)) return false;
+  return true;
+}
+
 boolean hmtl_validate_mpr121(config_mpr121_t *mpr121) {
   if (mpr121->irqPin > MAX_PIN_NUM) return false;
   return true;
@@ -485,6 +601,13 @@ boolean hmtl_validate_xbee(config_xbee_t *xbee) {
   return true;
 }
 
+boolean hmtl_validate_segments(config_segments_t *segments) {
+  if ((segments->count == 0) || (segments->length == 0)) return false;
+  if ((uint32_t)segments->start +
+      (uint32_t)segments->length * segments->count > (uint16_t)-1) return false;
+  return true;
+}
+
 boolean hmtl_validate_config(config_hdr_t *hdr, output_hdr_t *outputs[],
                              int num_outputs) {
   uint32_t pinmap = 0;
@@ -529,6 +652,17 @@ boolean hmtl_validate_config(config_hdr_t *hdr, output_hdr_t *outputs[],
         pinmap |= pinbit;
         break;
       }
+      case HMTL_OUTPUT_PALETTE: {
+        config_palette_t *out2 = (config_palette_t *)out;
+        if (!hmtl_validate_palette(out2)) goto VALIDATE_ERROR;
+        pinbit = (1 << out2->clockPin);
+        if (pinmap & pinbit) goto PIN_ERROR;
+        pinmap |= pinbit;
+        pinbit = (1 << out2->dataPin);
+        if (pinmap & pinbit) goto PIN_ERROR;
+        pinmap |= pinbit;
+        break;
+      }
       case HMTL_OUTPUT_MPR121: {
         config_mpr121_t *out2 = (config_mpr121_t *)out;
         if (!hmtl_validate_mpr121(out2)) goto VALIDATE_ERROR;
@@ -565,6 +699,20 @@ boolean hmtl_validate_config(config_hdr_t *hdr, output_hdr_t *outputs[],
         pinmap |= pinbit;
         break;
       }
+      case HMTL_OUTPUT_SEGMENTS: {
+        /* The segments must fit on the pixel output they split */
+        config_segments_t *out2 = (config_segments_t *)out;
+        if (!hmtl_validate_segments(out2)) goto VALIDATE_ERROR;
+        if (out2->pixels_output >= num_outputs) goto VALIDATE_ERROR;
+        config_pixels_t *pixels =
+                (config_pixels_t *)outputs[out2->pixels_output];
+        if ((pixels == NULL) || (pixels->hdr.type != HMTL_OUTPUT_PIXELS) ||
+            (out2->start + (uint32_t)out2->length * out2->count >
+             pixels->numPixels)) {
+          goto VALIDATE_ERROR;
+        }
+        break;
+      }
 
       default: {
         DEBUG_ERR("Invalid output type");
@@ -670,6 +818,25 @@ void hmtl_print_output(output_hdr_t *out) {
         DEBUG_PRINT_END();
         break;
       }
+    case HMTL_OUTPUT_SEGMENTS:
+      {
+        config_segments_t *out2 = (config_segments_t *)out;
+        DEBUG3_VALUE("segments pixels=", out2->pixels_output);
+        DEBUG3_VALUE(" start=", out2->start);
+        DEBUG3_VALUE(" length=", out2->length);
+        DEBUG3_VALUELN(" count=", out2->count);
+        break;
+      }
+    case HMTL_OUTPUT_PALETTE:
+      {
+        config_palette_t *out2 = (config_palette_t *)out;
+        DEBUG3_VALUE("palette clock=", out2->clockPin);
+        DEBUG3_VALUE(" data=", out2->dataPin);
+        DEBUG3_VALUE(" num=", out2->numPixels);
+        DEBUG3_VALUE(" type=", out2->type);
+        DEBUG3_VALUELN(" bits=", out2->bits);
+        break;
+      }
     default:
       {
         DEBUG3_PRINTLN("Unknown type");
@@ -762,6 +929,10 @@ int32_t hmtl_setup(config_hdr_t *config,
         data = pixels;
         break;
       }
+      case HMTL_OUTPUT_PALETTE: {
+        // Palette outputs are setup by hmtl_setup_palette()
+        continue;
+      }
 #endif
 #ifdef USE_RS485
       case HMTL_OUTPUT_RS485: {
@@ -806,3 +977,74 @@ int32_t hmtl_setup(config_hdr_t *config,
 
   return outputs_found;
 }
+
+/*
+ * Build the segments defined in a config that has been read by hmtl_setup(),
+ * returning the number of segments.  Segment n is addressed as output
+ * HMTL_SEGMENT_OUTPUT(n).
+ */
+int hmtl_setup_segments(config_hdr_t *config, config_max_t readoutputs[],
+                        hmtl_segment_t segments[], byte max_segments) {
+  int num_segments = 0;
+
+  for (int i = 0; i < config->num_outputs; i++) {
+    config_segments_t *out = (config_segments_t *)&readoutputs[i];
+    if (out->hdr.type != HMTL_OUTPUT_SEGMENTS) continue;
+
+    config_pixels_t *pixels = NULL;
+    if (out->pixels_output < config->num_outputs) {
+      pixels = (config_pixels_t *)&readoutputs[out->pixels_output];
+    }
+    if ((pixels == NULL) || (pixels->hdr.type != HMTL_OUTPUT_PIXELS) ||
+        !hmtl_validate_segments(out) ||
+        (out->start + (uint32_t)out->length * out->count > pixels->numPixels)) {
+      DEBUG1_VALUELN("hmtl_setup_segments: invalid segments:", i);
+      continue;
+    }
+
+    for (byte c = 0; c < out->count; c++) {
+      if (num_segments >= max_segments) {
+        DEBUG1_VALUELN("hmtl_setup_segments: too many segments:", i);
+        return num_segments;
+      }
+
+      hmtl_segment_t *segment = &segments[num_segments];
+      segment->hdr.type = HMTL_OUTPUT_SEGMENT;
+      segment->hdr.output = HMTL_SEGMENT_OUTPUT(num_segments);
+      segment->pixels_output = out->pixels_output;
+      segment->start = out->start + c * out->length;
+      segment->length = out->length;
+      num_segments++;
+    }
+  }
+
+  DEBUG2_VALUELN("hmtl_setup_segments: segments=", num_segments);
+
+  return num_segments;
+}
+
+/*
+ * Setup the first palette output in a config that has been read by
+ * hmtl_setup() with a PalettePixels object, returning its output number or -1
+ * if there is none.
+ */
+int hmtl_setup_palette(config_hdr_t *config, config_max_t readoutputs[],
+                       void *objects[], void *palette) {
+#ifdef USE_PIXELUTIL
+  for (int i = 0; i < config->num_outputs; i++) {
+    output_hdr_t *out = (output_hdr_t *)&readoutputs[i];
+    if (out->type != HMTL_OUTPUT_PALETTE) continue;
+
+    if (hmtl_setup_output(config, out, palette) < 0) {
+      DEBUG1_VALUELN("hmtl_setup_palette: invalid palette:", i);
+      return -1;
+    }
+    if (objects) objects[i] = palette;
+
+    DEBUG2_VALUELN("hmtl_setup_palette: output=", i);
+    return i;
+  }
+#endif
+
+  return -1;
+}
@@ -99,18 +99,35 @@ typedef struct {
 #define HMTL_OUTPUT_MPR121  0x5
 #define HMTL_OUTPUT_RS485   0x6
 #define HMTL_OUTPUT_XBEE    0x7
+#define HMTL_OUTPUT_SEGMENTS 0x8 // Config record for segments of a pixel output
+#define HMTL_OUTPUT_SEGMENT  0x9 // A single segment, built from the config
+#define HMTL_OUTPUT_PALETTE  0xA // Pixels with a palette-indexed framebuffer
 
 #define IS_HMTL_RGB_OUTPUT(out) \
   ((out == HMTL_OUTPUT_VALUE) || \
    (out == HMTL_OUTPUT_RGB) || \
-   (out == HMTL_OUTPUT_PIXELS))
+   (out == HMTL_OUTPUT_PIXELS) || \
+   (out == HMTL_OUTPUT_SEGMENT) || \
+   (out == HMTL_OUTPUT_PALETTE))
 
 #define IS_HMTL_PIXEL_OUTPUT(out) \
-  ((out == HMTL_OUTPUT_PIXELS))
+  ((out == HMTL_OUTPUT_PIXELS) || \
+   (out == HMTL_OUTPUT_SEGMENT))
 
 #define HMTL_FLAG_MASTER 0x1
 #define HMTL_FLAG_SERIAL 0x2
 
+/*
+ * The upper bits of the config flags hold the output frame period in units
+ * of HMTL_FRAME_UNIT_MS, with 0 indicating no fixed frame rate.
+ */
+#define HMTL_FLAG_FRAME_MASK  0xF0
+#define HMTL_FLAG_FRAME_SHIFT 4
+#define HMTL_FRAME_UNIT_MS    4
+#define HMTL_FRAME_PERIOD(flags) \
+  ((((flags) & HMTL_FLAG_FRAME_MASK) >> HMTL_FLAG_FRAME_SHIFT) * \
+   HMTL_FRAME_UNIT_MS)
+
 #define HMTL_NO_OUTPUT (uint8_t)-1
 #define HMTL_ALL_OUTPUTS (uint8_t)-2
 
@@ -140,6 +157,21 @@ typedef struct __attribute__((__packed__)) {
   byte type;
 } config_pixels_t;
 
+/*
+ * A pixel strip that stores a 4 or 8 bit palette index per pixel in place of
+ * RGB values, see PalettePixels.h.  Programs that support palette outputs
+ * draw palette indices, and other colors are set to the nearest palette
+ * entry.
+ */
+typedef struct __attribute__((__packed__)) {
+  output_hdr_t hdr;
+  byte clockPin;
+  byte dataPin;
+  uint16_t numPixels;
+  byte type;            // PALETTE_TYPE_APA102 or PALETTE_TYPE_WS2801
+  byte bits;            // Bits per pixel, 4 or 8
+} config_palette_t;
+
 // This should be MPR121::MAX_SENSORS, but we don't want to include that here
 #define MAX_MPR121_PINS 12
 typedef struct __attribute__((__packed__)) {
@@ -164,14 +196,85 @@ typedef struct __attribute__((__packed__)) {
   byte xmitPin;
 } config_xbee_t;
 
+/*
+ * Segments split a pixel output into virtual outputs that each run their own
+ * programs over a range of the strip.  A config record defines count
+ * consecutive segments of length pixels beginning at start, and segments are
+ * numbered from HMTL_SEGMENT_OUTPUT(0) in the order they are configured.
+ */
+typedef struct __attribute__((__packed__)) {
+  output_hdr_t hdr;
+  byte pixels_output;   // Output number of the pixel output to split
+  uint16_t start;
+  uint16_t length;
+  byte count;
+} config_segments_t;
+
+typedef struct __attribute__((__packed__)) {
+  output_hdr_t hdr;     // Type HMTL_OUTPUT_SEGMENT and the segment's output
+  byte pixels_output;
+  uint16_t start;
+  uint16_t length;
+} hmtl_segment_t;
+
+#ifndef HMTL_MAX_SEGMENTS
+  #if defined(__AVR__)
+    #define HMTL_MAX_SEGMENTS 4
+  #else
+    #define HMTL_MAX_SEGMENTS 16
+  #endif
+#endif
+
+#define HMTL_SEGMENT_OUTPUT(n) (HMTL_MAX_OUTPUTS + (n))
+#define IS_HMTL_SEGMENT_OUTPUT(out) \
+  (((out) >= HMTL_MAX_OUTPUTS) && \
+   ((out) < HMTL_MAX_OUTPUTS + HMTL_MAX_SEGMENTS))
+
 typedef config_mpr121_t config_max_t; // Set to the largest output structure
 
+/*
+ * Scene store
+ *
+ * Scenes are sets of program messages kept in EEPROM directly after the
+ * configuration records, so that a single MSG_TYPE_SCENE message can start
+ * every program of a scene and the boot scene can be started without a host.
+ * The store is a config_scenes_t record followed by num_programs program
+ * records, each the scene number followed by the body of a program message
+ * (a scene_program_t, see HMTLMessaging.h).  The records of a scene must be
+ * consecutive.  Values past the end of a record are zero, so trailing zero
+ * values needn't be stored.
+ */
+#define HMTL_SCENE_MAGIC 0x5D
+#define HMTL_SCENE_NONE  (uint8_t)-1 // No boot scene
+
+typedef struct {
+  uint8_t magic;
+  uint8_t num_programs;
+  uint8_t boot_scene;
+} config_scenes_t;
+
+// Length of a program record with no values, and with all 32 values
+#define HMTL_SCENE_RECORD_MIN (1 + sizeof (output_hdr_t) + 1)
+#define HMTL_SCENE_RECORD_MAX (HMTL_SCENE_RECORD_MIN + 32)
+
 /* Dump the entire raw configuration to serial */
 void hmtl_dump_config();
 
 int hmtl_read_config(config_hdr_t *hdr, config_max_t outputs[],
                      int max_outputs);
 
+/*
+ * Read the header of the scene store at addr, returning the address of the
+ * first program record or a negative value if there's no valid store.
+ */
+int hmtl_read_scenes(int addr, config_scenes_t *scenes);
+
+/*
+ * Write the header of the scene store at addr, returning the address
+ * following it.  The program records are written following it.
+ */
+int hmtl_write_scenes(int addr, config_scenes_t *scenes);
+
 int32_t hmtl_setup(config_hdr_t *config, 
                    config_max_t readoutputs[], output_hdr_t *outputs[], 
                    void *objects[], byte num_outputs, 
@@ -179,6 +282,12 @@ int32_t hmtl_setup(config_hdr_t *config,
                    config_rgb_t *rgb_output, config_value_t *value_output,
                    int *configOffset);
 
+int hmtl_setup_segments(config_hdr_t *config, config_max_t readoutputs[],
+                        hmtl_segment_t segments[], byte max_segments);
+
+int hmtl_setup_palette(config_hdr_t *config, config_max_t readoutputs[],
+                       void *objects[], void *palette);
+
 int hmtl_write_config(config_hdr_t *hdr, output_hdr_t *outputs[]);
 int hmtl_setup_output(config_hdr_t *config, output_hdr_t *hdr, void *data);
 int hmtl_update_output(output_hdr_t *hdr, void *data);
@@ -195,6 +304,8 @@ boolean hmtl_validate_pixels(config_pixels_t *pixels);
 boolean hmtl_validate_mpr121(config_mpr121_t *mpr121);
 boolean hmtl_validate_rs485(config_rs485_t *rs485);
 boolean hmtl_validate_xbee(config_xbee_t *xbee);
+boolean hmtl_validate_segments(config_segments_t *segments);
+boolean hmtl_validate_palette(config_palette_t *palette);
 boolean hmtl_validate_config(config_hdr_t *config_hdr, output_hdr_t *outputs[],
                              int num_outputs);
 
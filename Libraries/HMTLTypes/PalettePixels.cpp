@@ -0,0 +1,289 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Palette-indexed pixel framebuffer
+ ******************************************************************************/
+
+#include <Arduino.h>
+
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_ERROR
+#endif
+#include "Debug.h"
+
+#include "PalettePixels.h"
+
+#ifdef ARDUINO
+  #include <SPI.h>
+#endif
+
+/*
+ * The default palette's hues are entries 1 through PALETTE_SIZE - 2, with the
+ * last of them repeating the first hue so that the hues wrap around.
+ */
+#define PALETTE_HUE_SPANS (PALETTE_SIZE - 3)
+
+PalettePixels::PalettePixels() {
+  num_pixels = 0;
+  index_bits = BITS_8;
+  strip_type = PALETTE_TYPE_APA102;
+  indices = NULL;
+#ifdef ARDUINO
+  writer = palette_spi_write;
+#else
+  writer = NULL;
+#endif
+  writer_context = NULL;
+  defaultPalette();
+}
+
+PalettePixels::PalettePixels(uint16_t numPixels, byte bits, byte type)
+        : PalettePixels() {
+  init(numPixels, bits, type);
+}
+
+PalettePixels::~PalettePixels() {
+  free(indices);
+}
+
+boolean PalettePixels::init(uint16_t numPixels, byte bits, byte type) {
+  if ((bits != BITS_4) && (bits != BITS_8)) {
+    DEBUG1_VALUELN("PalettePixels: invalid bits:", bits);
+    return false;
+  }
+
+  free(indices);
+  indices = (byte *)calloc(bufferSize(numPixels, bits), 1);
+  if (indices == NULL) {
+    DEBUG_ERR("PalettePixels: failed to allocate indices");
+    num_pixels = 0;
+    return false;
+  }
+
+  num_pixels = numPixels;
+  index_bits = bits;
+  strip_type = type;
+
+#ifdef ARDUINO
+  SPI.begin();
+#endif
+
+  DEBUG3_VALUE("PalettePixels: pixels:", num_pixels);
+  DEBUG3_VALUELN(" bits:", index_bits);
+  return true;
+}
+
+void PalettePixels::setWriter(palette_write_t _writer, void *context) {
+  writer = _writer;
+  writer_context = context;
+}
+
+uint16_t PalettePixels::bufferSize(uint16_t numPixels, byte bits) {
+  if (bits == BITS_4) {
+    return (numPixels + 1) / 2;
+  }
+  return numPixels;
+}
+
+void PalettePixels::defaultPalette() {
+  palette[PALETTE_ENTRY_BLACK] = CRGB(0, 0, 0);
+  for (byte entry = 1; entry < PALETTE_SIZE - 1; entry++) {
+    palette[entry] = CHSV((uint16_t)(entry - 1) * 256 / PALETTE_HUE_SPANS,
+                          255, 255);
+  }
+  palette[PALETTE_ENTRY_WHITE] = CRGB(255, 255, 255);
+}
+
+/*******************************************************************************
+ * Pixel indices
+ */
+
+void PalettePixels::setIndex(uint16_t led, byte index) {
+  if (led >= num_pixels) return;
+
+  if (index_bits == BITS_4) {
+    byte *pair = &indices[led / 2];
+    if (led & 0x1) {
+      *pair = (*pair & 0x0F) | (index << 4);
+    } else {
+      *pair = (*pair & 0xF0) | (index & 0x0F);
+    }
+  } else {
+    indices[led] = index;
+  }
+}
+
+byte PalettePixels::getIndex(uint16_t led) {
+  if (led >= num_pixels) return 0;
+
+  if (index_bits == BITS_4) {
+    byte pair = indices[led / 2];
+    return (led & 0x1) ? (pair >> 4) : (pair & 0x0F);
+  }
+  return indices[led];
+}
+
+void PalettePixels::setRange(uint16_t start, uint16_t length, byte index) {
+  if (start >= num_pixels) return;
+  if (length > num_pixels - start) length = num_pixels - start;
+
+  if (index_bits == BITS_8) {
+    memset(&indices[start], index, length);
+    return;
+  }
+
+  /* Set the unpaired pixels at either end, and then whole bytes */
+  uint16_t end = start + length;
+  if ((start & 0x1) && (start < end)) {
+    setIndex(start++, index);
+  }
+  if ((end & 0x1) && (start < end)) {
+    setIndex(--end, index);
+  }
+  index &= 0x0F;
+  memset(&indices[start / 2], index | (index << 4), (end - start) / 2);
+}
+
+void PalettePixels::setAll(byte index) {
+  setRange(0, num_pixels, index);
+}
+
+byte PalettePixels::entryIndex(byte entry) {
+  entry &= (PALETTE_SIZE - 1);
+  return (index_bits == BITS_4) ? entry : (entry << 4);
+}
+
+byte PalettePixels::nearestIndex(CRGB color) {
+  byte nearest = 0;
+  uint16_t nearest_distance = (uint16_t)-1;
+  for (byte entry = 0; entry < PALETTE_SIZE; entry++) {
+    uint16_t distance = abs((int)color.r - palette[entry].r) +
+                        abs((int)color.g - palette[entry].g) +
+                        abs((int)color.b - palette[entry].b);
+    if (distance < nearest_distance) {
+      nearest = entry;
+      nearest_distance = distance;
+      if (distance == 0) break;
+    }
+  }
+  return entryIndex(nearest);
+}
+
+byte PalettePixels::hueIndex(byte hue) {
+  if (index_bits == BITS_4) {
+    return 1 + (((uint16_t)hue * PALETTE_HUE_SPANS) >> 8);
+  }
+  return 16 + (((uint16_t)hue * (PALETTE_HUE_SPANS * 16)) >> 8);
+}
+
+/*******************************************************************************
+ * Expansion to RGB
+ */
+
+CRGB PalettePixels::color(byte index) {
+  if (index_bits == BITS_4) {
+    return palette[index & 0x0F];
+  }
+
+  /* Blend in amount sixteenths of the next entry */
+  byte entry = index >> 4;
+  int8_t amount = index & 0x0F;
+  const CRGB &from = palette[entry];
+  if (amount == 0) {
+    return from;
+  }
+  const CRGB &to = palette[(entry + 1) & (PALETTE_SIZE - 1)];
+  return CRGB(from.r + (((int16_t)to.r - from.r) * amount >> 4),
+              from.g + (((int16_t)to.g - from.g) * amount >> 4),
+              from.b + (((int16_t)to.b - from.b) * amount >> 4));
+}
+
+void PalettePixels::expand(CRGB *out, uint16_t first, uint16_t count) {
+  if (first >= num_pixels) return;
+  if (count > num_pixels - first) count = num_pixels - first;
+
+  if (index_bits == BITS_4) {
+    for (uint16_t led = first; led < first + count; led++) {
+      byte pair = indices[led / 2];
+      *out++ = palette[(led & 0x1) ? (pair >> 4) : (pair & 0x0F)];
+    }
+    return;
+  }
+
+  /* Blending is only needed when the index changes, usually in runs */
+  const byte *index = &indices[first];
+  byte last = *index;
+  CRGB last_color = color(last);
+  for (uint16_t i = 0; i < count; i++, index++) {
+    if (*index != last) {
+      last = *index;
+      last_color = color(last);
+    }
+    *out++ = last_color;
+  }
+}
+
+void PalettePixels::update() {
+  if ((writer == NULL) || (indices == NULL)) return;
+
+  CRGB chunk[PALETTE_CHUNK_PIXELS];
+  uint8_t brightness = FastLED.getBrightness();
+
+  for (uint16_t first = 0; first < num_pixels;
+       first += PALETTE_CHUNK_PIXELS) {
+    uint16_t count = num_pixels - first;
+    if (count > PALETTE_CHUNK_PIXELS) count = PALETTE_CHUNK_PIXELS;
+
+    expand(chunk, first, count);
+    if (brightness != 255) {
+      for (uint16_t i = 0; i < count; i++) {
+        chunk[i].nscale8_video(brightness);
+      }
+    }
+
+    writer(this, chunk, first, count, writer_context);
+  }
+}
+
+#ifdef ARDUINO
+/*
+ * APA102 pixels are framed by a zero start frame and enough trailing clocks
+ * to push the data through the strip, WS2801 pixels latch once the clock has
+ * been idle.
+ */
+void palette_spi_write(PalettePixels *strip, const CRGB *pixels,
+                       uint16_t first, uint16_t count, void *context) {
+  boolean apa102 = (strip->type() == PALETTE_TYPE_APA102);
+
+  if (first == 0) {
+    SPI.beginTransaction(SPISettings(PALETTE_SPI_HZ, MSBFIRST, SPI_MODE0));
+    if (apa102) {
+      for (byte i = 0; i < 4; i++) SPI.transfer(0x00);
+    }
+  }
+
+  for (uint16_t i = 0; i < count; i++) {
+    if (apa102) {
+      SPI.transfer(0xFF);
+      SPI.transfer(pixels[i].b);
+      SPI.transfer(pixels[i].g);
+      SPI.transfer(pixels[i].r);
+    } else {
+      SPI.transfer(pixels[i].r);
+      SPI.transfer(pixels[i].g);
+      SPI.transfer(pixels[i].b);
+    }
+  }
+
+  if (first + count >= strip->numPixels()) {
+    if (apa102) {
+      for (uint16_t i = 0; i < (strip->numPixels() + 15) / 16; i++) {
+        SPI.transfer(0xFF);
+      }
+    }
+    SPI.endTransaction();
+  }
+}
+#endif
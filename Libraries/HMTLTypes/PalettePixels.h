@@ -0,0 +1,118 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Palette-indexed pixel framebuffer.
+ *
+ * PalettePixels keeps a 4 or 8 bit palette index per pixel rather than the 3
+ * byte CRGB that PixelUtil keeps, and only expands the indices to RGB a chunk
+ * at a time as they are written out to the strip.  A strip of N pixels takes
+ * N/2 or N bytes plus the palette, rather than 3N.
+ *
+ * The palette holds PALETTE_SIZE colors.  4 bit indices select an entry
+ * directly.  8 bit indices blend between neighboring entries as FastLED's
+ * CRGBPalette16 does, the upper nibble selecting the entry and the lower the
+ * amount of the following entry, wrapping from the last entry to the first.
+ ******************************************************************************/
+
+#ifndef PALETTEPIXELS_H
+#define PALETTEPIXELS_H
+
+#include "PixelUtil.h"
+
+#define PALETTE_SIZE 16
+
+/* Pixels expanded to RGB at a time when writing to the strip */
+#ifndef PALETTE_CHUNK_PIXELS
+  #define PALETTE_CHUNK_PIXELS 16
+#endif
+
+/* Strips driven by palette_spi_write() */
+#define PALETTE_TYPE_APA102 0
+#define PALETTE_TYPE_WS2801 1
+
+#ifndef PALETTE_SPI_HZ
+  #define PALETTE_SPI_HZ 4000000
+#endif
+
+/*
+ * Default palette entries, with the rainbow hues in between.  Programs use
+ * the nearest entry for fixed colors and the hues for hue ranges.
+ */
+#define PALETTE_ENTRY_BLACK 0
+#define PALETTE_ENTRY_WHITE (PALETTE_SIZE - 1)
+
+class PalettePixels;
+
+/*
+ * Write count expanded pixels beginning at pixel first of the strip.  Chunks
+ * are written in order, so first is 0 for the start of the strip and
+ * first + count is numPixels() for its end.
+ */
+typedef void (*palette_write_t)(PalettePixels *strip, const CRGB *pixels,
+                                uint16_t first, uint16_t count,
+                                void *context);
+
+class PalettePixels {
+ public:
+  static const byte BITS_4 = 4;
+  static const byte BITS_8 = 8;
+
+  PalettePixels();
+  PalettePixels(uint16_t numPixels, byte bits, byte type = PALETTE_TYPE_APA102);
+  ~PalettePixels();
+
+  boolean init(uint16_t numPixels, byte bits, byte type = PALETTE_TYPE_APA102);
+  void setWriter(palette_write_t writer, void *context);
+
+  /* Expand the pixels and write them to the strip */
+  void update();
+
+  uint16_t numPixels() { return num_pixels; }
+  byte bits() { return index_bits; }
+  byte type() { return strip_type; }
+
+  /* Bytes of index storage for a strip */
+  static uint16_t bufferSize(uint16_t numPixels, byte bits);
+
+  void setIndex(uint16_t led, byte index);
+  byte getIndex(uint16_t led);
+  void setRange(uint16_t start, uint16_t length, byte index);
+  void setAll(byte index);
+
+  /* Index that displays a palette entry unblended */
+  byte entryIndex(byte entry);
+
+  /* Index of the palette entry closest to a color */
+  byte nearestIndex(CRGB color);
+
+  /* Index for a hue, spread across the entries between black and white */
+  byte hueIndex(byte hue);
+
+  /* RGB value of an index, and of count pixels from first */
+  CRGB color(byte index);
+  void expand(CRGB *out, uint16_t first, uint16_t count);
+
+  /* Reset the palette to black, the rainbow hues, and white */
+  void defaultPalette();
+
+  CRGB palette[PALETTE_SIZE];
+
+ private:
+  uint16_t num_pixels;
+  byte index_bits;
+  byte strip_type;
+  byte *indices;
+
+  palette_write_t writer;
+  void *writer_context;
+};
+
+#ifdef ARDUINO
+/* Writer for APA102 and WS2801 strips on the hardware SPI pins */
+void palette_spi_write(PalettePixels *strip, const CRGB *pixels,
+                       uint16_t first, uint16_t count, void *context);
+#endif
+
+#endif
@@ -23,6 +23,8 @@
 #define HMTL_COMMAND_ADDRESS   0xE0
 #define HMTL_COMMAND_DEVICE_ID 0xE1
 #define HMTL_COMMAND_BAUD      0xE2
+#define HMTL_COMMAND_SCENE     0xE3 // Add a program record to the scene store
+#define HMTL_COMMAND_BOOT_SCENE 0xE4
 
 /* Terminator indicating that a complete command has been received */
 #define HMTL_TERMINATOR   (uint32_t)(0xFEFEFEFE)
@@ -30,6 +32,15 @@
 #define CONFIG_START_BYTE 0xFD // Beginning of a binary comand
 #define CONFIG_START_SIZE 2    // Length of a binary command
 
+/*
+ * Prefixes for sequenced serial messages, each followed by a one byte sequence
+ * number and then the HMTL message.  Sequenced messages are acknowledged
+ * cumulatively by MSG_TYPE_SERIAL_ACK messages rather than HMTL_ACK text, so
+ * that the host can have several messages outstanding.
+ */
+#define HMTL_SERIAL_SEQ      0xFB
+#define HMTL_SERIAL_SEQ_SYNC 0xFA // Restart the sequence with this message
+
 /* Socket port for when using a wifi connection */
 #define HMTL_PORT 4365
 
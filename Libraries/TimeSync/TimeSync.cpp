@@ -14,23 +14,40 @@
  * 
  * Synchronization:
  *   1) M initiates time synchronization
- *     - M sends sync initiation message (SYNC), 
- *     - M enters hot-wait mode // TODO: hot-wait not implemented
+ *     - M sends sync initiation message (SYNC),
+ *     - M enters hot-wait mode
  *   2) S receives SYNC
  *     - S sends SYNC_ACK at time=t_a
- *     - S enters hot-wait mode // TODO: hot-wait not implemented
+ *     - S enters hot-wait mode
  *   3) M receives SYNC_ACK
  *     - M sends SYNC set with time=t_s
- *     - M exits hot wait
+ *     - M sends the next SYNC, or exits hot wait after TIMESYNC_SAMPLES
  *   4) S recieves SYNC_SET at time=t_b
- *     - S sets latency = (t_b - t_a)/2 + PROCESSING TIME(calculate this?)
- *     - S sets delta = t_b - (t_s + L)
+ *     - S records the sample latency = (t_b - t_a)/2, delta = (t_s + L) - t_b
  *     - S exits hot-wait
+ *   5) S uses the sample with the lowest round trip from the burst, as the
+ *      others were delayed by processing on M or S.
  *
  * Resynchronization:
  *   1) M transmits time resync message RESYNC with time=t_r
  *   2) S receives RESYNC at time t=t_a
- *     - sets delta = t_a - (t_r + L)
+ *     - records a sample with delta = (t_r + L) - t_a
+ *
+ * Drift correction:
+ *   Once synchronized S polls M itself, sending a burst of REQUEST messages
+ *   which M answers with a REPLY carrying its time.  Each REPLY is a sample as
+ *   in step 4, and the lowest round trip one is compared against the time S
+ *   predicted.  The error over the time since the previous burst updates the
+ *   estimate of the rate difference between the clocks, which ms() applies.
+ *   The period between polls doubles while the error stays small and halves
+ *   when it grows, up to TIMESYNC_MAX_INTERVAL_MS.
+ *
+ * Hot-wait:
+ *   While an exchange is outstanding update() returns true, and the caller
+ *   should call hotWait() to handle the reply as soon as it arrives rather
+ *   than when its loop next checks the socket.  Each hotWait() polls for at
+ *   most TIMESYNC_HOT_WAIT_US, and replies that arrive while the loop is busy
+ *   elsewhere are timestamped when they are handled.
  *
  ******************************************************************************/
 
@@ -48,26 +65,84 @@
 #include "HMTLMessaging.h"
 #include "HMTLProtocol.h"
 
+
 TimeSync::TimeSync() {
-  latency = 0;
   delta = 0;
+  delta_us = 0;
+  skew = 0;
+  skew_ms = 0;
+  skew_valid = false;
+
   state = STATE_IDLE;
+  synced = false;
   last_msg_time = 0;
+  sent_us = 0;
+  latency = 0;
+  samples_left = 0;
+
+  sync_socket = NULL;
+  sync_target = SOCKET_ADDR_INVALID;
+  sync_source = SOCKET_ADDR_INVALID;
+
+  burst_open = false;
+  burst_ms = 0;
+  best_rtt = 0;
+  best_ms = 0;
+  best_delta = 0;
+  best_delta_us = 0;
+
+  sample_ms = 0;
+  interval = TIMESYNC_MIN_INTERVAL_MS;
+  next_resync_ms = 0;
 }
 
 /*
  * Set the delta to make the indicated time current
  */
 void TimeSync::set(unsigned long time) {
-  delta = time - millis();
+  unsigned long now = millis();
+  delta = time - now;
+  delta_us = 0;
+  skew_ms = now;
   DEBUG3_VALUELN("TimeSet:", delta);
 }
 
+/*
+ * Move whole milliseconds from delta_us into delta
+ */
+void TimeSync::normalize() {
+  long whole = delta_us / 1000;
+  if (delta_us % 1000 < 0) whole--;
+  delta += whole;
+  delta_us -= whole * 1000;
+}
+
+/*
+ * Return the sub-millisecond offset plus the skew correction at local time
+ * now, folding elapsed skew periods into delta_us.
+ */
+long TimeSync::offsetUs(unsigned long now) {
+  long elapsed = (int32_t)(uint32_t)(now - skew_ms);
+  if (elapsed >= SKEW_FOLD_MS) {
+    while (elapsed >= SKEW_FOLD_MS) {
+      delta_us += skew;
+      skew_ms += SKEW_FOLD_MS;
+      elapsed -= SKEW_FOLD_MS;
+    }
+    normalize();
+  }
+  return delta_us + skew * elapsed / SKEW_FOLD_MS;
+}
+
 /*
  * Return the current time adjusted based on the derived time delta
  */
 unsigned long TimeSync::ms() {
-  return millis() + delta;
+  unsigned long now = millis();
+  long adjust_us = offsetUs(now) + 500;
+  long adjust = adjust_us / 1000;
+  if (adjust_us % 1000 < 0) adjust--;
+  return now + delta + adjust;
 }
 
 unsigned long TimeSync::s() {
@@ -93,16 +168,131 @@ void TimeSync::sendSyncMsg(Socket *socket, socket_addr_t target, byte phase, int
   DEBUG3_VALUE(" time:", msg_time->timestamp);
 }
 
+/*
+ * Send the next SYNC of a burst to the synchronization target
+ */
+void TimeSync::sendSync() {
+  DEBUG3_VALUELN("SYNC to:", sync_target);
+  sendSyncMsg(sync_socket, sync_target, TIMESYNC_SYNC);
+  samples_left--;
+  last_msg_time = millis();
+  state = STATE_AWAITING_ACK;
+}
+
+/*
+ * Send the next REQUEST of a burst to the module this one is synced to
+ */
+void TimeSync::sendRequest() {
+  DEBUG4_VALUELN("REQUEST to:", sync_source);
+  sent_us = micros();
+  sendSyncMsg(sync_socket, sync_source, TIMESYNC_REQUEST);
+  samples_left--;
+  last_msg_time = millis();
+  state = STATE_AWAITING_REPLY;
+}
+
+/*
+ * Record a sample of the remote time, received at local_ms after a round trip
+ * of rtt_us.  Only the lowest round trip sample of a burst is used, except
+ * that the first sample is applied immediately if not yet synchronized.
+ */
+void TimeSync::addSample(unsigned long remote_ms, unsigned long local_ms,
+                         uint32_t rtt_us) {
+  if (burst_open && (local_ms - burst_ms > TIMESYNC_BURST_MS)) {
+    finishBurst();
+  }
+
+  if (!burst_open) {
+    burst_open = true;
+    burst_ms = local_ms;
+  } else if (rtt_us >= best_rtt) {
+    return;
+  }
+
+  best_rtt = rtt_us;
+  best_ms = local_ms;
+  best_delta = (long)(remote_ms - local_ms);
+  best_delta_us = rtt_us / 2;
+
+  if (!synced) {
+    applySample(best_ms, best_delta, best_delta_us);
+    sample_ms = best_ms;
+    synced = true;
+  }
+}
+
+void TimeSync::applySample(unsigned long local_ms, long sample_delta,
+                           long sample_delta_us) {
+  delta = sample_delta;
+  delta_us = sample_delta_us;
+  skew_ms = local_ms;
+  normalize();
+}
+
+/*
+ * Apply the best sample of a burst.  The difference between it and the time
+ * predicted by the current delta and skew is the drift since the previous
+ * burst, which updates the skew estimate and the resync interval.
+ */
+void TimeSync::finishBurst() {
+  if (!burst_open) return;
+  burst_open = false;
+
+  long predicted_us = offsetUs(best_ms);
+  long step = best_delta - delta;
+  unsigned long elapsed = best_ms - sample_ms;
+  long sample_delta_us = best_delta_us;
+
+  if ((step > TIMESYNC_STEP_MS) || (step < -TIMESYNC_STEP_MS)) {
+    DEBUG2_VALUELN("TimeSync step:", step);
+    interval = TIMESYNC_MIN_INTERVAL_MS;
+  } else if (elapsed >= TIMESYNC_MIN_INTERVAL_MS / 2) {
+    long error_us = step * 1000 + best_delta_us - predicted_us;
+
+    long drift = (long)((int64_t)error_us * 16000 / (long)elapsed);
+    skew += skew_valid ? drift / 2 : drift;
+    if (skew > TIMESYNC_MAX_SKEW_PPM * 16L) skew = TIMESYNC_MAX_SKEW_PPM * 16L;
+    if (skew < -TIMESYNC_MAX_SKEW_PPM * 16L) skew = -TIMESYNC_MAX_SKEW_PPM * 16L;
+    /*
+     * Once the skew is known the remaining error is mostly noise in the
+     * sample, so only half of it is applied.
+     */
+    if (skew_valid) sample_delta_us -= error_us / 2;
+    skew_valid = true;
+
+    long error = labs(error_us);
+    if ((error < TIMESYNC_TARGET_US) && (interval < TIMESYNC_MAX_INTERVAL_MS)) {
+      interval *= 2;
+    } else if ((error > 2 * TIMESYNC_TARGET_US) &&
+               (interval > TIMESYNC_MIN_INTERVAL_MS)) {
+      interval /= 2;
+    }
+
+    DEBUG4_VALUE("TimeSync err:", error_us);
+    DEBUG4_VALUE(" skew:", skew);
+    DEBUG4_VALUELN(" int:", interval);
+  }
+
+  applySample(best_ms, best_delta, sample_delta_us);
+  latency = best_rtt / 2;
+  sample_ms = best_ms;
+  next_resync_ms = best_ms + interval;
+}
+
 /*
  * Run the synchronization procedure
  *
  * Returns true if synchronization is ongoing and hot-wait mode should be
  * maintained.
  */
-// TODO: Static method?
 boolean TimeSync::synchronize(Socket *socket,
                               socket_addr_t target,
                               msg_hdr_t *msg_hdr) {
+  if (socket == NULL) {
+    /* Replies can't be sent, such as to messages received over serial */
+    goto EXIT;
+  }
+
   if (msg_hdr == NULL) {
     /* This was called to synchronize the times to a remote address */
     if (state != STATE_IDLE) {
@@ -111,9 +301,10 @@ boolean TimeSync::synchronize(Socket *socket,
     }
 
     /* Begin the synchronization process */
-    DEBUG3_VALUELN("SYNC to:", target);
-    sendSyncMsg(socket, target, TIMESYNC_SYNC);
-    state = STATE_AWAITING_ACK;
+    sync_socket = socket;
+    sync_target = target;
+    samples_left = TIMESYNC_SAMPLES;
+    sendSync();
   } else {
 
     if (msg_hdr->type != MSG_TYPE_TIMESYNC) {
@@ -122,6 +313,7 @@ boolean TimeSync::synchronize(Socket *socket,
     }
 
     unsigned long now = millis();
+    uint32_t now_us = micros();
     msg_time_sync_t *msg_time = (msg_time_sync_t *)(msg_hdr + 1);
     socket_addr_t source = socket->sourceFromData(msg_hdr);
 
@@ -131,34 +323,34 @@ boolean TimeSync::synchronize(Socket *socket,
           DEBUG3_VALUE("CHECK from:", source);
           DEBUG3_VALUE(" ts:", msg_time->timestamp);
           DEBUG3_VALUE(" ms:", local_now);
-          DEBUG3_VALUE(" diff:", (long)(msg_time->timestamp + latency - local_now));
+          DEBUG3_VALUE(" diff:", (long)(msg_time->timestamp + latency / 1000 - local_now));
         );
-        sendSyncMsg(socket, source, TIMESYNC_ACK, latency);
+        sendSyncMsg(socket, source, TIMESYNC_ACK, latency / 1000);
         break;
       }
 
       case TIMESYNC_SYNC: {
-        switch (state) {
-          case STATE_IDLE:
-          case STATE_SYNCED: {
-            // Record the timestamp to compute the latency
-            DEBUG3_VALUE("SYNC from:", source);
-            latency = now;
-
-            // Reply with ack
-            sendSyncMsg(socket, source, TIMESYNC_ACK);
-            state = STATE_AWAITING_SET;
-            break;
-          }
+        if (state != STATE_AWAITING_ACK) {
+          /*
+           * Reply with an ack, recording when it was sent to compute the
+           * latency.  This restarts any exchange whose SET was lost, and takes
+           * priority over this module's own REQUEST.
+           */
+          DEBUG3_VALUE("SYNC from:", source);
+          sync_socket = socket;
+          sent_us = micros();
+          sendSyncMsg(socket, source, TIMESYNC_ACK);
+          last_msg_time = now;
+          state = STATE_AWAITING_SET;
         }
 
         break;
       }
 
       case TIMESYNC_RESYNC: {
-        if (state == STATE_SYNCED) {
-          delta = (msg_time->timestamp + latency) - now;
+        if (synced) {
           DEBUG3_VALUE("RESYNC from:", source);
+          addSample(msg_time->timestamp, now, latency * 2);
           DEBUG3_VALUE(" delta:", delta);
         }
         break;
@@ -171,7 +363,19 @@ boolean TimeSync::synchronize(Socket *socket,
         if (state == STATE_AWAITING_ACK) {
           // Send TIMESYNC_SET
           sendSyncMsg(socket, source, TIMESYNC_SET);
-          state = STATE_IDLE;
+
+          /*
+           * A single target is sent the next SYNC immediately, while a
+           * broadcast waits for every module's ack and is continued by
+           * update().
+           */
+          if (sync_target != SOCKET_ADDR_ANY) {
+            if (samples_left > 0) {
+              sendSync();
+            } else {
+              state = restState();
+            }
+          }
         } else {
           DEBUG3_COMMAND(unsigned long local_now = ms();
             DEBUG3_VALUE(" ts:", msg_time->timestamp);
@@ -185,22 +389,44 @@ boolean TimeSync::synchronize(Socket *socket,
       case TIMESYNC_SET: {
         if (state == STATE_AWAITING_SET) {
           /*
-           * Set the latecy to 1/2 the time between sending the ack and receiving
-           * this message, and then use that latecy to compute the delta from
-           * the sender's time.
+           * The latency is 1/2 the time between sending the ack and receiving
+           * this message, which is used to compute the delta from the
+           * sender's time.
            */
           DEBUG3_VALUE("SET from:", source);
           DEBUG3_VALUE(" ts:", msg_time->timestamp);
 
-          latency = (now - latency) / 2;
-          delta = (msg_time->timestamp + latency) - now;
+          sync_source = source;
+          addSample(msg_time->timestamp, now, now_us - sent_us);
           state = STATE_SYNCED;
 
-          DEBUG3_VALUE(" lat:", latency);
+          DEBUG3_VALUE(" rtt:", now_us - sent_us);
           DEBUG3_VALUE(" delta:", delta);
         }
         break;
       }
+
+      case TIMESYNC_REQUEST: {
+        sendSyncMsg(socket, source, TIMESYNC_REPLY);
+        break;
+      }
+
+      case TIMESYNC_REPLY: {
+        if ((state == STATE_AWAITING_REPLY) && (source == sync_source)) {
+          addSample(msg_time->timestamp, now, now_us - sent_us);
+          state = STATE_SYNCED;
+          if (samples_left > 0) {
+            /*
+             * Space the requests randomly so that they don't all arrive at
+             * the same point in the source's loop.
+             */
+            next_resync_ms = now + random(TIMESYNC_SAMPLE_MS);
+          } else {
+            finishBurst();
+          }
+        }
+        break;
+      }
     }
     DEBUG_PRINT_END();
   }
@@ -209,6 +435,103 @@ boolean TimeSync::synchronize(Socket *socket,
   return (state != STATE_IDLE) && (state != STATE_SYNCED);
 }
 
+/*
+ * Advance the synchronization timers: continue or end bursts whose replies
+ * have arrived or timed out, and start this module's periodic resync.  This
+ * should be called from the main loop.
+ *
+ * Returns true if an exchange is outstanding and hot-wait mode should be
+ * maintained.
+ */
+boolean TimeSync::update() {
+  unsigned long now = millis();
+  unsigned long waited = now - last_msg_time;
+
+  switch (state) {
+    case STATE_AWAITING_ACK: {
+      if (waited >= ((sync_target == SOCKET_ADDR_ANY) ?
+                     TIMESYNC_SAMPLE_MS : TIMESYNC_TIMEOUT_MS)) {
+        if (samples_left > 0) {
+          sendSync();
+        } else {
+          state = restState();
+        }
+      }
+      break;
+    }
+
+    case STATE_AWAITING_SET: {
+      if (waited >= TIMESYNC_TIMEOUT_MS) {
+        DEBUG4_PRINTLN("SET timed out");
+        state = restState();
+      }
+      break;
+    }
+
+    case STATE_AWAITING_REPLY: {
+      if (waited >= TIMESYNC_TIMEOUT_MS) {
+        DEBUG4_PRINTLN("REPLY timed out");
+        state = STATE_SYNCED;
+        if (samples_left > 0) {
+          next_resync_ms = now;
+        } else {
+          if (burst_open) {
+            finishBurst();
+          } else {
+            /* No replies, back off in case the source doesn't answer */
+            if (interval < TIMESYNC_MAX_INTERVAL_MS) interval *= 2;
+            next_resync_ms = now + interval;
+          }
+        }
+      }
+      break;
+    }
+
+    case STATE_SYNCED: {
+      if (samples_left > 0) {
+        /* Continue a burst of requests */
+        if ((long)(now - next_resync_ms) >= 0) sendRequest();
+      } else if (burst_open) {
+        /* End a burst started by another module's SYNCs */
+        if (now - burst_ms > TIMESYNC_BURST_MS) finishBurst();
+      } else if ((sync_socket != NULL) &&
+                 (sync_source != SOCKET_ADDR_INVALID) &&
+                 ((long)(now - next_resync_ms) >= 0)) {
+        samples_left = TIMESYNC_SAMPLES;
+        sendRequest();
+      }
+      break;
+    }
+  }
+
+  return (state != STATE_IDLE) && (state != STATE_SYNCED);
+}
+
+/*
+ * Poll the synchronization socket while an exchange is outstanding, so that
+ * replies are timestamped as soon as they arrive.  Time sync messages to this
+ * module's address are handled here, any other message ends the wait and is
+ * returned to be handled by the caller, which should then call hotWait()
+ * again.  Returns NULL once the exchange has completed or timed out, or after
+ * TIMESYNC_HOT_WAIT_US.
+ */
+msg_hdr_t *TimeSync::hotWait(socket_addr_t address, unsigned int *msglen) {
+  uint32_t start_us = micros();
+  while (update() && ((uint32_t)(micros() - start_us) < TIMESYNC_HOT_WAIT_US)) {
+    msg_hdr_t *msg_hdr = hmtl_socket_getmsg(sync_socket, msglen);
+    if (msg_hdr == NULL) continue;
+
+    if ((msg_hdr->type == MSG_TYPE_TIMESYNC) && (msg_hdr->address == address)) {
+      synchronize(sync_socket, SOCKET_ADDR_INVALID, msg_hdr);
+    } else {
+      return msg_hdr;
+    }
+  }
+
+  *msglen = 0;
+  return NULL;
+}
+
 /*
  * Send a resynchronization message with the current timestamp
  */
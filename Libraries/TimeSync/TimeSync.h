@@ -13,18 +13,76 @@
 #include "Socket.h"
 #include "HMTLMessaging.h"
 
+/* Exchanges per synchronization burst, the lowest round trip one is used */
+#ifndef TIMESYNC_SAMPLES
+  #define TIMESYNC_SAMPLES 8
+#endif
+
+/* Time to wait for a reply before treating an exchange as lost */
+#ifndef TIMESYNC_TIMEOUT_MS
+  #define TIMESYNC_TIMEOUT_MS 50
+#endif
+
+/*
+ * Longest that hotWait() polls for a reply before returning, so that the
+ * caller's loop keeps running its programs and reading its other inputs
+ * while an exchange is outstanding.
+ */
+#ifndef TIMESYNC_HOT_WAIT_US
+  #define TIMESYNC_HOT_WAIT_US 500
+#endif
+
+/* Spacing of SYNC messages when synchronizing to the broadcast address */
+#ifndef TIMESYNC_SAMPLE_MS
+  #define TIMESYNC_SAMPLE_MS 100
+#endif
+
+/* Samples within this period of the first are part of the same burst */
+#ifndef TIMESYNC_BURST_MS
+  #define TIMESYNC_BURST_MS 1000
+#endif
+
+/*
+ * Bounds on the period between a synchronized module's own resyncs.  The
+ * period doubles while the clock stays within TIMESYNC_TARGET_US of its
+ * source's and halves when it is off by more than twice that.
+ */
+#ifndef TIMESYNC_MIN_INTERVAL_MS
+  #define TIMESYNC_MIN_INTERVAL_MS 4000UL
+#endif
+
+#ifndef TIMESYNC_MAX_INTERVAL_MS
+  #define TIMESYNC_MAX_INTERVAL_MS 256000UL
+#endif
+
+#ifndef TIMESYNC_TARGET_US
+  #define TIMESYNC_TARGET_US 1000
+#endif
+
+/* Errors larger than this step the clock without updating the skew */
+#ifndef TIMESYNC_STEP_MS
+  #define TIMESYNC_STEP_MS 100
+#endif
+
+/* Largest clock rate difference corrected, ceramic resonators are +/-0.5% */
+#ifndef TIMESYNC_MAX_SKEW_PPM
+  #define TIMESYNC_MAX_SKEW_PPM 5000
+#endif
+
 class TimeSync {
  public:
 
-  static const byte STATE_IDLE         = 0;
-  static const byte STATE_AWAITING_ACK = 1;
-  static const byte STATE_AWAITING_SET = 2;
-  static const byte STATE_SYNCED       = 3;
+  static const byte STATE_IDLE           = 0;
+  static const byte STATE_AWAITING_ACK   = 1;
+  static const byte STATE_AWAITING_SET   = 2;
+  static const byte STATE_SYNCED         = 3;
+  static const byte STATE_AWAITING_REPLY = 4;
 
   TimeSync();
 
   /*
-   * Return the current time adjusted based on the derived time delta
+   * Return the current time adjusted based on the derived time delta and
+   * clock skew
    */
   unsigned long ms();
   unsigned long s();
@@ -37,11 +95,63 @@ class TimeSync {
                      socket_addr_t target);
   void check(Socket *socket, socket_addr_t target);
 
+  boolean update();
+  msg_hdr_t *hotWait(socket_addr_t address, unsigned int *msglen);
+
+  byte getState() { return state; }
+  Socket *getSocket() { return sync_socket; }
+
+  /* Estimated rate of the source's clock relative to this one, in ppm * 16 */
+  long getSkew() { return skew; }
+  unsigned long getInterval() { return interval; }
+
  private:
-  unsigned long latency;
+  /*
+   * ms() is millis() + delta + (delta_us + skew * elapsed / 16000) / 1000,
+   * where elapsed is the time since skew_ms.  The skew term is folded into
+   * delta_us every SKEW_FOLD_MS, which adds exactly skew microseconds.
+   */
+  static const long SKEW_FOLD_MS = 16000;
+
   long delta;
+  long delta_us;
+  long skew;
+  unsigned long skew_ms;
+  boolean skew_valid;
+
   byte state;
+  boolean synced;
   unsigned long last_msg_time;
+  uint32_t sent_us;
+  unsigned long latency;  // One-way latency of the last sample in us
+  byte samples_left;
+
+  Socket *sync_socket;
+  socket_addr_t sync_target;  // Address this module is synchronizing
+  socket_addr_t sync_source;  // Address this module is synchronized to
+
+  /* Lowest round trip sample of the current burst */
+  boolean burst_open;
+  unsigned long burst_ms;
+  uint32_t best_rtt;
+  unsigned long best_ms;
+  long best_delta;
+  long best_delta_us;
+
+  unsigned long sample_ms;  // Local time of the last applied sample
+  unsigned long interval;
+  unsigned long next_resync_ms;
+
+  long offsetUs(unsigned long now);
+  void normalize();
+  void addSample(unsigned long remote_ms, unsigned long local_ms,
+                 uint32_t rtt_us);
+  void applySample(unsigned long local_ms, long sample_delta,
+                   long sample_delta_us);
+  void finishBurst();
+  void sendSync();
+  void sendRequest();
+  byte restState() { return synced ? STATE_SYNCED : STATE_IDLE; }
 
   void sendSyncMsg(Socket *socket, socket_addr_t target, byte phase, int adjustment);
 };
@@ -49,11 +159,13 @@ class TimeSync {
 /*******************************************************************************
  * Message format for MSG_TYPE_TIMESYNC
  */
-#define TIMESYNC_SYNC   0x1
-#define TIMESYNC_ACK    0x2
-#define TIMESYNC_SET    0x3
-#define TIMESYNC_RESYNC 0x4
-#define TIMESYNC_CHECK  0x5
+#define TIMESYNC_SYNC    0x1
+#define TIMESYNC_ACK     0x2
+#define TIMESYNC_SET     0x3
+#define TIMESYNC_RESYNC  0x4
+#define TIMESYNC_CHECK   0x5
+#define TIMESYNC_REQUEST 0x6
+#define TIMESYNC_REPLY   0x7
 
 typedef struct {
   byte sync_phase;
@@ -94,6 +94,15 @@ void loop() {
     time.synchronize(&rs485, SOCKET_ADDR_INVALID, msg_hdr);
   }
 
+  /* Continue synchronization, hot-waiting for replies */
+  if (time.update()) {
+    while ((msg_hdr = time.hotWait(config.address, &msglen)) != NULL) {
+      if (msg_hdr->type == MSG_TYPE_TIMESYNC) {
+        time.synchronize(&rs485, SOCKET_ADDR_INVALID, msg_hdr);
+      }
+    }
+  }
+
   /* Handle commands from the Serial CLI connection */
   serialcli.checkSerial();
 
@@ -8,6 +8,7 @@
 ################################################################################
 
 from binascii import hexlify
+import struct
 import time
 
 import hmtl.HMTLprotocol as HMTLprotocol
@@ -26,12 +27,32 @@ class HMTLSerial():
     # How long to wait for the ready signal after connection
     MAX_READY_WAIT = 10
 
-    def __init__(self, buff, verbose=False):
+    # Resend unacknowledged sequenced messages after this many seconds, and
+    # restart the sequence after this many resends without progress
+    RETRANSMIT_TIMEOUT = 0.1
+    RETRANSMIT_SYNC = 3
+
+    # Outstanding sequenced bytes, which should fit in the module's serial
+    # receive buffer
+    WINDOW_BYTES = 64
+
+    def __init__(self, buff, verbose=False, window=0,
+                 window_bytes=WINDOW_BYTES):
         '''Open a serial connection and wait for the ready signal'''
         self.verbose = verbose
         self.last_received = 0
         self.serial = buff
 
+        # Sliding window of sequenced messages awaiting an ack, if window is
+        # 0 then each message waits for a text ack.
+        self.window = window
+        self.window_bytes = window_bytes
+        self.sequence = None
+        self.synced = False
+        self.outstanding = []
+        self.last_progress = 0
+        self.timeouts = 0
+
         # Create the logger
         self.logger = TimedLogger(self.serial.start_time, textcolor=self.LOGGING_COLOR)
 
@@ -42,14 +63,17 @@ class HMTLSerial():
     def get_message(self, timeout=None):
         """Returns the next line of text or a complete HMTL message"""
 
-        item = self.serial.get(wait=timeout)
+        while True:
+            item = self.serial.get(wait=timeout)
 
-        if not item:
-            return None
+            if not item:
+                return None
 
-        self.last_received = time.time()
+            self.last_received = time.time()
 
-        return item
+            # Acks of sequenced messages are handled here and not returned
+            if not self.handle_serial_ack(item):
+                return item
 
     # Wait for data from device indicating its ready for commands
     def wait_for_ready(self):
@@ -74,6 +98,14 @@ class HMTLSerial():
     def send_and_confirm(self, data, terminated, timeout=10):
         """Send a command and wait for the ACK"""
 
+        if self.window and not terminated:
+            # Messages are pipelined and acked cumulatively
+            self.send_sequenced(data, timeout)
+            return True
+
+        # Commands aren't sequenced, so everything sent before must be acked
+        self.flush(timeout)
+
         self.serial.write(data)
         if (terminated):
             self.serial.write(HMTLprotocol.HMTL_TERMINATOR)
@@ -88,6 +120,100 @@ class HMTLSerial():
             if (time.time() - start_wait) > timeout:
                 raise Exception("Timed out waiting for ACK signal")
 
+    def send_sequenced(self, data, timeout=10):
+        """Send a message once there is room in the window"""
+        start_wait = time.time()
+        while not self.window_open(len(data) + 2):
+            self.wait_for_ack(start_wait, timeout)
+
+        if self.sequence is None:
+            # The first message restarts the module's sequence
+            prefix = HMTLprotocol.HMTL_SERIAL_SEQ_SYNC
+            self.sequence = 0
+        else:
+            prefix = HMTLprotocol.HMTL_SERIAL_SEQ
+
+        frame = struct.pack("BB", prefix, self.sequence) + data
+        self.serial.write(frame)
+
+        if not self.outstanding:
+            self.last_progress = time.time()
+        self.outstanding.append((self.sequence, frame))
+        self.sequence = (self.sequence + 1) & 0xFF
+
+    def window_open(self, length):
+        """Check if a message of this length can be sent now"""
+        if not self.outstanding:
+            return True
+        if not self.synced:
+            # Wait for the ack of the first message to confirm the sequence
+            return False
+        if len(self.outstanding) >= self.window:
+            return False
+        pending = sum([len(frame) for (sequence, frame) in self.outstanding])
+        return pending + length <= self.window_bytes
+
+    def flush(self, timeout=10):
+        """Wait until all sequenced messages have been acked"""
+        start_wait = time.time()
+        while self.outstanding:
+            self.wait_for_ack(start_wait, timeout)
+
+    def wait_for_ack(self, start_wait, timeout):
+        """Process incoming data, resending if acks have stopped"""
+        item = self.serial.get(wait=self.RETRANSMIT_TIMEOUT / 5)
+        if item:
+            self.last_received = time.time()
+            self.handle_serial_ack(item)
+
+        if not self.outstanding:
+            return
+        if (time.time() - start_wait) > timeout:
+            raise Exception("Timed out waiting for sequenced ACK")
+        if (time.time() - self.last_progress) > self.RETRANSMIT_TIMEOUT:
+            self.timeouts += 1
+            if self.timeouts >= self.RETRANSMIT_SYNC:
+                # The module may have restarted, so restart the sequence with
+                # the first message, at the risk of it being handled twice.
+                (sequence, frame) = self.outstanding[0]
+                self.outstanding[0] = (sequence,
+                                       struct.pack("B", HMTLprotocol.HMTL_SERIAL_SEQ_SYNC) +
+                                       frame[1:])
+            self.resend_outstanding()
+
+    def resend_outstanding(self):
+        self.logger.log("Resending %d messages from %d" %
+                        (len(self.outstanding), self.outstanding[0][0]))
+        for (sequence, frame) in self.outstanding:
+            self.serial.write(frame)
+        self.last_progress = time.time()
+
+    def handle_serial_ack(self, item):
+        """Process an ack of sequenced messages, returning False if the item
+        is not an ack"""
+        if (not item.is_hmtl or
+                item.hdr.mtype != HMTLprotocol.MSG_TYPE_SERIAL_ACK):
+            return False
+
+        acked = bytearray(item.data)[HMTLprotocol.MSG_BASE_LEN]
+        count = 0
+        for (sequence, frame) in self.outstanding:
+            # Acks are cumulative, compare sequence numbers modulo 256
+            if ((acked - sequence) & 0xFF) >= 128:
+                break
+            count += 1
+
+        if count:
+            del self.outstanding[:count]
+            self.last_progress = time.time()
+            self.timeouts = 0
+            self.synced = True
+        elif self.outstanding:
+            # An ack without progress reports a gap, go back and resend
+            self.resend_outstanding()
+
+        return True
+
 
 # XXX: Here we need a method of getting data back from poll or the like
 
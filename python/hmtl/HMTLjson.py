@@ -56,6 +56,15 @@ def validate_output(output):
         if (not check_required(output, "datapin")): return False
         if (not check_required(output, "numpixels")): return False
         if (not check_required(output, "rgbtype")): return False
+    elif (output["type"] == "palette"):
+        if (not check_required(output, "clockpin")): return False
+        if (not check_required(output, "datapin")): return False
+        if (not check_required(output, "numpixels")): return False
+        if (not check_required(output, "rgbtype")): return False
+        if (not check_required(output, "bits")): return False
+        if (output["bits"] not in (4, 8)):
+            print("ERROR: palette bits must be 4 or 8")
+            return False
     elif (output["type"] == "rs485"):
         if (not check_required(output, "recvpin")): return False
         if (not check_required(output, "xmitpin")): return False
@@ -63,6 +72,11 @@ def validate_output(output):
     elif (output["type"] == "xbee"):
         if (not check_required(output, "recvpin")): return False
         if (not check_required(output, "xmitpin")): return False
+    elif (output["type"] == "segments"):
+        if (not check_required(output, "pixelsoutput")): return False
+        if (not check_required(output, "start")): return False
+        if (not check_required(output, "length")): return False
+        if (not check_required(output, "count")): return False
     elif (output["type"] == "mpr121"):
         if (not check_required(output, "irqpin")): return False
         if (not check_required(output, "useinterrupt")): return False
@@ -91,6 +105,46 @@ def post_process_config(output):
         #print("thresholds:", [ "%x" % val for val in output["threshold"]])
 
 
+def validate_scenes(scenes):
+    """Verify that the scene store's scenes are valid"""
+    boot_scenes = 0
+    numbers = set()
+    for scene in scenes:
+        if ((not "scene" in scene) or (scene["scene"] < 0) or
+            (scene["scene"] >= HMTLprotocol.SCENE_NONE)):
+            print("ERROR: scene must have a 'scene' number from 0 to %d" %
+                  (HMTLprotocol.SCENE_NONE - 1))
+            return False
+        if (scene["scene"] in numbers):
+            # A scene's program records must be consecutive in the store
+            print("ERROR: scene %d is defined more than once" % scene["scene"])
+            return False
+        numbers.add(scene["scene"])
+        if (not "programs" in scene):
+            print("ERROR: scene %d has no 'programs'" % scene["scene"])
+            return False
+        if (scene.get("boot", False)):
+            boot_scenes += 1
+
+        for program in scene["programs"]:
+            if ((not "output" in program) or (not "program" in program)):
+                print("ERROR: scene %d programs need 'output' and 'program'" %
+                      scene["scene"])
+                return False
+            values = program.get("values", [])
+            if ((len(values) > HMTLprotocol.SCENE_MAX_VALUES) or
+                any((val < 0) or (val > 0xFF) for val in values)):
+                print("ERROR: scene %d program values must be at most %d bytes" %
+                      (scene["scene"], HMTLprotocol.SCENE_MAX_VALUES))
+                return False
+
+    if (boot_scenes > 1):
+        print("ERROR: only one scene can be the boot scene")
+        return False
+
+    return True
+
+
 def validate_config(data):
     """Verify that the configuration file is valid"""
 
@@ -118,6 +172,15 @@ def validate_config(data):
         return False
     if (not "flags" in config):
         config['flags'] = 0
+    if ("frame_period" in config):
+        # The frame period is stored in the upper bits of the flags
+        period = config["frame_period"]
+        if ((period % HMTLprotocol.FRAME_UNIT_MS) or
+            (period > HMTLprotocol.FRAME_UNIT_MS * (HMTLprotocol.FLAG_FRAME_MASK >> HMTLprotocol.FLAG_FRAME_SHIFT))):
+            print("Invalid frame_period %d" % period)
+            return False
+        config['flags'] = ((config['flags'] & ~HMTLprotocol.FLAG_FRAME_MASK) |
+                           ((period // HMTLprotocol.FRAME_UNIT_MS) << HMTLprotocol.FLAG_FRAME_SHIFT))
 
     if (not "outputs" in data):
         print("Input file does not contain 'data'")
@@ -127,6 +190,9 @@ def validate_config(data):
         if (not validate_output(output)):
             return False;
 
+    if (not validate_scenes(data.get("scenes", []))):
+        return False
+
     # Perform post-validation processing
     for output in data["outputs"]:
         post_process_config(output)
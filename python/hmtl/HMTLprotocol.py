@@ -9,6 +9,7 @@
 
 """HMTL Protocol definitions module"""
 
+import random
 import struct
 from binascii import hexlify
 from hmtl.constants import *
@@ -21,24 +22,51 @@ HMTL_CONFIG_FAIL   = b"fail"
 
 HMTL_TERMINATOR    = b'\xfe\xfe\xfe\xfe' # Indicates end of command
 
+# Prefixes for sequenced serial messages, followed by a sequence number
+HMTL_SERIAL_SEQ      = 0xFB
+HMTL_SERIAL_SEQ_SYNC = 0xFA # Restart the sequence with this message
+
 
 #
 # HMTL Message formats
 #
-MSG_HDR_FMT = "<BBBBBBH" # All HMTL messages start with this
+MSG_HDR_FMT = "<BBBBBBHHBB" # All HMTL messages start with this
+
+MSG_PROTOCOL_VERSION = 3
+MSG_SOURCE_NONE = 65534 # Unstamped, copies of the message can't be recognized
+MSG_TTL = 8             # Times a message may be forwarded
+
+# Controllers stamp their messages with a source address and sequence number,
+# by default an address picked at random from this range so that controllers
+# sharing a network are unlikely to collide.  See set_msg_source().
+MSG_SOURCE_CONTROLLER_MIN = 0xF000
+MSG_SOURCE_CONTROLLER_MAX = 0xFFFD
 
 # Msg type
 MSG_TYPE_OUTPUT   = 1
 MSG_TYPE_POLL     = 2
 MSG_TYPE_SET_ADDR = 3
+MSG_TYPE_BATCH    = 6
+MSG_TYPE_TIMED    = 7
+MSG_TYPE_PIXEL_FRAME = 8
+MSG_TYPE_FRAGMENT = 9
+MSG_TYPE_SCENE    = 10
+MSG_TYPE_DONT_FORWARD = 0xE0 # Types from here on can't be forwarded or batched
 MSG_TYPE_DUMPCONFIG = 0xE0
+MSG_TYPE_SERIAL_ACK = 0xE1
 
 # Mapping of message types to strings
 MSG_TYPES = {
     MSG_TYPE_OUTPUT: "OUTPUT",
     MSG_TYPE_POLL: "POLL",
     MSG_TYPE_SET_ADDR: "SETADDR",
+    MSG_TYPE_BATCH: "BATCH",
+    MSG_TYPE_TIMED: "TIMED",
+    MSG_TYPE_PIXEL_FRAME: "PIXELFRAME",
+    MSG_TYPE_FRAGMENT: "FRAGMENT",
+    MSG_TYPE_SCENE: "SCENE",
     MSG_TYPE_DUMPCONFIG: "DUMPCONFIG",
+    MSG_TYPE_SERIAL_ACK: "SERIALACK",
 }
 
 # Msg flags
@@ -59,7 +87,7 @@ MSG_VALUE_FMT = "H"
 MSG_RGB_FMT = "BBB"
 MSG_PROGRAM_FMT = "B"
 
-MSG_BASE_LEN = 8
+MSG_BASE_LEN = 12
 MSG_OUTPUT_LEN = MSG_BASE_LEN + 2
 MSG_VALUE_LEN = MSG_OUTPUT_LEN + 2
 MSG_RGB_LEN = MSG_OUTPUT_LEN + 3
@@ -70,6 +98,42 @@ MSG_PROGRAM_LEN = MSG_OUTPUT_LEN + 1 + MSG_PROGRAM_VALUE_LEN
 MSG_POLL_LEN = MSG_BASE_LEN
 MSG_DUMPCONFIG_LEN = MSG_BASE_LEN
 
+MSG_BATCH_ENTRY_FMT = "<BBH" # Body length, type, address
+MSG_BATCH_ENTRY_LEN = 4
+MSG_BATCH_MAX_LEN = 64 # Fits the standard module socket buffers
+
+MSG_TIMED_FMT = "<I" # Execution time in module timesync ms
+MSG_TIMED_LEN = 4
+
+MSG_PIXEL_FRAME_FMT = "<BBHB" # Output, frame id, pixel offset, flags
+MSG_PIXEL_FRAME_LEN = 5
+
+MSG_FRAGMENT_FMT = "<BBB" # Message id, fragment index, number of fragments
+MSG_FRAGMENT_LEN = 3
+MSG_FRAGMENT_MAX_MSG_LEN = 255 # Limited by the header's length field
+
+MSG_SCENE_FMT = "<BBB" # Scene, flags, reserved
+MSG_SCENE_LEN = 3
+MSG_SCENE_FLAG_BOOT = 0x1 # Also store the scene as the boot scene
+
+# Message CRC-8, polynomial 0x07 with an initial value of 0
+MSG_CRC_OFFSET = 1
+MSG_CRC_POLY = 0x07
+
+def _crc_table():
+    table = []
+    for i in range(256):
+        crc = i
+        for bit in range(8):
+            if (crc & 0x80):
+                crc = ((crc << 1) ^ MSG_CRC_POLY) & 0xFF
+            else:
+                crc = (crc << 1) & 0xFF
+        table.append(crc)
+    return table
+
+MSG_CRC_TABLE = _crc_table()
+
 # Broadcast address
 BROADCAST = 65535  # = (uint16_t)-1
 
@@ -102,19 +166,65 @@ MODULE_TYPES = {
 }
 
 
+#
+# Message CRC
+#
+
+def get_msg_crc(msg):
+    """Compute the CRC of a message, treating the crc field as 0"""
+    data = bytearray(msg)
+    crc = 0
+    for i, val in enumerate(data[:data[3]]):
+        if (i == MSG_CRC_OFFSET):
+            val = 0
+        crc = MSG_CRC_TABLE[crc ^ val]
+    return crc
+
+def set_msg_crc(msg):
+    """Return the message with its crc field filled in"""
+    return (msg[:MSG_CRC_OFFSET] + struct.pack("B", get_msg_crc(msg)) +
+            msg[MSG_CRC_OFFSET + 1:])
+
+def check_msg_crc(msg):
+    """Check a received message's CRC"""
+    return bytearray(msg)[MSG_CRC_OFFSET] == get_msg_crc(msg)
+
+
 #
 # HMTL Message types
 #
 
+msg_source = random.randint(MSG_SOURCE_CONTROLLER_MIN,
+                            MSG_SOURCE_CONTROLLER_MAX)
+msg_seq = 0
+
+def set_msg_source(source):
+    """
+    Set the source address stamped on messages from this controller, which
+    must differ from every module's and other controller's address.
+    MSG_SOURCE_NONE sends messages unstamped.
+    """
+    global msg_source
+    msg_source = source
+
 def get_msg_hdr(msglen, address, mtype=MSG_TYPE_OUTPUT, flags=0):
+    global msg_seq
+    seq = 0
+    if msg_source != MSG_SOURCE_NONE:
+        seq = msg_seq
+        msg_seq = (msg_seq + 1) & 0xFF
+
     packed = struct.pack(MSG_HDR_FMT,
                          0xFC,   # Startcode
-                         0,      # CRC - XXX: TODO!
-                         2,      # Protocol version
+                         0,      # CRC, filled in by set_msg_crc()
+                         MSG_PROTOCOL_VERSION,
                          msglen, # Message length
                          mtype,  # Type: 1 is OUTPUT, 2 POLL, 3 is SETADDR
                          flags,  # flags
-                         address)  # Destination address 65535 is "Any"
+                         address, # Destination address 65535 is "Any"
+                         msg_source,
+                         seq,    # Sequence number from this source
+                         MSG_TTL)
     return packed
 
 def get_output_hdr(otype, output):
@@ -129,14 +239,14 @@ def get_value_msg(address, output, value):
     packed = struct.pack(MSG_VALUE_FMT,
                          value)                 # Value to set
 
-    return packed_hdr + packed_out + packed                        
+    return set_msg_crc(packed_hdr + packed_out + packed)
 
 def get_rgb_msg(address, output, r, g, b):
     packed_hdr = get_msg_hdr(MSG_RGB_LEN, address)
     packed_out = get_output_hdr("rgb", output)
     packed = struct.pack(MSG_RGB_FMT, r, g, b)
 
-    return packed_hdr + packed_out + packed
+    return set_msg_crc(packed_hdr + packed_out + packed)
 
 
 def get_poll_msg(address):
@@ -144,7 +254,7 @@ def get_poll_msg(address):
                              mtype=MSG_TYPE_POLL,
                              flags=MSG_FLAG_RESPONSE)
 
-    return packed_hdr
+    return set_msg_crc(packed_hdr)
 
 
 def get_dumpconfig_msg(address):
@@ -152,7 +262,16 @@ def get_dumpconfig_msg(address):
                              mtype=MSG_TYPE_DUMPCONFIG,
                              flags=MSG_FLAG_RESPONSE)
 
-    return packed_hdr
+    return set_msg_crc(packed_hdr)
+
+
+def get_scene_msg(address, scene, flags=0):
+    """Start the programs of a scene from each module's scene store"""
+    packed_hdr = get_msg_hdr(MSG_BASE_LEN + MSG_SCENE_LEN, address,
+                             mtype=MSG_TYPE_SCENE)
+    packed = struct.pack(MSG_SCENE_FMT, scene, flags, 0)
+
+    return set_msg_crc(packed_hdr + packed)
 
 
 def get_set_addr_msg(address, device_id, new_address):
@@ -161,7 +280,7 @@ def get_set_addr_msg(address, device_id, new_address):
                  address = address)
     sethdr = SetAddress(device_id, new_address)
 
-    return hdr.pack() + sethdr.pack()
+    return set_msg_crc(hdr.pack() + sethdr.pack())
 
 
 def get_program_msg(address, output, program_type, program_data):
@@ -172,7 +291,7 @@ def get_program_msg(address, output, program_type, program_data):
     packed_out = get_output_hdr("program", output)
     packed = struct.pack(MSG_PROGRAM_FMT, program_type)
 
-    return packed_hdr + packed_out + packed + program_data
+    return set_msg_crc(packed_hdr + packed_out + packed + program_data)
 
 def get_program_blink_msg(address, output, 
                           on_period, on_values, off_period, off_values):
@@ -197,6 +316,95 @@ def get_program_timed_change_msg(address, output,
     return get_program_msg(address, output, MSG_PROGRAM_TIMED_CHANGE_TYPE, msg)
 
 
+def get_batch_entry(msg):
+    """Convert a formatted message into an entry of a batch message"""
+    (startcode, crc, version, length, mtype, flags, address,
+     source, seq, ttl) = struct.unpack_from(MSG_HDR_FMT, msg)
+    if (mtype in (MSG_TYPE_BATCH, MSG_TYPE_FRAGMENT)) or \
+       (mtype >= MSG_TYPE_DONT_FORWARD):
+        raise Exception("Message type 0x%x can't be batched" % (mtype))
+
+    body = msg[MSG_BASE_LEN:length]
+    return struct.pack(MSG_BATCH_ENTRY_FMT, len(body), mtype, address) + body
+
+def get_batch_msg(address, msgs, flags=0):
+    """Pack a list of formatted messages into a single batch message"""
+    entries = b"".join([get_batch_entry(msg) for msg in msgs])
+    packed_hdr = get_msg_hdr(MSG_BASE_LEN + len(entries), address,
+                             mtype=MSG_TYPE_BATCH, flags=flags)
+    return set_msg_crc(packed_hdr + entries)
+
+def get_batch_msgs(address, msgs, max_len=MSG_BATCH_MAX_LEN, flags=0):
+    """Pack formatted messages into as few batch messages as possible"""
+    batches = []
+    entries = b""
+    for msg in msgs:
+        entry = get_batch_entry(msg)
+        if (MSG_BASE_LEN + len(entry) > max_len):
+            raise Exception("Message of %d bytes won't fit in a batch" %
+                            (len(msg)))
+
+        if (MSG_BASE_LEN + len(entries) + len(entry) > max_len):
+            batches.append(set_msg_crc(
+                get_msg_hdr(MSG_BASE_LEN + len(entries), address,
+                            mtype=MSG_TYPE_BATCH, flags=flags) + entries))
+            entries = b""
+        entries += entry
+
+    if (len(entries) > 0):
+        batches.append(set_msg_crc(
+            get_msg_hdr(MSG_BASE_LEN + len(entries), address,
+                        mtype=MSG_TYPE_BATCH, flags=flags) + entries))
+
+    return batches
+
+
+def get_timed_msg(execute_ms, msg):
+    """
+    Wrap a formatted output, batch or scene message so that modules process
+    it at execute_ms in their synchronized time
+    """
+    (startcode, crc, version, length, mtype, flags, address,
+     source, seq, ttl) = struct.unpack_from(MSG_HDR_FMT, msg)
+    if mtype not in (MSG_TYPE_OUTPUT, MSG_TYPE_BATCH, MSG_TYPE_SCENE):
+        raise Exception("Message type 0x%x can't be timed" % (mtype))
+
+    packed_hdr = get_msg_hdr(MSG_BASE_LEN + MSG_TIMED_LEN + length, address,
+                             mtype=MSG_TYPE_TIMED)
+    packed = struct.pack(MSG_TIMED_FMT, execute_ms & 0xFFFFFFFF)
+    return set_msg_crc(packed_hdr + packed + msg[:length])
+
+
+def get_fragment_msgs(msg, fragment_id, max_len=MSG_BATCH_MAX_LEN):
+    """
+    Split a formatted message into fragments of at most max_len bytes, which
+    the receiving module reassembles before processing the message.  AVR
+    modules only reassemble fragments if built with HMTL_FRAGMENT_BUFFERS set.
+    """
+    (startcode, crc, version, length, mtype, flags, address,
+     source, seq, ttl) = struct.unpack_from(MSG_HDR_FMT, msg)
+    if length > MSG_FRAGMENT_MAX_MSG_LEN:
+        raise Exception("Message of %d bytes is too long to fragment" %
+                        (length))
+
+    payload = min(max_len, MSG_FRAGMENT_MAX_MSG_LEN) - \
+              (MSG_BASE_LEN + MSG_FRAGMENT_LEN)
+    if payload <= 0:
+        raise Exception("Fragments of %d bytes can't carry data" % (max_len))
+
+    total = (length + payload - 1) // payload
+    fragments = []
+    for index in range(0, total):
+        data = msg[index * payload:min((index + 1) * payload, length)]
+        packed_hdr = get_msg_hdr(MSG_BASE_LEN + MSG_FRAGMENT_LEN + len(data),
+                                 address, mtype=MSG_TYPE_FRAGMENT)
+        packed = struct.pack(MSG_FRAGMENT_FMT, fragment_id & 0xFF, index,
+                             total)
+        fragments.append(set_msg_crc(packed_hdr + packed + data))
+
+    return fragments
+
+
 # Decode raw data into an HMTL message
 def decode_data(readdata):
     try:
@@ -299,10 +507,11 @@ class MsgHdr(Msg):
     LENGTH =  MSG_BASE_LEN
     
     STARTCODE = 0xFC
-    PROTOCOL_VERSION = 2
+    PROTOCOL_VERSION = MSG_PROTOCOL_VERSION
 
     def __init__(self, startcode=STARTCODE, crc=0, version=PROTOCOL_VERSION, 
-                 length=0, mtype=0, flags=0, address=0):
+                 length=0, mtype=0, flags=0, address=0,
+                 source=MSG_SOURCE_NONE, seq=0, ttl=MSG_TTL):
         self.startcode = startcode
         self.crc = crc
         self.version = version
@@ -310,6 +519,9 @@ class MsgHdr(Msg):
         self.mtype = mtype
         self.flags = flags
         self.address = address
+        self.source = source
+        self.seq = seq
+        self.ttl = ttl
 
     def __str__(self):
         return """  msg_hdr_t:
@@ -320,6 +532,9 @@ class MsgHdr(Msg):
     type:%d (%s)
     flags:0x%x (%s)
     addr:%d
+    source:%d
+    seq:%d
+    ttl:%d
 """ % (
             self.startcode,
             self.crc,
@@ -327,12 +542,16 @@ class MsgHdr(Msg):
             self.length,
             self.mtype, MSG_TYPES[self.mtype],
             self.flags, '|'.join([MSG_FLAGS[1 << x] for x in range(0,8) if ((1 << x) & self.flags) ]),
-            self.address
+            self.address,
+            self.source,
+            self.seq,
+            self.ttl
         )
 
     def pack(self):
         return struct.pack(self.FORMAT, self.startcode, self.crc, self.version, 
-                           self.length, self.mtype, self.flags, self.address)
+                           self.length, self.mtype, self.flags, self.address,
+                           self.source, self.seq, self.ttl)
 
     def next_hdr(self, data):
         '''Return the header following the message header'''
@@ -481,6 +700,10 @@ class DumpConfigHdr(Msg):
             config = ConfigHeaderXbee.from_data(remaining_data)
         elif output_hdr.outputtype == CONFIG_TYPES["mpr121"]:
             config = ConfigHeaderMPR121.from_data(remaining_data)
+        elif output_hdr.outputtype == CONFIG_TYPES["segments"]:
+            config = ConfigHeaderSegments.from_data(remaining_data)
+        elif output_hdr.outputtype == CONFIG_TYPES["palette"]:
+            config = ConfigHeaderPalette.from_data(remaining_data)
 
         if config:
             config.output_hdr = output_hdr
@@ -545,6 +768,7 @@ class ProgramGeneric(Msg):
         "sparkle":     0x06,
         "soundpixels": 0x07,
         "circular":    0x08,
+        "layer":       0x09,
 
         "brightness":  0x30,
         "color":       0x31,
@@ -578,6 +802,19 @@ class ProgramFade(Msg):
     TYPE = "PROGRAMFADE"
     TYPE_NUM = ProgramGeneric.NAME_MAP["fade"]
 
+    FLAG_CYCLE = 0x1  # Fade reverses when completed
+
+    # Easing curves, set in bits 1-2 of the flags with ease()
+    EASE_LINEAR = 0
+    EASE_IN = 1
+    EASE_OUT = 2
+    EASE_IN_OUT = 3
+    EASE_SHIFT = 1
+
+    @classmethod
+    def ease(cls, curve):
+        return curve << cls.EASE_SHIFT
+
     BASE_FORMAT = 'LBBBBBBB'
     BASE_FORMAT_LENGTH = 11
     PADDING = ProgramHdr.MAX_DATA - BASE_FORMAT_LENGTH
@@ -645,7 +882,7 @@ class ProgramSparkle(Msg):
                      mtype=MSG_TYPE_OUTPUT,
                      address=address)
         programhdr = ProgramHdr(self.TYPE_NUM, output)
-        return hdr.pack() + programhdr.pack() + self.pack()
+        return set_msg_crc(hdr.pack() + programhdr.pack() + self.pack())
 
 
 class ProgramCircular(Msg):
@@ -679,7 +916,51 @@ class ProgramCircular(Msg):
                      mtype=MSG_TYPE_OUTPUT,
                      address=address)
         programhdr = ProgramHdr(self.TYPE_NUM, output)
-        return hdr.pack() + programhdr.pack() + self.pack()
+        return set_msg_crc(hdr.pack() + programhdr.pack() + self.pack())
+
+
+class ProgramLayer(Msg):
+    """Run another program message on a layer of a pixel output"""
+    TYPE = "PROGRAMLAYER"
+    TYPE_NUM = ProgramGeneric.NAME_MAP["layer"]
+
+    BLEND_REPLACE = 0
+    BLEND_ADD = 1    # Saturating add
+    BLEND_MAX = 2    # Brightest of each channel
+    BLEND_ALPHA = 3  # alpha/255 of the layer over the pixels below
+
+    BASE_FORMAT = 'BBBBHH'
+    BASE_FORMAT_LENGTH = 8
+    PADDING = ProgramHdr.MAX_DATA - BASE_FORMAT_LENGTH
+    FORMAT = "<%s" % BASE_FORMAT
+
+    def __init__(self, layer, program, blend=BLEND_REPLACE, alpha=255,
+                 start=0, length=0):
+        """program is the program message to run, or None to remove the
+        layer.  A length of 0 covers the rest of the strip."""
+        self.layer = layer
+        self.program = program
+        self.blend = blend
+        self.alpha = alpha
+        self.start = start
+        self.length = length
+
+    def pack(self):
+        if self.program is None:
+            program_type = 0
+            values = bytes(self.PADDING)
+        else:
+            program_type = self.program.TYPE_NUM
+            values = self.program.pack()[:self.PADDING]
+        return struct.pack(self.FORMAT, self.layer, program_type, self.blend,
+                           self.alpha, self.start, self.length) + values
+
+    def prepare_msg(self, address, output):
+        hdr = MsgHdr(length=MsgHdr.LENGTH + ProgramHdr.LENGTH,
+                     mtype=MSG_TYPE_OUTPUT,
+                     address=address)
+        programhdr = ProgramHdr(self.TYPE_NUM, output)
+        return set_msg_crc(hdr.pack() + programhdr.pack() + self.pack())
 
 
 def get_program_level_value_msg(address, output):
@@ -689,7 +970,7 @@ def get_program_level_value_msg(address, output):
     programhdr = ProgramHdr(MSG_PROGRAM_LEVEL_VALUE_TYPE, output)
     levelhdr = ProgramLevelValue()
 
-    return hdr.pack() + programhdr.pack() + levelhdr.pack()
+    return set_msg_crc(hdr.pack() + programhdr.pack() + levelhdr.pack())
 
 
 def get_program_sound_value_msg(address, output):
@@ -699,7 +980,7 @@ def get_program_sound_value_msg(address, output):
     programhdr = ProgramHdr(MSG_PROGRAM_SOUND_VALUE_TYPE, output)
     soundhdr = ProgramSoundValue()
 
-    return hdr.pack() + programhdr.pack() + soundhdr.pack()
+    return set_msg_crc(hdr.pack() + programhdr.pack() + soundhdr.pack())
 
 
 def get_program_fade_msg(address, output,
@@ -710,7 +991,7 @@ def get_program_fade_msg(address, output,
     programhdr = ProgramHdr(ProgramFade.TYPE_NUM, output)
     fadehdr = ProgramFade(change_period, start_values, stop_values, flags)
 
-    return hdr.pack() + programhdr.pack() + fadehdr.pack()
+    return set_msg_crc(hdr.pack() + programhdr.pack() + fadehdr.pack())
 
 
 def get_program_generic(address, output, program, data):
@@ -720,4 +1001,4 @@ def get_program_generic(address, output, program, data):
     programhdr = ProgramHdr(program, output)
     datahdr = ProgramGeneric(data)
 
-    return hdr.pack() + programhdr.pack() + datahdr.pack()
+    return set_msg_crc(hdr.pack() + programhdr.pack() + datahdr.pack())
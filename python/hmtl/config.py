@@ -82,6 +82,13 @@ def get_output_struct(output):
                                     output['datapin'],
                                     output['numpixels'],
                                     output['rgbtype'])
+    elif (type == "palette"):
+        packed_output = struct.pack(OUTPUT_PALETTE_FMT,
+                                    output['clockpin'],
+                                    output['datapin'],
+                                    output['numpixels'],
+                                    output['rgbtype'],
+                                    output['bits'])
     elif (type == "rs485"):
         packed_output = struct.pack(OUTPUT_RS485_FMT,
                                     output['recvpin'],
@@ -92,6 +99,12 @@ def get_output_struct(output):
                                     output['recvpin'],
                                     output['xmitpin'])
 
+    elif (type == "segments"):
+        packed_output = struct.pack(OUTPUT_SEGMENTS_FMT,
+                                    output['pixelsoutput'],
+                                    output['start'],
+                                    output['length'],
+                                    output['count'])
     elif (type == "mpr121"):
         args = [OUTPUT_MPR121_FMT, output["irqpin"],
                 output["useinterrupt"]] + [x for x in output["threshold"]]
@@ -131,6 +144,38 @@ def get_baud_struct(baud):
 
     return packed_start + packed_baud
 
+
+def get_scene_structs(data):
+    """
+    Return the (type, struct) commands that fill the module's scene store, a
+    record for each program of each scene followed by the boot scene.
+    Trailing zero values are left off, as the module fills them back in.
+    """
+    structs = []
+    boot_scene = SCENE_NONE
+
+    for scene in data.get("scenes", []):
+        if scene.get("boot", False):
+            boot_scene = scene["scene"]
+
+        for program in scene["programs"]:
+            values = list(program.get("values", []))
+            while values and (values[-1] == 0):
+                values.pop()
+
+            packed = struct.pack(SCENE_PROGRAM_FMT,
+                                 scene["scene"],
+                                 CONFIG_TYPES["program"],
+                                 program["output"],
+                                 program["program"])
+            structs.append(("scene", get_config_start("scene") + packed +
+                            bytes(values)))
+
+    packed = struct.pack(BOOT_SCENE_FMT, boot_scene)
+    structs.append(("boot_scene", get_config_start("boot_scene") + packed))
+
+    return structs
+
 ################################################################################
 #
 # Configuration object classes
@@ -271,6 +316,39 @@ class ConfigHeaderPixels(BaseConfig):
                            self.numpixels, self.rgbtype)
 
 
+class ConfigHeaderPalette(BaseConfig):
+    TYPE = "PALETTE"
+    FORMAT = OUTPUT_PALETTE_FMT
+    LENGTH = 6
+
+    def __init__(self, clockpin, datapin, numpixels, rgbtype, bits):
+        self.output_hdr = None
+        self.clockpin = clockpin
+        self.datapin = datapin
+        self.numpixels = numpixels
+        self.rgbtype = rgbtype
+        self.bits = bits
+
+    def __str__(self):
+        return str(self.output_hdr) + """  config_palette_t:
+    clockpin:%d
+    datapin:%d
+    numpixels:%d
+    rgbtype:%d
+    bits:%d
+        """ % (self.clockpin, self.datapin, self.numpixels, self.rgbtype,
+               self.bits)
+
+    def short(self):
+        return "palette dat:%d,clk:%d,num:%d,bits:%d" % (
+            self.datapin, self.clockpin, self.numpixels, self.bits)
+
+    def pack(self):
+        return self.output_hdr.pack() + \
+               struct.pack(self.FORMAT, self.clockpin, self.datapin,
+                           self.numpixels, self.rgbtype, self.bits)
+
+
 class ConfigHeaderRS485(BaseConfig):
     TYPE = "RS485"
     FORMAT = OUTPUT_RS485_FMT
@@ -320,6 +398,36 @@ class ConfigHeaderXbee(BaseConfig):
                struct.pack(self.FORMAT, self.recvpin, self.xmitvalue)
 
 
+class ConfigHeaderSegments(BaseConfig):
+    TYPE = "SEGMENTS"
+    FORMAT = OUTPUT_SEGMENTS_FMT
+    LENGTH = 6
+
+    def __init__(self, pixelsoutput, start, length, count):
+        self.output_hdr = None
+        self.pixelsoutput = pixelsoutput
+        self.start = start
+        self.length = length
+        self.count = count
+
+    def __str__(self):
+        return str(self.output_hdr) + """  config_segments_t:
+    pixelsoutput:%d
+    start:%d
+    length:%d
+    count:%d
+        """ % (self.pixelsoutput, self.start, self.length, self.count)
+
+    def short(self):
+        return "segments out:%d,start:%d,len:%d,count:%d" % (
+            self.pixelsoutput, self.start, self.length, self.count)
+
+    def pack(self):
+        return self.output_hdr.pack() + \
+               struct.pack(self.FORMAT, self.pixelsoutput, self.start,
+                           self.length, self.count)
+
+
 class ConfigHeaderMPR121(BaseConfig):
     TYPE = "MPR121"
     FORMAT = OUTPUT_MPR121_FMT
@@ -30,17 +30,28 @@ CONFIG_TYPES = {
     "mpr121": 0x5,
     "rs485": 0x6,
     "xbee": 0x7,
+    "segments": 0x8,
+    "palette": 0xA,
 
     # The following values are for special commands
     "address": 0xE0,
     "device_id": 0xE1,
     "baud": 0xE2,
+    "scene": 0xE3,
+    "boot_scene": 0xE4,
 }
 
 # Individial object formats
 HEADER_FMT = '<BBBBBBHH'
 HEADER_MAGIC = 0x5C
 
+# Header flags, the upper bits hold the frame period in FRAME_UNIT_MS units
+FLAG_MASTER = 0x1
+FLAG_SERIAL = 0x2
+FLAG_FRAME_MASK = 0xF0
+FLAG_FRAME_SHIFT = 4
+FRAME_UNIT_MS = 4
+
 OUTPUT_HDR_FMT = '<BB'
 OUTPUT_VALUE_FMT = '<Bh'
 OUTPUT_RGB_FMT = '<BBBBBB'
@@ -48,13 +59,28 @@ OUTPUT_PIXELS_FMT = '<BBHB'
 OUTPUT_MPR121_FMT = '<BB' + 'B' * 12
 OUTPUT_RS485_FMT = '<BBB'
 OUTPUT_XBEE_FMT = '<BB'
+OUTPUT_SEGMENTS_FMT = '<BHHB'
+OUTPUT_PALETTE_FMT = '<BBHBB'
 
 OUTPUT_ALL_OUTPUTS = 254
 
+# Segments of pixel outputs are numbered after the HMTL_MAX_OUTPUTS outputs
+OUTPUT_SEGMENT_BASE = 8
+
+
+def segment_output(segment):
+    return OUTPUT_SEGMENT_BASE + segment
+
 UPDATE_ADDRESS_FMT = '<H'
 UPDATE_DEVICE_ID_FMT = '<H'
 UPDATE_BAUD_FMT = '<B'
 
+# Scene store program records, the scene and the start of a program message
+SCENE_PROGRAM_FMT = '<BBBB' # Scene, output type, output, program type
+SCENE_MAX_VALUES = 32
+SCENE_NONE = 0xFF
+BOOT_SCENE_FMT = '<B'
+
 #
 # Utility
 #
@@ -58,6 +58,17 @@ output_hdr_t *outputs[HMTL_MAX_OUTPUTS];
 config_max_t rawoutputs[HMTL_MAX_OUTPUTS];
 int config_outputs = 0;
 
+/*
+ * Program records of the scene store, each kept as its length followed by the
+ * record, to be written following the configuration.
+ */
+#ifndef SCENE_BUFFER_LEN
+  #define SCENE_BUFFER_LEN 256
+#endif
+config_scenes_t scenes = { HMTL_SCENE_MAGIC, 0, HMTL_SCENE_NONE };
+byte scene_data[SCENE_BUFFER_LEN];
+uint16_t scene_data_len = 0;
+
 void setup()
 {
   Serial.begin(9600);
@@ -117,6 +128,55 @@ boolean read_configuration() {
     }
   }
 
+  read_scenes(configOffset);
+
+  return true;
+}
+
+/* Read any scene store following the configuration, so it can be rewritten */
+void read_scenes(int addr) {
+  scene_data_len = 0;
+  addr = hmtl_read_scenes(addr, &scenes);
+  if (addr < 0) {
+    scenes.num_programs = 0;
+    scenes.boot_scene = HMTL_SCENE_NONE;
+    return;
+  }
+
+  for (byte i = 0; i < scenes.num_programs; i++) {
+    int next = EEPROM_safe_read(addr, &scene_data[scene_data_len + 1],
+                                SCENE_BUFFER_LEN - scene_data_len - 1);
+    if (next < 0) {
+      DEBUG1_VALUELN("Failed to read scene record ", i);
+      scenes.num_programs = i;
+      break;
+    }
+    scene_data[scene_data_len] = EEPROM_DATA_SIZE(next - addr);
+    scene_data_len += 1 + scene_data[scene_data_len];
+    addr = next;
+  }
+
+  DEBUG3_VALUELN("Read scene programs: ", scenes.num_programs);
+}
+
+/* Write the scene store following the configuration */
+boolean write_scenes(int addr) {
+  addr = hmtl_write_scenes(addr, &scenes);
+  if (addr < 0) {
+    return false;
+  }
+
+  EEPROM_init();
+  for (uint16_t offset = 0; offset < scene_data_len;
+       offset += 1 + scene_data[offset]) {
+    addr = EEPROM_safe_write(addr, &scene_data[offset + 1], scene_data[offset]);
+    if (addr < 0) {
+      DEBUG_ERR("Failed to write scene record");
+      return false;
+    }
+  }
+  EEPROM_end();
+
   return true;
 }
 
@@ -228,6 +288,11 @@ void handle_command(byte *cmd, byte len) {
 
         memcpy(&config_hdr, hdr, sizeof (config_hdr_t));
 
+        /* A new configuration replaces any scenes */
+        scenes.num_programs = 0;
+        scenes.boot_scene = HMTL_SCENE_NONE;
+        scene_data_len = 0;
+
         break;
       }
       case HMTL_OUTPUT_VALUE: {
@@ -290,6 +355,26 @@ void handle_command(byte *cmd, byte len) {
         add_output(pixels, sizeof (config_pixels_t));
         break;
       }
+      case HMTL_OUTPUT_PALETTE: {
+        DEBUG3_PRINTLN("Received PALETTE output");
+        if (config_length != sizeof (config_palette_t)) {
+          DEBUG_VALUE(DEBUG_ERROR,
+                      "Received config message with wrong len for PALETTE:",
+                      config_length);
+          DEBUG1_VALUELN(" needed:", sizeof (config_palette_t));
+          goto FAIL;
+        }
+        config_palette_t *palette = (config_palette_t *)config_start;
+        hmtl_print_output(&palette->hdr);
+
+        if (!hmtl_validate_palette(palette)) {
+          DEBUG_ERR("Recieved invalid palette output");
+          goto FAIL;
+        }
+
+        add_output(palette, sizeof (config_palette_t));
+        break;
+      }
       case HMTL_OUTPUT_MPR121: {
         DEBUG3_PRINTLN("Received MPR121 output");
         if (config_length != sizeof (config_mpr121_t)) {
@@ -351,6 +436,26 @@ void handle_command(byte *cmd, byte len) {
         add_output(xbee, sizeof (config_xbee_t));
         break;
       }
+      case HMTL_OUTPUT_SEGMENTS: {
+        DEBUG3_PRINTLN("Received SEGMENTS output");
+        if (config_length != sizeof (config_segments_t)) {
+          DEBUG_VALUE(DEBUG_ERROR,
+                      "Received config message with wrong len for SEGMENTS:",
+                      config_length);
+          DEBUG1_VALUELN(" needed:", sizeof (config_segments_t));
+          goto FAIL;
+        }
+        config_segments_t *segments = (config_segments_t *)config_start;
+        hmtl_print_output(&segments->hdr);
+
+        if (!hmtl_validate_segments(segments)) {
+          DEBUG_ERR("Recieved invalid segments output");
+          goto FAIL;
+        }
+
+        add_output(segments, sizeof (config_segments_t));
+        break;
+      }
 
       case HMTL_COMMAND_ADDRESS: {
         if (config_length != sizeof(uint16_t)) {
@@ -401,6 +506,50 @@ void handle_command(byte *cmd, byte len) {
         break;
       }
 
+      case HMTL_COMMAND_SCENE: {
+        if ((config_length < (int)HMTL_SCENE_RECORD_MIN) ||
+            (config_length > (int)HMTL_SCENE_RECORD_MAX)) {
+          DEBUG_VALUE(DEBUG_ERROR,
+                      "Received config message with wrong len for scene:",
+                      config_length);
+          goto FAIL;
+        }
+        if ((scene_data_len + 1 + config_length > SCENE_BUFFER_LEN) ||
+            (scenes.num_programs == (uint8_t)-1)) {
+          DEBUG_ERR("Scene buffer is full");
+          goto FAIL;
+        }
+        output_hdr_t *hdr = (output_hdr_t *)((byte *)config_start + 1);
+        if ((hdr->type != HMTL_OUTPUT_PROGRAM) ||
+            (*(byte *)config_start == HMTL_SCENE_NONE)) {
+          DEBUG_ERR("Received invalid scene program");
+          goto FAIL;
+        }
+        DEBUG3_VALUE("Received scene: ", *(byte *)config_start);
+        DEBUG3_VALUELN(" output: ", hdr->output);
+
+        scene_data[scene_data_len] = config_length;
+        memcpy(&scene_data[scene_data_len + 1], config_start, config_length);
+        scene_data_len += 1 + config_length;
+        scenes.num_programs++;
+
+        break;
+      }
+
+      case HMTL_COMMAND_BOOT_SCENE: {
+        if (config_length != sizeof(uint8_t)) {
+          DEBUG_VALUE(DEBUG_ERROR,
+                      "Received config message with wrong len for boot scene:",
+                      config_length);
+          DEBUG1_VALUELN(" needed:", sizeof(uint8_t));
+          goto FAIL;
+        }
+        scenes.boot_scene = *(uint8_t *)config_start;
+        DEBUG3_VALUELN("Received boot scene: ", scenes.boot_scene);
+
+        break;
+      }
+
       default: {
         DEBUG1_VALUELN("Received unknown configuration type:",
                        type);
@@ -445,11 +594,18 @@ void handle_command(byte *cmd, byte len) {
         DEBUG_ERR("Failed to write configuration");
         goto FAIL;
       }
+
+      if (!write_scenes(configOffset)) {
+        DEBUG_ERR("Failed to write scenes");
+        goto FAIL;
+      }
     }
 
     else if (strcmp(str, HMTL_CONFIG_PRINT) == 0) {
       DEBUG3_PRINTLN("Received command 'print'");
       hmtl_print_config(&config_hdr, outputs);
+      DEBUG1_VALUE("Scene programs: ", scenes.num_programs);
+      DEBUG1_VALUELN(" boot scene: ", scenes.boot_scene);
     }
 
     else if (strcmp(str, HMTL_CONFIG_READ) == 0) {
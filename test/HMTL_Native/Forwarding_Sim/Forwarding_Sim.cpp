@@ -0,0 +1,475 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Simulation of message forwarding over a looped topology.
+ *
+ * Two emulated buses, standing in for RS485 and an RFM69 radio network, are
+ * joined by --bridges modules that each have a socket on both, so every
+ * broadcast can return to a bus by another bridge.  --nodes further modules
+ * sit on each bus.  Every module runs the real MessageHandler, with a
+ * handler table that only counts the simulation's messages.
+ *
+ * A controller sends --messages broadcasts --interval-ms apart to the serial
+ * port of the first module on the RS485 bus, or with --raw 1 puts them on the
+ * RS485 bus itself, stamping them with its address as hmtl_msg_fmt() does.
+ * With --unicast N the controller also sends N messages to a module outside
+ * the simulation between each pair of broadcasts, which the simulated modules
+ * never receive but which advance the controller's sequence numbers.  With --dedup 0 every
+ * frame has its origin stripped as it's delivered, so that modules can't
+ * recognize copies and only the ttl limits forwarding.
+ *
+ * The run reports the frames on each bus per message and how often each
+ * module processed each message, and fails if forwarding wasn't bounded or a
+ * module missed a message or processed one more than once.  --dedup 0 shows
+ * what happens without duplicate suppression, and always fails.
+ *
+ * Usage: Forwarding_Sim [--bridges N] [--nodes N] [--messages N]
+ *                       [--interval-ms N] [--loop-ms N] [--jitter-us N]
+ *                       [--baud N] [--raw 0|1] [--dedup 0|1] [--unicast N]
+ *                       [--seed N]
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+#include "Debug.h"
+#include "HMTLMessaging.h"
+#include "MessageHandler.h"
+#include "Socket.h"
+#include "TimeSync.h"
+
+#define BUS_RS485      0
+#define BUS_RFM69      1
+#define NUM_BUSES      2
+
+#define BRIDGE_ADDRESS     1   // Bridges are numbered from here
+#define NODE_ADDRESS       100 // and the other modules from here
+#define UNICAST_ADDRESS    500 // A module on the RS485 bus outside the sim
+#define CONTROLLER_ADDRESS 999
+
+#define SIM_MSG_TYPE     0x40
+#define SIM_UNICAST_TYPE 0x41 // Not handled, only advances the sequence
+
+typedef struct {
+  uint16_t id;
+} msg_sim_t;
+#define SIM_MSG_LEN (sizeof (msg_hdr_t) + sizeof (msg_sim_t))
+
+typedef struct {
+  uint16_t bridges;
+  uint16_t nodes;
+  uint16_t messages;
+  unsigned long interval_ms;
+  unsigned long loop_ms;
+  unsigned long jitter_us;
+  unsigned long baud;
+  uint8_t raw;
+  uint8_t dedup;
+  uint16_t unicast;
+  unsigned long seed;
+} sim_options_t;
+
+static sim_options_t options = {
+  2,       // bridges between the buses
+  3,       // nodes, on each bus in addition to the bridges
+  1000,    // messages
+  50,      // interval_ms
+  10,      // loop_ms
+  200,     // jitter_us, random extra delivery delay
+  115200,  // baud
+  0,       // raw
+  1,       // dedup
+  0,       // unicast messages between broadcasts
+  1        // seed
+};
+
+struct sim_node_s;
+
+typedef struct {
+  struct sim_node_s *node;
+  uint8_t bus;
+  NativeSocket socket;
+  byte buffer[sizeof (native_socket_hdr_t) + HMTL_MAX_MSG_LEN];
+} sim_port_t;
+
+typedef struct sim_node_s {
+  socket_addr_t address;
+  uint8_t num_ports;
+  sim_port_t ports[NUM_BUSES];
+  Socket *sockets[NUM_BUSES];
+  unsigned long next_us;    // Simulation time of the next loop()
+  config_hdr_t config;
+  MessageHandler handler;
+  std::vector<uint8_t> processed; // Times each message was processed
+} sim_node_t;
+
+typedef struct {
+  unsigned long deliver_us;
+  uint8_t bus;
+  sim_port_t *from;
+  socket_addr_t destination;
+  byte length;
+  byte data[NATIVE_SOCKET_MAX_DATA];
+} sim_frame_t;
+
+TimeSync timesync;
+
+static std::vector<sim_node_t *> nodes;
+static std::vector<sim_frame_t> frames;
+static unsigned long sim_us = 0;
+static unsigned long bus_frames[NUM_BUSES];
+static unsigned long bus_wire_us[NUM_BUSES];
+static std::vector<unsigned long> msg_frames; // Frames sent for each message
+static unsigned long overflows = 0;
+
+static const char *bus_names[NUM_BUSES] = { "RS485", "RFM69" };
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [--bridges N] [--nodes N] [--messages N]\n"
+          "          [--interval-ms N] [--loop-ms N] [--jitter-us N] "
+          "[--baud N]\n"
+          "          [--raw 0|1] [--dedup 0|1] [--unicast N] [--seed N]\n",
+          name);
+  exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) usage(argv[0]);
+    const char *arg = argv[i];
+    const char *val = argv[++i];
+
+    if (strcmp(arg, "--bridges") == 0) {
+      options.bridges = atoi(val);
+    } else if (strcmp(arg, "--nodes") == 0) {
+      options.nodes = atoi(val);
+    } else if (strcmp(arg, "--messages") == 0) {
+      options.messages = atoi(val);
+    } else if (strcmp(arg, "--interval-ms") == 0) {
+      options.interval_ms = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--loop-ms") == 0) {
+      options.loop_ms = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--jitter-us") == 0) {
+      options.jitter_us = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--baud") == 0) {
+      options.baud = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--raw") == 0) {
+      options.raw = atoi(val);
+    } else if (strcmp(arg, "--dedup") == 0) {
+      options.dedup = atoi(val);
+    } else if (strcmp(arg, "--unicast") == 0) {
+      options.unicast = atoi(val);
+    } else if (strcmp(arg, "--seed") == 0) {
+      options.seed = strtoul(val, NULL, 0);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if ((options.bridges < 1) || (options.nodes < 1) ||
+      (options.messages < 1) || (options.interval_ms < 1) ||
+      (options.loop_ms < 1) || (options.baud < 1)) {
+    usage(argv[0]);
+  }
+}
+
+/* Count a frame against the message it carries */
+static void count_frame(uint8_t bus, const byte *data, unsigned long wire_us) {
+  const msg_hdr_t *msg_hdr = (const msg_hdr_t *)data;
+  const msg_sim_t *msg_sim = (const msg_sim_t *)(msg_hdr + 1);
+  if ((msg_hdr->type == SIM_MSG_TYPE) && (msg_sim->id < msg_frames.size())) {
+    msg_frames[msg_sim->id]++;
+  }
+  bus_frames[bus]++;
+  bus_wire_us[bus] += wire_us;
+}
+
+/*
+ * Put a frame on a bus for the other modules on it, arriving after its
+ * transmission time plus a random delay.
+ */
+static void bus_send(NativeSocket *socket, socket_addr_t address,
+                     const byte *data, byte datalength, void *context) {
+  sim_port_t *from = (sim_port_t *)context;
+  unsigned long wire_us = (unsigned long)datalength * 10 * 1000000 /
+                          options.baud;
+
+  sim_frame_t frame;
+  frame.deliver_us = sim_us + wire_us +
+                     (options.jitter_us ? random(options.jitter_us) : 0);
+  frame.bus = from->bus;
+  frame.from = from;
+  frame.destination = address;
+  frame.length = datalength;
+  memcpy(frame.data, data, datalength);
+  frames.push_back(frame);
+
+  count_frame(from->bus, data, wire_us);
+}
+
+/* Count each time a module processes one of the simulation's messages */
+static uint16_t handle_sim(MessageHandler *handler, msg_hdr_t *msg_hdr,
+                           Socket *src, Socket *serial_socket,
+                           config_hdr_t *config) {
+  msg_sim_t *msg_sim = (msg_sim_t *)(msg_hdr + 1);
+  for (uint16_t n = 0; n < nodes.size(); n++) {
+    if ((&nodes[n]->handler == handler) &&
+        (msg_sim->id < nodes[n]->processed.size())) {
+      nodes[n]->processed[msg_sim->id]++;
+    }
+  }
+  return 0;
+}
+
+const msg_handler_t sim_handlers[] PROGMEM = {
+  { SIM_MSG_TYPE, handle_sim }
+};
+
+static sim_node_t *add_node(socket_addr_t address, boolean bridge,
+                            uint8_t bus) {
+  sim_node_t *node = new sim_node_t();
+  node->address = address;
+  node->num_ports = bridge ? NUM_BUSES : 1;
+  for (uint8_t p = 0; p < node->num_ports; p++) {
+    sim_port_t *port = &node->ports[p];
+    port->node = node;
+    port->bus = bridge ? p : bus;
+    port->socket.sourceAddress = address;
+    port->socket.initBuffer(port->buffer, sizeof (port->buffer));
+    port->socket.setSendHook(bus_send, port);
+    node->sockets[p] = &port->socket;
+  }
+
+  memset(&node->config, 0, sizeof (node->config));
+  node->config.magic = HMTL_CONFIG_MAGIC;
+  node->config.protocol_version = HMTL_CONFIG_VERSION;
+  node->config.address = address;
+
+  node->handler = MessageHandler(address, NULL, node->sockets,
+                                 node->num_ports, sim_handlers,
+                                 MSG_HANDLER_COUNT(sim_handlers));
+  node->next_us = random(options.loop_ms * 1000);
+  node->processed.resize(options.messages, 0);
+  nodes.push_back(node);
+  return node;
+}
+
+/*
+ * Deliver a frame to every socket on its bus but the sender's.  As with the
+ * RS485 and radio sockets, modules only receive frames to their address or
+ * the broadcast address.  Without duplicate suppression the origin is removed
+ * so that copies can't be recognized.
+ */
+static void deliver(sim_frame_t *frame) {
+  if (!options.dedup) {
+    msg_hdr_t *msg_hdr = (msg_hdr_t *)frame->data;
+    msg_hdr->source = SOCKET_ADDR_INVALID;
+#ifdef HMTL_USE_CRC
+    hmtl_msg_set_crc(msg_hdr);
+#endif
+  }
+
+  socket_addr_t source = frame->from ? frame->from->node->address :
+                         CONTROLLER_ADDRESS;
+  for (uint16_t n = 0; n < nodes.size(); n++) {
+    for (uint8_t p = 0; p < nodes[n]->num_ports; p++) {
+      sim_port_t *port = &nodes[n]->ports[p];
+      if ((port->bus != frame->bus) || (port == frame->from)) continue;
+      if ((frame->destination != SOCKET_ADDR_ANY) &&
+          (frame->destination != nodes[n]->address)) {
+        continue;
+      }
+
+      if (!port->socket.inject(source, frame->destination, frame->data,
+                               frame->length)) {
+        overflows++;
+      }
+    }
+  }
+}
+
+/* Send the next message from the controller */
+static void send_message(sim_node_t *origin, socket_addr_t address,
+                         uint8_t type, uint16_t id) {
+  byte buffer[SIM_MSG_LEN];
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)buffer;
+  msg_sim_t *msg_sim = (msg_sim_t *)(msg_hdr + 1);
+  hmtl_msg_fmt(msg_hdr, address, SIM_MSG_LEN, type, 0);
+  msg_sim->id = id;
+#ifdef HMTL_USE_CRC
+  hmtl_msg_set_crc(msg_hdr);
+#endif
+
+  if (options.raw) {
+    sim_frame_t frame;
+    frame.deliver_us = sim_us + (unsigned long)SIM_MSG_LEN * 10 * 1000000 /
+                                options.baud;
+    frame.bus = BUS_RS485;
+    frame.from = NULL;
+    frame.destination = address;
+    frame.length = SIM_MSG_LEN;
+    memcpy(frame.data, buffer, SIM_MSG_LEN);
+    frames.push_back(frame);
+    count_frame(BUS_RS485, buffer, frame.deliver_us - sim_us);
+  } else {
+    Serial.inject(buffer, SIM_MSG_LEN);
+    origin->handler.check_serial(&origin->config);
+    Serial.clear();
+  }
+}
+
+/* The part of a module's loop() that checks its sockets, as check() does */
+static void node_loop(sim_node_t *node) {
+  for (uint8_t p = 0; p < node->num_ports; p++) {
+    node->handler.check_socket(node->sockets[p], node->sockets[p],
+                               &node->config);
+  }
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
+  randomSeed(options.seed);
+  native_clock_manual(true);
+  native_clock_set(0);
+
+  for (uint16_t b = 0; b < options.bridges; b++) {
+    add_node(BRIDGE_ADDRESS + b, true, 0);
+  }
+  for (uint8_t bus = 0; bus < NUM_BUSES; bus++) {
+    for (uint16_t n = 0; n < options.nodes; n++) {
+      add_node(NODE_ADDRESS + bus * options.nodes + n, false, bus);
+    }
+  }
+  sim_node_t *origin = nodes[options.bridges];
+  msg_frames.resize(options.messages, 0);
+
+  /*
+   * Each MessageHandler set its module as the source, but the simulation's
+   * messages are sent by the controller
+   */
+  hmtl_msg_set_source(CONTROLLER_ADDRESS);
+
+  printf("Forwarding simulation\n");
+  printf("  bridges:%u nodes:%u per bus messages:%u interval:%lums "
+         "loop:%lums baud:%lu\n",
+         options.bridges, options.nodes, options.messages,
+         options.interval_ms, options.loop_ms, options.baud);
+  printf("  origin:%s dedup:%s ttl:%u seen cache:%u unicast:%u per msg\n",
+         options.raw ? "controller on RS485" : "controller serial to module",
+         options.dedup ? "on" : "off", HMTL_MSG_TTL, HMTL_SEEN_CACHE,
+         options.unicast);
+
+  /* Unicasts are spread evenly between the broadcasts */
+  uint16_t sent = 0;
+  uint16_t slot = 0;
+  unsigned long next_send_us = 0;
+  unsigned long slot_us = options.interval_ms * 1000 / (options.unicast + 1);
+  while ((sent < options.messages) || !frames.empty()) {
+    /* Advance to the next loop(), frame delivery or message */
+    unsigned long next_us = (unsigned long)-1;
+    if (sent < options.messages) next_us = next_send_us;
+    for (uint16_t i = 0; i < nodes.size(); i++) {
+      next_us = std::min(next_us, nodes[i]->next_us);
+    }
+    for (uint32_t i = 0; i < frames.size(); i++) {
+      next_us = std::min(next_us, frames[i].deliver_us);
+    }
+    if (next_us > sim_us) {
+      delayMicroseconds(next_us - sim_us);
+      sim_us = next_us;
+    }
+
+    if ((sent < options.messages) && (sim_us >= next_send_us)) {
+      if (slot == 0) {
+        send_message(origin, SOCKET_ADDR_ANY, SIM_MSG_TYPE, sent++);
+      } else {
+        send_message(origin, UNICAST_ADDRESS, SIM_UNICAST_TYPE, 0);
+      }
+      slot = (slot + 1) % (options.unicast + 1);
+      next_send_us += slot_us;
+    }
+
+    for (uint32_t i = 0; i < frames.size(); ) {
+      if (frames[i].deliver_us > sim_us) {
+        i++;
+        continue;
+      }
+      deliver(&frames[i]);
+      frames.erase(frames.begin() + i);
+    }
+
+    for (uint16_t i = 0; i < nodes.size(); i++) {
+      sim_node_t *node = nodes[i];
+      if (node->next_us > sim_us) continue;
+
+      /* Rendering time varies, so loops run every 1/2 to 3/2 of --loop-ms */
+      node_loop(node);
+      node->next_us = sim_us + random(options.loop_ms * 500,
+                                      options.loop_ms * 1500);
+    }
+
+    /* Finish handling the last messages once the buses are quiet */
+    if ((sent == options.messages) && frames.empty()) {
+      for (uint16_t i = 0; i < nodes.size(); i++) {
+        while ((nodes[i]->ports[0].socket.pending() > 0) ||
+               ((nodes[i]->num_ports > 1) &&
+                (nodes[i]->ports[1].socket.pending() > 0))) {
+          node_loop(nodes[i]);
+        }
+      }
+    }
+  }
+  unsigned long total = 0;
+  for (uint16_t id = 0; id < options.messages; id++) {
+    total += msg_frames[id];
+  }
+  unsigned long max_frames = *std::max_element(msg_frames.begin(),
+                                               msg_frames.end());
+
+  /*
+   * A message is put on the RS485 bus once, and each bridge forwards it at
+   * most once.  Other modules only have one socket, so they never forward.
+   */
+  unsigned long bound = 1 + options.bridges;
+
+  printf("  %-8s %10s %10s %10s\n", "bus", "frames", "per msg", "busy");
+  for (uint8_t bus = 0; bus < NUM_BUSES; bus++) {
+    printf("  %-8s %10lu %10.2f %9.1f%%\n", bus_names[bus], bus_frames[bus],
+           (double)bus_frames[bus] / options.messages,
+           100.0 * bus_wire_us[bus] / sim_us);
+  }
+
+  unsigned long missed = 0;
+  unsigned long repeated = 0;
+  uint8_t most = 0;
+  for (uint16_t n = 0; n < nodes.size(); n++) {
+    for (uint16_t id = 0; id < options.messages; id++) {
+      uint8_t count = nodes[n]->processed[id];
+      if (count == 0) missed++;
+      if (count > 1) repeated++;
+      most = std::max(most, count);
+    }
+  }
+
+  printf("Frames:        %.2f per msg, max %lu  (bound %lu)\n",
+         (double)total / options.messages, max_frames, bound);
+  printf("Processed:     %lu missed, %lu processed more than once "
+         "(at most %u times)  of %lu\n",
+         missed, repeated, most,
+         (unsigned long)nodes.size() * options.messages);
+  printf("Overflows:     %lu frames dropped by full receive queues\n",
+         overflows);
+
+  boolean passed = (max_frames <= bound) && (missed == 0) && (most <= 1) &&
+                   (overflows == 0);
+  printf("%s\n", passed ? "PASS" : "FAIL");
+  return passed ? 0 : 1;
+}
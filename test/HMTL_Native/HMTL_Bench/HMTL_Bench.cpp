@@ -0,0 +1,1465 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Native benchmark for the HMTL Module firmware.  The module sketch is built
+ * unmodified against the host stubs, configured through the emulated EEPROM,
+ * and then timed:
+ *
+ *  - loop() iterations per second, and pixel shows per second
+ *  - ProgramManager::run() cost per call
+ *  - Per-frame fade fraction cost, with map() and with hmtl_tween_fract8()
+ *  - Sparkle pixels/ms on 60, 150 and 300 pixel strips, before and after
+ *  - MessageHandler::check() cost per message, for serial and socket input
+ *  - MessageHandler::process_msg() dispatch cost, table versus switch
+ *  - Broadcast poll response latency and the longest loop() while waiting
+ *  - Longest loop() while a broadcast time sync burst is outstanding
+ *  - Forwarding cost for messages staged in and formatted in a send buffer
+ *  - How late timed messages are processed relative to their execution time
+ *  - Configuration dump over a socket, one EEPROM record per loop()
+ *  - Program switch cost and ProgramManager pool high-water marks
+ *  - Frame cost with layered programs composited onto a strip
+ *  - Frame cost with independent programs on segments of a strip, and strip
+ *    updates while a frame is streamed to one of them
+ *  - Bytes per frame and decode cost of streamed 300 pixel frames
+ *  - Framebuffer size and frame cost of RGB and palette-indexed strips
+ *  - Cost of receiving a batch as fragments versus as socket-sized batches
+ *  - Sensor broadcast cost per sensor record
+ *  - Scene recall from the EEPROM scene store versus per-program messages
+ *
+ * Usage: HMTL_Bench [--pixel-outputs N] [--value-outputs N] [--pixels N]
+ *                   [--program sparkle|circular|fade|blink|none]
+ *                   [--iterations N] [--messages N] [--advance-ms N]
+ *                   [--show-ns N] [--frame-ms N] [--segments N]
+ ******************************************************************************/
+
+#include "../../../HMTL_Module/HMTL_Module.ino"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+#define BENCH_ADDRESS 64
+#define BENCH_SOURCE  1
+
+typedef struct {
+  uint8_t pixel_outputs;
+  uint8_t value_outputs;
+  uint16_t num_pixels;
+  const char *program;
+  unsigned long iterations;
+  unsigned long messages;
+  unsigned long advance_ms;
+  unsigned long show_ns;
+  unsigned long frame_ms;
+  uint8_t segments;
+} bench_options_t;
+
+static bench_options_t options = {
+  1,          // pixel_outputs
+  1,          // value_outputs
+  150,        // num_pixels
+  "sparkle",  // program
+  20000,      // iterations
+  20000,      // messages
+  0,          // advance_ms, 0 uses the real clock
+  0,          // show_ns, emulated strip time per pixel
+  0,          // frame_ms, configured frame period
+  4           // segments, of the first pixel output
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start) {
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+          bench_clock::now() - start).count();
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [--pixel-outputs N] [--value-outputs N] [--pixels N]\n"
+          "          [--program sparkle|circular|fade|blink|none]\n"
+          "          [--iterations N] [--messages N] [--advance-ms N]\n"
+          "          [--show-ns N] [--frame-ms N] [--segments N]\n", name);
+  exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) usage(argv[0]);
+    const char *arg = argv[i];
+    const char *val = argv[++i];
+
+    if (strcmp(arg, "--pixel-outputs") == 0) {
+      options.pixel_outputs = atoi(val);
+    } else if (strcmp(arg, "--value-outputs") == 0) {
+      options.value_outputs = atoi(val);
+    } else if (strcmp(arg, "--pixels") == 0) {
+      options.num_pixels = atoi(val);
+    } else if (strcmp(arg, "--program") == 0) {
+      options.program = val;
+    } else if (strcmp(arg, "--iterations") == 0) {
+      options.iterations = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--messages") == 0) {
+      options.messages = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--advance-ms") == 0) {
+      options.advance_ms = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--show-ns") == 0) {
+      options.show_ns = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--frame-ms") == 0) {
+      options.frame_ms = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--segments") == 0) {
+      options.segments = atoi(val);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if ((options.pixel_outputs == 0) ||
+      (options.segments > options.num_pixels)) {
+    options.segments = 0;
+  }
+  if (options.segments > HMTL_MAX_SEGMENTS) {
+    fprintf(stderr, "At most %d segments may be configured\n",
+            HMTL_MAX_SEGMENTS);
+    exit(1);
+  }
+
+  /* One output is always used by the RS485 socket, and one for segments */
+  byte reserved = (options.segments ? 2 : 1);
+  if (options.pixel_outputs + options.value_outputs + reserved >
+      HMTL_MAX_OUTPUTS) {
+    fprintf(stderr, "At most %d outputs may be configured\n",
+            HMTL_MAX_OUTPUTS - reserved);
+    exit(1);
+  }
+
+  if ((options.frame_ms % HMTL_FRAME_UNIT_MS) ||
+      (HMTL_FRAME_PERIOD(HMTL_FLAG_FRAME_MASK) < options.frame_ms)) {
+    fprintf(stderr, "Frame period must be a multiple of %dms up to %dms\n",
+            HMTL_FRAME_UNIT_MS, HMTL_FRAME_PERIOD(HMTL_FLAG_FRAME_MASK));
+    exit(1);
+  }
+}
+
+/*
+ * Write a module configuration into the emulated EEPROM so that the sketch's
+ * setup() reads it exactly as it would on hardware.
+ */
+static void write_config() {
+  config_hdr_t hdr;
+  config_max_t configs[HMTL_MAX_OUTPUTS];
+  output_hdr_t *configured[HMTL_MAX_OUTPUTS];
+  uint8_t num = 0;
+  uint8_t pin = 2;
+
+  memset(&hdr, 0, sizeof (hdr));
+  memset(configs, 0, sizeof (configs));
+  hdr.hardware_version = 1;
+  hdr.baud = BAUD_TO_BYTE(BAUD);
+  hdr.device_id = 1;
+  hdr.address = BENCH_ADDRESS;
+  hdr.flags = (options.frame_ms / HMTL_FRAME_UNIT_MS) << HMTL_FLAG_FRAME_SHIFT;
+
+  for (uint8_t i = 0; i < options.pixel_outputs; i++, num++) {
+    config_pixels_t *out = (config_pixels_t *)&configs[num];
+    out->hdr.type = HMTL_OUTPUT_PIXELS;
+    out->hdr.output = num;
+    out->clockPin = pin++;
+    out->dataPin = pin++;
+    out->numPixels = options.num_pixels;
+    configured[num] = &out->hdr;
+  }
+
+  for (uint8_t i = 0; i < options.value_outputs; i++, num++) {
+    config_value_t *out = (config_value_t *)&configs[num];
+    out->hdr.type = HMTL_OUTPUT_VALUE;
+    out->hdr.output = num;
+    out->pin = pin++;
+    configured[num] = &out->hdr;
+  }
+
+  config_rs485_t *rs485_out = (config_rs485_t *)&configs[num];
+  rs485_out->hdr.type = HMTL_OUTPUT_RS485;
+  rs485_out->hdr.output = num;
+  rs485_out->recvPin = pin++;
+  rs485_out->xmitPin = pin++;
+  rs485_out->enablePin = pin++;
+  configured[num] = &rs485_out->hdr;
+  num++;
+
+  if (options.segments) {
+    /* Split the first pixel output into equal segments */
+    config_segments_t *out = (config_segments_t *)&configs[num];
+    out->hdr.type = HMTL_OUTPUT_SEGMENTS;
+    out->hdr.output = num;
+    out->pixels_output = 0;
+    out->start = 0;
+    out->length = options.num_pixels / options.segments;
+    out->count = options.segments;
+    configured[num] = &out->hdr;
+    num++;
+  }
+
+  hdr.num_outputs = num;
+  if (hmtl_write_config(&hdr, configured) < 0) {
+    fprintf(stderr, "Failed to write configuration\n");
+    exit(1);
+  }
+}
+
+/*
+ * Start the selected program on every output that supports it
+ */
+static void start_programs() {
+  byte buffer[HMTL_MSG_PROGRAM_LEN];
+  msg_hdr_t *msg = (msg_hdr_t *)buffer;
+
+  for (byte i = 0; i < config.num_outputs; i++) {
+    if (outputs[i] == NULL) continue;
+
+    boolean formatted = true;
+    if (outputs[i]->type == HMTL_OUTPUT_PIXELS) {
+      if (strcmp(options.program, "sparkle") == 0) {
+        program_sparkle_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, i,
+                            50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+      } else if (strcmp(options.program, "circular") == 0) {
+        program_circular_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, i,
+                             25, options.num_pixels / 8, CRGB::Black, 1, 0);
+      } else if (strcmp(options.program, "fade") == 0) {
+        hmtl_program_fade_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, i,
+                              1000, CRGB(255, 0, 0), CRGB(0, 0, 255),
+                              HMTL_FADE_FLAG_CYCLE);
+      } else if (strcmp(options.program, "blink") == 0) {
+        hmtl_program_blink_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, i,
+                               100, pixel_color(255, 255, 255),
+                               100, pixel_color(0, 0, 0));
+      } else {
+        formatted = false;
+      }
+    } else if (outputs[i]->type == HMTL_OUTPUT_VALUE) {
+      hmtl_program_blink_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, i,
+                             100, pixel_color(255, 255, 255),
+                             100, pixel_color(0, 0, 0));
+    } else {
+      formatted = false;
+    }
+
+    if (formatted) {
+      handler.process_msg(msg, sockets[0], sockets[0], &config);
+    }
+  }
+}
+
+/*
+ * Format the message used to time MessageHandler::check(), a value message
+ * if a value output exists or otherwise an RGB message to the first output.
+ */
+static uint16_t format_bench_msg(byte *buffer, uint16_t size) {
+  byte output = manager.lookup_output_by_type(HMTL_OUTPUT_VALUE);
+  if (output != HMTL_NO_OUTPUT) {
+    return hmtl_value_fmt(buffer, size, BENCH_ADDRESS, output, 128);
+  }
+  return hmtl_rgb_fmt(buffer, size, BENCH_ADDRESS, 0, 0, 128, 255);
+}
+
+static void clock_step() {
+  if (options.advance_ms) native_clock_advance(options.advance_ms);
+}
+
+static void bench_loop() {
+  unsigned long shows = pixels.shows;
+  unsigned long start_ms = millis();
+
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.iterations; i++) {
+    loop();
+    clock_step();
+  }
+  double ns = elapsed_ns(start);
+
+  double seconds = ns / 1e9;
+  printf("loop():                    %12.0f iterations/s  %10.1f shows/s\n",
+         options.iterations / seconds, (pixels.shows - shows) / seconds);
+
+  /* Frame rate and jitter as seen by the module's clock */
+  unsigned long module_ms = millis() - start_ms;
+  byte strips = options.pixel_outputs ? options.pixel_outputs : 1;
+  printf("  module time:%lums  %.1f shows/s per strip  "
+         "jitter avg:%luus max:%luus\n",
+         module_ms,
+         module_ms ? (pixels.shows - shows) * 1000.0 / module_ms / strips : 0,
+         frame_count ? frame_jitter_total_us / frame_count : 0,
+         frame_jitter_max_us);
+}
+
+static void bench_run() {
+  unsigned long updates = 0;
+
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.iterations; i++) {
+    if (manager.run()) updates++;
+    clock_step();
+  }
+  double ns = elapsed_ns(start);
+
+  printf("ProgramManager::run():     %12.1f ns/call       %10.1f%% updating\n",
+         ns / options.iterations, 100.0 * updates / options.iterations);
+}
+
+/*
+ * Time the per-frame fraction calculation of a fade, the map() division it
+ * used against the precomputed rate with and without an easing curve.
+ */
+static void bench_tween() {
+  volatile uint32_t period = 1000 + options.iterations;
+  volatile uint8_t sink = 0;
+  hmtl_tween_t tween;
+  hmtl_tween_start(&tween, 0, period);
+
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.iterations; i++) {
+    sink ^= (fract8)map(i, 0, period, 0, 255);
+  }
+  double map_ns = elapsed_ns(start);
+
+  start = bench_clock::now();
+  for (unsigned long i = 0; i < options.iterations; i++) {
+    sink ^= hmtl_tween_fract8(&tween, i, period, HMTL_EASE_LINEAR);
+  }
+  double linear_ns = elapsed_ns(start);
+
+  start = bench_clock::now();
+  for (unsigned long i = 0; i < options.iterations; i++) {
+    sink ^= hmtl_tween_fract8(&tween, i, period, HMTL_EASE_IN_OUT);
+  }
+  double eased_ns = elapsed_ns(start);
+
+  printf("Fade fraction:             %12.2f ns/frame      (map() %.2f, "
+         "eased %.2f)\n",
+         linear_ns / options.iterations, map_ns / options.iterations,
+         eased_ns / options.iterations);
+}
+
+/*
+ * program_sparkle()'s frame as it was, a random() call per pixel and per
+ * color channel with the pixels set through setPixelRGB().
+ */
+static void sparkle_reference(PixelUtil *strip,
+                              const hmtl_program_sparkle_t *msg) {
+  for (PIXEL_ADDR_TYPE led = 0; led < strip->numPixels(); led++) {
+    byte rand = (byte)random(100);
+    if (rand <= msg->sparkle_threshold) {
+      CRGB color = CHSV(msg->hue_min +
+                                (uint8_t)random(msg->hue_max - msg->hue_min),
+                        msg->sat_min +
+                                (uint8_t)random(msg->sat_max - msg->sat_min),
+                        msg->val_min +
+                                (uint8_t)random(msg->val_max - msg->val_min));
+      strip->setPixelRGB(led, color);
+    } else if (rand <= msg->bg_threshold) {
+      strip->setPixelRGB(led, msg->bgColor);
+    }
+  }
+}
+
+/*
+ * Time sparkle frames on 60, 150 and 300 pixel strips, with the original
+ * per-pixel random() kernel and with program_sparkle()
+ */
+static void bench_sparkle() {
+  static const uint16_t strip_pixels[] = { 60, 150, 300 };
+  unsigned long frames = options.iterations / 10 + 1;
+
+  byte buffer[HMTL_MSG_PROGRAM_LEN];
+  program_sparkle_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, 0,
+                      50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+  msg_program_t *msg = (msg_program_t *)((msg_hdr_t *)buffer + 1);
+
+  config_pixels_t output;
+  output.hdr.type = HMTL_OUTPUT_PIXELS;
+
+  for (byte i = 0; i < sizeof (strip_pixels) / sizeof (strip_pixels[0]); i++) {
+    PixelUtil strip(strip_pixels[i], 0, 0);
+    program_tracker_t tracker = { 0, 0, &output.hdr, NULL, &strip };
+    program_sparkle_init(msg, &tracker, &output.hdr, &strip, &manager);
+    state_sparkle_t *state = (state_sparkle_t *)tracker.state;
+    state->msg.period = 0; // Produce a frame on every call
+
+    /* The reference uses the same thresholds with the original maximums */
+    hmtl_program_sparkle_t reference = state->msg;
+    reference.hue_max += reference.hue_min;
+    reference.sat_max += reference.sat_min;
+    reference.val_max += reference.val_min;
+
+    /* Untimed frames so that both start with a warm cache */
+    sparkle_reference(&strip, &reference);
+    program_sparkle(&output.hdr, &strip, &tracker);
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long f = 0; f < frames; f++) {
+      sparkle_reference(&strip, &reference);
+    }
+    double before_ns = elapsed_ns(start);
+
+    start = bench_clock::now();
+    for (unsigned long f = 0; f < frames; f++) {
+      program_sparkle(&output.hdr, &strip, &tracker);
+    }
+    double after_ns = elapsed_ns(start);
+
+    manager.free_program_state(&tracker);
+
+    double pixels_total = (double)frames * strip_pixels[i];
+    printf("Sparkle %3u pixels:        %12.0f pixels/ms     (random() %.0f)\n",
+           strip_pixels[i], pixels_total / (after_ns / 1e6),
+           pixels_total / (before_ns / 1e6));
+  }
+}
+
+static void bench_check_socket() {
+  byte buffer[HMTL_MAX_MSG_LEN];
+  uint16_t len = format_bench_msg(buffer, sizeof (buffer));
+  unsigned long processed = 0;
+  double ns = 0;
+
+  while (processed < options.messages) {
+    while ((processed + rs485.pending() < options.messages) &&
+           rs485.inject(BENCH_SOURCE, BENCH_ADDRESS, buffer, len));
+
+    unsigned long batch = rs485.pending();
+    bench_clock::time_point start = bench_clock::now();
+    while (rs485.pending()) {
+      handler.check(&config);
+    }
+    ns += elapsed_ns(start);
+    processed += batch;
+  }
+
+  printf("MessageHandler::check():   %12.1f ns/msg        (socket, %u bytes)\n",
+         ns / processed, len);
+}
+
+static void bench_check_serial() {
+  byte buffer[HMTL_MAX_MSG_LEN];
+  uint16_t len = format_bench_msg(buffer, sizeof (buffer));
+  unsigned long processed = 0;
+  double ns = 0;
+
+  while (processed < options.messages) {
+    unsigned long batch = 0;
+    while ((processed + batch < options.messages) &&
+           (Serial.available() + len <= NATIVE_SERIAL_BUFFER)) {
+      Serial.inject(buffer, len);
+      batch++;
+    }
+
+    bench_clock::time_point start = bench_clock::now();
+    while (Serial.available()) {
+      handler.check(&config);
+    }
+    ns += elapsed_ns(start);
+    processed += batch;
+  }
+
+  printf("MessageHandler::check():   %12.1f ns/msg        (serial, %u bytes)\n",
+         ns / processed, len);
+}
+
+/*
+ * Send sequenced serial messages a window at a time as a pipelining host
+ * would, reporting the acknowledgement bytes sent back per message.
+ */
+static void bench_sequenced() {
+  const byte window = 8;
+  byte buffer[HMTL_MAX_MSG_LEN + 2];
+  uint16_t len = format_bench_msg(buffer + 2, sizeof (buffer) - 2) + 2;
+  unsigned long written = Serial.bytes_written;
+  unsigned long processed = 0;
+  byte sequence = 0;
+  double ns = 0;
+
+  while (processed < options.messages) {
+    unsigned long batch = 0;
+    while ((processed + batch < options.messages) && (batch < window)) {
+      buffer[0] = (processed + batch == 0) ? HMTL_SERIAL_SEQ_SYNC :
+                  HMTL_SERIAL_SEQ;
+      buffer[1] = sequence++;
+      Serial.inject(buffer, len);
+      batch++;
+    }
+
+    bench_clock::time_point start = bench_clock::now();
+    while (Serial.available()) {
+      handler.check(&config);
+    }
+    ns += elapsed_ns(start);
+    processed += batch;
+  }
+
+  printf("MessageHandler::check():   %12.1f ns/msg        "
+         "(sequenced, window %u, %.2f ack bytes/msg vs %u)\n",
+         ns / processed, window,
+         (double)(Serial.bytes_written - written) / processed,
+         (unsigned int)strlen(HMTL_ACK "\r\n"));
+}
+
+/*
+ * Time the message CRC over a full batch-sized message
+ */
+static void bench_crc() {
+  byte buffer[HMTL_MSG_BATCH_MAX_LEN];
+  for (byte i = 0; i < sizeof (buffer); i++) buffer[i] = i * 7;
+  hmtl_msg_fmt((msg_hdr_t *)buffer, BENCH_ADDRESS, sizeof (buffer), 0x7F);
+
+  volatile uint8_t crc = 0;
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.messages; i++) {
+    crc ^= hmtl_msg_crc((msg_hdr_t *)buffer);
+  }
+  double ns = elapsed_ns(start);
+
+  printf("hmtl_msg_crc():            %12.2f ns/byte       (%u bytes)\n",
+         ns / (options.messages * sizeof (buffer)),
+         (unsigned int)sizeof (buffer));
+}
+
+/*
+ * process_msg() as it dispatched before the handler table, a switch over the
+ * standard message types calling the same handlers.
+ */
+static uint16_t switch_process_msg(msg_hdr_t *msg_hdr, Socket *src,
+                                   Socket *serial_socket,
+                                   config_hdr_t *config) {
+  if (msg_hdr->version != HMTL_MSG_VERSION) {
+    return 0;
+  }
+
+  if ((msg_hdr->address != BENCH_ADDRESS) &&
+      (msg_hdr->address != SOCKET_ADDR_ANY)) {
+    return 0;
+  }
+
+  if ((msg_hdr->flags & MSG_FLAG_ACK) &&
+      (msg_hdr->address != SOCKET_ADDR_ANY)) {
+    Serial.write((byte *)msg_hdr, msg_hdr->length);
+    if (msg_hdr->type != MSG_TYPE_SENSOR) {
+      return 0;
+    }
+  }
+
+  switch (msg_hdr->type) {
+    case MSG_TYPE_OUTPUT:
+      return MessageHandler::handle_output(&handler, msg_hdr, src,
+                                           serial_socket, config);
+    case MSG_TYPE_POLL:
+      return MessageHandler::handle_poll(&handler, msg_hdr, src,
+                                         serial_socket, config);
+    case MSG_TYPE_SET_ADDR:
+      return MessageHandler::handle_set_addr(&handler, msg_hdr, src,
+                                             serial_socket, config);
+    case MSG_TYPE_SENSOR:
+      return MessageHandler::handle_sensor(&handler, msg_hdr, src,
+                                           serial_socket, config);
+    case MSG_TYPE_TIMESYNC:
+      return MessageHandler::handle_timesync(&handler, msg_hdr, src,
+                                             serial_socket, config);
+    case MSG_TYPE_BATCH:
+      return MessageHandler::handle_batch(&handler, msg_hdr, src,
+                                          serial_socket, config);
+    case MSG_TYPE_TIMED:
+      return MessageHandler::handle_timed(&handler, msg_hdr, src,
+                                          serial_socket, config);
+    case MSG_TYPE_PIXEL_FRAME:
+      return MessageHandler::handle_pixel_frame(&handler, msg_hdr, src,
+                                                serial_socket, config);
+    case MSG_TYPE_FRAGMENT:
+      return MessageHandler::handle_fragment(&handler, msg_hdr, src,
+                                             serial_socket, config);
+    case MSG_TYPE_SCENE:
+      return MessageHandler::handle_scene(&handler, msg_hdr, src,
+                                          serial_socket, config);
+    case MSG_TYPE_DUMP_CONFIG:
+      return MessageHandler::handle_dump_config(&handler, msg_hdr, src,
+                                                serial_socket, config);
+  }
+
+  return 0;
+}
+
+/*
+ * Time process_msg() directly for an output message and for a message type
+ * with no handler, the latter being the cost of dispatch alone, with the
+ * handler table and with the switch it replaced.
+ */
+static void bench_dispatch() {
+  byte value[HMTL_MAX_MSG_LEN];
+  byte unhandled[HMTL_MAX_MSG_LEN];
+  format_bench_msg(value, sizeof (value));
+  memcpy(unhandled, value, sizeof (unhandled));
+  ((msg_hdr_t *)unhandled)->type = 0x7F;
+
+  const char *names[] = { "output", "unhandled" };
+  msg_hdr_t *msgs[] = { (msg_hdr_t *)value, (msg_hdr_t *)unhandled };
+
+  for (byte m = 0; m < 2; m++) {
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long i = 0; i < options.messages; i++) {
+      switch_process_msg(msgs[m], sockets[0], sockets[0], &config);
+    }
+    double before_ns = elapsed_ns(start);
+
+    start = bench_clock::now();
+    for (unsigned long i = 0; i < options.messages; i++) {
+      handler.process_msg(msgs[m], sockets[0], sockets[0], &config);
+    }
+    double ns = elapsed_ns(start);
+
+    printf("MessageHandler::process_msg(): %8.1f ns/msg        "
+           "(%s, switch %.1f)\n",
+           ns / options.messages, names[m], before_ns / options.messages);
+  }
+
+  // Pack as many copies of the output message as fit in a single batch
+  byte batch[HMTL_MSG_BATCH_MAX_LEN];
+  unsigned int entries = 0;
+  hmtl_batch_fmt(batch, sizeof (batch), BENCH_ADDRESS);
+  while (hmtl_batch_add(batch, sizeof (batch), (msg_hdr_t *)value)) {
+    entries++;
+  }
+
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.messages; i++) {
+    handler.process_msg((msg_hdr_t *)batch, sockets[0], sockets[0], &config);
+  }
+  double ns = elapsed_ns(start);
+
+  printf("MessageHandler::process_msg(): %8.1f ns/msg        "
+         "(batch of %u, %u bytes vs %u)\n",
+         ns / (options.messages * entries), entries,
+         ((msg_hdr_t *)batch)->length,
+         entries * ((msg_hdr_t *)value)->length);
+}
+
+/*
+ * Send broadcast polls over the socket and run loop() until each response is
+ * sent, recording the response latency and the longest single loop() call.
+ */
+static void bench_poll() {
+  byte buffer[sizeof (msg_hdr_t)];
+  uint16_t len = sizeof (msg_hdr_t);
+  hmtl_msg_fmt((msg_hdr_t *)buffer, SOCKET_ADDR_ANY, len, MSG_TYPE_POLL);
+
+  const byte polls = 10;
+  unsigned long latency_total = 0;
+  double loop_max_ns = 0;
+
+  for (byte p = 0; p < polls; p++) {
+    unsigned long sent = rs485.msgs_sent;
+    unsigned long start_ms = millis();
+    rs485.inject(BENCH_SOURCE, SOCKET_ADDR_ANY, buffer, len);
+
+    while (rs485.msgs_sent == sent) {
+      bench_clock::time_point start = bench_clock::now();
+      loop();
+      double ns = elapsed_ns(start);
+      if (ns > loop_max_ns) loop_max_ns = ns;
+      clock_step();
+    }
+    latency_total += millis() - start_ms;
+  }
+
+  printf("Broadcast poll:            %12.1f ms latency     %10.3f ms max loop()\n",
+         (double)latency_total / polls, loop_max_ns / 1e6);
+}
+
+/*
+ * Start a broadcast time synchronization burst from this module, which no
+ * other module answers, and run loop() until it ends, recording the longest
+ * single loop() call while it was outstanding.
+ */
+static void bench_timesync() {
+  unsigned long loops = 0;
+  double loop_max_ns = 0;
+  unsigned long start_ms = millis();
+
+  timesync.synchronize(&rs485, SOCKET_ADDR_ANY, NULL);
+  while (timesync.update()) {
+    bench_clock::time_point start = bench_clock::now();
+    loop();
+    double ns = elapsed_ns(start);
+    if (ns > loop_max_ns) loop_max_ns = ns;
+    loops++;
+    clock_step();
+  }
+
+  printf("Time sync burst:           %12.1f ms max loop()  %10lu loops in %lu ms\n",
+         loop_max_ns / 1e6, loops, millis() - start_ms);
+}
+
+/*
+ * Forward a message for another address over the socket with
+ * check_and_forward(), from a separate buffer as for received messages and
+ * from the socket's send buffer as for messages formatted in place.
+ */
+static void bench_forward() {
+  byte buffer[HMTL_MAX_MSG_LEN];
+  uint16_t len = hmtl_rgb_fmt(buffer, sizeof (buffer), BENCH_ADDRESS + 1,
+                              0, 0, 128, 255);
+  msg_hdr_t *msgs[] = { (msg_hdr_t *)buffer,
+                        (msg_hdr_t *)rs485.send_buffer };
+  const char *names[] = { "staged", "in place" };
+
+  for (byte m = 0; m < 2; m++) {
+    memcpy(rs485.send_buffer, buffer, len);
+    unsigned long sent = rs485.msgs_sent;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long i = 0; i < options.messages; i++) {
+      handler.check_and_forward(msgs[m], &rs485);
+    }
+    double ns = elapsed_ns(start);
+
+    printf("Forwarding:                %12.1f ns/msg        "
+           "(%s, %lu msgs of %u bytes)\n",
+           ns / options.messages, names[m], rs485.msgs_sent - sent, len);
+  }
+}
+
+/*
+ * Queue timed messages over the socket with shuffled execution times, then run
+ * loop() until all have been processed, recording how late each was processed.
+ */
+static void bench_timed() {
+  byte value[HMTL_MAX_MSG_LEN];
+  byte timed[HMTL_MAX_MSG_LEN];
+  format_bench_msg(value, sizeof (value));
+
+  const byte rounds = 20;
+  unsigned long late_total = 0, late_max = 0, processed = 0;
+
+  for (byte r = 0; r < rounds; r++) {
+    uint32_t due[MSG_PENDING_QUEUE];
+    uint32_t now = (uint32_t)timesync.ms();
+    for (byte i = 0; i < MSG_PENDING_QUEUE; i++) {
+      due[i] = now + 5 + ((i * 3) % MSG_PENDING_QUEUE) * 2;
+      uint16_t len = hmtl_timed_fmt(timed, sizeof (timed), due[i],
+                                    (msg_hdr_t *)value);
+      rs485.inject(BENCH_SOURCE, BENCH_ADDRESS, timed, len);
+    }
+    std::sort(due, due + MSG_PENDING_QUEUE);
+
+    byte next = 0;
+    while (rs485.pending() || handler.pending_count()) {
+      loop();
+
+      byte fired = MSG_PENDING_QUEUE - rs485.pending() -
+                   handler.pending_count();
+      for ( ; next < fired; next++) {
+        unsigned long late = (uint32_t)timesync.ms() - due[next];
+        late_total += late;
+        if (late > late_max) late_max = late;
+        processed++;
+      }
+      clock_step();
+    }
+  }
+
+  printf("Timed messages:            %12.2f ms late avg   %10lu ms max "
+         "(%u queued)\n",
+         (double)late_total / processed, late_max, MSG_PENDING_QUEUE);
+}
+
+typedef struct {
+  unsigned long messages;
+  unsigned long bytes;
+  boolean done;
+} dump_result_t;
+
+static void dump_hook(NativeSocket *socket, socket_addr_t address,
+                      const byte *data, byte datalength, void *context) {
+  dump_result_t *result = (dump_result_t *)context;
+  msg_hdr_t *msg_hdr = (msg_hdr_t *)data;
+  if (msg_hdr->type != MSG_TYPE_DUMP_CONFIG) return;
+
+  result->messages++;
+  result->bytes += datalength;
+  if (!(msg_hdr->flags & MSG_FLAG_MORE_DATA)) {
+    result->done = true;
+  }
+}
+
+/*
+ * Request a configuration dump over the socket and run loop() until the
+ * final record has been sent.
+ */
+static void bench_dump() {
+  byte buffer[sizeof (msg_hdr_t)];
+  uint16_t len = sizeof (msg_hdr_t);
+  hmtl_msg_fmt((msg_hdr_t *)buffer, BENCH_ADDRESS, len, MSG_TYPE_DUMP_CONFIG);
+
+  dump_result_t result = { 0, 0, false };
+  rs485.setSendHook(dump_hook, &result);
+  rs485.inject(BENCH_SOURCE, BENCH_ADDRESS, buffer, len);
+
+  unsigned long loops = 0;
+  double loop_max_ns = 0;
+  while (!result.done && (loops < 1000)) {
+    bench_clock::time_point start = bench_clock::now();
+    loop();
+    double ns = elapsed_ns(start);
+    if (ns > loop_max_ns) loop_max_ns = ns;
+    clock_step();
+    loops++;
+  }
+  rs485.setSendHook(NULL, NULL);
+
+  printf("Config dump:               %12lu messages      %10lu bytes  "
+         "%lu loops  %.3f ms max loop()%s\n",
+         result.messages, result.bytes, loops, loop_max_ns / 1e6,
+         result.done ? "" : " INCOMPLETE");
+}
+
+/*
+ * Repeatedly switch the program running on every output
+ */
+static void bench_switch() {
+  byte blink[HMTL_MSG_PROGRAM_LEN];
+  byte fade[HMTL_MSG_PROGRAM_LEN];
+  hmtl_program_blink_fmt(blink, sizeof (blink), BENCH_ADDRESS,
+                         HMTL_ALL_OUTPUTS, 100, pixel_color(255, 255, 255),
+                         100, pixel_color(0, 0, 0));
+  hmtl_program_fade_fmt(fade, sizeof (fade), BENCH_ADDRESS, HMTL_ALL_OUTPUTS,
+                        1000, CRGB(255, 0, 0), CRGB(0, 0, 255), 0);
+
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.messages; i++) {
+    msg_hdr_t *msg = (msg_hdr_t *)((i & 0x1) ? fade : blink);
+    handler.process_msg(msg, sockets[0], sockets[0], &config);
+  }
+  double ns = elapsed_ns(start);
+
+  program_pool_stats_t *stats = &manager.pool_stats;
+  printf("Program switch:            %12.1f ns/msg\n", ns / options.messages);
+  printf("  trackers:%u/%u states:%u/%u (used/max) "
+         "largest state:%u/%u failed states:%u\n",
+         stats->trackers_used, stats->trackers_max,
+         stats->states_used, stats->states_max,
+         stats->state_size_max, PROGRAM_STATE_SIZE, stats->states_failed);
+}
+
+/*
+ * Time frames of a sparkle program on the first pixel output, alone and
+ * with a circular layer added to it and a fade layer blended over a quarter
+ * of the strip.  Every frame updates, so each layered frame is composited.
+ */
+static double time_frames(unsigned long frames) {
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < frames; i++) {
+    native_clock_advance(50);
+    manager.run();
+  }
+  return elapsed_ns(start) / frames;
+}
+
+static void bench_layers() {
+  byte output = manager.lookup_output_by_type(HMTL_OUTPUT_PIXELS);
+  if (output == HMTL_NO_OUTPUT) return;
+
+  byte buffer[HMTL_MSG_PROGRAM_LEN];
+  msg_hdr_t *msg = (msg_hdr_t *)buffer;
+  unsigned long frames = options.iterations / 10 + 1;
+  native_clock_manual(true);
+
+  hmtl_program_cancel_fmt(buffer, sizeof (buffer), BENCH_ADDRESS,
+                          HMTL_ALL_OUTPUTS);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  program_sparkle_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                      50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  double base_ns = time_frames(frames);
+
+  program_circular_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                       25, options.num_pixels / 8, CRGB::Black, 1, 0);
+  hmtl_program_layer_fmt(buffer, sizeof (buffer), 1, HMTL_BLEND_ADD, 0, 0, 0);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  hmtl_program_fade_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                        1000, CRGB(255, 0, 0), CRGB(0, 0, 255),
+                        HMTL_FADE_FLAG_CYCLE);
+  hmtl_program_layer_fmt(buffer, sizeof (buffer), 2, HMTL_BLEND_ALPHA, 128,
+                         0, options.num_pixels / 4);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  double layered_ns = time_frames(frames);
+
+  program_pool_stats_t *stats = &manager.pool_stats;
+  printf("Layered frame:             %12.1f ns/frame      (base only %.1f, "
+         "layers:%u/%u)\n",
+         layered_ns, base_ns, stats->layers_used, PROGRAM_MANAGER_LAYERS);
+
+  hmtl_program_cancel_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  native_clock_manual(options.advance_ms != 0);
+}
+
+/*
+ * Time frames with a different program on each segment of the first pixel
+ * output, against a single sparkle program on the whole strip.
+ */
+static void bench_segments() {
+  if (options.segments == 0) return;
+
+  byte buffer[HMTL_MSG_PROGRAM_LEN];
+  msg_hdr_t *msg = (msg_hdr_t *)buffer;
+  unsigned long frames = options.iterations / 10 + 1;
+  uint16_t length = options.num_pixels / options.segments;
+  native_clock_manual(true);
+
+  hmtl_program_cancel_fmt(buffer, sizeof (buffer), BENCH_ADDRESS,
+                          HMTL_ALL_OUTPUTS);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  program_sparkle_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, 0,
+                      50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  double strip_ns = time_frames(frames);
+
+  hmtl_program_cancel_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, 0);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  for (byte i = 0; i < options.segments; i++) {
+    byte output = HMTL_SEGMENT_OUTPUT(i);
+    switch (i % 4) {
+      case 0:
+        program_sparkle_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                            50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+        break;
+      case 1:
+        program_circular_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                             25, length / 4 + 1, CRGB::Black, 1, 0);
+        break;
+      case 2:
+        hmtl_program_fade_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                              1000, CRGB(255, 0, 0), CRGB(0, 0, 255),
+                              HMTL_FADE_FLAG_CYCLE);
+        break;
+      default:
+        hmtl_program_blink_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, output,
+                               100, pixel_color(255, 255, 255),
+                               100, pixel_color(0, 0, 0));
+        break;
+    }
+    handler.process_msg(msg, sockets[0], sockets[0], &config);
+  }
+  double segments_ns = time_frames(frames);
+
+  printf("Segmented frame:           %12.1f ns/frame      (%u segments of "
+         "%u pixels, whole strip sparkle %.1f)\n",
+         segments_ns, options.segments, length, strip_ns);
+
+  /*
+   * Stream a frame to the first segment in small chunks while the programs
+   * on the others run, counting strip updates before the final chunk.
+   */
+  byte *frame_pixels = new byte[3 * length];
+  for (uint16_t i = 0; i < 3 * length; i++) {
+    frame_pixels[i] = random(256);
+  }
+
+  byte chunk[HMTL_MSG_PIXEL_FRAME_MIN_LEN + 32];
+  uint16_t strip_bit = manager.output_bit(HMTL_SEGMENT_OUTPUT(0));
+  unsigned long chunks = 0, early = 0, shown = 0;
+  uint16_t offset = 0;
+  while (offset < length) {
+    if (!hmtl_pixel_frame_fmt(chunk, sizeof (chunk), BENCH_ADDRESS,
+                              HMTL_SEGMENT_OUTPUT(0), 1, frame_pixels, NULL,
+                              length, &offset)) {
+      break;
+    }
+    chunks++;
+    uint16_t updated = handler.process_msg((msg_hdr_t *)chunk, sockets[0],
+                                           sockets[0], &config);
+    native_clock_advance(50);
+    updated |= manager.run();
+    if (updated & strip_bit) {
+      if (offset < length) early++;
+      else shown++;
+    }
+  }
+  delete[] frame_pixels;
+
+  printf("Segment pixel frame:       %12lu early updates  (%lu chunks, "
+         "%lu on the final chunk)\n", early, chunks, shown);
+
+  hmtl_program_cancel_fmt(buffer, sizeof (buffer), BENCH_ADDRESS,
+                          HMTL_ALL_OUTPUTS);
+  handler.process_msg(msg, sockets[0], sockets[0], &config);
+  native_clock_manual(options.advance_ms != 0);
+}
+
+/*
+ * Render the next frame of a pixel frame benchmark scene into strip.  The
+ * scenes are sparkle, a rainbow circular and a solid color fade.
+ */
+static void pixel_frame_scene(byte scene, PixelUtil *strip,
+                              program_tracker_t *tracker, unsigned long f) {
+  switch (scene) {
+    case 0:
+      program_sparkle(tracker->output, strip, tracker);
+      break;
+    case 1:
+      program_circular(tracker->output, strip, tracker);
+      break;
+    default: {
+      CRGB color = CHSV((byte)f, 255, 255);
+      strip->setAllRGB(color.r, color.g, color.b);
+      break;
+    }
+  }
+}
+
+/*
+ * Stream 300 pixel frames as MSG_TYPE_PIXEL_FRAME chunks sized for the
+ * RS485 receive buffer, a key frame each second and delta frames between.
+ * Reports the bytes on the wire per frame, including the RS485 socket header
+ * of each chunk, the frame rate this allows at 250kbaud, and the time to
+ * decode a frame.
+ */
+static void bench_pixel_frames() {
+  static const char *scene_names[] = { "sparkle", "circular", "fade" };
+  static const uint16_t num_pixels = 300;
+  static const unsigned long key_interval = 30;
+  static const unsigned long baud = 250000;
+  unsigned long frames = options.iterations / 100 + key_interval;
+
+  byte buffer[RS485_RECV_BUFFER];
+  byte program[HMTL_MSG_PROGRAM_LEN];
+  msg_program_t *msg = (msg_program_t *)((msg_hdr_t *)program + 1);
+
+  config_pixels_t output;
+  output.hdr.type = HMTL_OUTPUT_PIXELS;
+
+  for (byte scene = 0; scene < 3; scene++) {
+    PixelUtil strip(num_pixels, 0, 0);
+    program_tracker_t tracker = { 0, 0, &output.hdr, NULL, &strip };
+    if (scene == 0) {
+      program_sparkle_fmt(program, sizeof (program), BENCH_ADDRESS, 0,
+                          50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+      program_sparkle_init(msg, &tracker, &output.hdr, &strip, &manager);
+      ((state_sparkle_t *)tracker.state)->msg.period = 0;
+    } else if (scene == 1) {
+      program_circular_fmt(program, sizeof (program), BENCH_ADDRESS, 0,
+                           0, num_pixels / 4, CRGB::Black,
+                           CIRCULAR_PATTERN_RAINBOW, 0);
+      program_circular_init(msg, &tracker, &output.hdr, &strip, &manager);
+    }
+
+    byte previous[3 * num_pixels];
+    byte decoded[3 * num_pixels];
+    memset(previous, 0, sizeof (previous));
+    memset(decoded, 0, sizeof (decoded));
+
+    unsigned long wire_bytes = 0;
+    unsigned long chunks = 0;
+    unsigned long mismatches = 0;
+    double decode_ns = 0;
+
+    for (unsigned long f = 0; f < frames; f++) {
+      pixel_frame_scene(scene, &strip, &tracker, f);
+      const byte *pixels = (const byte *)strip.leds;
+      boolean key = (f % key_interval == 0);
+
+      uint16_t offset = 0;
+      while (offset < num_pixels) {
+        uint16_t start = offset;
+        uint16_t len = hmtl_pixel_frame_fmt(buffer, sizeof (buffer),
+                                            BENCH_ADDRESS, 0, (byte)f, pixels,
+                                            key ? NULL : previous, num_pixels,
+                                            &offset);
+        if (len == 0) break;
+        wire_bytes += len + sizeof (rs485_socket_hdr_t);
+        chunks++;
+
+        msg_pixel_frame_t *chunk =
+          (msg_pixel_frame_t *)((msg_hdr_t *)buffer + 1);
+        bench_clock::time_point begin = bench_clock::now();
+        int count = hmtl_pixel_frame_decode(chunk->data,
+                                            len - HMTL_MSG_PIXEL_FRAME_MIN_LEN,
+                                            chunk->flags & HMTL_FRAME_DELTA,
+                                            decoded + 3 * start,
+                                            num_pixels - start);
+        decode_ns += elapsed_ns(begin);
+        if (count != offset - start) mismatches++;
+      }
+
+      if (memcmp(decoded, pixels, sizeof (decoded)) != 0) mismatches++;
+      memcpy(previous, pixels, sizeof (previous));
+    }
+
+    if (tracker.state != NULL) manager.free_program_state(&tracker);
+
+    double bytes_per_frame = (double)wire_bytes / frames;
+    printf("Pixel frame %-8s       %12.1f bytes/frame   (%.1f chunks, "
+           "%.0f fps at %lukbaud, decode %.0f ns/frame%s)\n",
+           scene_names[scene], bytes_per_frame, (double)chunks / frames,
+           baud / 10 / bytes_per_frame, baud / 1000, decode_ns / frames,
+           mismatches ? ", MISMATCH" : "");
+  }
+
+  unsigned long raw_chunk = RS485_RECV_BUFFER - HMTL_MSG_PIXEL_FRAME_MIN_LEN;
+  raw_chunk -= raw_chunk % 3;
+  unsigned long raw_chunks = (3 * num_pixels + raw_chunk - 1) / raw_chunk;
+  double raw_bytes = 3 * num_pixels +
+                     raw_chunks * (HMTL_MSG_PIXEL_FRAME_MIN_LEN +
+                                   sizeof (rs485_socket_hdr_t));
+  printf("Pixel frame uncompressed   %12.1f bytes/frame   (%lu chunks, "
+         "%.0f fps at %lukbaud)\n",
+         raw_bytes, raw_chunks, baud / 10 / raw_bytes, baud / 1000);
+}
+
+/* Palette writer that copies the expanded pixels into a wire buffer */
+static void palette_wire_write(PalettePixels *strip, const CRGB *pixels,
+                               uint16_t first, uint16_t count, void *context) {
+  memcpy((CRGB *)context + first, pixels, count * sizeof (CRGB));
+}
+
+/*
+ * Report the framebuffer size of RGB and palette strips, and time sparkle
+ * frames and updates on a 300 pixel strip of each.
+ */
+static void bench_palette() {
+  static const uint16_t strip_pixels[] = { 150, 300, 600, 1000 };
+  static const uint16_t num_pixels = 300;
+  unsigned long frames = options.iterations / 10 + 1;
+
+  for (byte i = 0; i < sizeof (strip_pixels) / sizeof (strip_pixels[0]); i++) {
+    uint16_t n = strip_pixels[i];
+    uint16_t palette_bytes = sizeof (((PalettePixels *)NULL)->palette);
+    printf("Framebuffer %4u pixels:   %12u bytes RGB     (8-bit palette %u, "
+           "4-bit palette %u)\n",
+           n, (unsigned)(n * sizeof (CRGB)),
+           PalettePixels::bufferSize(n, PalettePixels::BITS_8) + palette_bytes,
+           PalettePixels::bufferSize(n, PalettePixels::BITS_4) + palette_bytes);
+  }
+
+  byte buffer[HMTL_MSG_PROGRAM_LEN];
+  program_sparkle_fmt(buffer, sizeof (buffer), BENCH_ADDRESS, 0,
+                      50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+  msg_program_t *msg = (msg_program_t *)((msg_hdr_t *)buffer + 1);
+  CRGB wire[num_pixels];
+
+  static const byte bits[] = { 0, PalettePixels::BITS_8,
+                               PalettePixels::BITS_4 };
+  for (byte b = 0; b < sizeof (bits); b++) {
+    PixelUtil strip;
+    PalettePixels palette;
+    config_pixels_t output;
+    void *object;
+    if (bits[b] == 0) {
+      output.hdr.type = HMTL_OUTPUT_PIXELS;
+      strip.init(num_pixels, 0, 0);
+      object = &strip;
+    } else {
+      output.hdr.type = HMTL_OUTPUT_PALETTE;
+      palette.init(num_pixels, bits[b]);
+      palette.setWriter(palette_wire_write, wire);
+      object = &palette;
+    }
+
+    program_tracker_t tracker = { 0, 0, &output.hdr, NULL, object };
+    program_sparkle_init(msg, &tracker, &output.hdr, object, &manager);
+    ((state_sparkle_t *)tracker.state)->msg.period = 0;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long f = 0; f < frames; f++) {
+      program_sparkle(&output.hdr, object, &tracker);
+    }
+    double frame_ns = elapsed_ns(start);
+
+    start = bench_clock::now();
+    for (unsigned long f = 0; f < frames; f++) {
+      hmtl_update_output(&output.hdr, object);
+    }
+    double update_ns = elapsed_ns(start);
+
+    manager.free_program_state(&tracker);
+
+    char name[16];
+    if (bits[b] == 0) {
+      snprintf(name, sizeof (name), "RGB");
+    } else {
+      snprintf(name, sizeof (name), "%u-bit", bits[b]);
+    }
+    printf("Palette %-6s sparkle:     %12.1f ns/frame      (update %.1f "
+           "ns/frame, %u pixels)\n",
+           name, frame_ns / frames, update_ns / frames, num_pixels);
+  }
+}
+
+/*
+ * Receive a batch of HMTL_MAX_MSG_LEN bytes over the socket as fragments that
+ * fit its receive buffer, and the same messages as batches that fit it.
+ */
+static void bench_fragments() {
+  byte value[HMTL_MAX_MSG_LEN];
+  format_bench_msg(value, sizeof (value));
+
+  byte batch[HMTL_MAX_MSG_LEN];
+  unsigned int entries = 0;
+  hmtl_batch_fmt(batch, sizeof (batch), BENCH_ADDRESS);
+  while (hmtl_batch_add(batch, sizeof (batch), (msg_hdr_t *)value)) {
+    entries++;
+  }
+  msg_hdr_t *batch_hdr = (msg_hdr_t *)batch;
+
+  const byte max_fragments = 4;
+  byte fragments[max_fragments][RS485_RECV_BUFFER];
+  uint16_t lengths[max_fragments];
+  byte total = hmtl_fragment_count(batch_hdr->length, RS485_RECV_BUFFER);
+  if ((total == 0) || (total > max_fragments)) return;
+  for (byte f = 0; f < total; f++) {
+    lengths[f] = hmtl_fragment_fmt(fragments[f], RS485_RECV_BUFFER, batch_hdr,
+                                   0, f);
+  }
+
+  byte small[RS485_RECV_BUFFER];
+  unsigned int small_entries = 0;
+  hmtl_batch_fmt(small, sizeof (small), BENCH_ADDRESS);
+  while (hmtl_batch_add(small, sizeof (small), (msg_hdr_t *)value)) {
+    small_entries++;
+  }
+
+  const unsigned long rounds = options.messages / total;
+  unsigned long small_msgs = 0;
+  double ns[2] = { 0, 0 };
+  for (unsigned long r = 0; r < rounds; r++) {
+    for (byte f = 0; f < total; f++) {
+      ((msg_fragment_t *)(fragments[f] + sizeof (msg_hdr_t)))->id = r;
+#ifdef HMTL_USE_CRC
+      hmtl_msg_set_crc((msg_hdr_t *)fragments[f]);
+#endif
+      rs485.inject(BENCH_SOURCE, BENCH_ADDRESS, fragments[f], lengths[f]);
+    }
+    bench_clock::time_point start = bench_clock::now();
+    while (rs485.pending()) {
+      handler.check(&config);
+    }
+    ns[0] += elapsed_ns(start);
+
+    for (unsigned int m = 0; m < entries; m += small_entries) {
+      rs485.inject(BENCH_SOURCE, BENCH_ADDRESS, small,
+                   ((msg_hdr_t *)small)->length);
+      small_msgs += small_entries;
+    }
+    start = bench_clock::now();
+    while (rs485.pending()) {
+      handler.check(&config);
+    }
+    ns[1] += elapsed_ns(start);
+  }
+
+  printf("Fragmented batch:          %12.1f ns/msg        "
+         "(%u bytes in %u fragments, %u byte batches %.1f)\n",
+         ns[0] / (rounds * entries), batch_hdr->length, total,
+         RS485_RECV_BUFFER, ns[1] / small_msgs);
+}
+
+/*
+ * Process a sensor broadcast of light and pot records, each of which is
+ * passed to the PROGRAM_SENSOR_DATA program.
+ */
+static void bench_sensor() {
+  byte buffer[HMTL_MAX_MSG_LEN];
+  const byte records = 8;
+  uint8_t *data;
+  uint16_t len = hmtl_sensor_fmt(buffer, sizeof (buffer), SOCKET_ADDR_ANY,
+                                 records * (sizeof (msg_sensor_data_t) + 2),
+                                 &data);
+  for (byte r = 0; r < records; r++) {
+    msg_sensor_data_t *sensor = (msg_sensor_data_t *)data;
+    sensor->sensor_type = (r & 0x1) ? HMTL_SENSOR_LIGHT : HMTL_SENSOR_POT;
+    sensor->data_len = 2;
+    sensor->data[0] = r;
+    sensor->data[1] = 0;
+    data += sizeof (msg_sensor_data_t) + 2;
+  }
+#ifdef HMTL_USE_CRC
+  hmtl_msg_set_crc((msg_hdr_t *)buffer);
+#endif
+
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long i = 0; i < options.messages; i++) {
+    handler.process_msg((msg_hdr_t *)buffer, sockets[0], sockets[0], &config);
+  }
+  double ns = elapsed_ns(start);
+
+  printf("Sensor broadcast:          %12.1f ns/record     (%u records, %u bytes)\n",
+         ns / (options.messages * records), records, len);
+}
+
+/*
+ * Append a program message's body to the emulated EEPROM as a scene program
+ * record, leaving off trailing zero values as the configuration tool does.
+ */
+static int write_scene_program(int addr, byte scene, const byte *msg) {
+  scene_program_t record;
+  record.scene = scene;
+  memcpy(&record.program, msg + sizeof (msg_hdr_t), sizeof (msg_program_t));
+
+  byte values = MAX_PROGRAM_VAL;
+  while ((values > 0) && (record.program.values[values - 1] == 0)) values--;
+
+  return EEPROM_safe_write(addr, (uint8_t *)&record,
+                           HMTL_SCENE_RECORD_MIN + values);
+}
+
+/*
+ * Store two scenes following the configuration, sparkle and circular on the
+ * pixel outputs and their segments and blink and fade on the value outputs,
+ * and alternate between them with scene messages and with the equivalent
+ * program messages.
+ */
+static void bench_scene() {
+  config_hdr_t hdr;
+  config_max_t configs[HMTL_MAX_OUTPUTS];
+  int addr = hmtl_read_config(&hdr, configs, HMTL_MAX_OUTPUTS);
+  if (addr < 0) return;
+  handler.set_scene_store(addr);
+
+  const byte max_programs = 2 * (HMTL_MAX_OUTPUTS + HMTL_MAX_SEGMENTS);
+  static byte programs[max_programs][HMTL_MSG_PROGRAM_LEN];
+  byte scenes[max_programs];
+  byte num_programs = 0;
+
+  for (byte scene = 0; scene < 2; scene++) {
+    for (byte out = 0; out < HMTL_MAX_OUTPUTS + HMTL_MAX_SEGMENTS; out++) {
+      byte *buffer = programs[num_programs];
+      byte type = HMTL_OUTPUT_NONE;
+      if (out < config.num_outputs) {
+        type = outputs[out]->type;
+      } else if (manager.lookup_segment(out) != NULL) {
+        type = HMTL_OUTPUT_SEGMENT;
+      }
+
+      if (IS_HMTL_PIXEL_OUTPUT(type)) {
+        if (scene == 0) {
+          program_sparkle_fmt(buffer, HMTL_MSG_PROGRAM_LEN, BENCH_ADDRESS, out,
+                              50, CRGB(0, 0, 0), 0, 0, 0, 255, 0, 255, 0, 255);
+        } else {
+          program_circular_fmt(buffer, HMTL_MSG_PROGRAM_LEN, BENCH_ADDRESS,
+                               out, 25, 10, CRGB::Black, 1, 0);
+        }
+      } else if (type == HMTL_OUTPUT_VALUE) {
+        if (scene == 0) {
+          hmtl_program_blink_fmt(buffer, HMTL_MSG_PROGRAM_LEN, BENCH_ADDRESS,
+                                 out, 100, pixel_color(255, 255, 255),
+                                 100, pixel_color(0, 0, 0));
+        } else {
+          hmtl_program_fade_fmt(buffer, HMTL_MSG_PROGRAM_LEN, BENCH_ADDRESS,
+                                out, 1000, CRGB(255, 0, 0), CRGB(0, 0, 255),
+                                HMTL_FADE_FLAG_CYCLE);
+        }
+      } else {
+        continue;
+      }
+      scenes[num_programs++] = scene;
+    }
+  }
+
+  config_scenes_t store = { HMTL_SCENE_MAGIC, num_programs, 0 };
+  int end = hmtl_write_scenes(addr, &store);
+  for (byte p = 0; (p < num_programs) && (end > 0); p++) {
+    end = write_scene_program(end, scenes[p], programs[p]);
+  }
+  if (end < 0) {
+    fprintf(stderr, "Failed to write scene store\n");
+    return;
+  }
+
+  byte scene_msg[2][HMTL_MSG_SCENE_LEN];
+  for (byte scene = 0; scene < 2; scene++) {
+    hmtl_scene_fmt(scene_msg[scene], HMTL_MSG_SCENE_LEN, SOCKET_ADDR_ANY,
+                   scene);
+#ifdef HMTL_USE_CRC
+    hmtl_msg_set_crc((msg_hdr_t *)scene_msg[scene]);
+#endif
+  }
+
+  const unsigned long rounds = options.messages / 2;
+  bench_clock::time_point start = bench_clock::now();
+  for (unsigned long r = 0; r < rounds; r++) {
+    handler.process_msg((msg_hdr_t *)scene_msg[r & 0x1], sockets[0],
+                        sockets[0], &config);
+  }
+  double scene_ns = elapsed_ns(start);
+
+  uint16_t program_bytes = 0;
+  start = bench_clock::now();
+  for (unsigned long r = 0; r < rounds; r++) {
+    for (byte p = 0; p < num_programs; p++) {
+      if (scenes[p] != (r & 0x1)) continue;
+      handler.process_msg((msg_hdr_t *)programs[p], sockets[0], sockets[0],
+                          &config);
+      if (r < 2) program_bytes += ((msg_hdr_t *)programs[p])->length;
+    }
+  }
+  double program_ns = elapsed_ns(start);
+
+  printf("Scene recall:              %12.1f ns/scene      "
+         "(%u programs, %u bytes of EEPROM)\n",
+         scene_ns / rounds, num_programs, end - addr);
+  printf("  %u byte scene message vs %u bytes of program messages, "
+         "%.1f ns/scene\n",
+         (unsigned)HMTL_MSG_SCENE_LEN, program_bytes / 2, program_ns / rounds);
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
+
+  PixelUtil::show_ns_per_pixel = options.show_ns;
+  if (options.advance_ms) native_clock_manual(true);
+
+  write_config();
+  setup();
+
+  /*
+   * The bench sends as a controller, and it repeats messages that would be
+   * dropped as copies if they were stamped.
+   */
+  hmtl_msg_set_source(SOCKET_ADDR_INVALID);
+  start_programs();
+
+  printf("HMTL native benchmark\n");
+  printf("  pixel outputs:%u value outputs:%u pixels:%u program:%s\n",
+         options.pixel_outputs, options.value_outputs, options.num_pixels,
+         options.program);
+  printf("  iterations:%lu messages:%lu clock:%s show:%luns/pixel "
+         "frame:%lums\n",
+         options.iterations, options.messages,
+         options.advance_ms ? "manual" : "realtime", options.show_ns,
+         options.frame_ms);
+
+  bench_loop();
+  bench_run();
+  bench_tween();
+  bench_sparkle();
+  bench_check_socket();
+  bench_check_serial();
+  bench_sequenced();
+  bench_crc();
+  bench_dispatch();
+  bench_poll();
+  bench_timesync();
+  bench_forward();
+  bench_timed();
+  bench_dump();
+  bench_switch();
+  bench_layers();
+  bench_segments();
+  bench_pixel_frames();
+  bench_palette();
+  bench_fragments();
+  bench_sensor();
+  bench_scene();
+
+  return 0;
+}
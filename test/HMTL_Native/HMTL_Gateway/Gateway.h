@@ -0,0 +1,102 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Definitions shared by the native HMTL gateway and its load generator.
+ *
+ * Clients connect to the gateway over TCP or a Unix socket and write raw HMTL
+ * messages back to back, exactly as they would be written to the serial port.
+ * The gateway writes back:
+ *
+ *  - MSG_TYPE_SERIAL_ACK messages whose sequence is the number of the client's
+ *    messages that have been delivered to the module (modulo 256).  Acks are
+ *    cumulative and may cover several messages.
+ *  - Responses from the module (poll, sensor, dump config, ...) to the client
+ *    that sent the request.  Responses that can't be matched to a request are
+ *    sent to every client.
+ ******************************************************************************/
+
+#ifndef HMTL_GATEWAY_H
+#define HMTL_GATEWAY_H
+
+#include "HMTLMessaging.h"
+
+#define GATEWAY_DEFAULT_PORT 6001
+
+/* Messages queued per client before the gateway stops reading from it */
+#ifndef GATEWAY_CLIENT_QUEUE
+  #define GATEWAY_CLIENT_QUEUE 64
+#endif
+
+/* Bytes of unsent output before a client is considered stuck and dropped */
+#ifndef GATEWAY_CLIENT_MAX_OUTPUT
+  #define GATEWAY_CLIENT_MAX_OUTPUT 65536
+#endif
+
+/*
+ * Sequenced serial link parameters, matching HMTLSerial: messages in flight,
+ * bytes in flight (the AVR serial receive buffer is 64 bytes), and the
+ * retransmit timeout.  After GATEWAY_RETRANSMIT_SYNC timeouts without progress
+ * the module is assumed to have restarted and the sequence is restarted.
+ */
+#ifndef GATEWAY_WINDOW
+  #define GATEWAY_WINDOW 8
+#endif
+
+#ifndef GATEWAY_WINDOW_BYTES
+  #define GATEWAY_WINDOW_BYTES 64
+#endif
+
+#ifndef GATEWAY_RETRANSMIT_MS
+  #define GATEWAY_RETRANSMIT_MS 100
+#endif
+
+#ifndef GATEWAY_RETRANSMIT_SYNC
+  #define GATEWAY_RETRANSMIT_SYNC 3
+#endif
+
+/* Time to wait for the module's response to a request */
+#ifndef GATEWAY_RESPONSE_MS
+  #define GATEWAY_RESPONSE_MS 500
+#endif
+
+/* Time to wait for the module's 'ready' before sending anyway */
+#ifndef GATEWAY_READY_MS
+  #define GATEWAY_READY_MS 3000
+#endif
+
+/*
+ * Return the length of the complete HMTL message at the start of data, 0 if
+ * more data is needed, or -1 if the data doesn't start with a valid message.
+ */
+static inline int gateway_msg_length(const byte *data, uint16_t len) {
+  if (len < 1) {
+    return 0;
+  }
+  if (data[0] != HMTL_MSG_START) {
+    return -1;
+  }
+  if (len < sizeof (msg_hdr_t)) {
+    return 0;
+  }
+
+  const msg_hdr_t *msg_hdr = (const msg_hdr_t *)data;
+  if ((msg_hdr->length < sizeof (msg_hdr_t)) ||
+      (msg_hdr->length > HMTL_MAX_MSG_LEN)) {
+    return -1;
+  }
+  if (len < msg_hdr->length) {
+    return 0;
+  }
+  return msg_hdr->length;
+}
+
+/* Does the message ask the module for a response */
+static inline boolean gateway_expects_response(const msg_hdr_t *msg_hdr) {
+  return (msg_hdr->flags & MSG_FLAG_RESPONSE) ||
+         (msg_hdr->type == MSG_TYPE_POLL) ||
+         (msg_hdr->type == MSG_TYPE_DUMP_CONFIG);
+}
+
+#endif // HMTL_GATEWAY_H
@@ -0,0 +1,833 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Native host gateway between many clients and the serial bridge module,
+ * replacing the single-client Python HMTLServer.
+ *
+ * A single epoll loop accepts TCP and Unix socket clients, takes complete HMTL
+ * messages from each in round-robin order, and pipelines them to the module
+ * using sequenced serial messages (HMTL_SERIAL_SEQ) with a sliding window.
+ * Module acks are translated into per-client acks, and responses are returned
+ * to the client whose request is waiting for them.  See Gateway.h for the
+ * client protocol.
+ *
+ * Usage: HMTL_Gateway --device PATH [--baud N] [--port N] [--unix PATH]
+ *                     [--window N] [--verbose N]
+ *
+ * A window of 0 sends one unsequenced message at a time and waits for the
+ * module's text ack, for modules without sequenced serial support.
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+#include "Arduino.h"
+#include "Debug.h"
+#include "HMTLMessaging.h"
+#include "HMTLProtocol.h"
+#include "Gateway.h"
+
+typedef struct {
+  const char *device;
+  unsigned long baud;
+  uint16_t port;
+  const char *unix_path;
+  uint8_t window;
+  uint8_t verbose;
+} gateway_options_t;
+
+static gateway_options_t options = {
+  NULL,                 // device
+  115200,               // baud
+  GATEWAY_DEFAULT_PORT, // port, 0 to disable TCP
+  NULL,                 // unix_path
+  GATEWAY_WINDOW,       // window
+  0                     // verbose
+};
+
+static volatile sig_atomic_t terminate_requested = 0;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s --device PATH [--baud N] [--port N] [--unix PATH]\n"
+          "          [--window N] [--verbose N]\n", name);
+  exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) usage(argv[0]);
+    const char *arg = argv[i];
+    const char *val = argv[++i];
+
+    if (strcmp(arg, "--device") == 0) {
+      options.device = val;
+    } else if (strcmp(arg, "--baud") == 0) {
+      options.baud = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--port") == 0) {
+      options.port = atoi(val);
+    } else if (strcmp(arg, "--unix") == 0) {
+      options.unix_path = val;
+    } else if (strcmp(arg, "--window") == 0) {
+      options.window = atoi(val);
+    } else if (strcmp(arg, "--verbose") == 0) {
+      options.verbose = atoi(val);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (options.device == NULL) usage(argv[0]);
+  if ((options.port == 0) && (options.unix_path == NULL)) {
+    fprintf(stderr, "A TCP port or Unix socket path is required\n");
+    exit(1);
+  }
+}
+
+/*******************************************************************************
+ * Gateway state
+ */
+
+typedef struct {
+  byte length;
+  byte data[HMTL_MAX_MSG_LEN];
+} gateway_msg_t;
+
+/* A message sent to the module and not yet acknowledged */
+typedef struct {
+  uint32_t client_id;
+  byte sequence;
+  byte length; // Including the sequence prefix
+  byte data[2 + HMTL_MAX_MSG_LEN];
+} gateway_frame_t;
+
+/* A request waiting for a response from the module */
+typedef struct {
+  uint32_t client_id;
+  uint8_t type;
+  unsigned long expires_ms;
+} gateway_request_t;
+
+#define GATEWAY_CLIENT_INPUT (4 * HMTL_MAX_MSG_LEN)
+
+typedef struct {
+  int fd;
+  uint32_t id;
+  boolean reading; // EPOLLIN is enabled
+  boolean acked;   // The current delivered count has been sent
+
+  byte input[GATEWAY_CLIENT_INPUT];
+  uint16_t input_len;
+  std::deque<gateway_msg_t> queue;
+  std::string output;
+
+  uint32_t received;  // Messages taken from the client
+  uint32_t delivered; // Messages acknowledged by the module
+} gateway_client_t;
+
+typedef struct {
+  unsigned long received;
+  unsigned long delivered;
+  unsigned long retransmits;
+  unsigned long resyncs;
+  unsigned long crc_errors;
+  unsigned long routed;
+  unsigned long broadcast;
+  unsigned long clients;
+} gateway_stats_t;
+
+static int epoll_fd = -1;
+static int serial_fd = -1;
+static int tcp_fd = -1;
+static int unix_fd = -1;
+
+static std::map<uint32_t, gateway_client_t *> clients;
+static std::map<int, gateway_client_t *> clients_by_fd;
+static uint32_t next_client_id = 1;
+static uint32_t last_client_id = 0; // Last client served, for round-robin
+
+static std::deque<gateway_frame_t> outstanding;
+static uint16_t outstanding_bytes = 0;
+static std::list<gateway_request_t> requests;
+
+static byte next_sequence = 0;
+static boolean sync_next = true;  // Next new frame restarts the sequence
+static boolean synced = false;    // The module has acked the current sequence
+static boolean module_ready = false;
+static unsigned long start_ms = 0;
+static unsigned long last_progress_ms = 0;
+static byte timeouts = 0;
+
+static byte serial_input[4 * HMTL_MAX_MSG_LEN];
+static uint16_t serial_input_len = 0;
+static std::string serial_output;
+
+static gateway_stats_t stats;
+
+static void update_events(int fd, uint32_t events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static void add_events(int fd, uint32_t events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+}
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*******************************************************************************
+ * Serial device
+ */
+
+static speed_t baud_to_speed(unsigned long baud) {
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    default: return B115200;
+  }
+}
+
+static void open_serial() {
+  serial_fd = open(options.device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (serial_fd < 0) {
+    perror(options.device);
+    exit(1);
+  }
+
+  struct termios tio;
+  if (tcgetattr(serial_fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, baud_to_speed(options.baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(serial_fd, TCSANOW, &tio);
+  }
+
+  add_events(serial_fd, EPOLLIN);
+}
+
+static void write_serial() {
+  while (!serial_output.empty()) {
+    ssize_t ret = write(serial_fd, serial_output.data(), serial_output.size());
+    if (ret <= 0) {
+      if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        perror("serial write");
+        exit(1);
+      }
+      break;
+    }
+    serial_output.erase(0, ret);
+  }
+
+  update_events(serial_fd, serial_output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+/*******************************************************************************
+ * Clients
+ */
+
+static void queue_client_output(gateway_client_t *client, const byte *data,
+                                uint16_t length) {
+  client->output.append((const char *)data, length);
+}
+
+static void close_client(gateway_client_t *client) {
+  if (options.verbose) {
+    fprintf(stderr, "gateway: client %u closed, %u/%u delivered\n",
+            client->id, client->delivered, client->received);
+  }
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  clients_by_fd.erase(client->fd);
+  clients.erase(client->id);
+  delete client;
+}
+
+static void update_client_events(gateway_client_t *client) {
+  uint32_t events = 0;
+  if (client->reading) events |= EPOLLIN;
+  if (!client->output.empty()) events |= EPOLLOUT;
+  update_events(client->fd, events);
+}
+
+/*
+ * Returns false if the client was closed
+ */
+static boolean write_client(gateway_client_t *client) {
+  while (!client->output.empty()) {
+    ssize_t ret = send(client->fd, client->output.data(),
+                       client->output.size(), MSG_NOSIGNAL);
+    if (ret <= 0) {
+      if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+        break;
+      }
+      close_client(client);
+      return false;
+    }
+    client->output.erase(0, ret);
+  }
+
+  if (client->output.size() > GATEWAY_CLIENT_MAX_OUTPUT) {
+    DEBUG_ERR("gateway: client not reading output, dropped");
+    close_client(client);
+    return false;
+  }
+
+  update_client_events(client);
+  return true;
+}
+
+/*
+ * Move complete messages from the client's input into its queue, stopping
+ * reads from the client while the queue is full.  Returns false if the client
+ * was closed.
+ */
+static boolean parse_client(gateway_client_t *client) {
+  uint16_t pos = 0;
+  while (client->queue.size() < GATEWAY_CLIENT_QUEUE) {
+    int length = gateway_msg_length(client->input + pos,
+                                    client->input_len - pos);
+    if (length == 0) {
+      break;
+    }
+    if (length < 0) {
+      DEBUG_ERR("gateway: invalid message from client");
+      close_client(client);
+      return false;
+    }
+
+    gateway_msg_t msg;
+    msg.length = length;
+    memcpy(msg.data, client->input + pos, length);
+    client->queue.push_back(msg);
+    client->received++;
+    stats.received++;
+    pos += length;
+  }
+
+  if (pos > 0) {
+    client->input_len -= pos;
+    memmove(client->input, client->input + pos, client->input_len);
+  }
+
+  boolean reading = (client->queue.size() < GATEWAY_CLIENT_QUEUE);
+  if (reading != client->reading) {
+    client->reading = reading;
+    update_client_events(client);
+  }
+  return true;
+}
+
+static void read_client(gateway_client_t *client) {
+  if (client->input_len < sizeof (client->input)) {
+    ssize_t ret = recv(client->fd, client->input + client->input_len,
+                       sizeof (client->input) - client->input_len, 0);
+    if (ret == 0 || ((ret < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+      close_client(client);
+      return;
+    }
+    if (ret > 0) {
+      client->input_len += ret;
+    }
+  }
+
+  parse_client(client);
+}
+
+static void accept_client(int listen_fd) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  set_nonblocking(fd);
+  if (listen_fd == tcp_fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  }
+
+  gateway_client_t *client = new gateway_client_t();
+  client->fd = fd;
+  client->id = next_client_id++;
+  client->reading = true;
+  client->acked = true;
+  client->input_len = 0;
+  client->received = 0;
+  client->delivered = 0;
+
+  clients[client->id] = client;
+  clients_by_fd[fd] = client;
+  stats.clients++;
+  add_events(fd, EPOLLIN);
+
+  if (options.verbose) {
+    fprintf(stderr, "gateway: client %u connected\n", client->id);
+  }
+}
+
+/* Send acks to every client with newly delivered messages */
+static void send_client_acks() {
+  for (auto it = clients.begin(); it != clients.end(); ) {
+    gateway_client_t *client = (it++)->second;
+    if (client->acked) {
+      continue;
+    }
+    client->acked = true;
+
+    byte ack[HMTL_MSG_SERIAL_ACK_LEN];
+    uint16_t len = hmtl_serial_ack_fmt(ack, sizeof (ack), 0,
+                                       (uint8_t)client->delivered);
+    queue_client_output(client, ack, len);
+    write_client(client);
+  }
+}
+
+/*******************************************************************************
+ * Responses from the module
+ */
+
+/*
+ * Send a response to the client with the oldest request of the same type, or
+ * to every client if no request is waiting.
+ */
+static void route_response(const msg_hdr_t *msg_hdr) {
+  unsigned long now = millis();
+
+  for (auto it = requests.begin(); it != requests.end(); ) {
+    if ((long)(now - it->expires_ms) > 0) {
+      it = requests.erase(it);
+      continue;
+    }
+
+    if (it->type == msg_hdr->type) {
+      auto client = clients.find(it->client_id);
+      if (msg_hdr->flags & MSG_FLAG_MORE_DATA) {
+        it->expires_ms = now + GATEWAY_RESPONSE_MS;
+      } else {
+        requests.erase(it);
+      }
+
+      if (client != clients.end()) {
+        queue_client_output(client->second, (const byte *)msg_hdr,
+                            msg_hdr->length);
+        write_client(client->second);
+      }
+      stats.routed++;
+      return;
+    }
+    it++;
+  }
+
+  stats.broadcast++;
+  for (auto it = clients.begin(); it != clients.end(); ) {
+    gateway_client_t *client = (it++)->second;
+    queue_client_output(client, (const byte *)msg_hdr, msg_hdr->length);
+    write_client(client);
+  }
+}
+
+static void resend_outstanding() {
+  for (auto frame = outstanding.begin(); frame != outstanding.end(); frame++) {
+    serial_output.append((const char *)frame->data, frame->length);
+  }
+  stats.retransmits += outstanding.size();
+  last_progress_ms = millis();
+  write_serial();
+}
+
+/* Remove acknowledged frames from the front of the window */
+static void acknowledge_frames(uint16_t count) {
+  while (count-- > 0) {
+    gateway_frame_t *frame = &outstanding.front();
+    auto client = clients.find(frame->client_id);
+    if (client != clients.end()) {
+      client->second->delivered++;
+      client->second->acked = false;
+    }
+    outstanding_bytes -= frame->length;
+    outstanding.pop_front();
+    stats.delivered++;
+  }
+
+  last_progress_ms = millis();
+  timeouts = 0;
+}
+
+/*
+ * Handle a cumulative ack from the module.  An ack that doesn't acknowledge
+ * any outstanding message reports a gap, so everything outstanding is resent.
+ */
+static void handle_serial_ack(byte sequence) {
+  if (outstanding.empty()) {
+    return;
+  }
+
+  byte count = sequence - outstanding.front().sequence + 1;
+  if ((count > 0) && (count <= outstanding.size())) {
+    acknowledge_frames(count);
+    synced = true;
+  } else {
+    resend_outstanding();
+  }
+}
+
+static void handle_serial_msg(const msg_hdr_t *msg_hdr) {
+  if (options.verbose > 1) {
+    fprintf(stderr, "gateway: module msg type %u len %u\n",
+            msg_hdr->type, msg_hdr->length);
+  }
+
+  if (msg_hdr->type == MSG_TYPE_SERIAL_ACK) {
+    if (msg_hdr->length >= HMTL_MSG_SERIAL_ACK_LEN) {
+      handle_serial_ack(((const msg_serial_ack_t *)(msg_hdr + 1))->sequence);
+    }
+    return;
+  }
+
+  route_response(msg_hdr);
+}
+
+static void handle_serial_line(const char *line) {
+  if (options.verbose) {
+    fprintf(stderr, "gateway: module: %s\n", line);
+  }
+
+  if (strcmp(line, HMTL_ACK) == 0) {
+    if ((options.window == 0) && !outstanding.empty()) {
+      acknowledge_frames(1);
+    }
+  } else if (strcmp(line, HMTL_READY) == 0) {
+    /*
+     * The module sends 'ready' when it starts and after long idle periods, in
+     * either case it is safe to restart the sequence once nothing is in flight.
+     */
+    module_ready = true;
+    if (outstanding.empty()) {
+      sync_next = true;
+    }
+  }
+}
+
+/*
+ * Split serial input into HMTL messages and text lines, as done by the Python
+ * InputBuffer.
+ */
+static void parse_serial() {
+  uint16_t pos = 0;
+  while (pos < serial_input_len) {
+    byte *data = serial_input + pos;
+    uint16_t len = serial_input_len - pos;
+
+    if (data[0] == HMTL_MSG_START) {
+      int length = gateway_msg_length(data, len);
+      if (length == 0) {
+        break;
+      }
+      if (length < 0) {
+        pos++;
+        continue;
+      }
+#ifdef HMTL_USE_CRC
+      if (hmtl_msg_crc((const msg_hdr_t *)data) != ((msg_hdr_t *)data)->crc) {
+        stats.crc_errors++;
+        pos++;
+        continue;
+      }
+#endif
+      handle_serial_msg((const msg_hdr_t *)data);
+      pos += length;
+      continue;
+    }
+
+    uint16_t end = 0;
+    while ((end < len) && (data[end] != '\n') && (data[end] != HMTL_MSG_START)) {
+      end++;
+    }
+    if ((end == len) && (pos > 0 || len < sizeof (serial_input))) {
+      // Wait for the rest of the line
+      break;
+    }
+
+    char line[sizeof (serial_input) + 1];
+    uint16_t line_len = end;
+    if ((line_len > 0) && (data[line_len - 1] == '\r')) {
+      line_len--;
+    }
+    memcpy(line, data, line_len);
+    line[line_len] = '\0';
+    handle_serial_line(line);
+
+    pos += end;
+    if ((pos < serial_input_len) && (serial_input[pos] == '\n')) {
+      pos++;
+    }
+  }
+
+  if (pos > 0) {
+    serial_input_len -= pos;
+    memmove(serial_input, serial_input + pos, serial_input_len);
+  }
+}
+
+static void read_serial() {
+  ssize_t ret = read(serial_fd, serial_input + serial_input_len,
+                     sizeof (serial_input) - serial_input_len);
+  if (ret < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR)) {
+      perror("serial read");
+      exit(1);
+    }
+    return;
+  }
+  if (ret == 0) {
+    fprintf(stderr, "gateway: serial device closed\n");
+    exit(1);
+  }
+
+  serial_input_len += ret;
+  parse_serial();
+}
+
+/*******************************************************************************
+ * Sending to the module
+ */
+
+static boolean window_open(uint16_t length) {
+  if (outstanding.empty()) {
+    return true;
+  }
+  if ((options.window == 0) || !synced) {
+    return false;
+  }
+  return (outstanding.size() < options.window) &&
+         (outstanding_bytes + length <= GATEWAY_WINDOW_BYTES);
+}
+
+/* Return the next client with a queued message, in round-robin order */
+static gateway_client_t *next_client() {
+  auto it = clients.upper_bound(last_client_id);
+  for (size_t i = 0; i < clients.size(); i++, it++) {
+    if (it == clients.end()) {
+      it = clients.begin();
+    }
+    if (!it->second->queue.empty()) {
+      return it->second;
+    }
+  }
+  return NULL;
+}
+
+static void transmit(gateway_client_t *client, const gateway_msg_t *msg) {
+  gateway_frame_t frame;
+  frame.client_id = client->id;
+  frame.sequence = next_sequence;
+  frame.length = 0;
+
+  if (options.window > 0) {
+    frame.data[frame.length++] = (sync_next ? HMTL_SERIAL_SEQ_SYNC :
+                                  HMTL_SERIAL_SEQ);
+    frame.data[frame.length++] = next_sequence++;
+    if (sync_next) {
+      sync_next = false;
+      synced = false;
+    }
+  }
+  memcpy(frame.data + frame.length, msg->data, msg->length);
+  frame.length += msg->length;
+
+  if (outstanding.empty()) {
+    last_progress_ms = millis();
+  }
+  outstanding.push_back(frame);
+  outstanding_bytes += frame.length;
+  serial_output.append((const char *)frame.data, frame.length);
+
+  if (gateway_expects_response((const msg_hdr_t *)msg->data)) {
+    gateway_request_t request;
+    request.client_id = client->id;
+    request.type = ((const msg_hdr_t *)msg->data)->type;
+    request.expires_ms = millis() + GATEWAY_RESPONSE_MS;
+    requests.push_back(request);
+  }
+}
+
+static void fill_window() {
+  if (!module_ready && (millis() - start_ms < GATEWAY_READY_MS)) {
+    return;
+  }
+
+  boolean sent = false;
+  gateway_client_t *client;
+  while ((client = next_client()) != NULL) {
+    gateway_msg_t *msg = &client->queue.front();
+    uint16_t length = msg->length + (options.window > 0 ? 2 : 0);
+    if (!window_open(length)) {
+      break;
+    }
+
+    transmit(client, msg);
+    client->queue.pop_front();
+    last_client_id = client->id;
+    sent = true;
+
+    if (!client->reading && !parse_client(client)) {
+      continue;
+    }
+  }
+
+  if (sent) {
+    write_serial();
+  }
+}
+
+static void check_timeouts() {
+  if (outstanding.empty() ||
+      (millis() - last_progress_ms <= GATEWAY_RETRANSMIT_MS)) {
+    return;
+  }
+
+  timeouts++;
+  if ((options.window > 0) && (timeouts >= GATEWAY_RETRANSMIT_SYNC)) {
+    /*
+     * The module may have restarted, restart the sequence at the oldest
+     * message at the risk of it being handled twice.
+     */
+    outstanding.front().data[0] = HMTL_SERIAL_SEQ_SYNC;
+    synced = false;
+    stats.resyncs++;
+  }
+  resend_outstanding();
+}
+
+/*******************************************************************************
+ * Setup and event loop
+ */
+
+static int listen_on(int fd, struct sockaddr *addr, socklen_t len) {
+  if ((bind(fd, addr, len) < 0) || (listen(fd, 64) < 0)) {
+    perror("bind");
+    exit(1);
+  }
+  set_nonblocking(fd);
+  add_events(fd, EPOLLIN);
+  return fd;
+}
+
+static void open_listeners() {
+  if (options.port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(options.port);
+    tcp_fd = listen_on(fd, (struct sockaddr *)&addr, sizeof (addr));
+  }
+
+  if (options.unix_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, options.unix_path, sizeof (addr.sun_path) - 1);
+    unlink(options.unix_path);
+    unix_fd = listen_on(fd, (struct sockaddr *)&addr, sizeof (addr));
+  }
+}
+
+static void handle_signal(int sig) {
+  terminate_requested = 1;
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  epoll_fd = epoll_create1(0);
+  open_serial();
+  open_listeners();
+  start_ms = millis();
+
+  fprintf(stderr, "gateway: %s window:%u port:%u unix:%s\n", options.device,
+          options.window, options.port,
+          options.unix_path ? options.unix_path : "-");
+
+  struct epoll_event events[64];
+  while (!terminate_requested) {
+    int timeout = outstanding.empty() ? 100 : GATEWAY_RETRANSMIT_MS / 4;
+    int count = epoll_wait(epoll_fd, events, 64, timeout);
+
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if ((fd == tcp_fd) || (fd == unix_fd)) {
+        accept_client(fd);
+      } else if (fd == serial_fd) {
+        if (events[i].events & EPOLLIN) read_serial();
+        if (events[i].events & EPOLLOUT) write_serial();
+      } else {
+        auto client = clients_by_fd.find(fd);
+        if (client == clients_by_fd.end()) {
+          continue;
+        }
+        if ((events[i].events & EPOLLOUT) && !write_client(client->second)) {
+          continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          read_client(client->second);
+        }
+      }
+    }
+
+    send_client_acks();
+    check_timeouts();
+    fill_window();
+  }
+
+  fprintf(stderr,
+          "gateway: clients:%lu received:%lu delivered:%lu retransmits:%lu "
+          "resyncs:%lu crc errors:%lu responses routed:%lu broadcast:%lu\n",
+          stats.clients, stats.received, stats.delivered, stats.retransmits,
+          stats.resyncs, stats.crc_errors, stats.routed, stats.broadcast);
+
+  if (options.unix_path) {
+    unlink(options.unix_path);
+  }
+  return 0;
+}
@@ -0,0 +1,530 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Load generator for HMTL_Gateway.
+ *
+ * A fake bridge module runs the real MessageHandler against the Serial stub,
+ * which is connected to a pty so that the gateway opens it like a serial
+ * device.  Each client connection pipelines value messages, with a poll
+ * request every --poll-every messages, and the run reports delivered messages
+ * per second, ack latency percentiles, and whether every poll response
+ * reached the client that sent the poll.
+ *
+ * Usage: HMTL_Gateway_Load [--gateway PATH] [--connect ADDR] [--serve 1]
+ *                          [--clients N] [--messages N] [--inflight N]
+ *                          [--poll-every N] [--window N] [--baud N]
+ *                          [--loss P]
+ *
+ *   --gateway PATH  Start the gateway at PATH against the fake module
+ *   --connect ADDR  Use a running gateway (Unix socket path or TCP port)
+ *                   instead of the fake module
+ *   --serve 1       Only run the fake module, printing the pty path
+ *   --baud N        Emulated serial rate into the fake module, 0 for none
+ *   --loss P        Probability of dropping each byte into the fake module
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+#include "Debug.h"
+#include "HMTLMessaging.h"
+#include "HMTLProtocol.h"
+#include "MessageHandler.h"
+#include "RS485Utils.h"
+#include "TimeSync.h"
+#include "Gateway.h"
+
+#define FAKE_MODULE_ADDRESS 1
+
+/* Receive buffer of the emulated AVR serial port */
+#define FAKE_MODULE_RX_BUFFER 64
+
+typedef struct {
+  const char *gateway;
+  const char *connect;
+  uint8_t serve;
+  uint16_t clients;
+  unsigned long messages;
+  uint16_t inflight;
+  unsigned long poll_every;
+  uint8_t window;
+  unsigned long baud;
+  double loss;
+} load_options_t;
+
+static load_options_t options = {
+  NULL,   // gateway
+  NULL,   // connect
+  0,      // serve
+  4,      // clients
+  10000,  // messages per client
+  32,     // inflight per client
+  100,    // poll_every, 0 for no polls
+  GATEWAY_WINDOW, // window
+  0,      // baud, 0 for no rate limit
+  0.0     // loss
+};
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [--gateway PATH] [--connect ADDR] [--serve 1]\n"
+          "          [--clients N] [--messages N] [--inflight N]\n"
+          "          [--poll-every N] [--window N] [--baud N] [--loss P]\n",
+          name);
+  exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) usage(argv[0]);
+    const char *arg = argv[i];
+    const char *val = argv[++i];
+
+    if (strcmp(arg, "--gateway") == 0) {
+      options.gateway = val;
+    } else if (strcmp(arg, "--connect") == 0) {
+      options.connect = val;
+    } else if (strcmp(arg, "--serve") == 0) {
+      options.serve = atoi(val);
+    } else if (strcmp(arg, "--clients") == 0) {
+      options.clients = atoi(val);
+    } else if (strcmp(arg, "--messages") == 0) {
+      options.messages = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--inflight") == 0) {
+      options.inflight = atoi(val);
+    } else if (strcmp(arg, "--poll-every") == 0) {
+      options.poll_every = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--window") == 0) {
+      options.window = atoi(val);
+    } else if (strcmp(arg, "--baud") == 0) {
+      options.baud = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--loss") == 0) {
+      options.loss = atof(val);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (!options.serve && !options.gateway && !options.connect) {
+    fprintf(stderr, "One of --gateway, --connect or --serve is required\n");
+    exit(1);
+  }
+
+  /* Client acks count messages modulo 256 */
+  if ((options.inflight == 0) || (options.inflight > 255)) {
+    fprintf(stderr, "--inflight must be between 1 and 255\n");
+    exit(1);
+  }
+}
+
+/*******************************************************************************
+ * Fake bridge module
+ */
+
+TimeSync timesync;
+
+static RS485Socket rs485;
+static byte rs485_buffer[RS485_BUFFER_TOTAL(HMTL_MAX_MSG_LEN)];
+static Socket *sockets[] = { &rs485 };
+
+static config_hdr_t config;
+static config_value_t value_output;
+static output_hdr_t *outputs[] = { &value_output.hdr };
+static void *objects[] = { NULL };
+static program_tracker_t *trackers[1];
+
+static ProgramManager manager;
+static MessageHandler handler;
+
+static int pty_master = -1;
+static char pty_path[64];
+static volatile boolean module_stop = false;
+static unsigned long module_overflows = 0;
+static unsigned long module_dropped = 0;
+
+static void open_pty() {
+  pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ((pty_master < 0) || (grantpt(pty_master) < 0) ||
+      (unlockpt(pty_master) < 0)) {
+    perror("posix_openpt");
+    exit(1);
+  }
+  strncpy(pty_path, ptsname(pty_master), sizeof (pty_path) - 1);
+
+  /*
+   * Put the pty in raw mode before the gateway opens it so that nothing is
+   * echoed back to the module.  The slave is kept open so that the master
+   * doesn't see a hangup if the gateway restarts.
+   */
+  int slave = open(pty_path, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+}
+
+static void *fake_module(void *arg) {
+  memset(&config, 0, sizeof (config));
+  config.magic = HMTL_CONFIG_MAGIC;
+  config.protocol_version = HMTL_CONFIG_VERSION;
+  config.address = FAKE_MODULE_ADDRESS;
+  config.num_outputs = 1;
+
+  value_output.hdr.type = HMTL_OUTPUT_VALUE;
+  value_output.hdr.output = 0;
+
+  rs485.init(0, 0, 0, FAKE_MODULE_ADDRESS, HMTL_MAX_MSG_LEN);
+  rs485.initBuffer(rs485_buffer, sizeof (rs485_buffer));
+
+  manager = ProgramManager(outputs, trackers, objects, 1, NULL);
+  handler = MessageHandler(FAKE_MODULE_ADDRESS, &manager, sockets, 1);
+
+  /*
+   * The clients share this process, so their messages would be stamped as
+   * the module's own and dropped.  They're sent unstamped instead.
+   */
+  hmtl_msg_set_source(SOCKET_ADDR_INVALID);
+
+  Serial.output_fd = pty_master;
+  Serial.println(F(HMTL_READY));
+
+  unsigned long last_us = micros();
+  double credit = 0;
+  while (!module_stop) {
+    int wait_ms = Serial.available() ? 0 : 1;
+    struct pollfd fd = { pty_master, POLLIN, 0 };
+    if (poll(&fd, 1, wait_ms) > 0) {
+      /*
+       * Without a baud rate the module reads only what fits in its receive
+       * buffer.  Otherwise bytes arrive at the baud rate whether or not there
+       * is room for them, with idle time not building up a burst.
+       */
+      size_t allowed = FAKE_MODULE_RX_BUFFER - Serial.available();
+      if (options.baud) {
+        unsigned long now = micros();
+        credit = std::min(credit + (now - last_us) * options.baud / 10 / 1e6,
+                          2.0);
+        last_us = now;
+        allowed = (size_t)credit;
+        credit -= allowed;
+      }
+
+      byte data[FAKE_MODULE_RX_BUFFER];
+      ssize_t len = (allowed > 0) ? read(pty_master, data, allowed) : 0;
+      for (ssize_t i = 0; i < len; i++) {
+        if ((options.loss > 0) && ((double)rand() / RAND_MAX < options.loss)) {
+          module_dropped++;
+        } else if (Serial.available() >= FAKE_MODULE_RX_BUFFER) {
+          module_overflows++;
+        } else {
+          Serial.inject(&data[i], 1);
+        }
+      }
+    }
+
+    handler.serial_ready();
+    handler.check(&config);
+  }
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * Clients
+ */
+
+typedef struct {
+  uint16_t index;
+  unsigned long sent;
+  unsigned long acked;
+  unsigned long polls;
+  unsigned long responses;
+  unsigned long other;
+  boolean stalled;
+  std::vector<unsigned long> latency_us;
+} load_client_t;
+
+static int connect_gateway(const char *address) {
+  int fd;
+  if (strchr(address, '/') != NULL) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address, sizeof (addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(address));
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+      close(fd);
+      return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  }
+  return fd;
+}
+
+static boolean write_all(int fd, const byte *data, uint16_t length) {
+  while (length > 0) {
+    ssize_t ret = send(fd, data, length, MSG_NOSIGNAL);
+    if (ret <= 0) {
+      if ((ret < 0) && (errno == EINTR)) continue;
+      return false;
+    }
+    data += ret;
+    length -= ret;
+  }
+  return true;
+}
+
+static void handle_gateway_msg(load_client_t *client, const msg_hdr_t *msg_hdr,
+                               unsigned long *sent_us) {
+  if (msg_hdr->type == MSG_TYPE_SERIAL_ACK) {
+    byte sequence = ((const msg_serial_ack_t *)(msg_hdr + 1))->sequence;
+    unsigned long acked = client->acked +
+                          (byte)(sequence - (byte)client->acked);
+    unsigned long now = micros();
+    for ( ; client->acked < acked; client->acked++) {
+      client->latency_us.push_back(now - sent_us[client->acked % 256]);
+    }
+  } else if ((msg_hdr->type == MSG_TYPE_POLL) &&
+             (msg_hdr->flags & MSG_FLAG_ACK)) {
+    client->responses++;
+  } else {
+    client->other++;
+  }
+}
+
+static void *run_client(void *arg) {
+  load_client_t *client = (load_client_t *)arg;
+  unsigned long sent_us[256];
+
+  int fd = connect_gateway(options.connect);
+  if (fd < 0) {
+    perror("connect");
+    client->stalled = true;
+    return NULL;
+  }
+
+  byte input[4 * HMTL_MAX_MSG_LEN];
+  uint16_t input_len = 0;
+  unsigned long last_progress_ms = millis();
+  unsigned long responses_expected = (options.poll_every ?
+                                      options.messages / options.poll_every : 0);
+
+  while ((client->acked < options.messages) ||
+         (client->responses < responses_expected)) {
+    while ((client->sent < options.messages) &&
+           (client->sent - client->acked < options.inflight)) {
+      byte msg[HMTL_MAX_MSG_LEN];
+      uint16_t len;
+      if (options.poll_every &&
+          ((client->sent + 1) % options.poll_every == 0)) {
+        len = sizeof (msg_hdr_t);
+        hmtl_msg_fmt((msg_hdr_t *)msg, FAKE_MODULE_ADDRESS, len, MSG_TYPE_POLL,
+                     MSG_FLAG_RESPONSE);
+        client->polls++;
+      } else {
+        hmtl_value_fmt(msg, sizeof (msg), FAKE_MODULE_ADDRESS, 0,
+                       client->sent & 0xFF);
+        len = ((msg_hdr_t *)msg)->length;
+      }
+
+      sent_us[client->sent % 256] = micros();
+      if (!write_all(fd, msg, len)) {
+        client->stalled = true;
+        close(fd);
+        return NULL;
+      }
+      client->sent++;
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 100) > 0) {
+      ssize_t ret = recv(fd, input + input_len, sizeof (input) - input_len, 0);
+      if (ret <= 0) {
+        client->stalled = true;
+        break;
+      }
+      input_len += ret;
+
+      uint16_t pos = 0;
+      int length;
+      while ((length = gateway_msg_length(input + pos, input_len - pos)) > 0) {
+        handle_gateway_msg(client, (msg_hdr_t *)(input + pos), sent_us);
+        pos += length;
+      }
+      if (length < 0) {
+        fprintf(stderr, "client %u: invalid message from gateway\n",
+                client->index);
+        client->stalled = true;
+        break;
+      }
+      input_len -= pos;
+      memmove(input, input + pos, input_len);
+      last_progress_ms = millis();
+    } else if (millis() - last_progress_ms > 5000) {
+      fprintf(stderr, "client %u: stalled at %lu/%lu acked, %lu/%lu responses\n",
+              client->index, client->acked, options.messages,
+              client->responses, responses_expected);
+      client->stalled = true;
+      break;
+    }
+  }
+
+  close(fd);
+  return NULL;
+}
+
+/*******************************************************************************
+ * Gateway process
+ */
+
+static pid_t gateway_pid = 0;
+static char gateway_socket[64];
+
+static void start_gateway() {
+  snprintf(gateway_socket, sizeof (gateway_socket), "/tmp/hmtl_gateway_%d.sock",
+           (int)getpid());
+  char window[8];
+  snprintf(window, sizeof (window), "%u", options.window);
+
+  gateway_pid = fork();
+  if (gateway_pid == 0) {
+    execl(options.gateway, options.gateway, "--device", pty_path,
+          "--unix", gateway_socket, "--port", "0", "--window", window,
+          (char *)NULL);
+    perror(options.gateway);
+    _exit(1);
+  }
+
+  /* Wait for the gateway to start listening */
+  for (int i = 0; i < 200; i++) {
+    int fd = connect_gateway(gateway_socket);
+    if (fd >= 0) {
+      close(fd);
+      options.connect = gateway_socket;
+      return;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "Gateway did not start\n");
+  kill(gateway_pid, SIGTERM);
+  exit(1);
+}
+
+static void stop_gateway() {
+  if (gateway_pid > 0) {
+    kill(gateway_pid, SIGTERM);
+    waitpid(gateway_pid, NULL, 0);
+  }
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_t module_thread;
+  if (!options.connect) {
+    open_pty();
+    pthread_create(&module_thread, NULL, fake_module, NULL);
+  }
+
+  if (options.serve) {
+    printf("Fake module on %s\n", pty_path);
+    fflush(stdout);
+    pthread_join(module_thread, NULL);
+    return 0;
+  }
+
+  if (options.gateway) {
+    start_gateway();
+  }
+
+  printf("HMTL_Gateway_Load: %s clients:%u messages:%lu inflight:%u "
+         "poll every:%lu window:%u baud:%lu loss:%g\n",
+         options.connect, options.clients, options.messages, options.inflight,
+         options.poll_every, options.window, options.baud, options.loss);
+
+  std::vector<load_client_t> load_clients(options.clients);
+  std::vector<pthread_t> threads(options.clients);
+
+  unsigned long start_us = micros();
+  for (uint16_t i = 0; i < options.clients; i++) {
+    load_clients[i].index = i;
+    pthread_create(&threads[i], NULL, run_client, &load_clients[i]);
+  }
+
+  std::vector<unsigned long> latency_us;
+  unsigned long acked = 0, polls = 0, responses = 0, other = 0, stalled = 0;
+  boolean routed = true;
+  for (uint16_t i = 0; i < options.clients; i++) {
+    pthread_join(threads[i], NULL);
+    load_client_t *client = &load_clients[i];
+    acked += client->acked;
+    polls += client->polls;
+    responses += client->responses;
+    other += client->other;
+    stalled += client->stalled;
+    if (client->responses != client->polls) {
+      routed = false;
+    }
+    latency_us.insert(latency_us.end(), client->latency_us.begin(),
+                      client->latency_us.end());
+  }
+  double elapsed_s = (micros() - start_us) / 1e6;
+
+  stop_gateway();
+  if (!options.connect || options.gateway) {
+    module_stop = true;
+  }
+
+  std::sort(latency_us.begin(), latency_us.end());
+  unsigned long p50 = 0, p99 = 0, max = 0;
+  if (!latency_us.empty()) {
+    p50 = latency_us[latency_us.size() / 2];
+    p99 = latency_us[latency_us.size() * 99 / 100];
+    max = latency_us.back();
+  }
+
+  printf("  delivered:%lu in %.3fs = %.0f msgs/s  latency p50:%luus "
+         "p99:%luus max:%luus\n",
+         acked, elapsed_s, acked / elapsed_s, p50, p99, max);
+  printf("  polls:%lu responses:%lu (%s) other:%lu stalled clients:%lu\n",
+         polls, responses, routed ? "each to its sender" : "mismatched",
+         other, stalled);
+  if (!options.connect || options.gateway) {
+    printf("  module rx overflows:%lu dropped:%lu\n",
+           module_overflows, module_dropped);
+  }
+
+  return (stalled || !routed) ? 1 : 0;
+}
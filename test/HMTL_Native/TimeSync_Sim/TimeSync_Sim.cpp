@@ -0,0 +1,297 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Simulation of TimeSync across modules with skewed clocks.
+ *
+ * One master and --nodes modules share an emulated RS485 bus.  Every module
+ * has its own TimeSync and NativeSocket, and a clock that started at a random
+ * time and runs up to --skew-ppm fast or slow.  The master synchronizes the
+ * bus once with a broadcast SYNC, after which the modules keep themselves in
+ * sync.  Each module's loop() runs every --loop-ms on average, as rendering
+ * would allow, except while TimeSync requests hot-wait when it polls its
+ * socket every --poll-us.
+ *
+ * The run reports the error between each module's ms() and the master's,
+ * sampled every 100ms of the final --minutes less the first, along with the
+ * estimated and actual clock skew and the time sync messages per minute.
+ *
+ * Usage: TimeSync_Sim [--nodes N] [--skew-ppm N] [--minutes N] [--loop-ms N]
+ *                     [--poll-us N] [--jitter-us N] [--baud N] [--hot-wait 0|1]
+ *                     [--seed N]
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+#include "Debug.h"
+#include "HMTLMessaging.h"
+#include "Socket.h"
+#include "TimeSync.h"
+
+#define MASTER_ADDRESS 1
+#define SAMPLE_US      100000UL
+
+typedef struct {
+  uint16_t nodes;
+  long skew_ppm;
+  unsigned long minutes;
+  unsigned long loop_ms;
+  unsigned long poll_us;
+  unsigned long jitter_us;
+  unsigned long baud;
+  uint8_t hot_wait;
+  unsigned long seed;
+} sim_options_t;
+
+static sim_options_t options = {
+  4,       // nodes, in addition to the master
+  200,     // skew_ppm, largest clock rate error
+  10,      // minutes
+  10,      // loop_ms
+  50,      // poll_us
+  200,     // jitter_us, random extra delivery delay
+  115200,  // baud
+  1,       // hot_wait
+  1        // seed
+};
+
+typedef struct {
+  socket_addr_t address;
+  unsigned long offset_us;  // Local clock at simulation time 0
+  long ppm;                 // Local clock rate error
+  unsigned long next_us;    // Simulation time of the next loop()
+  TimeSync timesync;
+  NativeSocket socket;
+  byte buffer[sizeof (native_socket_hdr_t) + 64];
+} sim_node_t;
+
+typedef struct {
+  unsigned long deliver_us;
+  uint16_t from;
+  socket_addr_t destination;
+  byte length;
+  byte data[NATIVE_SOCKET_MAX_DATA];
+} sim_frame_t;
+
+static std::vector<sim_node_t *> nodes;
+static std::vector<sim_frame_t> bus;
+static unsigned long sim_us = 0;
+static unsigned long sync_msgs = 0;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [--nodes N] [--skew-ppm N] [--minutes N] [--loop-ms N]\n"
+          "          [--poll-us N] [--jitter-us N] [--baud N] "
+          "[--hot-wait 0|1]\n"
+          "          [--seed N]\n", name);
+  exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) usage(argv[0]);
+    const char *arg = argv[i];
+    const char *val = argv[++i];
+
+    if (strcmp(arg, "--nodes") == 0) {
+      options.nodes = atoi(val);
+    } else if (strcmp(arg, "--skew-ppm") == 0) {
+      options.skew_ppm = atol(val);
+    } else if (strcmp(arg, "--minutes") == 0) {
+      options.minutes = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--loop-ms") == 0) {
+      options.loop_ms = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--poll-us") == 0) {
+      options.poll_us = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--jitter-us") == 0) {
+      options.jitter_us = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--baud") == 0) {
+      options.baud = strtoul(val, NULL, 0);
+    } else if (strcmp(arg, "--hot-wait") == 0) {
+      options.hot_wait = atoi(val);
+    } else if (strcmp(arg, "--seed") == 0) {
+      options.seed = strtoul(val, NULL, 0);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if ((options.nodes < 1) || (options.minutes < 2) || (options.loop_ms < 1) ||
+      (options.poll_us < 1) || (options.baud < 1)) {
+    usage(argv[0]);
+  }
+}
+
+/* Switch millis() and micros() to a module's clock */
+static void use_clock(sim_node_t *node) {
+  native_clock_skew(node->offset_us, node->ppm);
+}
+
+/*
+ * Put a frame on the bus for the other modules, arriving after its
+ * transmission time plus a random delay.
+ */
+static void bus_send(NativeSocket *socket, socket_addr_t address,
+                     const byte *data, byte datalength, void *context) {
+  sim_node_t *from = (sim_node_t *)context;
+  unsigned long wire_us = (unsigned long)datalength * 10 * 1000000 /
+                          options.baud;
+
+  sim_frame_t frame;
+  frame.deliver_us = sim_us + wire_us +
+                     (options.jitter_us ? random(options.jitter_us) : 0);
+  frame.from = from->address;
+  frame.destination = address;
+  frame.length = datalength;
+  memcpy(frame.data, data, datalength);
+  bus.push_back(frame);
+
+  sync_msgs++;
+}
+
+/*
+ * The part of a module's loop() that handles time sync, as MessageHandler
+ * does.  Returns true if hot-wait was requested.
+ */
+static boolean node_loop(sim_node_t *node) {
+  use_clock(node);
+
+  unsigned int msglen;
+  msg_hdr_t *msg_hdr;
+  while ((msg_hdr = hmtl_socket_getmsg(&node->socket, &msglen)) != NULL) {
+    if ((msg_hdr->type == MSG_TYPE_TIMESYNC) &&
+        ((msg_hdr->address == node->address) ||
+         (msg_hdr->address == SOCKET_ADDR_ANY))) {
+      node->timesync.synchronize(&node->socket, SOCKET_ADDR_INVALID, msg_hdr);
+    }
+  }
+
+  return node->timesync.update();
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
+  randomSeed(options.seed);
+  native_clock_manual(true);
+  native_clock_set(0);
+
+  for (uint16_t i = 0; i <= options.nodes; i++) {
+    sim_node_t *node = new sim_node_t();
+    node->address = MASTER_ADDRESS + i;
+    node->offset_us = random(10000) * 1000UL + random(1000);
+    node->ppm = random(-options.skew_ppm, options.skew_ppm + 1);
+    node->next_us = random(options.loop_ms * 1000);
+    node->socket.initBuffer(node->buffer, sizeof (node->buffer));
+    node->socket.setSendHook(bus_send, node);
+    nodes.push_back(node);
+  }
+  sim_node_t *master = nodes[0];
+
+  printf("TimeSync simulation\n");
+  printf("  nodes:%u skew:+/-%ldppm minutes:%lu loop:%lums jitter:%luus "
+         "baud:%lu hot-wait:%s\n",
+         options.nodes, options.skew_ppm, options.minutes, options.loop_ms,
+         options.jitter_us, options.baud, options.hot_wait ? "on" : "off");
+
+  unsigned long end_us = options.minutes * 60000000UL;
+  unsigned long measure_us = 60000000UL;
+  unsigned long next_sample_us = measure_us;
+  unsigned long measured_msgs = 0;
+  std::vector<long> errors;
+
+  use_clock(master);
+  master->timesync.synchronize(&master->socket, SOCKET_ADDR_ANY, NULL);
+
+  while (sim_us < end_us) {
+    /* Advance to the next loop() or frame delivery */
+    unsigned long next_us = next_sample_us;
+    for (uint16_t i = 0; i < nodes.size(); i++) {
+      next_us = std::min(next_us, nodes[i]->next_us);
+    }
+    for (uint16_t i = 0; i < bus.size(); i++) {
+      next_us = std::min(next_us, bus[i].deliver_us);
+    }
+    if (next_us > sim_us) {
+      native_clock_skew(0, 0);
+      delayMicroseconds(next_us - sim_us);
+      sim_us = next_us;
+    }
+
+    /* Deliver frames that have arrived to every module but the sender */
+    for (uint16_t i = 0; i < bus.size(); ) {
+      if (bus[i].deliver_us > sim_us) {
+        i++;
+        continue;
+      }
+      for (uint16_t n = 0; n < nodes.size(); n++) {
+        if ((nodes[n]->address != bus[i].from) &&
+            !nodes[n]->socket.inject(bus[i].from, bus[i].destination,
+                                     bus[i].data, bus[i].length)) {
+          fprintf(stderr, "Receive queue full\n");
+        }
+      }
+      bus.erase(bus.begin() + i);
+    }
+
+    for (uint16_t i = 0; i < nodes.size(); i++) {
+      sim_node_t *node = nodes[i];
+      if (node->next_us > sim_us) continue;
+
+      /* Rendering time varies, so loops run every 1/2 to 3/2 of --loop-ms */
+      boolean waiting = node_loop(node);
+      node->next_us = sim_us + ((waiting && options.hot_wait) ?
+                                options.poll_us :
+                                random(options.loop_ms * 500,
+                                       options.loop_ms * 1500));
+    }
+
+    if (sim_us >= next_sample_us) {
+      use_clock(master);
+      unsigned long master_ms = master->timesync.ms();
+      for (uint16_t i = 1; i < nodes.size(); i++) {
+        use_clock(nodes[i]);
+        errors.push_back((long)(int32_t)(uint32_t)
+                         (nodes[i]->timesync.ms() - master_ms));
+      }
+      if (next_sample_us == measure_us) measured_msgs = sync_msgs;
+      next_sample_us += SAMPLE_US;
+    }
+  }
+
+  printf("  %-8s %10s %10s %10s %10s\n", "module", "skew ppm", "estimate",
+         "interval", "state");
+  for (uint16_t i = 1; i < nodes.size(); i++) {
+    sim_node_t *node = nodes[i];
+    /* The estimate is of the master's clock rate relative to the module's */
+    long relative = (long)((master->ppm - node->ppm) * 1000000LL /
+                           (1000000 + node->ppm));
+    printf("  %-8u %10ld %10.1f %9lus %10u\n", node->address, relative,
+           node->timesync.getSkew() / 16.0,
+           node->timesync.getInterval() / 1000, node->timesync.getState());
+  }
+
+  std::vector<long> sorted;
+  double total = 0;
+  for (uint32_t i = 0; i < errors.size(); i++) {
+    sorted.push_back(labs(errors[i]));
+    total += labs(errors[i]);
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  unsigned long measured_min = options.minutes - 1;
+  printf("Sync error:    mean:%.2fms p99:%ldms max:%ldms  (%lu samples)\n",
+         total / sorted.size(), sorted[sorted.size() * 99 / 100],
+         sorted.back(), (unsigned long)sorted.size());
+  printf("Bus load:      %.1f timesync msgs/min  (%lu during the first "
+         "minute)\n",
+         (double)(sync_msgs - measured_msgs) / measured_min, measured_msgs);
+
+  return 0;
+}
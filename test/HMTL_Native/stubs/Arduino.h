@@ -0,0 +1,136 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Minimal host-side replacement for the Arduino core, used to build the HMTL
+ * libraries and module sketch natively on Linux for benchmarking.  Only the
+ * portions of the API used by HMTL are provided.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_ARDUINO_H
+#define HMTL_NATIVE_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P memcpy
+
+#define F(str) (str)
+
+/*******************************************************************************
+ * Timing
+ *
+ * By default millis() and micros() follow the host's monotonic clock.  The
+ * native_clock_* functions allow a harness to switch to a manually advanced
+ * clock so that timed programs can be driven deterministically, and to skew
+ * the clock as seen by each emulated module.
+ */
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void native_clock_manual(boolean manual);
+void native_clock_set(unsigned long ms);
+void native_clock_advance(unsigned long ms);
+
+/*
+ * Make millis() and micros() run offset_us ahead of the underlying clock at a
+ * rate of ppm parts per million fast, to emulate a module's crystal.
+ */
+void native_clock_skew(unsigned long offset_us, long ppm);
+
+/*******************************************************************************
+ * Math and random numbers
+ */
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+#define constrain(amt, low, high) \
+  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+/*******************************************************************************
+ * Pins, which are all no-ops on the host
+ */
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+int analogRead(uint8_t pin);
+
+/*******************************************************************************
+ * Serial device
+ *
+ * Input is supplied by the harness via inject(), output is counted and
+ * optionally echoed to stdout or written to a descriptor such as a pty.
+ */
+#define NATIVE_SERIAL_BUFFER 4096
+
+class NativeSerial {
+ public:
+  NativeSerial();
+
+  void begin(unsigned long baud);
+  int available();
+  int read();
+  int peek();
+  void flush();
+
+  size_t write(uint8_t val);
+  size_t write(const uint8_t *buffer, size_t size);
+
+  size_t print(const char *str);
+  size_t print(char val);
+  size_t print(int val, int base = 10);
+  size_t print(unsigned int val, int base = 10);
+  size_t print(long val, int base = 10);
+  size_t print(unsigned long val, int base = 10);
+  size_t print(double val, int digits = 2);
+
+  size_t println();
+  size_t println(const char *str);
+  size_t println(char val);
+  size_t println(int val, int base = 10);
+  size_t println(unsigned int val, int base = 10);
+  size_t println(long val, int base = 10);
+  size_t println(unsigned long val, int base = 10);
+  size_t println(double val, int digits = 2);
+
+  operator bool() { return true; }
+
+  /* Harness access */
+  void inject(const uint8_t *data, size_t len);
+  void clear();
+  unsigned long bytes_written;
+  boolean echo;
+  int output_fd; // Output is also written to this descriptor if >= 0
+
+ private:
+  uint8_t input[NATIVE_SERIAL_BUFFER];
+  size_t input_head;
+  size_t input_tail;
+};
+
+extern NativeSerial Serial;
+
+#endif // HMTL_NATIVE_ARDUINO_H
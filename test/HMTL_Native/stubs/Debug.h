@@ -0,0 +1,140 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for the Debug.h macros.  Messages are written to stderr
+ * rather than the serial device so that they don't pollute serial output
+ * counted by the native harness.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_DEBUG_H
+#define HMTL_NATIVE_DEBUG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+
+#define DEBUG_NONE  0
+#define DEBUG_ERROR 1
+#define DEBUG_LOW   2
+#define DEBUG_MID   3
+#define DEBUG_HIGH  4
+#define DEBUG_TRACE 5
+
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_ERROR
+#endif
+
+/* Unary plus promotes byte values so they print as numbers */
+#define NATIVE_DEBUG_OUT(x) (std::cerr << +(x))
+#define NATIVE_DEBUG_HEX(x) (std::cerr << std::hex << +(x) << std::dec)
+
+#define DEBUG_ERR(x) { std::cerr << "ERROR: " << x << std::endl; }
+#define DEBUG_ERR_STATE(x) { \
+    std::cerr << "ERROR STATE: " << x << " " << __FILE__ << ":" << __LINE__ \
+              << std::endl;                                                 \
+    abort();                                                                \
+  }
+
+#define DEBUG_PRINT_END() { if (DEBUG_LEVEL >= DEBUG_HIGH) std::cerr << std::endl; }
+#define DEBUG_COMMAND(level, ...) { if (DEBUG_LEVEL >= (level)) { __VA_ARGS__; } }
+
+#define NATIVE_DEBUG_PRINT(x)        { std::cerr << x; }
+#define NATIVE_DEBUG_PRINTLN(x)      { std::cerr << x << std::endl; }
+#define NATIVE_DEBUG_VALUE(x, v)     { std::cerr << x; NATIVE_DEBUG_OUT(v); }
+#define NATIVE_DEBUG_VALUELN(x, v)   { std::cerr << x; NATIVE_DEBUG_OUT(v) << std::endl; }
+#define NATIVE_DEBUG_HEXVAL(x, v)    { std::cerr << x; NATIVE_DEBUG_HEX(v); }
+#define NATIVE_DEBUG_HEXVALLN(x, v)  { std::cerr << x; NATIVE_DEBUG_HEX(v) << std::endl; }
+
+#if DEBUG_LEVEL >= 1
+  #define DEBUG1_PRINT(x)         NATIVE_DEBUG_PRINT(x)
+  #define DEBUG1_PRINTLN(x)       NATIVE_DEBUG_PRINTLN(x)
+  #define DEBUG1_VALUE(x, v)      NATIVE_DEBUG_VALUE(x, v)
+  #define DEBUG1_VALUELN(x, v)    NATIVE_DEBUG_VALUELN(x, v)
+  #define DEBUG1_HEXVAL(x, v)     NATIVE_DEBUG_HEXVAL(x, v)
+  #define DEBUG1_HEXVALLN(x, v)   NATIVE_DEBUG_HEXVALLN(x, v)
+  #define DEBUG1_COMMAND(...)     { __VA_ARGS__; }
+#else
+  #define DEBUG1_PRINT(x)
+  #define DEBUG1_PRINTLN(x)
+  #define DEBUG1_VALUE(x, v)
+  #define DEBUG1_VALUELN(x, v)
+  #define DEBUG1_HEXVAL(x, v)
+  #define DEBUG1_HEXVALLN(x, v)
+  #define DEBUG1_COMMAND(...)
+#endif
+
+#if DEBUG_LEVEL >= 2
+  #define DEBUG2_PRINT(x)         NATIVE_DEBUG_PRINT(x)
+  #define DEBUG2_PRINTLN(x)       NATIVE_DEBUG_PRINTLN(x)
+  #define DEBUG2_VALUE(x, v)      NATIVE_DEBUG_VALUE(x, v)
+  #define DEBUG2_VALUELN(x, v)    NATIVE_DEBUG_VALUELN(x, v)
+  #define DEBUG2_HEXVAL(x, v)     NATIVE_DEBUG_HEXVAL(x, v)
+  #define DEBUG2_HEXVALLN(x, v)   NATIVE_DEBUG_HEXVALLN(x, v)
+  #define DEBUG2_COMMAND(...)     { __VA_ARGS__; }
+#else
+  #define DEBUG2_PRINT(x)
+  #define DEBUG2_PRINTLN(x)
+  #define DEBUG2_VALUE(x, v)
+  #define DEBUG2_VALUELN(x, v)
+  #define DEBUG2_HEXVAL(x, v)
+  #define DEBUG2_HEXVALLN(x, v)
+  #define DEBUG2_COMMAND(...)
+#endif
+
+#if DEBUG_LEVEL >= 3
+  #define DEBUG3_PRINT(x)         NATIVE_DEBUG_PRINT(x)
+  #define DEBUG3_PRINTLN(x)       NATIVE_DEBUG_PRINTLN(x)
+  #define DEBUG3_VALUE(x, v)      NATIVE_DEBUG_VALUE(x, v)
+  #define DEBUG3_VALUELN(x, v)    NATIVE_DEBUG_VALUELN(x, v)
+  #define DEBUG3_HEXVAL(x, v)     NATIVE_DEBUG_HEXVAL(x, v)
+  #define DEBUG3_HEXVALLN(x, v)   NATIVE_DEBUG_HEXVALLN(x, v)
+  #define DEBUG3_COMMAND(...)     { __VA_ARGS__; }
+#else
+  #define DEBUG3_PRINT(x)
+  #define DEBUG3_PRINTLN(x)
+  #define DEBUG3_VALUE(x, v)
+  #define DEBUG3_VALUELN(x, v)
+  #define DEBUG3_HEXVAL(x, v)
+  #define DEBUG3_HEXVALLN(x, v)
+  #define DEBUG3_COMMAND(...)
+#endif
+
+#if DEBUG_LEVEL >= 4
+  #define DEBUG4_PRINT(x)         NATIVE_DEBUG_PRINT(x)
+  #define DEBUG4_PRINTLN(x)       NATIVE_DEBUG_PRINTLN(x)
+  #define DEBUG4_VALUE(x, v)      NATIVE_DEBUG_VALUE(x, v)
+  #define DEBUG4_VALUELN(x, v)    NATIVE_DEBUG_VALUELN(x, v)
+  #define DEBUG4_HEXVAL(x, v)     NATIVE_DEBUG_HEXVAL(x, v)
+  #define DEBUG4_HEXVALLN(x, v)   NATIVE_DEBUG_HEXVALLN(x, v)
+  #define DEBUG4_COMMAND(...)     { __VA_ARGS__; }
+#else
+  #define DEBUG4_PRINT(x)
+  #define DEBUG4_PRINTLN(x)
+  #define DEBUG4_VALUE(x, v)
+  #define DEBUG4_VALUELN(x, v)
+  #define DEBUG4_HEXVAL(x, v)
+  #define DEBUG4_HEXVALLN(x, v)
+  #define DEBUG4_COMMAND(...)
+#endif
+
+#if DEBUG_LEVEL >= 5
+  #define DEBUG5_PRINT(x)         NATIVE_DEBUG_PRINT(x)
+  #define DEBUG5_PRINTLN(x)       NATIVE_DEBUG_PRINTLN(x)
+  #define DEBUG5_VALUE(x, v)      NATIVE_DEBUG_VALUE(x, v)
+  #define DEBUG5_VALUELN(x, v)    NATIVE_DEBUG_VALUELN(x, v)
+  #define DEBUG5_HEXVAL(x, v)     NATIVE_DEBUG_HEXVAL(x, v)
+  #define DEBUG5_HEXVALLN(x, v)   NATIVE_DEBUG_HEXVALLN(x, v)
+  #define DEBUG5_COMMAND(...)     { __VA_ARGS__; }
+#else
+  #define DEBUG5_PRINT(x)
+  #define DEBUG5_PRINTLN(x)
+  #define DEBUG5_VALUE(x, v)
+  #define DEBUG5_VALUELN(x, v)
+  #define DEBUG5_HEXVAL(x, v)
+  #define DEBUG5_HEXVALLN(x, v)
+  #define DEBUG5_COMMAND(...)
+#endif
+
+#endif // HMTL_NATIVE_DEBUG_H
@@ -0,0 +1,14 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Empty host placeholder for EEPROM.h, nothing in it is used natively.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_EEPROM_H
+#define HMTL_NATIVE_EEPROM_H
+
+#include "Arduino.h"
+
+#endif // HMTL_NATIVE_EEPROM_H
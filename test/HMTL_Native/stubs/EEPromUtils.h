@@ -0,0 +1,37 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for EEPromUtils, backed by an in-memory EEPROM image.
+ *
+ * Each record written with EEPROM_safe_write() is stored as:
+ *   | start | length | crc | data... |
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_EEPROMUTILS_H
+#define HMTL_NATIVE_EEPROMUTILS_H
+
+#include "Arduino.h"
+
+#define NATIVE_EEPROM_SIZE 4096
+
+#define EEPROM_SAFE_START   0xA5
+#define EEPROM_SAFE_HDR_LEN 3
+#define EEPROM_DATA_SIZE(total) ((total) - EEPROM_SAFE_HDR_LEN)
+
+void EEPROM_init();
+void EEPROM_end();
+
+uint8_t EEPROM_crc(const void *data, int length);
+
+int EEPROM_safe_write(int address, uint8_t *data, int datalen);
+int EEPROM_safe_read(int address, uint8_t *data, int maxlen);
+boolean EEPROM_check_address(int address);
+
+void EEPROM_dump(int address);
+
+/* Harness access to the raw EEPROM image */
+extern uint8_t native_eeprom[NATIVE_EEPROM_SIZE];
+
+#endif // HMTL_NATIVE_EEPROMUTILS_H
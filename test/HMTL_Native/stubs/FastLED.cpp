@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host implementation of the FastLED subset in FastLED.h
+ ******************************************************************************/
+
+#include "FastLED.h"
+
+CFastLED FastLED;
+
+CFastLED::CFastLED() {
+  brightness = 255;
+}
+
+/*
+ * Port of FastLED's hsv2rgb_rainbow(), which is the conversion used when
+ * assigning a CHSV to a CRGB.
+ */
+void hsv2rgb_rainbow(const CHSV &hsv, CRGB &rgb) {
+  uint8_t hue = hsv.h;
+  uint8_t sat = hsv.s;
+  uint8_t val = hsv.v;
+
+  uint8_t offset = hue & 0x1F;
+  uint8_t offset8 = offset << 3;
+  uint8_t third = scale8(offset8, (256 / 3));
+
+  uint8_t r, g, b;
+
+  if (!(hue & 0x80)) {
+    if (!(hue & 0x40)) {
+      if (!(hue & 0x20)) {
+        r = 255 - third; g = third; b = 0;
+      } else {
+        r = 171; g = 85 + third; b = 0;
+      }
+    } else {
+      if (!(hue & 0x20)) {
+        uint8_t twothirds = scale8(offset8, ((256 * 2) / 3));
+        r = 171 - twothirds; g = 170 + third; b = 0;
+      } else {
+        r = 0; g = 255 - third; b = third;
+      }
+    }
+  } else {
+    if (!(hue & 0x40)) {
+      if (!(hue & 0x20)) {
+        uint8_t twothirds = scale8(offset8, ((256 * 2) / 3));
+        r = 0; g = 171 - twothirds; b = 85 + twothirds;
+      } else {
+        r = third; g = 0; b = 255 - third;
+      }
+    } else {
+      if (!(hue & 0x20)) {
+        r = 85 + third; g = 0; b = 171 - third;
+      } else {
+        r = 170 + third; g = 0; b = 85 - third;
+      }
+    }
+  }
+
+  if (sat != 255) {
+    if (sat == 0) {
+      r = 255; b = 255; g = 255;
+    } else {
+      uint8_t desat = 255 - sat;
+      desat = scale8_video(desat, desat);
+      uint8_t satscale = 255 - desat;
+      r = scale8(r, satscale) + desat;
+      g = scale8(g, satscale) + desat;
+      b = scale8(b, satscale) + desat;
+    }
+  }
+
+  if (val != 255) {
+    val = scale8_video(val, val);
+    if (val == 0) {
+      r = 0; g = 0; b = 0;
+    } else {
+      r = scale8(r, val);
+      g = scale8(g, val);
+      b = scale8(b, val);
+    }
+  }
+
+  rgb.r = r;
+  rgb.g = g;
+  rgb.b = b;
+}
+
+CRGB blend(const CRGB &p1, const CRGB &p2, fract8 amountOfP2) {
+  CRGB nu;
+  fract8 amountOfP1 = 255 - amountOfP2;
+  nu.r = scale8(p1.r, amountOfP1) + scale8(p2.r, amountOfP2);
+  nu.g = scale8(p1.g, amountOfP1) + scale8(p2.g, amountOfP2);
+  nu.b = scale8(p1.b, amountOfP1) + scale8(p2.b, amountOfP2);
+  return nu;
+}
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for the subset of FastLED used by HMTL.  The color math
+ * follows FastLED's 8-bit implementations so that per-pixel costs are
+ * representative.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_FASTLED_H
+#define HMTL_NATIVE_FASTLED_H
+
+#include "Arduino.h"
+
+typedef uint8_t fract8;
+
+static inline uint8_t scale8(uint8_t i, fract8 scale) {
+  return (uint8_t)(((uint16_t)i * (1 + (uint16_t)scale)) >> 8);
+}
+
+static inline uint8_t scale8_video(uint8_t i, fract8 scale) {
+  return (uint8_t)((((uint16_t)i * (uint16_t)scale) >> 8) +
+                   ((i && scale) ? 1 : 0));
+}
+
+struct CRGB;
+
+struct CHSV {
+  union {
+    struct {
+      uint8_t h;
+      uint8_t s;
+      uint8_t v;
+    };
+    uint8_t raw[3];
+  };
+
+  CHSV() {}
+  CHSV(uint8_t ih, uint8_t is, uint8_t iv) : h(ih), s(is), v(iv) {}
+};
+
+void hsv2rgb_rainbow(const CHSV &hsv, CRGB &rgb);
+
+struct CRGB {
+  union {
+    struct {
+      union { uint8_t r; uint8_t red; };
+      union { uint8_t g; uint8_t green; };
+      union { uint8_t b; uint8_t blue; };
+    };
+    uint8_t raw[3];
+  };
+
+  typedef enum {
+    Black = 0x000000,
+    Blue  = 0x0000FF,
+    Green = 0x008000,
+    Red   = 0xFF0000,
+    White = 0xFFFFFF
+  } HTMLColorCode;
+
+  CRGB() {}
+  CRGB(uint8_t ir, uint8_t ig, uint8_t ib) : r(ir), g(ig), b(ib) {}
+  CRGB(uint32_t colorcode)
+          : r((colorcode >> 16) & 0xFF), g((colorcode >> 8) & 0xFF),
+            b(colorcode & 0xFF) {}
+  CRGB(HTMLColorCode colorcode) : CRGB((uint32_t)colorcode) {}
+  CRGB(const CHSV &rhs) { hsv2rgb_rainbow(rhs, *this); }
+
+  CRGB &operator=(const CHSV &rhs) {
+    hsv2rgb_rainbow(rhs, *this);
+    return *this;
+  }
+
+  uint8_t &operator[](uint8_t x) { return raw[x]; }
+  const uint8_t &operator[](uint8_t x) const { return raw[x]; }
+
+  CRGB &nscale8(uint8_t scaledown) {
+    r = scale8(r, scaledown);
+    g = scale8(g, scaledown);
+    b = scale8(b, scaledown);
+    return *this;
+  }
+
+  CRGB &nscale8_video(uint8_t scaledown) {
+    r = scale8_video(r, scaledown);
+    g = scale8_video(g, scaledown);
+    b = scale8_video(b, scaledown);
+    return *this;
+  }
+
+  CRGB &operator+=(const CRGB &rhs) {
+    r = (r + rhs.r > 255) ? 255 : r + rhs.r;
+    g = (g + rhs.g > 255) ? 255 : g + rhs.g;
+    b = (b + rhs.b > 255) ? 255 : b + rhs.b;
+    return *this;
+  }
+
+  bool operator==(const CRGB &rhs) const {
+    return (r == rhs.r) && (g == rhs.g) && (b == rhs.b);
+  }
+  bool operator!=(const CRGB &rhs) const { return !(*this == rhs); }
+};
+
+CRGB blend(const CRGB &p1, const CRGB &p2, fract8 amountOfP2);
+
+class CFastLED {
+ public:
+  CFastLED();
+
+  void setBrightness(uint8_t scale) { brightness = scale; }
+  uint8_t getBrightness() { return brightness; }
+
+ private:
+  uint8_t brightness;
+};
+
+extern CFastLED FastLED;
+
+#endif // HMTL_NATIVE_FASTLED_H
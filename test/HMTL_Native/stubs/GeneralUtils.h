@@ -0,0 +1,17 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for the GeneralUtils helpers used by HMTL
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_GENERALUTILS_H
+#define HMTL_NATIVE_GENERALUTILS_H
+
+#include "Arduino.h"
+
+void print_hex_string(const byte *buff, int len);
+void print_hex_buffer(const char *buff, int len);
+
+#endif // HMTL_NATIVE_GENERALUTILS_H
@@ -0,0 +1,224 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host implementation of the Arduino core subset in Arduino.h
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+
+#include "Arduino.h"
+
+/*******************************************************************************
+ * Timing
+ */
+static boolean clock_is_manual = false;
+static unsigned long manual_us = 0;
+static unsigned long skew_offset_us = 0;
+static long skew_ppm = 0;
+
+static unsigned long realtime_us() {
+  static const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+unsigned long micros() {
+  unsigned long us = clock_is_manual ? manual_us : realtime_us();
+  return skew_offset_us + us + (long long)us * skew_ppm / 1000000;
+}
+
+void delay(unsigned long ms) {
+  if (clock_is_manual) {
+    manual_us += ms * 1000;
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  }
+}
+
+void delayMicroseconds(unsigned int us) {
+  if (clock_is_manual) {
+    manual_us += us;
+  } else {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+void native_clock_manual(boolean manual) {
+  if (manual && !clock_is_manual) manual_us = realtime_us();
+  clock_is_manual = manual;
+}
+
+void native_clock_set(unsigned long ms) {
+  manual_us = ms * 1000;
+}
+
+void native_clock_advance(unsigned long ms) {
+  manual_us += ms * 1000;
+}
+
+void native_clock_skew(unsigned long offset_us, long ppm) {
+  skew_offset_us = offset_us;
+  skew_ppm = ppm;
+}
+
+/*******************************************************************************
+ * Math and random numbers
+ */
+static uint32_t random_state = 1;
+
+static uint32_t next_random() {
+  /* Same LCG as avr-libc's random() so sequences are comparable */
+  random_state = random_state * 1103515245 + 12345;
+  return (random_state >> 1) & 0x7FFFFFFF;
+}
+
+long random(long howbig) {
+  if (howbig <= 0) return 0;
+  return next_random() % howbig;
+}
+
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) return howsmall;
+  return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed) {
+  if (seed != 0) random_state = seed;
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max) {
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+/*******************************************************************************
+ * Pins
+ */
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+int digitalRead(uint8_t pin) { return HIGH; }
+void analogWrite(uint8_t pin, int val) {}
+int analogRead(uint8_t pin) { return 0; }
+
+/*******************************************************************************
+ * Serial device
+ */
+NativeSerial Serial;
+
+NativeSerial::NativeSerial() {
+  bytes_written = 0;
+  echo = false;
+  output_fd = -1;
+  input_head = 0;
+  input_tail = 0;
+}
+
+void NativeSerial::begin(unsigned long baud) {}
+
+int NativeSerial::available() {
+  return (int)(input_tail - input_head);
+}
+
+int NativeSerial::read() {
+  if (input_head == input_tail) return -1;
+  int val = input[input_head % NATIVE_SERIAL_BUFFER];
+  input_head++;
+  if (input_head == input_tail) {
+    input_head = 0;
+    input_tail = 0;
+  }
+  return val;
+}
+
+int NativeSerial::peek() {
+  if (input_head == input_tail) return -1;
+  return input[input_head % NATIVE_SERIAL_BUFFER];
+}
+
+void NativeSerial::flush() {}
+
+void NativeSerial::inject(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (input_tail - input_head >= NATIVE_SERIAL_BUFFER) {
+      fprintf(stderr, "NativeSerial: input overflow\n");
+      return;
+    }
+    input[input_tail % NATIVE_SERIAL_BUFFER] = data[i];
+    input_tail++;
+  }
+}
+
+void NativeSerial::clear() {
+  input_head = 0;
+  input_tail = 0;
+}
+
+size_t NativeSerial::write(uint8_t val) {
+  return write(&val, 1);
+}
+
+size_t NativeSerial::write(const uint8_t *buffer, size_t size) {
+  bytes_written += size;
+  if (echo) fwrite(buffer, 1, size, stdout);
+  if (output_fd >= 0) {
+    size_t written = 0;
+    while (written < size) {
+      ssize_t ret = ::write(output_fd, buffer + written, size - written);
+      if (ret <= 0) break;
+      written += ret;
+    }
+  }
+  return size;
+}
+
+size_t NativeSerial::print(const char *str) {
+  return write((const uint8_t *)str, strlen(str));
+}
+
+size_t NativeSerial::print(char val) {
+  return write((uint8_t)val);
+}
+
+size_t NativeSerial::print(int val, int base) {
+  return print((long)val, base);
+}
+
+size_t NativeSerial::print(unsigned int val, int base) {
+  return print((unsigned long)val, base);
+}
+
+size_t NativeSerial::print(long val, int base) {
+  char buf[24];
+  snprintf(buf, sizeof (buf), base == 16 ? "%lx" : "%ld", val);
+  return print(buf);
+}
+
+size_t NativeSerial::print(unsigned long val, int base) {
+  char buf[24];
+  snprintf(buf, sizeof (buf), base == 16 ? "%lx" : "%lu", val);
+  return print(buf);
+}
+
+size_t NativeSerial::print(double val, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof (buf), "%.*f", digits, val);
+  return print(buf);
+}
+
+size_t NativeSerial::println() { return print("\r\n"); }
+size_t NativeSerial::println(const char *str) { return print(str) + println(); }
+size_t NativeSerial::println(char val) { return print(val) + println(); }
+size_t NativeSerial::println(int val, int base) { return print(val, base) + println(); }
+size_t NativeSerial::println(unsigned int val, int base) { return print(val, base) + println(); }
+size_t NativeSerial::println(long val, int base) { return print(val, base) + println(); }
+size_t NativeSerial::println(unsigned long val, int base) { return print(val, base) + println(); }
+size_t NativeSerial::println(double val, int digits) { return print(val, digits) + println(); }
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host implementations of GeneralUtils and EEPromUtils
+ ******************************************************************************/
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "GeneralUtils.h"
+#include "EEPromUtils.h"
+
+/*******************************************************************************
+ * GeneralUtils
+ */
+void print_hex_string(const byte *buff, int len) {
+  for (int i = 0; i < len; i++) {
+    fprintf(stderr, "%02x", buff[i]);
+  }
+}
+
+void print_hex_buffer(const char *buff, int len) {
+  print_hex_string((const byte *)buff, len);
+}
+
+/*******************************************************************************
+ * EEPromUtils
+ */
+uint8_t native_eeprom[NATIVE_EEPROM_SIZE];
+
+void EEPROM_init() {}
+void EEPROM_end() {}
+
+uint8_t EEPROM_crc(const void *data, int length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint8_t crc = 0;
+  for (int i = 0; i < length; i++) {
+    crc ^= bytes[i];
+    for (byte bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+int EEPROM_safe_write(int address, uint8_t *data, int datalen) {
+  if ((address < 0) || (datalen > 255) ||
+      (address + EEPROM_SAFE_HDR_LEN + datalen > NATIVE_EEPROM_SIZE)) {
+    return -1;
+  }
+
+  native_eeprom[address] = EEPROM_SAFE_START;
+  native_eeprom[address + 1] = (uint8_t)datalen;
+  native_eeprom[address + 2] = EEPROM_crc(data, datalen);
+  memcpy(&native_eeprom[address + EEPROM_SAFE_HDR_LEN], data, datalen);
+
+  return address + EEPROM_SAFE_HDR_LEN + datalen;
+}
+
+boolean EEPROM_check_address(int address) {
+  if ((address < 0) || (address + EEPROM_SAFE_HDR_LEN > NATIVE_EEPROM_SIZE)) {
+    return false;
+  }
+  if (native_eeprom[address] != EEPROM_SAFE_START) return false;
+
+  int datalen = native_eeprom[address + 1];
+  if (address + EEPROM_SAFE_HDR_LEN + datalen > NATIVE_EEPROM_SIZE) {
+    return false;
+  }
+
+  return (EEPROM_crc(&native_eeprom[address + EEPROM_SAFE_HDR_LEN], datalen) ==
+          native_eeprom[address + 2]);
+}
+
+int EEPROM_safe_read(int address, uint8_t *data, int maxlen) {
+  if (!EEPROM_check_address(address)) {
+    return -1;
+  }
+
+  int datalen = native_eeprom[address + 1];
+  if (datalen > maxlen) {
+    return -2;
+  }
+
+  memcpy(data, &native_eeprom[address + EEPROM_SAFE_HDR_LEN], datalen);
+
+  return address + EEPROM_SAFE_HDR_LEN + datalen;
+}
+
+void EEPROM_dump(int address) {
+  while (EEPROM_check_address(address)) {
+    int datalen = native_eeprom[address + 1];
+    fprintf(stderr, "EEPROM %d: ", address);
+    print_hex_string(&native_eeprom[address + EEPROM_SAFE_HDR_LEN], datalen);
+    fprintf(stderr, "\n");
+    address += EEPROM_SAFE_HDR_LEN + datalen;
+  }
+}
@@ -0,0 +1,115 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host implementation of PixelUtil
+ ******************************************************************************/
+
+#include <chrono>
+
+#include "PixelUtil.h"
+
+uint32_t pixel_color(byte r, byte g, byte b) {
+  return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+byte pixel_red(uint32_t color) { return (color >> 16) & 0xFF; }
+byte pixel_green(uint32_t color) { return (color >> 8) & 0xFF; }
+byte pixel_blue(uint32_t color) { return color & 0xFF; }
+
+unsigned long PixelUtil::show_ns_per_pixel = 0;
+
+PixelUtil::PixelUtil() {
+  leds = NULL;
+  wire = NULL;
+  num_pixels = 0;
+  shows = 0;
+  pixels_shown = 0;
+}
+
+PixelUtil::PixelUtil(uint16_t numPixels, uint8_t dataPin, uint8_t clockPin,
+                     uint8_t type) : PixelUtil() {
+  init(numPixels, dataPin, clockPin, type);
+}
+
+PixelUtil::~PixelUtil() {
+  free(leds);
+  free(wire);
+}
+
+void PixelUtil::init(uint16_t numPixels, uint8_t dataPin, uint8_t clockPin,
+                     uint8_t type) {
+  free(leds);
+  free(wire);
+  num_pixels = numPixels;
+  leds = (CRGB *)calloc(num_pixels, sizeof (CRGB));
+  wire = (CRGB *)calloc(num_pixels, sizeof (CRGB));
+}
+
+void PixelUtil::update() {
+  std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+
+  uint8_t brightness = FastLED.getBrightness();
+  for (uint16_t i = 0; i < num_pixels; i++) {
+    wire[i] = leds[i];
+    if (brightness != 255) wire[i].nscale8_video(brightness);
+  }
+
+  if (show_ns_per_pixel) {
+    /* Busy wait for the time the strip would take to clock in the data */
+    std::chrono::nanoseconds wire_time(show_ns_per_pixel * num_pixels);
+    while (std::chrono::steady_clock::now() - start < wire_time);
+  }
+
+  shows++;
+  pixels_shown += num_pixels;
+}
+
+uint16_t PixelUtil::numPixels() {
+  return num_pixels;
+}
+
+void PixelUtil::setPixelRGB(PIXEL_ADDR_TYPE led, byte r, byte g, byte b) {
+  if (led >= num_pixels) return;
+  leds[led] = CRGB(r, g, b);
+}
+
+void PixelUtil::setPixelRGB(PIXEL_ADDR_TYPE led, uint32_t color) {
+  if (led >= num_pixels) return;
+  leds[led] = CRGB(color);
+}
+
+void PixelUtil::setPixelRGB(PIXEL_ADDR_TYPE led, CRGB color) {
+  if (led >= num_pixels) return;
+  leds[led] = color;
+}
+
+void PixelUtil::setAllRGB(byte r, byte g, byte b) {
+  for (uint16_t led = 0; led < num_pixels; led++) {
+    leds[led] = CRGB(r, g, b);
+  }
+}
+
+void PixelUtil::setAllRGB(uint32_t color) {
+  setAllRGB(pixel_red(color), pixel_green(color), pixel_blue(color));
+}
+
+void PixelUtil::setRangeRGB(pixel_range_t range, CRGB color) {
+  for (uint16_t led = range.start;
+       (led < (uint16_t)(range.start + range.length)) && (led < num_pixels);
+       led++) {
+    leds[led] = color;
+  }
+}
+
+void PixelUtil::setDistinct(uint16_t index, byte value) {
+  if (index / 3 >= num_pixels) return;
+  leds[index / 3][index % 3] = value;
+}
+
+CRGB PixelUtil::getColor(PIXEL_ADDR_TYPE led) {
+  if (led >= num_pixels) return CRGB(0, 0, 0);
+  return leds[led];
+}
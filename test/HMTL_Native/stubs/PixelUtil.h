@@ -0,0 +1,67 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for PixelUtil.  Pixels are kept in a CRGB array and
+ * update() copies them to a shadow "wire" buffer, optionally busy-waiting to
+ * emulate the time a real strip takes to latch the data.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_PIXELUTIL_H
+#define HMTL_NATIVE_PIXELUTIL_H
+
+#include "Arduino.h"
+#include "FastLED.h"
+
+#ifdef BIG_PIXELS
+  #define PIXEL_ADDR_TYPE uint16_t
+#else
+  #define PIXEL_ADDR_TYPE uint8_t
+#endif
+
+typedef struct {
+  PIXEL_ADDR_TYPE start;
+  PIXEL_ADDR_TYPE length;
+} pixel_range_t;
+
+uint32_t pixel_color(byte r, byte g, byte b);
+byte pixel_red(uint32_t color);
+byte pixel_green(uint32_t color);
+byte pixel_blue(uint32_t color);
+
+class PixelUtil {
+ public:
+  PixelUtil();
+  PixelUtil(uint16_t numPixels, uint8_t dataPin, uint8_t clockPin,
+            uint8_t type = 0);
+  ~PixelUtil();
+
+  void init(uint16_t numPixels, uint8_t dataPin, uint8_t clockPin,
+            uint8_t type = 0);
+
+  void update();
+  uint16_t numPixels();
+
+  void setPixelRGB(PIXEL_ADDR_TYPE led, byte r, byte g, byte b);
+  void setPixelRGB(PIXEL_ADDR_TYPE led, uint32_t color);
+  void setPixelRGB(PIXEL_ADDR_TYPE led, CRGB color);
+  void setAllRGB(byte r, byte g, byte b);
+  void setAllRGB(uint32_t color);
+  void setRangeRGB(pixel_range_t range, CRGB color);
+  void setDistinct(uint16_t index, byte value);
+
+  CRGB getColor(PIXEL_ADDR_TYPE led);
+  CRGB *leds;
+
+  /* Harness statistics and wire-time emulation */
+  unsigned long shows;
+  unsigned long pixels_shown;
+  static unsigned long show_ns_per_pixel;
+
+ private:
+  uint16_t num_pixels;
+  CRGB *wire;
+};
+
+#endif // HMTL_NATIVE_PIXELUTIL_H
@@ -0,0 +1,29 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for RS485Utils, the RS485 socket is a NativeSocket
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_RS485UTILS_H
+#define HMTL_NATIVE_RS485UTILS_H
+
+#include "Arduino.h"
+#include "Socket.h"
+
+typedef native_socket_hdr_t rs485_socket_hdr_t;
+
+#define RS485_BUFFER_TOTAL(data_size) (sizeof (rs485_socket_hdr_t) + (data_size))
+#define RS485_RECV_BUFFER 64
+
+class RS485Socket : public NativeSocket {
+ public:
+  void init(byte recvPin, byte xmitPin, byte enablePin,
+            socket_addr_t address, byte recvBuffer, boolean debug = false) {
+    sourceAddress = address;
+    recvLimit = recvBuffer;
+  }
+};
+
+#endif // HMTL_NATIVE_RS485UTILS_H
@@ -0,0 +1,14 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Empty host placeholder for RS485_non_blocking.h, nothing in it is used natively.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_RS485_NON_BLOCKING_H
+#define HMTL_NATIVE_RS485_NON_BLOCKING_H
+
+#include "Arduino.h"
+
+#endif // HMTL_NATIVE_RS485_NON_BLOCKING_H
@@ -0,0 +1,122 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host implementation of the in-memory NativeSocket transport
+ ******************************************************************************/
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "Socket.h"
+
+NativeSocket::NativeSocket() {
+  sourceAddress = SOCKET_ADDR_INVALID;
+  send_buffer = NULL;
+  send_data_size = 0;
+  recvLimit = NATIVE_SOCKET_MAX_DATA;
+
+  queue_head = 0;
+  queue_count = 0;
+  holding = false;
+
+  send_hook = NULL;
+  send_context = NULL;
+
+  msgs_sent = 0;
+  bytes_sent = 0;
+  msgs_received = 0;
+}
+
+boolean NativeSocket::initialized() {
+  return send_buffer != NULL;
+}
+
+void NativeSocket::setup() {}
+
+byte *NativeSocket::initBuffer(byte *data, uint16_t data_size) {
+  send_buffer = data + sizeof (native_socket_hdr_t);
+  send_data_size = data_size - sizeof (native_socket_hdr_t);
+  return send_buffer;
+}
+
+void NativeSocket::sendMsgTo(socket_addr_t address, const byte *data,
+                             const byte datalength) {
+  msgs_sent++;
+  bytes_sent += datalength;
+  if (send_hook) {
+    send_hook(this, address, data, datalength, send_context);
+  }
+}
+
+const byte *NativeSocket::getMsg(unsigned int *retlen) {
+  return getMsg(SOCKET_ADDR_INVALID, retlen);
+}
+
+/*
+ * Return the next queued frame, which remains valid until the next call.  If
+ * an address is given then frames for other addresses are dropped.
+ */
+const byte *NativeSocket::getMsg(socket_addr_t address, unsigned int *retlen) {
+  if (holding) {
+    queue_head = (queue_head + 1) % NATIVE_SOCKET_QUEUE;
+    queue_count--;
+    holding = false;
+  }
+
+  while (queue_count > 0) {
+    frame_t *frame = &queue[queue_head];
+    if ((address == SOCKET_ADDR_INVALID) ||
+        (frame->hdr.destination == address) ||
+        (frame->hdr.destination == SOCKET_ADDR_ANY)) {
+      holding = true;
+      msgs_received++;
+      *retlen = frame->hdr.length;
+      return frame->data;
+    }
+
+    queue_head = (queue_head + 1) % NATIVE_SOCKET_QUEUE;
+    queue_count--;
+  }
+
+  *retlen = 0;
+  return NULL;
+}
+
+socket_addr_t NativeSocket::sourceFromData(void *data) {
+  native_socket_hdr_t *hdr =
+          (native_socket_hdr_t *)((byte *)data - offsetof(frame_t, data));
+  return hdr->source;
+}
+
+socket_addr_t NativeSocket::destFromData(void *data) {
+  native_socket_hdr_t *hdr =
+          (native_socket_hdr_t *)((byte *)data - offsetof(frame_t, data));
+  return hdr->destination;
+}
+
+boolean NativeSocket::inject(socket_addr_t source, socket_addr_t destination,
+                             const byte *data, byte datalength) {
+  if (queue_count >= NATIVE_SOCKET_QUEUE) {
+    return false;
+  }
+
+  frame_t *frame = &queue[(queue_head + queue_count) % NATIVE_SOCKET_QUEUE];
+  frame->hdr.source = source;
+  frame->hdr.destination = destination;
+  frame->hdr.length = datalength;
+  memcpy(frame->data, data, datalength);
+  queue_count++;
+
+  return true;
+}
+
+uint16_t NativeSocket::pending() {
+  return queue_count - (holding ? 1 : 0);
+}
+
+void NativeSocket::setSendHook(native_send_hook_t hook, void *context) {
+  send_hook = hook;
+  send_context = context;
+}
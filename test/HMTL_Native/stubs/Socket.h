@@ -0,0 +1,101 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Host replacement for the Socket interface.  NativeSocket is an in-memory
+ * transport: the harness queues inbound frames with inject() and every
+ * sendMsgTo() is counted and passed to an optional send hook.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_SOCKET_H
+#define HMTL_NATIVE_SOCKET_H
+
+#include "Arduino.h"
+
+typedef uint16_t socket_addr_t;
+
+#define SOCKET_ADDR_ANY     ((socket_addr_t)-1)
+#define SOCKET_ADDR_INVALID ((socket_addr_t)-2)
+
+class Socket {
+ public:
+  socket_addr_t sourceAddress;
+
+  byte *send_buffer;
+  uint16_t send_data_size;
+  uint16_t recvLimit;
+
+  virtual boolean initialized() = 0;
+  virtual void setup() = 0;
+  virtual byte *initBuffer(byte *data, uint16_t data_size) = 0;
+
+  virtual void sendMsgTo(socket_addr_t address, const byte *data,
+                         const byte datalength) = 0;
+  virtual const byte *getMsg(unsigned int *retlen) = 0;
+  virtual const byte *getMsg(socket_addr_t address, unsigned int *retlen) = 0;
+
+  virtual socket_addr_t sourceFromData(void *data) = 0;
+  virtual socket_addr_t destFromData(void *data) = 0;
+
+  virtual ~Socket() {}
+};
+
+/* Header that precedes each frame's data, as in the RS485 socket */
+typedef struct {
+  socket_addr_t source;
+  socket_addr_t destination;
+  uint8_t length;
+} native_socket_hdr_t;
+
+#define NATIVE_SOCKET_MAX_DATA 255
+#define NATIVE_SOCKET_QUEUE    64
+
+class NativeSocket;
+typedef void (*native_send_hook_t)(NativeSocket *socket,
+                                   socket_addr_t address,
+                                   const byte *data, byte datalength,
+                                   void *context);
+
+class NativeSocket : public Socket {
+ public:
+  NativeSocket();
+
+  boolean initialized();
+  void setup();
+  byte *initBuffer(byte *data, uint16_t data_size);
+
+  void sendMsgTo(socket_addr_t address, const byte *data,
+                 const byte datalength);
+  const byte *getMsg(unsigned int *retlen);
+  const byte *getMsg(socket_addr_t address, unsigned int *retlen);
+
+  socket_addr_t sourceFromData(void *data);
+  socket_addr_t destFromData(void *data);
+
+  /* Harness access */
+  boolean inject(socket_addr_t source, socket_addr_t destination,
+                 const byte *data, byte datalength);
+  uint16_t pending();
+  void setSendHook(native_send_hook_t hook, void *context);
+
+  unsigned long msgs_sent;
+  unsigned long bytes_sent;
+  unsigned long msgs_received;
+
+ private:
+  typedef struct {
+    native_socket_hdr_t hdr;
+    byte data[NATIVE_SOCKET_MAX_DATA];
+  } frame_t;
+
+  frame_t queue[NATIVE_SOCKET_QUEUE];
+  uint16_t queue_head;
+  uint16_t queue_count;
+  boolean holding; // The frame at queue_head was returned by getMsg()
+
+  native_send_hook_t send_hook;
+  void *send_context;
+};
+
+#endif // HMTL_NATIVE_SOCKET_H
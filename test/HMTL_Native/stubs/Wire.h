@@ -0,0 +1,14 @@
+/*******************************************************************************
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2020
+ *
+ * Empty host placeholder for Wire.h, nothing in it is used natively.
+ ******************************************************************************/
+
+#ifndef HMTL_NATIVE_WIRE_H
+#define HMTL_NATIVE_WIRE_H
+
+#include "Arduino.h"
+
+#endif // HMTL_NATIVE_WIRE_H
@@ -78,6 +78,9 @@ void setup() {
   rs485.setup();
   send_buffer = rs485.initBuffer(databuffer);
 
+  /* Stamp sent messages so that modules can drop forwarded copies */
+  hmtl_msg_set_source(config.address);
+
   DEBUG2_VALUELN("*** HMTL_Command_CLI initialized.  Address:", config.address);
   print_usage();
 }
@@ -91,6 +94,13 @@ void loop() {
     process_message(msg_hdr, msglen);
   }
 
+  /* Handle time sync replies as soon as they arrive */
+  if (timesync.update()) {
+    while ((msg_hdr = timesync.hotWait(config.address, &msglen)) != NULL) {
+      process_message(msg_hdr, msglen);
+    }
+  }
+
   /* Handle commands from the Serial CLI connection */
   serialcli.checkSerial();
 }